@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# Copyright 2007 Stephen Liu
+# For license terms, see the file COPYING along with this library.
+#
+# restart testrestart again and again under the load of teststress,
+# fail if a connection is refused or a message gets no reply:
+#   ./checkrestart.sh [-p <port>] [-n <restarts>] [-s <hahs|lf|lfbase>]
+#
+# every teststress run connects its clients again, so the runs keep
+# connecting while the listening socket moves to the new copy
+
+PORT=8091
+RESTARTS=10
+SERVER=hahs
+
+while getopts "p:n:s:" opt; do
+	case $opt in
+		p) PORT=$OPTARG ;;
+		n) RESTARTS=$OPTARG ;;
+		s) SERVER=$OPTARG ;;
+		*) echo "Usage: $0 [-p <port>] [-n <restarts>] [-s <hahs|lf|lfbase>]"; exit 2 ;;
+	esac
+done
+
+LD_LIBRARY_PATH=.${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+export LD_LIBRARY_PATH
+
+TMP=${TMPDIR:-/tmp}/checkrestart.$$
+mkdir -p $TMP || exit 2
+
+./testrestart -p $PORT -s $SERVER -P line -w 10 > $TMP/server.log 2>&1 &
+PID=$!
+
+cleanup() {
+	touch $TMP/stop
+	wait $LOAD 2>/dev/null
+	kill $PID 2>/dev/null
+	sleep 1
+	rm -rf $TMP
+}
+
+# the pid of the last copy, from its "pid N, restarted" line
+last_pid() {
+	sed -n 's/.*: pid \([0-9]*\), .*started$/\1/p' $TMP/server.log | tail -1
+}
+
+count_restarted() {
+	grep -c ", restarted$" $TMP/server.log
+}
+
+sleep 1
+if ! kill -0 $PID 2>/dev/null; then
+	cat $TMP/server.log
+	echo "checkrestart: testrestart did not start"
+	rm -rf $TMP
+	exit 1
+fi
+
+(
+	runs=0
+	while [ ! -f $TMP/stop ]; do
+		./teststress -p $PORT -P line -c 20 -m 50 -D 5 > $TMP/client.log 2>&1
+		status=$?
+		lost=`awk '/^total / { print $5 }' $TMP/client.log`
+		if [ 0 != $status ] || [ "0" != "$lost" ] || grep -q "errno" $TMP/client.log; then
+			cat $TMP/client.log >> $TMP/failed.log
+		fi
+		runs=`expr $runs + 1`
+		echo $runs > $TMP/runs
+	done
+) &
+LOAD=$!
+
+i=0
+while [ $i -lt $RESTARTS ]; do
+	sleep 1
+	kill -USR2 `last_pid`
+
+	# the new copy logs "restarted" when it has taken the listener
+	want=`expr $i + 1`
+	waited=0
+	while [ `count_restarted` -lt $want ] && [ $waited -lt 100 ]; do
+		sleep 0.1
+		waited=`expr $waited + 1`
+	done
+
+	if [ `count_restarted` -lt $want ]; then
+		echo "checkrestart: restart #$want did not come up"
+		cat $TMP/server.log
+		cleanup
+		exit 1
+	fi
+
+	i=$want
+done
+
+sleep 1
+PID=`last_pid`
+touch $TMP/stop
+wait $LOAD
+
+runs=`cat $TMP/runs 2>/dev/null`
+
+if [ -f $TMP/failed.log ]; then
+	cat $TMP/failed.log
+	if grep -q "Connection refused" $TMP/failed.log; then
+		echo "checkrestart: FAILED, connection refused during a restart"
+	else
+		echo "checkrestart: FAILED, errors or lost replies during a restart"
+	fi
+	cleanup
+	exit 1
+fi
+
+echo "checkrestart: OK, $RESTARTS restarts, ${runs:-0} teststress runs"
+cleanup
+exit 0
@@ -0,0 +1,535 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include "spporting.hpp"
+
+#include "spasyncclient.hpp"
+#include "spdispatcher.hpp"
+#include "sphandler.hpp"
+#include "spmsgdecoder.hpp"
+#include "sprequest.hpp"
+#include "spbuffer.hpp"
+#include "spexecutor.hpp"
+#include "sputils.hpp"
+
+SP_AsyncCallback :: ~SP_AsyncCallback()
+{
+}
+
+//---------------------------------------------------------
+
+class SP_AsyncCall {
+public:
+	SP_AsyncCall( SP_AsyncClient * client, SP_Sid_t sid, const char * host, int port,
+			const char * request, int len, SP_MsgDecoder * decoder, SP_AsyncCallback * callback );
+
+	void addRef();
+	void release();
+
+	void setSession( SP_Sid_t sid );
+
+	// return 0 : session is unknown
+	int getSession( SP_Sid_t * sid );
+
+	// run the callback once, return -1 if it is already completed
+	int complete( int error );
+
+	int isDone();
+
+	SP_AsyncClient * mClient;
+	SP_Sid_t mSid;
+	char mKey[ 160 ];
+	char mHost[ 128 ];
+	int mPort;
+	struct sockaddr_in mAddr;
+	struct timeval mTimeout;
+
+	SP_Buffer * mRequest;
+	SP_MsgDecoder * mDecoder;
+
+private:
+	~SP_AsyncCall();
+
+	SP_AsyncCallback * mCallback;
+
+	sp_thread_mutex_t mMutex;
+	int mRefCount;
+	int mIsDone;
+	int mHasSession;
+	SP_Sid_t mSessionSid;
+};
+
+SP_AsyncCall :: SP_AsyncCall( SP_AsyncClient * client, SP_Sid_t sid, const char * host,
+		int port, const char * request, int len, SP_MsgDecoder * decoder,
+		SP_AsyncCallback * callback )
+{
+	mClient = client;
+	mSid = sid;
+	snprintf( mHost, sizeof( mHost ), "%s", host );
+	mPort = port;
+	snprintf( mKey, sizeof( mKey ), "%s:%d", host, port );
+
+	memset( &mAddr, 0, sizeof( mAddr ) );
+	mAddr.sin_family = AF_INET;
+	mAddr.sin_addr.s_addr = inet_addr( mHost );
+	mAddr.sin_port = htons( mPort );
+
+	mRequest = new SP_Buffer();
+	mRequest->append( request, len );
+	mDecoder = decoder;
+	mCallback = callback;
+
+	sp_thread_mutex_init( &mMutex, NULL );
+	mRefCount = 1;
+	mIsDone = 0;
+	mHasSession = 0;
+	memset( &mSessionSid, 0, sizeof( mSessionSid ) );
+}
+
+SP_AsyncCall :: ~SP_AsyncCall()
+{
+	delete mRequest;
+	delete mDecoder;
+	delete mCallback;
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+void SP_AsyncCall :: addRef()
+{
+	sp_thread_mutex_lock( &mMutex );
+	mRefCount++;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_AsyncCall :: release()
+{
+	sp_thread_mutex_lock( &mMutex );
+	int refCount = --mRefCount;
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( refCount <= 0 ) delete this;
+}
+
+void SP_AsyncCall :: setSession( SP_Sid_t sid )
+{
+	sp_thread_mutex_lock( &mMutex );
+	mSessionSid = sid;
+	mHasSession = 1;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+int SP_AsyncCall :: getSession( SP_Sid_t * sid )
+{
+	sp_thread_mutex_lock( &mMutex );
+	int hasSession = mHasSession;
+	*sid = mSessionSid;
+	sp_thread_mutex_unlock( &mMutex );
+
+	return hasSession;
+}
+
+int SP_AsyncCall :: isDone()
+{
+	sp_thread_mutex_lock( &mMutex );
+	int isDone = mIsDone;
+	sp_thread_mutex_unlock( &mMutex );
+
+	return isDone;
+}
+
+int SP_AsyncCall :: complete( int error )
+{
+	sp_thread_mutex_lock( &mMutex );
+	int isDone = mIsDone;
+	mIsDone = 1;
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( isDone ) return -1;
+
+	SP_Response * response = new SP_Response( mSid );
+	mCallback->completed( mDecoder, error, response );
+	mClient->mDispatcher->push( response );
+
+	return 0;
+}
+
+//---------------------------------------------------------
+
+// per-call timeout, closes the upstream session if the reply is late
+class SP_AsyncTimer : public SP_TimerHandler {
+public:
+	SP_AsyncTimer( SP_AsyncCall * call ) { mCall = call; }
+	virtual ~SP_AsyncTimer() { mCall->release(); }
+
+	virtual int handle( SP_Response * response, struct timeval * timeout ) {
+		if( 0 == mCall->complete( ETIMEDOUT ) ) {
+			SP_Sid_t sid;
+			if( mCall->getSession( &sid ) ) response->getToCloseList()->add( sid );
+		}
+
+		return -1;
+	}
+
+private:
+	SP_AsyncCall * mCall;
+};
+
+//---------------------------------------------------------
+
+// hands the decoding to the decoder of the current call
+class SP_AsyncDecoder : public SP_MsgDecoder {
+public:
+	SP_AsyncDecoder( SP_AsyncSession * session ) { mSession = session; }
+	virtual ~SP_AsyncDecoder() {}
+
+	virtual int decode( SP_Buffer * inBuffer );
+
+private:
+	SP_AsyncSession * mSession;
+};
+
+class SP_AsyncSession : public SP_Handler {
+public:
+	SP_AsyncSession( SP_AsyncClient * client, SP_AsyncCall * call );
+	virtual ~SP_AsyncSession();
+
+	virtual int start( SP_Request * request, SP_Response * response );
+	virtual int handle( SP_Request * request, SP_Response * response );
+	virtual void error( SP_Response * response );
+	virtual void timeout( SP_Response * response );
+	virtual void close();
+
+	int decode( SP_Buffer * inBuffer );
+
+	// the call is owned by the session until it is completed
+	void setCall( SP_AsyncCall * call );
+
+	const char * getKey();
+	SP_Sid_t getSid();
+
+private:
+	SP_AsyncClient * mClient;
+	char mKey[ 160 ];
+	SP_Sid_t mSid;
+
+	sp_thread_mutex_t mMutex;
+	SP_AsyncCall * mCall;
+	int mError;
+};
+
+int SP_AsyncDecoder :: decode( SP_Buffer * inBuffer )
+{
+	return mSession->decode( inBuffer );
+}
+
+SP_AsyncSession :: SP_AsyncSession( SP_AsyncClient * client, SP_AsyncCall * call )
+{
+	mClient = client;
+	snprintf( mKey, sizeof( mKey ), "%s", call->mKey );
+	memset( &mSid, 0, sizeof( mSid ) );
+
+	sp_thread_mutex_init( &mMutex, NULL );
+	mCall = call;
+	mError = ECONNRESET;
+}
+
+SP_AsyncSession :: ~SP_AsyncSession()
+{
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+const char * SP_AsyncSession :: getKey()
+{
+	return mKey;
+}
+
+SP_Sid_t SP_AsyncSession :: getSid()
+{
+	return mSid;
+}
+
+void SP_AsyncSession :: setCall( SP_AsyncCall * call )
+{
+	sp_thread_mutex_lock( &mMutex );
+	mCall = call;
+	sp_thread_mutex_unlock( &mMutex );
+
+	call->setSession( mSid );
+}
+
+int SP_AsyncSession :: decode( SP_Buffer * inBuffer )
+{
+	int ret = SP_MsgDecoder::eMoreData;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	if( NULL != mCall ) {
+		ret = mCall->mDecoder->decode( inBuffer );
+	} else if( inBuffer->getSize() > 0 ) {
+		// data without a call, handle will close the session
+		ret = SP_MsgDecoder::eOK;
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	return ret;
+}
+
+int SP_AsyncSession :: start( SP_Request * request, SP_Response * response )
+{
+	mSid = response->getFromSid();
+
+	request->setMsgDecoder( new SP_AsyncDecoder( this ) );
+
+	sp_thread_mutex_lock( &mMutex );
+	SP_AsyncCall * call = mCall;
+	sp_thread_mutex_unlock( &mMutex );
+
+	call->setSession( mSid );
+
+	response->getReply()->getMsg()->append( call->mRequest );
+
+	return 0;
+}
+
+int SP_AsyncSession :: handle( SP_Request * request, SP_Response * response )
+{
+	sp_thread_mutex_lock( &mMutex );
+	SP_AsyncCall * call = mCall;
+	mCall = NULL;
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( NULL == call ) {
+		sp_syslog( LOG_WARNING, "async session(%d.%d) %s, unexpected data",
+				mSid.mKey, mSid.mSeq, mKey );
+		return -1;
+	}
+
+	int isLate = call->complete( 0 );
+	call->release();
+
+	// a late reply has been timed out, the session is being closed
+	if( 0 != isLate ) return -1;
+
+	return mClient->putIdle( this );
+}
+
+void SP_AsyncSession :: error( SP_Response * response )
+{
+	mError = ECONNRESET;
+}
+
+void SP_AsyncSession :: timeout( SP_Response * response )
+{
+	mError = ETIMEDOUT;
+}
+
+void SP_AsyncSession :: close()
+{
+	// lock order : client, then session
+	mClient->removeIdle( this );
+
+	sp_thread_mutex_lock( &mMutex );
+	SP_AsyncCall * call = mCall;
+	mCall = NULL;
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( NULL != call ) {
+		call->complete( mError );
+		call->release();
+	}
+}
+
+//---------------------------------------------------------
+
+class SP_AsyncConnector : public SP_ConnectHandler {
+public:
+	SP_AsyncConnector( SP_AsyncCall * call ) { mCall = call; }
+	virtual ~SP_AsyncConnector() {}
+
+	virtual void completed( int fd, int error, SP_Response * response ) {
+		if( fd >= 0 && ! mCall->isDone() ) {
+			mCall->mClient->mDispatcher->push( fd, new SP_AsyncSession( mCall->mClient, mCall ) );
+		} else {
+			if( fd >= 0 ) sp_close( fd );
+			mCall->complete( error );
+			mCall->release();
+		}
+	}
+
+private:
+	SP_AsyncCall * mCall;
+};
+
+//---------------------------------------------------------
+
+SP_AsyncClient :: SP_AsyncClient( SP_Dispatcher * dispatcher, int maxIdlePerKey, int dnsThreads )
+{
+	mDispatcher = dispatcher;
+	mDnsExecutor = new SP_Executor( dnsThreads > 0 ? dnsThreads : 1, "dns" );
+	mMaxIdlePerKey = maxIdlePerKey;
+
+	sp_thread_mutex_init( &mMutex, NULL );
+	mIdleList = new SP_ArrayList();
+}
+
+SP_AsyncClient :: ~SP_AsyncClient()
+{
+	delete mDnsExecutor;
+	mDnsExecutor = NULL;
+
+	// idle sessions belong to the dispatcher
+	delete mIdleList;
+	mIdleList = NULL;
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+int SP_AsyncClient :: getIdleCount()
+{
+	sp_thread_mutex_lock( &mMutex );
+	int count = mIdleList->getCount();
+	sp_thread_mutex_unlock( &mMutex );
+
+	return count;
+}
+
+int SP_AsyncClient :: call( SP_Sid_t sid, const char * host, int port,
+		const char * request, int len, SP_MsgDecoder * decoder,
+		SP_AsyncCallback * callback, int timeout )
+{
+	if( NULL == host || port <= 0 || NULL == decoder || NULL == callback ) return -1;
+
+	SP_AsyncCall * call = new SP_AsyncCall( this, sid, host, port, request, len,
+			decoder, callback );
+	call->mTimeout.tv_sec = timeout / 1000;
+	call->mTimeout.tv_usec = ( timeout % 1000 ) * 1000;
+
+	if( timeout > 0 ) {
+		call->addRef();
+		mDispatcher->push( &( call->mTimeout ), new SP_AsyncTimer( call ) );
+	}
+
+	SP_Sid_t sessionSid;
+	if( 0 == takeIdle( call->mKey, call, &sessionSid ) ) {
+		SP_Sid_t pushSid;
+		pushSid.mKey = SP_Sid_t::ePushKey;
+		pushSid.mSeq = SP_Sid_t::ePushSeq;
+
+		SP_Response * response = new SP_Response( pushSid );
+		SP_Message * msg = new SP_Message();
+		msg->getToList()->add( sessionSid );
+		msg->getMsg()->append( call->mRequest );
+		response->addMessage( msg );
+
+		mDispatcher->push( response );
+	} else if( INADDR_NONE != call->mAddr.sin_addr.s_addr ) {
+		connect( call );
+	} else {
+		mDnsExecutor->execute( resolve, call );
+	}
+
+	return 0;
+}
+
+void SP_AsyncClient :: connect( SP_AsyncCall * call )
+{
+	mDispatcher->push( &( call->mAddr ), call->mTimeout.tv_sec > 0 || call->mTimeout.tv_usec > 0
+			? &( call->mTimeout ) : NULL, new SP_AsyncConnector( call ) );
+}
+
+void SP_AsyncClient :: resolve( void * arg )
+{
+	SP_AsyncCall * call = (SP_AsyncCall*)arg;
+
+	struct addrinfo hints, * result = NULL;
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo( call->mHost, NULL, &hints, &result );
+	if( 0 == ret && NULL != result ) {
+		call->mAddr.sin_addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+		freeaddrinfo( result );
+
+		if( ! call->isDone() ) {
+			call->mClient->connect( call );
+			return;
+		}
+	} else {
+		sp_syslog( LOG_WARNING, "Cannot resolve %s, %s", call->mHost, gai_strerror( ret ) );
+	}
+
+	call->complete( EHOSTUNREACH );
+	call->release();
+}
+
+int SP_AsyncClient :: takeIdle( const char * key, SP_AsyncCall * call, SP_Sid_t * sid )
+{
+	int ret = -1;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	for( int i = mIdleList->getCount() - 1; i >= 0; i-- ) {
+		SP_AsyncSession * session = (SP_AsyncSession*)mIdleList->getItem( i );
+		if( 0 == strcmp( session->getKey(), key ) ) {
+			mIdleList->takeItem( i );
+
+			// set under the client lock, so close() sees the call and completes it
+			session->setCall( call );
+			*sid = session->getSid();
+			ret = 0;
+			break;
+		}
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	return ret;
+}
+
+int SP_AsyncClient :: putIdle( SP_AsyncSession * session )
+{
+	int ret = -1;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	int count = 0;
+	for( int i = 0; i < mIdleList->getCount(); i++ ) {
+		SP_AsyncSession * iter = (SP_AsyncSession*)mIdleList->getItem( i );
+		if( 0 == strcmp( iter->getKey(), session->getKey() ) ) count++;
+	}
+
+	if( count < mMaxIdlePerKey ) {
+		mIdleList->append( session );
+		ret = 0;
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	return ret;
+}
+
+void SP_AsyncClient :: removeIdle( SP_AsyncSession * session )
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	for( int i = mIdleList->getCount() - 1; i >= 0; i-- ) {
+		if( session == mIdleList->getItem( i ) ) {
+			mIdleList->takeItem( i );
+			break;
+		}
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
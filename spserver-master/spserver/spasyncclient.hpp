@@ -0,0 +1,82 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spasyncclient_hpp__
+#define __spasyncclient_hpp__
+
+#include "spthread.hpp"
+#include "spresponse.hpp"
+
+class SP_Dispatcher;
+class SP_MsgDecoder;
+class SP_Executor;
+class SP_ArrayList;
+
+class SP_AsyncCall;
+class SP_AsyncSession;
+
+class SP_AsyncCallback {
+public:
+	virtual ~SP_AsyncCallback();
+
+	/**
+	 * @brief the call is done, run on a worker
+	 * @param decoder : holds the reply when error is 0
+	 * @param error : 0, errno of connect or io, ETIMEDOUT, EHOSTUNREACH for dns
+	 * @param response : from the originating session, getReply() goes back to it
+	 */
+	virtual void completed( SP_MsgDecoder * decoder, int error, SP_Response * response ) = 0;
+};
+
+/**
+ * @brief outbound request/reply calls from the handlers of a SP_Dispatcher,
+ *        connects are non-blocking, host names are resolved on a small
+ *        executor, the io runs in the event loop, and the upstream sessions
+ *        are kept in a pool keyed by host:port for the next call
+ */
+class SP_AsyncClient {
+public:
+	SP_AsyncClient( SP_Dispatcher * dispatcher, int maxIdlePerKey = 8, int dnsThreads = 2 );
+	~SP_AsyncClient();
+
+	/**
+	 * @brief send request to host:port and decode the reply with decoder
+	 * @param sid : the originating session
+	 * @param timeout : msec for connect, request and reply
+	 * @return 0 : OK, -1 : Fail, callback is not called
+	 * @note  decoder and callback are deleted after the call is completed
+	 */
+	int call( SP_Sid_t sid, const char * host, int port, const char * request, int len,
+			SP_MsgDecoder * decoder, SP_AsyncCallback * callback, int timeout );
+
+	int getIdleCount();
+
+private:
+	SP_Dispatcher * mDispatcher;
+	SP_Executor * mDnsExecutor;
+	int mMaxIdlePerKey;
+
+	sp_thread_mutex_t mMutex;
+	SP_ArrayList * mIdleList;
+
+	friend class SP_AsyncCall;
+	friend class SP_AsyncSession;
+	friend class SP_AsyncConnector;
+
+	// hand call to an idle session of key
+	// return 0 : taken, sid is the session, -1 : no idle session
+	int takeIdle( const char * key, SP_AsyncCall * call, SP_Sid_t * sid );
+
+	// return 0 : kept, -1 : pool is full
+	int putIdle( SP_AsyncSession * session );
+	void removeIdle( SP_AsyncSession * session );
+
+	void connect( SP_AsyncCall * call );
+
+	static void resolve( void * arg );
+};
+
+#endif
+
@@ -0,0 +1,549 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "spporting.hpp"
+
+#include "spbuffer.hpp"
+#include "spmsgdecoder.hpp"
+#include "sphttpmsg.hpp"
+#include "spsession.hpp"
+#include "sputils.hpp"
+#include "spexecutor.hpp"
+#include "spthread.hpp"
+
+#include "event_msgqueue.h"
+#include "event.h"
+
+// microbenchmarks of the building blocks, to track regressions:
+//   ./spbench              all benchmarks, as a table
+//   ./spbench -j > a.json  one json object per line
+//   ./spbench -b decoder   only the benchmarks whose name contains "decoder"
+// every benchmark is calibrated to run for -t msec, -r times,
+// the median, min and max of the time per op are reported
+
+typedef void ( * SP_BenchFunc_t ) ( int loops );
+
+typedef struct tagSP_Bench {
+	const char * mName;
+	SP_BenchFunc_t mFunc;
+	const char * mDesc;
+} SP_Bench_t;
+
+// keeps the results alive, so the compiler cannot drop the work
+static volatile unsigned long gSink = 0;
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void fill( char * buffer, int len )
+{
+	for( int i = 0; i < len; i++ ) buffer[i] = 'a' + i % 26;
+}
+
+//---------------------------------------------------------
+
+static void benchBufferAppend( int loops )
+{
+	SP_Buffer buffer;
+	char data[ 64 ];
+	fill( data, sizeof( data ) );
+
+	for( int i = 0; i < loops; i++ ) {
+		buffer.append( data, sizeof( data ) );
+		if( buffer.getSize() >= 65536 ) buffer.reset();
+	}
+
+	gSink += buffer.getSize();
+}
+
+static void benchBufferAppendErase( int loops )
+{
+	SP_Buffer buffer;
+	char data[ 1024 ];
+	fill( data, sizeof( data ) );
+
+	for( int i = 0; i < loops; i++ ) {
+		buffer.append( data, sizeof( data ) );
+		buffer.erase( sizeof( data ) );
+	}
+
+	gSink += buffer.getSize();
+}
+
+static void benchBufferFind( int loops )
+{
+	SP_Buffer buffer;
+	char data[ 4096 ];
+	fill( data, sizeof( data ) );
+	for( int i = 64; i < (int)sizeof( data ); i += 64 ) data[i] = '\r', data[i+1] = '\n';
+
+	buffer.append( data, sizeof( data ) );
+	buffer.append( "\r\n\r\n" );
+
+	for( int i = 0; i < loops; i++ ) {
+		gSink += (unsigned long)buffer.find( "\r\n\r\n", 4 );
+	}
+}
+
+//---------------------------------------------------------
+
+static void benchDefaultDecoder( int loops )
+{
+	SP_DefaultMsgDecoder decoder;
+	SP_Buffer inBuffer;
+	char data[ 1024 ];
+	fill( data, sizeof( data ) );
+
+	for( int i = 0; i < loops; i++ ) {
+		inBuffer.append( data, sizeof( data ) );
+		decoder.decode( &inBuffer );
+		gSink += decoder.getMsg()->getSize();
+		decoder.getMsg()->reset();
+	}
+}
+
+static const char * gLine = "GET /index.html HTTP/1.0\r\n";
+
+static void benchLineDecoder( int loops )
+{
+	SP_LineMsgDecoder decoder;
+	SP_Buffer inBuffer;
+
+	for( int i = 0; i < loops; i++ ) {
+		if( inBuffer.getSize() <= 0 ) {
+			for( int j = 0; j < 64; j++ ) inBuffer.append( gLine );
+		}
+		decoder.decode( &inBuffer );
+		gSink += (unsigned long)decoder.getMsg();
+	}
+}
+
+static void benchMultiLineDecoder( int loops )
+{
+	SP_MultiLineMsgDecoder decoder;
+	SP_Buffer inBuffer;
+
+	for( int i = 0; i < loops; i++ ) {
+		for( int j = 0; j < 64; j++ ) inBuffer.append( gLine );
+		decoder.decode( &inBuffer );
+
+		for( ; NULL != decoder.getQueue()->top(); ) {
+			free( decoder.getQueue()->pop() );
+		}
+	}
+}
+
+static void makeDotTermMsg( SP_Buffer * msg )
+{
+	char line[ 78 ];
+	fill( line, sizeof( line ) - 2 );
+	line[76] = '\r', line[77] = '\n';
+
+	for( ; msg->getSize() < 4096; ) msg->append( line, sizeof( line ) );
+	msg->append( "\r\n.\r\n" );
+}
+
+static void benchDotTermDecoder( int loops )
+{
+	SP_DotTermMsgDecoder decoder;
+	SP_Buffer msg, inBuffer;
+	makeDotTermMsg( &msg );
+
+	for( int i = 0; i < loops; i++ ) {
+		inBuffer.append( &msg );
+		decoder.decode( &inBuffer );
+		gSink += (unsigned long)decoder.getMsg();
+	}
+}
+
+static void benchDotTermChunkDecoder( int loops )
+{
+	SP_DotTermChunkMsgDecoder decoder;
+	SP_Buffer msg, inBuffer;
+	makeDotTermMsg( &msg );
+
+	for( int i = 0; i < loops; i++ ) {
+		inBuffer.append( &msg );
+		decoder.decode( &inBuffer );
+		char * data = decoder.getMsg();
+		gSink += data[0];
+		free( data );
+	}
+}
+
+static void benchDotTermStreamDecoder( int loops )
+{
+	SP_Buffer msg, inBuffer;
+	makeDotTermMsg( &msg );
+
+	for( int i = 0; i < loops; i++ ) {
+		SP_DotTermStreamMsgDecoder decoder;
+		inBuffer.append( &msg );
+		for( ; SP_MsgDecoder::eOK == decoder.decode( &inBuffer ); ) {
+			gSink += decoder.getChunk()->getSize();
+			if( decoder.isLast() ) break;
+		}
+	}
+}
+
+static void benchFrameDecoder( int loops )
+{
+	SP_FrameMsgDecoder decoder;
+	SP_Buffer block, inBuffer;
+
+	char frame[ 100 ];
+	fill( frame, sizeof( frame ) );
+	for( int j = 0; j < 64; j++ ) SP_FrameMsgDecoder::appendFrame( &block, frame, sizeof( frame ) );
+
+	for( int i = 0; i < loops; i++ ) {
+		inBuffer.append( &block );
+		decoder.decode( &inBuffer );
+		for( int j = 0; j < decoder.getCount(); j++ ) {
+			int len = 0;
+			gSink += decoder.getFrame( j, &len )[0];
+		}
+	}
+}
+
+//---------------------------------------------------------
+
+static const char * gHttpGet =
+	"GET /search?q=spserver&lang=en HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101 Firefox/60.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n";
+
+static void benchHttpParseGet( int loops )
+{
+	int len = strlen( gHttpGet );
+
+	for( int i = 0; i < loops; i++ ) {
+		SP_HttpMsgParser parser;
+		parser.append( gHttpGet, len );
+		assert( parser.isCompleted() );
+		gSink += (unsigned long)parser.getRequest();
+	}
+}
+
+static void benchHttpParsePost( int loops )
+{
+	char content[ 1024 ];
+	fill( content, sizeof( content ) );
+
+	SP_Buffer msg;
+	msg.printf( "POST /upload HTTP/1.1\r\nHost: www.example.com\r\n"
+			"Content-Type: application/octet-stream\r\nContent-Length: %d\r\n\r\n",
+			(int)sizeof( content ) );
+	msg.append( content, sizeof( content ) );
+
+	for( int i = 0; i < loops; i++ ) {
+		SP_HttpMsgParser parser;
+		parser.append( msg.getRawBuffer(), msg.getSize() );
+		assert( parser.isCompleted() );
+		gSink += (unsigned long)parser.getRequest();
+	}
+}
+
+//---------------------------------------------------------
+
+static void benchSessionManager( int loops )
+{
+	enum { LIVE = 4096 };
+
+	SP_SessionManager manager;
+	SP_Session * session = (SP_Session*)&manager;
+
+	SP_Sid_t live[ LIVE ];
+	for( int i = 0; i < LIVE; i++ ) {
+		live[i].mKey = manager.allocKey( &live[i].mSeq );
+		manager.put( live[i].mKey, live[i].mSeq, session );
+	}
+
+	// remove the oldest, alloc and put a new one, look up another one
+	for( int i = 0; i < loops; i++ ) {
+		SP_Sid_t * sid = &( live[ i % LIVE ] );
+		manager.remove( sid->mKey, sid->mSeq );
+
+		sid->mKey = manager.allocKey( &sid->mSeq );
+		manager.put( sid->mKey, sid->mSeq, session );
+
+		uint16_t seq = 0;
+		gSink += (unsigned long)manager.get( live[ ( i * 7 ) % LIVE ].mKey, &seq );
+	}
+
+	for( int i = 0; i < LIVE; i++ ) manager.remove( live[i].mKey, live[i].mSeq );
+}
+
+static void benchCircleQueue( int loops )
+{
+	SP_CircleQueue queue;
+	for( int i = 0; i < 64; i++ ) queue.push( &queue );
+
+	for( int i = 0; i < loops; i++ ) {
+		queue.push( &queue );
+		gSink += (unsigned long)queue.pop();
+	}
+}
+
+static void benchCircleList( int loops )
+{
+	SP_CircleList list;
+	for( int i = 0; i < 64; i++ ) list.append( &list );
+
+	for( int i = 0; i < loops; i++ ) {
+		list.append( &list );
+		gSink += (unsigned long)list.takeItem( 0 );
+	}
+}
+
+static void benchBlockingQueue( int loops )
+{
+	SP_BlockingQueue queue;
+
+	for( int i = 0; i < loops; i++ ) {
+		queue.push( &queue );
+		gSink += (unsigned long)queue.pop();
+	}
+}
+
+//---------------------------------------------------------
+
+typedef struct tagSP_BenchSignal {
+	sp_thread_mutex_t mMutex;
+	sp_thread_cond_t mCond;
+	int mDone;
+} SP_BenchSignal_t;
+
+static void initSignal( SP_BenchSignal_t * signal )
+{
+	sp_thread_mutex_init( &signal->mMutex, NULL );
+	sp_thread_cond_init( &signal->mCond, NULL );
+	signal->mDone = 0;
+}
+
+static void postSignal( SP_BenchSignal_t * signal )
+{
+	sp_thread_mutex_lock( &signal->mMutex );
+	signal->mDone = 1;
+	sp_thread_cond_signal( &signal->mCond );
+	sp_thread_mutex_unlock( &signal->mMutex );
+}
+
+static void waitSignal( SP_BenchSignal_t * signal )
+{
+	sp_thread_mutex_lock( &signal->mMutex );
+	for( ; 0 == signal->mDone; ) sp_thread_cond_wait( &signal->mCond, &signal->mMutex );
+	signal->mDone = 0;
+	sp_thread_mutex_unlock( &signal->mMutex );
+}
+
+static void executorTask( void * arg )
+{
+	postSignal( (SP_BenchSignal_t*)arg );
+}
+
+// one task at a time, from execute() to the task signalling back
+static void benchExecutor( int loops )
+{
+	static SP_Executor * executor = NULL;
+	static SP_BenchSignal_t signal;
+
+	if( NULL == executor ) {
+		initSignal( &signal );
+		executor = new SP_Executor( 1, "bench" );
+	}
+
+	for( int i = 0; i < loops; i++ ) {
+		executor->execute( executorTask, &signal );
+		waitSignal( &signal );
+	}
+}
+
+static void msgqueueCallback( void * queueData, void * arg )
+{
+	postSignal( (SP_BenchSignal_t*)queueData );
+}
+
+static sp_thread_result_t SP_THREAD_CALL msgqueueLoop( void * arg )
+{
+	event_base_loop( (struct event_base*)arg, 0 );
+
+	return 0;
+}
+
+// from msgqueue_push to the callback in the event loop thread and back
+static void benchMsgQueue( int loops )
+{
+	static struct event_msgqueue * queue = NULL;
+	static SP_BenchSignal_t signal;
+
+	if( NULL == queue ) {
+		initSignal( &signal );
+
+		struct event_base * base = (struct event_base*)event_init();
+		queue = msgqueue_new( base, 0, msgqueueCallback, NULL );
+
+		sp_thread_attr_t attr;
+		sp_thread_attr_init( &attr );
+		sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+		sp_thread_t thread;
+		assert( 0 == sp_thread_create( &thread, &attr, msgqueueLoop, base ) );
+		sp_thread_attr_destroy( &attr );
+	}
+
+	for( int i = 0; i < loops; i++ ) {
+		msgqueue_push( queue, &signal );
+		waitSignal( &signal );
+	}
+}
+
+//---------------------------------------------------------
+
+static SP_Bench_t gBenchList[] = {
+	{ "buffer_append_64", benchBufferAppend, "append 64 bytes" },
+	{ "buffer_append_erase_1k", benchBufferAppendErase, "append and erase 1KB" },
+	{ "buffer_find_4k", benchBufferFind, "find CRLFCRLF at the end of 4KB" },
+	{ "decoder_default_1k", benchDefaultDecoder, "SP_DefaultMsgDecoder, 1KB" },
+	{ "decoder_line", benchLineDecoder, "SP_LineMsgDecoder, one line" },
+	{ "decoder_multiline_64", benchMultiLineDecoder, "SP_MultiLineMsgDecoder, 64 lines" },
+	{ "decoder_dotterm_4k", benchDotTermDecoder, "SP_DotTermMsgDecoder, 4KB" },
+	{ "decoder_dottermchunk_4k", benchDotTermChunkDecoder, "SP_DotTermChunkMsgDecoder, 4KB" },
+	{ "decoder_dottermstream_4k", benchDotTermStreamDecoder, "SP_DotTermStreamMsgDecoder, 4KB" },
+	{ "decoder_frame_100x64", benchFrameDecoder, "SP_FrameMsgDecoder, 64 frames of 100 bytes" },
+	{ "http_parse_get", benchHttpParseGet, "SP_HttpMsgParser, GET with 6 headers" },
+	{ "http_parse_post_1k", benchHttpParsePost, "SP_HttpMsgParser, POST with 1KB content" },
+	{ "session_manager", benchSessionManager, "SP_SessionManager remove, allocKey, put, get" },
+	{ "circle_queue", benchCircleQueue, "SP_CircleQueue push and pop" },
+	{ "circle_list", benchCircleList, "SP_CircleList append and take the head" },
+	{ "blocking_queue", benchBlockingQueue, "SP_BlockingQueue push and pop, one thread" },
+	{ "executor_latency", benchExecutor, "SP_Executor execute to task run, round-trip" },
+	{ "msgqueue_roundtrip", benchMsgQueue, "msgqueue_push to callback, round-trip" },
+	{ NULL, NULL, NULL }
+};
+
+static int compareDouble( const void * a, const void * b )
+{
+	double x = *(double*)a, y = *(double*)b;
+	return x < y ? -1 : ( x > y ? 1 : 0 );
+}
+
+static void runBench( SP_Bench_t * bench, int minMsec, int repeats, int isJson )
+{
+	// double the loops until one run takes a tenth of the target
+	int loops = 1;
+	for( ; ; ) {
+		double begin = now();
+		bench->mFunc( loops );
+		double used = now() - begin;
+
+		if( used * 10000 >= minMsec || loops >= ( 1 << 28 ) ) {
+			double target = loops * ( minMsec / 1000.0 ) / ( used > 0 ? used : 1e-6 );
+			loops = target < 1 ? 1 : ( target > ( 1 << 30 ) ? ( 1 << 30 ) : (int)target );
+			break;
+		}
+		loops = loops * 2;
+	}
+
+	double * nsPerOp = (double*)malloc( sizeof( double ) * repeats );
+
+	for( int i = 0; i < repeats; i++ ) {
+		double begin = now();
+		bench->mFunc( loops );
+		nsPerOp[i] = ( now() - begin ) * 1e9 / loops;
+	}
+
+	qsort( nsPerOp, repeats, sizeof( double ), compareDouble );
+
+	double median = nsPerOp[ repeats / 2 ];
+
+	if( isJson ) {
+		printf( "{\"bench\": \"%s\", \"loops\": %d, \"repeats\": %d, \"ns_per_op\": %.2f, "
+				"\"min_ns\": %.2f, \"max_ns\": %.2f, \"ops_per_sec\": %.0f}\n",
+				bench->mName, loops, repeats, median, nsPerOp[0], nsPerOp[ repeats - 1 ],
+				1e9 / median );
+	} else {
+		printf( "%-26s %10d %12.1f %12.1f %12.1f %14.0f\n", bench->mName, loops,
+				median, nsPerOp[0], nsPerOp[ repeats - 1 ], 1e9 / median );
+	}
+	fflush( stdout );
+
+	free( nsPerOp );
+}
+
+int main( int argc, char * argv[] )
+{
+	int minMsec = 200, repeats = 5, isJson = 0, isList = 0;
+	const char * filter = NULL;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "t:r:b:jlv" )) != EOF ) {
+		switch ( c ) {
+			case 't' :
+				minMsec = atoi( optarg );
+				break;
+			case 'r':
+				repeats = atoi( optarg );
+				break;
+			case 'b':
+				filter = optarg;
+				break;
+			case 'j':
+				isJson = 1;
+				break;
+			case 'l':
+				isList = 1;
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-t <msec per run>] [-r <repeats>] [-b <name filter>] [-j] [-l]\n", argv[0] );
+				printf( "\t-j one json object per line\n" );
+				printf( "\t-l list the benchmarks\n" );
+				exit( 0 );
+		}
+	}
+
+	if( minMsec <= 0 ) minMsec = 200;
+	if( repeats <= 0 ) repeats = 5;
+
+	// the executor logs its threads
+	sp_openlog( "spbench", LOG_CONS | LOG_PID, LOG_USER );
+
+	if( ! isJson && ! isList ) {
+		printf( "%-26s %10s %12s %12s %12s %14s\n", "bench", "loops",
+				"ns/op", "min ns", "max ns", "ops/s" );
+	}
+
+	for( SP_Bench_t * bench = gBenchList; NULL != bench->mName; bench++ ) {
+		if( NULL != filter && NULL == strstr( bench->mName, filter ) ) continue;
+
+		if( isList ) {
+			printf( "%-26s %s\n", bench->mName, bench->mDesc );
+		} else {
+			runBench( bench, minMsec, repeats, isJson );
+		}
+	}
+
+	sp_closelog();
+
+	return 0;
+}
+
@@ -174,3 +174,34 @@ const void * SP_Buffer :: find( const void * key, size_t len )
 	return (NULL);
 }
 
+void SP_Buffer :: swap( SP_Buffer * other )
+{
+	sp_evbuffer_t * tmp = mBuffer;
+	mBuffer = other->mBuffer;
+	other->mBuffer = tmp;
+}
+
+void SP_Buffer :: shrink( int maxIdle )
+{
+	if( 0 == getSize() && getCapacity() > maxIdle ) {
+		sp_evbuffer_free( mBuffer );
+		mBuffer = sp_evbuffer_new();
+	}
+}
+
+void * SP_Buffer :: getTailSpace( int len, int * space )
+{
+	if( sp_evbuffer_expand( mBuffer, len ) < 0 ) {
+		*space = 0;
+		return NULL;
+	}
+
+	*space = mBuffer->totallen - mBuffer->misalign - mBuffer->off;
+
+	return mBuffer->buffer + mBuffer->off;
+}
+
+void SP_Buffer :: commitTailSpace( int len )
+{
+	mBuffer->off += len;
+}
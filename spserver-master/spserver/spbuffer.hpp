@@ -42,6 +42,19 @@ public:
 
 	SP_Buffer * take();
 
+	/// exchange the contents of two buffers without copying
+	void swap( SP_Buffer * other );
+
+	/// release the storage of an empty buffer whose capacity exceeds maxIdle
+	void shrink( int maxIdle );
+
+	/// free space after the data, at least len bytes, for a direct read
+	/// @return the start of the space, NULL if out of memory; *space : its size
+	void * getTailSpace( int len, int * space );
+
+	/// the first len bytes of the tail space have been filled
+	void commitTailSpace( int len );
+
 private:
 	sp_evbuffer_t * mBuffer;
 
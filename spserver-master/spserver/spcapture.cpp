@@ -0,0 +1,613 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spporting.hpp"
+
+#include "spcapture.hpp"
+#include "spbuffer.hpp"
+#include "spsession.hpp"
+#include "sprequest.hpp"
+#include "sphandler.hpp"
+#include "spmsgdecoder.hpp"
+
+static const char * SP_CAPTURE_MAGIC = "SPCAP001";
+
+enum { SP_CAPTURE_HEAD = 19 };
+
+// the writer is too slow beyond this, the records are dropped
+static const int SP_CAPTURE_MAX_PENDING = 64 * 1024 * 1024;
+
+static long long captureUsec()
+{
+	struct timeval tv;
+	sp_gettimeofday( &tv, NULL );
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void putInt( unsigned char * pos, unsigned long long value, int len )
+{
+	for( int i = len - 1; i >= 0; i-- ) {
+		pos[i] = (unsigned char)( value & 0xFF );
+		value >>= 8;
+	}
+}
+
+static unsigned long long getInt( const unsigned char * pos, int len )
+{
+	unsigned long long value = 0;
+	for( int i = 0; i < len; i++ ) value = ( value << 8 ) | pos[i];
+	return value;
+}
+
+//---------------------------------------------------------
+
+SP_Capture :: SP_Capture()
+{
+	mFile = NULL;
+	mPending = new SP_Buffer();
+	mDropped = 0;
+	mGapDropped = 0;
+
+	mIsShutdown = 0;
+	mIsRunning = 0;
+	sp_thread_mutex_init( &mMutex, NULL );
+}
+
+SP_Capture :: ~SP_Capture()
+{
+	close();
+
+	delete mPending;
+	mPending = NULL;
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+int SP_Capture :: open( const char * path )
+{
+	if( NULL != mFile ) return -1;
+
+	mFile = fopen( path, "wb" );
+	if( NULL == mFile ) {
+		sp_syslog( LOG_WARNING, "capture: cannot create %s, errno %d, %s",
+				path, errno, strerror( errno ) );
+		return -1;
+	}
+
+	fwrite( SP_CAPTURE_MAGIC, strlen( SP_CAPTURE_MAGIC ), 1, mFile );
+
+	mIsShutdown = 0;
+	mIsRunning = 1;
+
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	sp_thread_t thread;
+	int ret = sp_thread_create( &thread, &attr, writer, this );
+	sp_thread_attr_destroy( &attr );
+
+	if( 0 != ret ) {
+		sp_syslog( LOG_WARNING, "capture: cannot create the writer thread, %s", strerror( errno ) );
+		mIsRunning = 0;
+		fclose( mFile );
+		mFile = NULL;
+		return -1;
+	}
+
+	sp_syslog( LOG_NOTICE, "capture: writing to %s", path );
+
+	return 0;
+}
+
+void SP_Capture :: close()
+{
+	if( NULL == mFile ) return;
+
+	sp_thread_mutex_lock( &mMutex );
+	mIsShutdown = 1;
+	// the drops at the end, after the last record kept
+	if( mGapDropped > 0 ) appendGap();
+	sp_thread_mutex_unlock( &mMutex );
+
+	// the writer does the last flush
+	for( ; ; ) {
+		sp_thread_mutex_lock( &mMutex );
+		int isRunning = mIsRunning;
+		sp_thread_mutex_unlock( &mMutex );
+
+		if( ! isRunning ) break;
+		usleep( 1000 );
+	}
+
+	fclose( mFile );
+	mFile = NULL;
+
+	if( mDropped > 0 ) sp_syslog( LOG_WARNING, "capture: %lld records dropped", mDropped );
+}
+
+void SP_Capture :: record( int type, SP_Sid_t sid, const void * data, int len )
+{
+	if( len < 0 ) len = 0;
+
+	unsigned char head[ SP_CAPTURE_HEAD ];
+	head[0] = (unsigned char)type;
+	putInt( head + 1, sid.mKey, 4 );
+	putInt( head + 5, sid.mSeq, 2 );
+	putInt( head + 7, captureUsec(), 8 );
+	putInt( head + 15, len, 4 );
+
+	sp_thread_mutex_lock( &mMutex );
+
+	if( NULL == mFile || mIsShutdown ) {
+		// closed, such as the sessions still open at the end
+	} else if( (int)mPending->getSize() + len > SP_CAPTURE_MAX_PENDING ) {
+		mDropped++;
+		mGapDropped++;
+	} else {
+		if( mGapDropped > 0 ) appendGap();
+
+		mPending->append( head, sizeof( head ) );
+		if( len > 0 ) mPending->append( data, len );
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_Capture :: appendGap()
+{
+	unsigned char gap[ SP_CAPTURE_HEAD + 4 ];
+	memset( gap, 0, sizeof( gap ) );
+	gap[0] = (unsigned char)eGap;
+	putInt( gap + 7, captureUsec(), 8 );
+	putInt( gap + 15, 4, 4 );
+	putInt( gap + SP_CAPTURE_HEAD, mGapDropped, 4 );
+
+	mPending->append( gap, sizeof( gap ) );
+	mGapDropped = 0;
+}
+
+long long SP_Capture :: getDropped()
+{
+	sp_thread_mutex_lock( &mMutex );
+	long long dropped = mDropped;
+	sp_thread_mutex_unlock( &mMutex );
+
+	return dropped;
+}
+
+int SP_Capture :: flush( SP_Buffer * buffer )
+{
+	sp_thread_mutex_lock( &mMutex );
+	buffer->swap( mPending );
+	sp_thread_mutex_unlock( &mMutex );
+
+	int len = buffer->getSize();
+	if( len > 0 ) {
+		if( 1 != fwrite( buffer->getRawBuffer(), len, 1, mFile ) ) {
+			sp_syslog( LOG_WARNING, "capture: write fail, errno %d, %s", errno, strerror( errno ) );
+		}
+		fflush( mFile );
+	}
+
+	buffer->reset();
+
+	return len;
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_Capture :: writer( void * arg )
+{
+	SP_Capture * capture = (SP_Capture*)arg;
+
+	SP_Buffer buffer;
+
+	for( ; ; ) {
+		sp_thread_mutex_lock( &capture->mMutex );
+		int isShutdown = capture->mIsShutdown;
+		sp_thread_mutex_unlock( &capture->mMutex );
+
+		// nothing is recorded after the shutdown, so this is the last one
+		int len = capture->flush( &buffer );
+
+		if( isShutdown ) break;
+
+		// a batch per 20 msec, at once when it is busy
+		if( len < 1024 * 1024 ) usleep( 20000 );
+	}
+
+	sp_thread_mutex_lock( &capture->mMutex );
+	capture->mIsRunning = 0;
+	sp_thread_mutex_unlock( &capture->mMutex );
+
+	return 0;
+}
+
+//---------------------------------------------------------
+
+class SP_CaptureIOChannel : public SP_IOChannel {
+public:
+	SP_CaptureIOChannel( SP_IOChannel * channel, SP_Capture * capture );
+	virtual ~SP_CaptureIOChannel();
+
+	virtual int init( int fd );
+	virtual int receive( SP_Session * session );
+	virtual int transmit( SP_Session * session );
+
+protected:
+	virtual int write_vec( struct iovec * iovArray, int iovSize );
+
+private:
+	SP_IOChannel * mChannel;
+	SP_Capture * mCapture;
+
+	SP_Sid_t mSid;
+	int mIsOpened;
+};
+
+SP_CaptureIOChannel :: SP_CaptureIOChannel( SP_IOChannel * channel, SP_Capture * capture )
+{
+	mChannel = channel;
+	mCapture = capture;
+	mIsOpened = 0;
+	memset( &mSid, 0, sizeof( mSid ) );
+}
+
+SP_CaptureIOChannel :: ~SP_CaptureIOChannel()
+{
+	if( mIsOpened ) mCapture->record( SP_Capture::eClose, mSid, NULL, 0 );
+
+	delete mChannel;
+	mChannel = NULL;
+}
+
+int SP_CaptureIOChannel :: init( int fd )
+{
+	return mChannel->init( fd );
+}
+
+int SP_CaptureIOChannel :: receive( SP_Session * session )
+{
+	SP_Buffer * inBuffer = session->getInBuffer();
+
+	// what is appended to the input buffer, the plain text of a ssl channel
+	int before = inBuffer->getSize();
+
+	int ret = mChannel->receive( session );
+
+	int len = (int)inBuffer->getSize() - before;
+	if( len > 0 ) {
+		if( ! mIsOpened ) {
+			mIsOpened = 1;
+			mSid = session->getSid();
+
+			const char * clientIP = session->getRequest()->getClientIP();
+			mCapture->record( SP_Capture::eOpen, mSid, clientIP, strlen( clientIP ) );
+		}
+
+		mCapture->record( SP_Capture::eData, mSid,
+				(char*)inBuffer->getRawBuffer() + before, len );
+	}
+
+	return ret;
+}
+
+int SP_CaptureIOChannel :: transmit( SP_Session * session )
+{
+	return mChannel->transmit( session );
+}
+
+int SP_CaptureIOChannel :: write_vec( struct iovec * iovArray, int iovSize )
+{
+	// transmit is passed to the wrapped channel
+	return -1;
+}
+
+//---------------------------------------------------------
+
+SP_CaptureIOChannelFactory :: SP_CaptureIOChannelFactory(
+		SP_IOChannelFactory * factory, SP_Capture * capture )
+{
+	mFactory = factory;
+	mCapture = capture;
+}
+
+SP_CaptureIOChannelFactory :: ~SP_CaptureIOChannelFactory()
+{
+	delete mFactory;
+	mFactory = NULL;
+}
+
+SP_IOChannel * SP_CaptureIOChannelFactory :: create() const
+{
+	return new SP_CaptureIOChannel( mFactory->create(), mCapture );
+}
+
+//---------------------------------------------------------
+
+SP_Replayer :: SP_Replayer( SP_HandlerFactory * handlerFactory )
+{
+	mHandlerFactory = handlerFactory;
+
+	mSessions = NULL;
+	mCapacity = 0;
+
+	mSessionCount = 0;
+	mGaps = mTruncated = 0;
+	mRecords = mBytes = mMsgs = mReplyBytes = 0;
+	mElapsed = 0;
+
+	mLatency = NULL;
+	mLatencyCount = mLatencyCapacity = 0;
+}
+
+SP_Replayer :: ~SP_Replayer()
+{
+	for( int i = 0; i < mCapacity; i++ ) {
+		if( NULL != mSessions[i] ) closeSession( mSessions[i]->getSid() );
+	}
+	free( mSessions );
+	mSessions = NULL;
+
+	free( mLatency );
+	mLatency = NULL;
+
+	delete mHandlerFactory;
+	mHandlerFactory = NULL;
+}
+
+static int compareLatency( const void * a, const void * b )
+{
+	long long x = *(long long*)a, y = *(long long*)b;
+	return x < y ? -1 : ( x > y ? 1 : 0 );
+}
+
+int SP_Replayer :: run( const char * path, double speed )
+{
+	FILE * fp = fopen( path, "rb" );
+	if( NULL == fp ) {
+		sp_syslog( LOG_WARNING, "replay: cannot open %s, errno %d, %s", path, errno, strerror( errno ) );
+		return -1;
+	}
+
+	char magic[ 8 ] = { 0 };
+	if( 1 != fread( magic, sizeof( magic ), 1, fp )
+			|| 0 != memcmp( magic, SP_CAPTURE_MAGIC, sizeof( magic ) ) ) {
+		sp_syslog( LOG_WARNING, "replay: %s is not a capture", path );
+		fclose( fp );
+		return -1;
+	}
+
+	int dataCapacity = 64 * 1024;
+	char * data = (char*)malloc( dataCapacity + 1 );
+
+	long long firstUsec = -1, start = captureUsec();
+
+	unsigned char head[ SP_CAPTURE_HEAD ];
+	for( ; 1 == fread( head, sizeof( head ), 1, fp ); ) {
+		int type = head[0];
+
+		SP_Sid_t sid;
+		sid.mKey = (uint32_t)getInt( head + 1, 4 );
+		sid.mSeq = (uint16_t)getInt( head + 5, 2 );
+		long long usec = (long long)getInt( head + 7, 8 );
+		int len = (int)getInt( head + 15, 4 );
+
+		if( len > dataCapacity ) {
+			dataCapacity = len;
+			data = (char*)realloc( data, dataCapacity + 1 );
+		}
+
+		if( len > 0 && 1 != fread( data, len, 1, fp ) ) {
+			sp_syslog( LOG_WARNING, "replay: %s is truncated", path );
+			break;
+		}
+		data[ len ] = '\0';
+
+		mRecords++;
+
+		// the reads are due at their original distance, divided by the speed
+		long long begin = captureUsec();
+		if( firstUsec < 0 ) firstUsec = usec;
+		if( speed > 0 ) {
+			long long due = start + (long long)( ( usec - firstUsec ) / speed );
+			if( due > begin ) usleep( due - begin );
+			begin = due;
+		}
+
+		if( SP_Capture::eOpen == type ) {
+			openSession( sid, data );
+		} else if( SP_Capture::eData == type ) {
+			SP_Session * session = NULL;
+			if( sid.mKey < (uint32_t)mCapacity ) session = mSessions[ sid.mKey ];
+			if( NULL == session || session->getSid().mSeq != sid.mSeq ) {
+				session = openSession( sid, "" );
+				if( mGaps > 0 ) truncate( session );
+			}
+
+			feed( session, data, len );
+			mBytes += len;
+
+			addLatency( captureUsec() - begin );
+		} else if( SP_Capture::eClose == type ) {
+			closeSession( sid );
+		} else if( SP_Capture::eGap == type ) {
+			mGaps++;
+			sp_syslog( LOG_WARNING, "replay: %d records dropped by the capture",
+					len >= 4 ? (int)getInt( (unsigned char*)data, 4 ) : 0 );
+
+			for( int i = 0; i < mCapacity; i++ ) {
+				if( NULL != mSessions[i] ) truncate( mSessions[i] );
+			}
+		}
+	}
+
+	free( data );
+	fclose( fp );
+
+	for( int i = 0; i < mCapacity; i++ ) {
+		if( NULL != mSessions[i] ) closeSession( mSessions[i]->getSid() );
+	}
+
+	mElapsed = ( captureUsec() - start ) / 1000000.0;
+
+	qsort( mLatency, mLatencyCount, sizeof( long long ), compareLatency );
+
+	return 0;
+}
+
+SP_Session * SP_Replayer :: openSession( SP_Sid_t sid, const char * clientIP )
+{
+	if( sid.mKey >= (uint32_t)mCapacity ) {
+		int capacity = mCapacity > 0 ? mCapacity : 1024;
+		for( ; (uint32_t)capacity <= sid.mKey; ) capacity *= 2;
+
+		mSessions = (SP_Session**)realloc( mSessions, sizeof( SP_Session * ) * capacity );
+		memset( mSessions + mCapacity, 0, sizeof( SP_Session * ) * ( capacity - mCapacity ) );
+		mCapacity = capacity;
+	}
+
+	// the key of a closed session is reused
+	if( NULL != mSessions[ sid.mKey ] ) closeSession( mSessions[ sid.mKey ]->getSid() );
+
+	SP_Session * session = new SP_Session( sid );
+	session->getRequest()->setClientIP( clientIP );
+	session->setHandler( mHandlerFactory->create() );
+
+	SP_Response * response = new SP_Response( sid );
+	if( 0 != session->getHandler()->start( session->getRequest(), response ) ) {
+		session->setStatus( SP_Session::eWouldExit );
+	}
+	drop( response );
+
+	mSessions[ sid.mKey ] = session;
+	mSessionCount++;
+
+	return session;
+}
+
+void SP_Replayer :: closeSession( SP_Sid_t sid )
+{
+	if( sid.mKey >= (uint32_t)mCapacity ) return;
+
+	SP_Session * session = mSessions[ sid.mKey ];
+	if( NULL == session || session->getSid().mSeq != sid.mSeq ) return;
+
+	session->getHandler()->close();
+
+	mSessions[ sid.mKey ] = NULL;
+	delete session;
+}
+
+void SP_Replayer :: truncate( SP_Session * session )
+{
+	// feed ignores it from now on, the eClose record still closes it
+	if( SP_Session::eNormal == session->getStatus() ) {
+		session->setStatus( SP_Session::eWouldExit );
+		mTruncated++;
+	}
+}
+
+void SP_Replayer :: feed( SP_Session * session, const char * data, int len )
+{
+	// the rest of a session is ignored after its handler asked to close
+	if( SP_Session::eNormal != session->getStatus() ) return;
+
+	session->getInBuffer()->append( data, len );
+
+	for( ; ; ) {
+		// the handler may change the decoder
+		SP_MsgDecoder * decoder = session->getRequest()->getMsgDecoder();
+		if( SP_MsgDecoder::eOK != decoder->decode( session->getInBuffer() ) ) break;
+
+		SP_Response * response = new SP_Response( session->getSid() );
+		int ret = session->getHandler()->handle( session->getRequest(), response );
+		drop( response );
+
+		mMsgs++;
+
+		if( 0 != ret ) {
+			session->setStatus( SP_Session::eWouldExit );
+			break;
+		}
+	}
+}
+
+void SP_Replayer :: drop( SP_Response * response )
+{
+	for( ; NULL != response->peekMessage(); ) {
+		SP_Message * msg = response->takeMessage();
+		mReplyBytes += msg->getTotalSize();
+		delete msg;
+	}
+
+	delete response;
+}
+
+void SP_Replayer :: addLatency( long long usec )
+{
+	if( mLatencyCount >= mLatencyCapacity ) {
+		mLatencyCapacity = mLatencyCapacity > 0 ? mLatencyCapacity * 2 : 4096;
+		mLatency = (long long*)realloc( mLatency, sizeof( long long ) * mLatencyCapacity );
+	}
+
+	mLatency[ mLatencyCount++ ] = usec;
+}
+
+int SP_Replayer :: getSessions()
+{
+	return mSessionCount;
+}
+
+long long SP_Replayer :: getRecords()
+{
+	return mRecords;
+}
+
+long long SP_Replayer :: getBytes()
+{
+	return mBytes;
+}
+
+long long SP_Replayer :: getMsgs()
+{
+	return mMsgs;
+}
+
+long long SP_Replayer :: getReplyBytes()
+{
+	return mReplyBytes;
+}
+
+int SP_Replayer :: getGaps()
+{
+	return mGaps;
+}
+
+int SP_Replayer :: getTruncated()
+{
+	return mTruncated;
+}
+
+double SP_Replayer :: getElapsed()
+{
+	return mElapsed;
+}
+
+long long SP_Replayer :: getLatency( double percent )
+{
+	if( mLatencyCount <= 0 ) return 0;
+
+	int index = (int)( mLatencyCount * percent / 100 );
+	if( index >= mLatencyCount ) index = mLatencyCount - 1;
+	if( index < 0 ) index = 0;
+
+	return mLatency[ index ];
+}
+
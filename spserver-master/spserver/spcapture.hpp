@@ -0,0 +1,155 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcapture_hpp__
+#define __spcapture_hpp__
+
+#include <stdio.h>
+
+#include "spthread.hpp"
+#include "spiochannel.hpp"
+#include "spresponse.hpp"
+
+class SP_Buffer;
+class SP_Session;
+class SP_HandlerFactory;
+
+/**
+ * @brief capture the inbound byte streams of the sessions to a file, with
+ *        the time and the session id of every read, to replay them against
+ *        a handler with SP_Replayer.
+ *
+ *        record() only appends to a memory buffer, a background thread
+ *        writes it to the file, so the event loop does not wait for the disk.
+ *
+ *        file : "SPCAP001", then records of
+ *          type(1) key(4) seq(2) usec(8) length(4) data(length), big-endian
+ *
+ *        When the writer falls behind, the records are dropped and the next
+ *        one kept is preceded by an eGap record, its data is the count(4)
+ *        of records dropped.
+ */
+class SP_Capture {
+public:
+	enum { eOpen = 'O', eData = 'D', eClose = 'C', eGap = 'G' };
+
+	SP_Capture();
+	~SP_Capture();
+
+	/// return 0 : ok, -1 : cannot create the file or the writer
+	int open( const char * path );
+
+	/// write the pending records and close the file
+	void close();
+
+	/// the data of eOpen is the client ip
+	void record( int type, SP_Sid_t sid, const void * data, int len );
+
+	/// records dropped because the writer fell behind
+	long long getDropped();
+
+private:
+	FILE * mFile;
+	SP_Buffer * mPending;
+	long long mDropped;
+
+	// dropped since the last eGap record
+	int mGapDropped;
+
+	int mIsShutdown;
+	int mIsRunning;
+	sp_thread_mutex_t mMutex;
+
+	static sp_thread_result_t SP_THREAD_CALL writer( void * arg );
+
+	// swap the pending records out and write them, return the bytes written
+	int flush( SP_Buffer * buffer );
+
+	// called with the mutex held
+	void appendGap();
+};
+
+/// capture what the channels of the wrapped factory receive
+class SP_CaptureIOChannelFactory : public SP_IOChannelFactory {
+public:
+	/// the factory is deleted by this one, the capture is not
+	SP_CaptureIOChannelFactory( SP_IOChannelFactory * factory, SP_Capture * capture );
+	virtual ~SP_CaptureIOChannelFactory();
+
+	virtual SP_IOChannel * create() const;
+
+private:
+	SP_IOChannelFactory * mFactory;
+	SP_Capture * mCapture;
+};
+
+/**
+ * @brief feed a capture through the decoders and handlers of a factory,
+ *        session by session and read by read as they were received.
+ *        The handlers run in the calling thread, the replies are counted
+ *        and dropped.
+ *
+ *        The reads of a session missing from the capture would feed the
+ *        decoder a broken stream, so at an eGap record the sessions open
+ *        at that point are truncated: the rest of their reads is skipped.
+ *        So is a session first seen after a gap, its eOpen was dropped.
+ */
+class SP_Replayer {
+public:
+	/// the factory is deleted by the replayer
+	SP_Replayer( SP_HandlerFactory * handlerFactory );
+	~SP_Replayer();
+
+	/**
+	 * @param speed : 1 at the original pace, 10 ten times faster,
+	 *                0 as fast as the handlers can go
+	 * @return 0 : ok, -1 : cannot read the file
+	 */
+	int run( const char * path, double speed = 0 );
+
+	int getSessions();
+	long long getRecords();
+	long long getBytes();
+	long long getMsgs();
+	long long getReplyBytes();
+
+	/// eGap records met, and the sessions truncated by them
+	int getGaps();
+	int getTruncated();
+
+	/// seconds
+	double getElapsed();
+
+	/**
+	 * @brief usec from the time a read was due, or started when not paced,
+	 *        until its messages were handled
+	 */
+	long long getLatency( double percent );
+
+private:
+	SP_HandlerFactory * mHandlerFactory;
+
+	// indexed by the session key
+	SP_Session ** mSessions;
+	int mCapacity;
+
+	int mSessionCount;
+	int mGaps, mTruncated;
+	long long mRecords, mBytes, mMsgs, mReplyBytes;
+	double mElapsed;
+
+	long long * mLatency;
+	int mLatencyCount, mLatencyCapacity;
+
+	SP_Session * openSession( SP_Sid_t sid, const char * clientIP );
+	void closeSession( SP_Sid_t sid );
+	void truncate( SP_Session * session );
+	void feed( SP_Session * session, const char * data, int len );
+	void drop( SP_Response * response );
+	void addLatency( long long usec );
+};
+
+#endif
+
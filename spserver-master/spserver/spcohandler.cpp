@@ -0,0 +1,741 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+// the ucontext routines are hidden on darwin without it
+#if defined( __APPLE__ ) && ! defined( _XOPEN_SOURCE )
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "spporting.hpp"
+
+#include "spcohandler.hpp"
+#include "spthread.hpp"
+#include "spmsgdecoder.hpp"
+#include "sprequest.hpp"
+#include "spresponse.hpp"
+#include "spdispatcher.hpp"
+#include "spasyncclient.hpp"
+#include "sputils.hpp"
+
+static const int SP_CO_STACK_SIZE = 64 * 1024;
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__ELF__)
+
+#define SP_CO_FAST_SWITCH
+
+// swapcontext saves and restores the signal mask, a rt_sigprocmask
+// syscall on every switch. Only the callee-saved registers and the fp
+// control words need to survive a call, they are kept on the old stack.
+extern "C" void sp_co_switch( void ** from, void * to );
+
+// first frame of a coroutine, calls r13 with r12
+extern "C" void sp_co_start();
+
+asm(
+	".pushsection .text\n"
+	".globl sp_co_switch\n"
+	".hidden sp_co_switch\n"
+	".type sp_co_switch, @function\n"
+	"sp_co_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size sp_co_switch, .-sp_co_switch\n"
+	".globl sp_co_start\n"
+	".hidden sp_co_start\n"
+	".type sp_co_start, @function\n"
+	"sp_co_start:\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+	".size sp_co_start, .-sp_co_start\n"
+	".popsection\n"
+);
+
+#endif
+
+// stacks are carved from slabs, a mapping per session would run into
+// vm.max_map_count (65530 by default) long before 100k sessions
+static const int SP_CO_SLAB_STACKS = 64;
+
+// free stacks above this are given back with MADV_DONTNEED
+static const int SP_CO_MAX_WARM_STACKS = 256;
+
+typedef struct tagSP_CoStackClass {
+	size_t mSize;
+	SP_ArrayList * mFreeList;
+	struct tagSP_CoStackClass * mNext;
+} SP_CoStackClass_t;
+
+class SP_CoStackPool {
+public:
+	// @return NULL : cannot map a slab
+	static char * take( size_t size );
+
+	static void put( char * stack, size_t size );
+
+	static void setGuard( int guard );
+
+private:
+	static SP_CoStackClass_t * getClass( size_t size );
+	static int addSlab( SP_CoStackClass_t * stackClass );
+
+	static sp_thread_mutex_t mMutex;
+	static SP_CoStackClass_t * mClassList;
+	static int mGuard;
+};
+
+sp_thread_mutex_t SP_CoStackPool :: mMutex = PTHREAD_MUTEX_INITIALIZER;
+SP_CoStackClass_t * SP_CoStackPool :: mClassList = NULL;
+int SP_CoStackPool :: mGuard = 1;
+
+void SP_CoStackPool :: setGuard( int guard )
+{
+	sp_thread_mutex_lock( &mMutex );
+	mGuard = guard;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+SP_CoStackClass_t * SP_CoStackPool :: getClass( size_t size )
+{
+	SP_CoStackClass_t * iter = mClassList;
+	for( ; NULL != iter && size != iter->mSize; ) iter = iter->mNext;
+
+	if( NULL == iter ) {
+		iter = (SP_CoStackClass_t*)malloc( sizeof( SP_CoStackClass_t ) );
+		iter->mSize = size;
+		iter->mFreeList = new SP_ArrayList( SP_CO_SLAB_STACKS );
+		iter->mNext = mClassList;
+		mClassList = iter;
+	}
+
+	return iter;
+}
+
+int SP_CoStackPool :: addSlab( SP_CoStackClass_t * stackClass )
+{
+	long pageSize = sysconf( _SC_PAGESIZE );
+	size_t guardSize = mGuard ? pageSize : 0;
+	size_t slotSize = stackClass->mSize + guardSize;
+
+	// only the touched pages are committed
+	char * slab = (char*)mmap( NULL, slotSize * SP_CO_SLAB_STACKS, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( MAP_FAILED == (void*)slab ) {
+		sp_syslog( LOG_ERR, "cannot map %d coroutine stacks of %d bytes, errno %d, %s",
+				SP_CO_SLAB_STACKS, (int)stackClass->mSize, errno, strerror( errno ) );
+		return -1;
+	}
+
+	for( int i = SP_CO_SLAB_STACKS - 1; i >= 0; i-- ) {
+		char * slot = slab + slotSize * i;
+
+		// the guard below a stack, an overflow faults instead of running
+		// into the stack under it; every guard splits the mapping
+		if( guardSize > 0 && 0 != mprotect( slot, guardSize, PROT_NONE ) ) {
+			sp_syslog( LOG_ERR, "cannot protect a coroutine stack guard, errno %d, %s, "
+					"raise vm.max_map_count or turn the guards off by "
+					"SP_CoHandlerAdapter::setStackGuard( 0 )", errno, strerror( errno ) );
+
+			// the stacks of the slab which are not appended stay reserved
+			return stackClass->mFreeList->getCount() > 0 ? 0 : -1;
+		}
+
+		stackClass->mFreeList->append( slot + guardSize );
+	}
+
+	return 0;
+}
+
+char * SP_CoStackPool :: take( size_t size )
+{
+	char * stack = NULL;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	SP_CoStackClass_t * stackClass = getClass( size );
+
+	if( stackClass->mFreeList->getCount() > 0 || 0 == addSlab( stackClass ) ) {
+		stack = (char*)stackClass->mFreeList->takeItem( SP_ArrayList::LAST_INDEX );
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	return stack;
+}
+
+void SP_CoStackPool :: put( char * stack, size_t size )
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	SP_CoStackClass_t * stackClass = getClass( size );
+
+	// give the pages of a stack not needed soon back to the system
+	if( stackClass->mFreeList->getCount() >= SP_CO_MAX_WARM_STACKS ) {
+		madvise( stack, size, MADV_DONTNEED );
+	}
+
+	stackClass->mFreeList->append( stack );
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+//---------------------------------------------------------
+
+class SP_CoContext {
+public:
+	enum { eNew, eRunning, eWaitMsg, eWaitCall, eWaitSleep, eFinished };
+
+	SP_CoContext( SP_CoHandler * handler, SP_Dispatcher * dispatcher,
+			SP_AsyncClient * client, int stackSize );
+
+	void addRef();
+	void release();
+
+	// reserve the stack, return -1 if mmap failed
+	int init();
+
+	/**
+	 * @brief switch to the coroutine if it is waiting in state,
+	 *        wait for it if it is running on another thread
+	 * @return 0 : suspended again, 1 : finished, -1 : not waiting in state
+	 */
+	int resume( int state, int result, SP_Response * response );
+
+	// called by the coroutine, return the result of the resume
+	int suspend( int state );
+
+	void setClosed();
+	int isClosed();
+
+	// 1 : readMsg is waiting, the session decoder may hand over a message
+	int isWaitMsg();
+
+	SP_Message * getReply();
+
+	SP_CoHandler * mHandler;
+	SP_Dispatcher * mDispatcher;
+	SP_AsyncClient * mClient;
+
+	SP_MsgDecoder * mDecoder;
+	SP_Sid_t mSid;
+
+private:
+	~SP_CoContext();
+
+	static void entry( unsigned int hi, unsigned int lo );
+	static void run( SP_CoContext * context );
+
+	sp_thread_mutex_t mMutex;
+	sp_thread_cond_t mCond;
+	int mRefCount;
+	int mState, mNextState;
+	int mIsRunning, mIsClosed;
+	int mResult;
+
+	SP_Response * mResponse;
+
+#ifdef SP_CO_FAST_SWITCH
+	void * mContext;
+	void * mCaller;
+#else
+	ucontext_t mContext;
+	ucontext_t * mCaller;
+#endif
+	char * mStack;
+	size_t mStackSize;
+};
+
+SP_CoContext :: SP_CoContext( SP_CoHandler * handler, SP_Dispatcher * dispatcher,
+		SP_AsyncClient * client, int stackSize )
+{
+	mHandler = handler;
+	mHandler->mContext = this;
+	mDispatcher = dispatcher;
+	mClient = client;
+
+	mDecoder = new SP_DefaultMsgDecoder();
+	memset( &mSid, 0, sizeof( mSid ) );
+
+	sp_thread_mutex_init( &mMutex, NULL );
+	sp_thread_cond_init( &mCond, NULL );
+	mRefCount = 1;
+	mState = mNextState = eNew;
+	mIsRunning = mIsClosed = 0;
+	mResult = 0;
+
+	mResponse = NULL;
+
+#ifdef SP_CO_FAST_SWITCH
+	mContext = NULL;
+#else
+	memset( &mContext, 0, sizeof( mContext ) );
+#endif
+	mCaller = NULL;
+	mStack = NULL;
+	mStackSize = stackSize > 0 ? stackSize : SP_CO_STACK_SIZE;
+}
+
+SP_CoContext :: ~SP_CoContext()
+{
+	delete mHandler;
+	delete mDecoder;
+
+	// a coroutine still suspended here only holds its own stack
+	if( NULL != mStack ) SP_CoStackPool::put( mStack, mStackSize );
+
+	sp_thread_mutex_destroy( &mMutex );
+	sp_thread_cond_destroy( &mCond );
+}
+
+void SP_CoContext :: addRef()
+{
+	sp_thread_mutex_lock( &mMutex );
+	mRefCount++;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_CoContext :: release()
+{
+	sp_thread_mutex_lock( &mMutex );
+	int refCount = --mRefCount;
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( refCount <= 0 ) delete this;
+}
+
+int SP_CoContext :: init()
+{
+	long pageSize = sysconf( _SC_PAGESIZE );
+	mStackSize = ( mStackSize + pageSize - 1 ) / pageSize * pageSize;
+
+	mStack = SP_CoStackPool::take( mStackSize );
+
+	if( NULL == mStack ) {
+		sp_syslog( LOG_WARNING, "session(%d.%d) has no coroutine stack, closed",
+				mSid.mKey, mSid.mSeq );
+		return -1;
+	}
+
+#ifdef SP_CO_FAST_SWITCH
+	// the frame sp_co_switch pops: fp control words, r15, r14, r13, r12,
+	// rbx, rbp and the return address, rsp is 16-aligned after the return
+	uintptr_t * top = (uintptr_t*)( ( (uintptr_t)( mStack + mStackSize ) ) & ~(uintptr_t)15 );
+	uintptr_t * frame = top - 8;
+
+	memset( frame, 0, 8 * sizeof( uintptr_t ) );
+	asm volatile( "stmxcsr (%0)\n\tfnstcw 4(%0)" : : "r" ( frame ) : "memory" );
+	frame[3] = (uintptr_t)run;
+	frame[4] = (uintptr_t)this;
+	frame[7] = (uintptr_t)sp_co_start;
+
+	mContext = frame;
+#else
+	getcontext( &mContext );
+	mContext.uc_stack.ss_sp = mStack;
+	mContext.uc_stack.ss_size = mStackSize;
+	mContext.uc_link = NULL;
+
+	uintptr_t ptr = (uintptr_t)this;
+	makecontext( &mContext, (void (*)())entry, 2,
+			(unsigned int)( ( (uint64_t)ptr ) >> 32 ), (unsigned int)( ptr & 0xffffffff ) );
+#endif
+
+	return 0;
+}
+
+void SP_CoContext :: entry( unsigned int hi, unsigned int lo )
+{
+	run( (SP_CoContext*)(uintptr_t)( ( ( (uint64_t)hi ) << 32 ) | lo ) );
+}
+
+void SP_CoContext :: run( SP_CoContext * context )
+{
+	context->mHandler->run();
+
+	// never resumed again
+	context->suspend( eFinished );
+}
+
+int SP_CoContext :: resume( int state, int result, SP_Response * response )
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	for( ; mIsRunning; ) sp_thread_cond_wait( &mCond, &mMutex );
+
+	if( state != mState ) {
+		// pass the wakeup on to another waiter
+		sp_thread_cond_signal( &mCond );
+		sp_thread_mutex_unlock( &mMutex );
+		return -1;
+	}
+
+	mIsRunning = 1;
+	mState = eRunning;
+	mResult = result;
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	SP_Response * scratch = NULL;
+	if( NULL == response ) response = scratch = new SP_Response( mSid );
+	mResponse = response;
+
+#ifdef SP_CO_FAST_SWITCH
+	sp_co_switch( &mCaller, mContext );
+#else
+	ucontext_t caller;
+	mCaller = &caller;
+	swapcontext( &caller, &mContext );
+#endif
+
+	mResponse = NULL;
+	if( NULL != scratch ) delete scratch;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	mState = mNextState;
+	mIsRunning = 0;
+	int isFinished = ( eFinished == mState );
+
+	sp_thread_cond_signal( &mCond );
+	sp_thread_mutex_unlock( &mMutex );
+
+	return isFinished ? 1 : 0;
+}
+
+int SP_CoContext :: suspend( int state )
+{
+	mNextState = state;
+
+#ifdef SP_CO_FAST_SWITCH
+	sp_co_switch( &mContext, mCaller );
+#else
+	swapcontext( &mContext, mCaller );
+#endif
+
+	return mResult;
+}
+
+void SP_CoContext :: setClosed()
+{
+	sp_thread_mutex_lock( &mMutex );
+	mIsClosed = 1;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+int SP_CoContext :: isClosed()
+{
+	sp_thread_mutex_lock( &mMutex );
+	int isClosed = mIsClosed;
+	sp_thread_mutex_unlock( &mMutex );
+
+	return isClosed;
+}
+
+int SP_CoContext :: isWaitMsg()
+{
+	sp_thread_mutex_lock( &mMutex );
+	int isWaitMsg = ( 0 == mIsRunning && eWaitMsg == mState && 0 == mIsClosed );
+	sp_thread_mutex_unlock( &mMutex );
+
+	return isWaitMsg;
+}
+
+SP_Message * SP_CoContext :: getReply()
+{
+	return mResponse->getReply();
+}
+
+//---------------------------------------------------------
+
+// hands the input to the decoder of the coroutine while readMsg waits,
+// other input stays in the session buffer until then
+class SP_CoMsgDecoder : public SP_MsgDecoder {
+public:
+	SP_CoMsgDecoder( SP_CoContext * context ) {
+		mContext = context;
+		mContext->addRef();
+	}
+
+	virtual ~SP_CoMsgDecoder() {
+		mContext->release();
+	}
+
+	virtual int decode( SP_Buffer * inBuffer ) {
+		if( ! mContext->isWaitMsg() ) return eMoreData;
+
+		return mContext->mDecoder->decode( inBuffer );
+	}
+
+private:
+	SP_CoContext * mContext;
+};
+
+// decodes the upstream reply with the decoder owned by the coroutine,
+// a late reply after a timeout must not reach it
+class SP_CoProxyDecoder : public SP_MsgDecoder {
+public:
+	SP_CoProxyDecoder( SP_MsgDecoder * decoder ) {
+		mDecoder = decoder;
+		sp_thread_mutex_init( &mMutex, NULL );
+	}
+
+	virtual ~SP_CoProxyDecoder() {
+		sp_thread_mutex_destroy( &mMutex );
+	}
+
+	virtual int decode( SP_Buffer * inBuffer ) {
+		int ret = eMoreData;
+
+		sp_thread_mutex_lock( &mMutex );
+		if( NULL != mDecoder ) ret = mDecoder->decode( inBuffer );
+		sp_thread_mutex_unlock( &mMutex );
+
+		return ret;
+	}
+
+	void detach() {
+		sp_thread_mutex_lock( &mMutex );
+		mDecoder = NULL;
+		sp_thread_mutex_unlock( &mMutex );
+	}
+
+private:
+	sp_thread_mutex_t mMutex;
+	SP_MsgDecoder * mDecoder;
+};
+
+class SP_CoCallback : public SP_AsyncCallback {
+public:
+	SP_CoCallback( SP_CoContext * context, SP_CoProxyDecoder * proxy ) {
+		mContext = context;
+		mContext->addRef();
+		mProxy = proxy;
+	}
+
+	virtual ~SP_CoCallback() {
+		mContext->release();
+	}
+
+	virtual void completed( SP_MsgDecoder * decoder, int error, SP_Response * response ) {
+		// the decoder is on the stack of the coroutine, gone after the resume
+		mProxy->detach();
+
+		if( 1 == mContext->resume( SP_CoContext::eWaitCall, error, response ) ) {
+			if( ! mContext->isClosed() ) response->getToCloseList()->add( mContext->mSid );
+		}
+	}
+
+private:
+	SP_CoContext * mContext;
+	SP_CoProxyDecoder * mProxy;
+};
+
+class SP_CoTimer : public SP_TimerHandler {
+public:
+	SP_CoTimer( SP_CoContext * context ) {
+		mContext = context;
+		mContext->addRef();
+	}
+
+	virtual ~SP_CoTimer() {
+		mContext->release();
+	}
+
+	virtual int handle( SP_Response * response, struct timeval * timeout ) {
+		SP_Response * reply = new SP_Response( mContext->mSid );
+
+		int ret = mContext->resume( SP_CoContext::eWaitSleep, 0, reply );
+
+		if( mContext->isClosed() ) {
+			delete reply;
+		} else {
+			if( 1 == ret ) reply->getToCloseList()->add( mContext->mSid );
+			mContext->mDispatcher->push( reply );
+		}
+
+		return -1;
+	}
+
+private:
+	SP_CoContext * mContext;
+};
+
+//---------------------------------------------------------
+
+SP_CoHandler :: SP_CoHandler()
+{
+	mContext = NULL;
+}
+
+SP_CoHandler :: ~SP_CoHandler()
+{
+}
+
+void SP_CoHandler :: setMsgDecoder( SP_MsgDecoder * decoder )
+{
+	if( NULL != mContext->mDecoder ) delete mContext->mDecoder;
+	mContext->mDecoder = decoder;
+}
+
+SP_MsgDecoder * SP_CoHandler :: getMsgDecoder()
+{
+	return mContext->mDecoder;
+}
+
+int SP_CoHandler :: readMsg()
+{
+	if( mContext->isClosed() ) return -1;
+
+	return mContext->suspend( SP_CoContext::eWaitMsg );
+}
+
+int SP_CoHandler :: call( const char * host, int port, const char * request, int len,
+		SP_MsgDecoder * decoder, int timeout )
+{
+	if( NULL == mContext->mClient || mContext->isClosed() ) return -1;
+
+	SP_CoProxyDecoder * proxy = new SP_CoProxyDecoder( decoder );
+	SP_CoCallback * callback = new SP_CoCallback( mContext, proxy );
+
+	if( 0 != mContext->mClient->call( mContext->mSid, host, port, request, len,
+			proxy, callback, timeout ) ) {
+		delete proxy;
+		delete callback;
+		return EINVAL;
+	}
+
+	return mContext->suspend( SP_CoContext::eWaitCall );
+}
+
+int SP_CoHandler :: sleep( int msec )
+{
+	if( NULL == mContext->mDispatcher || mContext->isClosed() ) return -1;
+
+	struct timeval timeout;
+	timeout.tv_sec = msec / 1000;
+	timeout.tv_usec = ( msec % 1000 ) * 1000;
+
+	mContext->mDispatcher->push( &timeout, new SP_CoTimer( mContext ) );
+
+	return mContext->suspend( SP_CoContext::eWaitSleep );
+}
+
+SP_Message * SP_CoHandler :: getReply()
+{
+	return mContext->getReply();
+}
+
+SP_Sid_t SP_CoHandler :: getSid()
+{
+	return mContext->mSid;
+}
+
+//---------------------------------------------------------
+
+SP_CoHandlerFactory :: ~SP_CoHandlerFactory()
+{
+}
+
+//---------------------------------------------------------
+
+SP_CoHandlerAdapter :: SP_CoHandlerAdapter( SP_CoHandler * handler,
+		SP_Dispatcher * dispatcher, SP_AsyncClient * client, int stackSize )
+{
+	mContext = new SP_CoContext( handler, dispatcher, client, stackSize );
+}
+
+SP_CoHandlerAdapter :: ~SP_CoHandlerAdapter()
+{
+	mContext->release();
+}
+
+void SP_CoHandlerAdapter :: setStackGuard( int guard )
+{
+	SP_CoStackPool::setGuard( guard );
+}
+
+int SP_CoHandlerAdapter :: start( SP_Request * request, SP_Response * response )
+{
+	mContext->mSid = response->getFromSid();
+
+	request->setMsgDecoder( new SP_CoMsgDecoder( mContext ) );
+
+	if( 0 != mContext->init() ) return -1;
+
+	return 1 == mContext->resume( SP_CoContext::eNew, 0, response ) ? -1 : 0;
+}
+
+int SP_CoHandlerAdapter :: handle( SP_Request * request, SP_Response * response )
+{
+	return 1 == mContext->resume( SP_CoContext::eWaitMsg, 0, response ) ? -1 : 0;
+}
+
+void SP_CoHandlerAdapter :: error( SP_Response * response )
+{
+	mContext->setClosed();
+	mContext->resume( SP_CoContext::eWaitMsg, -1, response );
+}
+
+void SP_CoHandlerAdapter :: timeout( SP_Response * response )
+{
+	mContext->setClosed();
+	mContext->resume( SP_CoContext::eWaitMsg, -1, response );
+}
+
+void SP_CoHandlerAdapter :: close()
+{
+	mContext->setClosed();
+	mContext->resume( SP_CoContext::eWaitMsg, -1, NULL );
+}
+
+//---------------------------------------------------------
+
+SP_CoHandlerAdapterFactory :: SP_CoHandlerAdapterFactory( SP_CoHandlerFactory * factory,
+		SP_Dispatcher * dispatcher, SP_AsyncClient * client, int stackSize )
+{
+	mFactory = factory;
+	mDispatcher = dispatcher;
+	mClient = client;
+	mStackSize = stackSize;
+}
+
+SP_CoHandlerAdapterFactory :: ~SP_CoHandlerAdapterFactory()
+{
+	delete mFactory;
+}
+
+SP_Handler * SP_CoHandlerAdapterFactory :: create() const
+{
+	return new SP_CoHandlerAdapter( mFactory->create(), mDispatcher, mClient, mStackSize );
+}
+
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spcohandler_hpp__
+#define __spcohandler_hpp__
+
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+
+class SP_MsgDecoder;
+class SP_Dispatcher;
+class SP_AsyncClient;
+class SP_CoContext;
+
+/**
+ * @brief a session written as linear code, run as a coroutine on the
+ *        worker threads. readMsg, call and sleep suspend the coroutine
+ *        and return the worker to the pool, it is resumed on any worker
+ *        when the message, the reply or the timer arrives.
+ *
+ * @note  the coroutine may move between threads at every readMsg, call
+ *        and sleep. Do not keep errno, __thread variables or any other
+ *        thread-local address across them, the compiler may have cached
+ *        the address of the previous thread. Lane mode keeps the readMsg
+ *        resumes on one lane, the reply of call and the timer of sleep
+ *        still resume on the client and dispatcher threads.
+ */
+class SP_CoHandler {
+public:
+	SP_CoHandler();
+	virtual ~SP_CoHandler();
+
+	/// the whole session, the session is closed when it returns
+	virtual void run() = 0;
+
+protected:
+
+	/// decoder for the next readMsg, owned by the session
+	void setMsgDecoder( SP_MsgDecoder * decoder );
+	SP_MsgDecoder * getMsgDecoder();
+
+	/// return 0 : the decoder holds the message, -1 : session is closed
+	int readMsg();
+
+	/**
+	 * @brief request/reply with host:port by SP_AsyncClient
+	 * @param decoder : holds the reply, still owned by the caller
+	 * @return 0 : OK, errno of the call, -1 : no client or session is closed
+	 */
+	int call( const char * host, int port, const char * request, int len,
+			SP_MsgDecoder * decoder, int timeout );
+
+	/// return 0 : OK, -1 : no dispatcher or session is closed
+	int sleep( int msec );
+
+	/// sent when the coroutine suspends or returns
+	SP_Message * getReply();
+
+	SP_Sid_t getSid();
+
+private:
+	SP_CoContext * mContext;
+
+	friend class SP_CoContext;
+};
+
+class SP_CoHandlerFactory {
+public:
+	virtual ~SP_CoHandlerFactory();
+
+	virtual SP_CoHandler * create() const = 0;
+};
+
+/**
+ * @brief runs a SP_CoHandler as a SP_Handler, the coroutine stacks are
+ *        carved from large mmap slabs and only the touched pages are
+ *        committed, so 100k sessions with the default 64K stack need a
+ *        few KB each.
+ *
+ * @note  the guard page below each stack splits the slab mapping, that is
+ *        2 mappings per session, and vm.max_map_count is 65530 by default;
+ *        above 30k sessions raise it or call setStackGuard( 0 )
+ */
+class SP_CoHandlerAdapter : public SP_Handler {
+public:
+	/**
+	 * @param dispatcher : for sleep, may be NULL
+	 * @param client : for call, may be NULL
+	 */
+	SP_CoHandlerAdapter( SP_CoHandler * handler, SP_Dispatcher * dispatcher = 0,
+			SP_AsyncClient * client = 0, int stackSize = 0 );
+	virtual ~SP_CoHandlerAdapter();
+
+	/// 1 : a PROT_NONE page below every stack, the default, 0 : none,
+	/// for the slabs mapped after the call
+	static void setStackGuard( int guard );
+
+	virtual int start( SP_Request * request, SP_Response * response );
+
+	virtual int handle( SP_Request * request, SP_Response * response );
+
+	virtual void error( SP_Response * response );
+
+	virtual void timeout( SP_Response * response );
+
+	virtual void close();
+
+private:
+	SP_CoContext * mContext;
+};
+
+class SP_CoHandlerAdapterFactory : public SP_HandlerFactory {
+public:
+	SP_CoHandlerAdapterFactory( SP_CoHandlerFactory * factory,
+			SP_Dispatcher * dispatcher = 0, SP_AsyncClient * client = 0, int stackSize = 0 );
+	virtual ~SP_CoHandlerAdapterFactory();
+
+	virtual SP_Handler * create() const;
+
+private:
+	SP_CoHandlerFactory * mFactory;
+	SP_Dispatcher * mDispatcher;
+	SP_AsyncClient * mClient;
+	int mStackSize;
+};
+
+#endif
+
@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include "spporting.hpp"
 #include "spthread.hpp"
@@ -21,8 +22,10 @@
 #include "spexecutor.hpp"
 #include "sputils.hpp"
 #include "spiochannel.hpp"
+#include "spiouring.hpp"
 #include "spioutils.hpp"
 #include "sprequest.hpp"
+#include "spsplice.hpp"
 
 #include "event_msgqueue.h"
 
@@ -35,6 +38,7 @@ SP_Dispatcher :: SP_Dispatcher( SP_CompletionHandler * completionHandler, int ma
 
 	mIsShutdown = 0;
 	mIsRunning = 0;
+	mSpliceCount = 0;
 
 	mEventArg = new SP_EventArg( 600 );
 
@@ -64,6 +68,31 @@ void SP_Dispatcher :: setTimeout( int timeout )
 	mEventArg->setTimeout( timeout );
 }
 
+void SP_Dispatcher :: setLaneMode( int laneMode )
+{
+	mEventArg->setLaneMode( laneMode );
+}
+
+void SP_Dispatcher :: setBatchSize( int batchSize )
+{
+	mEventArg->setBatchSize( batchSize );
+}
+
+void SP_Dispatcher :: setOutputWatermarks( int highWatermark, int lowWatermark, int policy )
+{
+	mEventArg->setOutputWatermarks( highWatermark, lowWatermark, policy );
+}
+
+void SP_Dispatcher :: setOutputBudget( int budget )
+{
+	mEventArg->setOutputBudget( budget );
+}
+
+void SP_Dispatcher :: setTopicRegistry( SP_TopicRegistry * topicRegistry )
+{
+	mEventArg->setTopicRegistry( topicRegistry );
+}
+
 void SP_Dispatcher :: shutdown()
 {
 	mIsShutdown = 1;
@@ -79,6 +108,12 @@ int SP_Dispatcher :: getSessionCount()
 	return mEventArg->getSessionManager()->getCount();
 }
 
+int SP_Dispatcher :: getSpliceCount()
+{
+	// updated by the event loop, read from any thread
+	return sp_atomic_add( &mSpliceCount, 0 );
+}
+
 int SP_Dispatcher :: getReqQueueLength()
 {
 	return mEventArg->getInputResultQueue()->getLength();
@@ -120,51 +155,49 @@ sp_thread_result_t SP_THREAD_CALL SP_Dispatcher :: eventLoop( void * arg )
 	return 0;
 }
 
-void SP_Dispatcher :: outputCompleted( void * arg )
-{
-	SP_CompletionHandler * handler = ( SP_CompletionHandler * ) ((void**)arg)[0];
-	SP_Message * msg = ( SP_Message * ) ((void**)arg)[ 1 ];
-
-	handler->completionMessage( msg );
-
-	free( arg );
-}
-
 int SP_Dispatcher :: start()
 {
-	SP_Executor workerExecutor( mMaxThreads, "work" );
+	SP_Executor workerExecutor( mEventArg->getLaneMode() ? 1 : mMaxThreads, "work" );
 	SP_Executor actExecutor( 1, "act" );
+	SP_LaneExecutor * laneExecutor = NULL;
+	if( mEventArg->getLaneMode() ) laneExecutor = new SP_LaneExecutor( mMaxThreads, "lane" );
+
+	SP_Executor * completionExecutor = mCompletionHandler->isThreadSafe()
+			? &workerExecutor : &actExecutor;
 
 	/* Start the event loop. */
 	while( 0 == mIsShutdown ) {
 		event_base_loop( mEventArg->getEventBase(), EVLOOP_ONCE );
+		SP_UringIOChannel::flush();
 
 		for( ; NULL != mEventArg->getInputResultQueue()->top(); ) {
 			SP_Task * task = (SP_Task*)mEventArg->getInputResultQueue()->pop();
-			workerExecutor.execute( task );
+			if( NULL != laneExecutor ) {
+				laneExecutor->execute( task );
+			} else {
+				workerExecutor.execute( task );
+			}
 		}
 
-		for( ; NULL != mEventArg->getOutputResultQueue()->top(); ) {
-			SP_Message * msg = (SP_Message*)mEventArg->getOutputResultQueue()->pop();
-
-			void ** arg = ( void** )malloc( sizeof( void * ) * 2 );
-			arg[ 0 ] = (void*)mCompletionHandler;
-			arg[ 1 ] = (void*)msg;
-
-			actExecutor.execute( outputCompleted, arg );
-		}
+		SP_EventHelper::doCompletions( mEventArg->getOutputResultQueue(),
+				mCompletionHandler, completionExecutor );
 	}
 
+	if( NULL != laneExecutor ) delete laneExecutor;
+
 	sp_syslog( LOG_NOTICE, "Dispatcher is shutdown." );
 
 	return 0;
 }
 
 typedef struct tagSP_PushArg {
-	int mType;      // 0 : fd, 1 : timer
+	int mType;      // 0 : fd, 1 : timer, 2 : splice, 3 : connect
 
 	// for push fd
 	int mFd;
+	int mPeerFd;    // for push splice
+	int * mSpliceCount;
+	uint64_t * mSpliceBytes;
 	SP_Handler * mHandler;
 	SP_IOChannel * mIOChannel;
 	int mNeedStart;
@@ -175,6 +208,12 @@ typedef struct tagSP_PushArg {
 	SP_TimerHandler * mTimerHandler;
 	SP_EventArg * mEventArg;
 	void * mPushQueue;
+
+	// for push connect, mFd/mTimeout/mTimerEvent are shared with the above
+	struct sockaddr_in mAddr;
+	int mHasTimeout;
+	int mError;
+	SP_ConnectHandler * mConnectHandler;
 } SP_PushArg_t;
 
 void SP_Dispatcher :: onPush( void * queueData, void * arg )
@@ -219,6 +258,41 @@ void SP_Dispatcher :: onPush( void * queueData, void * arg )
 		}
 
 		free( pushArg );
+	} else if( 2 == pushArg->mType ) {
+		SP_SplicePump * pump = new SP_SplicePump( eventArg, pushArg->mFd,
+				pushArg->mPeerFd, pushArg->mHandler, pushArg->mSpliceCount,
+				pushArg->mSpliceBytes );
+		pump->start();
+
+		free( pushArg );
+	} else if( 3 == pushArg->mType ) {
+		pushArg->mError = 0;
+		// not inherited by a restarted or forked child
+#if defined( SOCK_NONBLOCK ) && defined( SOCK_CLOEXEC )
+		pushArg->mFd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_IP );
+#else
+		pushArg->mFd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+		if( pushArg->mFd >= 0 ) {
+			SP_IOUtils::setNonblock( pushArg->mFd );
+			fcntl( pushArg->mFd, F_SETFD, FD_CLOEXEC );
+		}
+#endif
+
+		int ret = -1;
+		if( pushArg->mFd >= 0 ) {
+			ret = connect( pushArg->mFd, (struct sockaddr*)&( pushArg->mAddr ),
+					sizeof( pushArg->mAddr ) );
+		}
+
+		if( ret < 0 && EINPROGRESS == errno ) {
+			event_set( &( pushArg->mTimerEvent ), pushArg->mFd, EV_WRITE, onConnect, pushArg );
+			event_base_set( eventArg->getEventBase(), &( pushArg->mTimerEvent ) );
+			event_add( &( pushArg->mTimerEvent ),
+					pushArg->mHasTimeout ? &( pushArg->mTimeout ) : NULL );
+		} else {
+			if( ret < 0 ) pushArg->mError = errno;
+			eventArg->getInputResultQueue()->push( new SP_SimpleTask( connected, pushArg, 1 ) );
+		}
 	} else {
 		event_set( &( pushArg->mTimerEvent ), -1, 0, onTimer, pushArg );
 		event_base_set( eventArg->getEventBase(), &( pushArg->mTimerEvent ) );
@@ -247,6 +321,85 @@ int SP_Dispatcher :: push( int fd, SP_Handler * handler,
 	return msgqueue_push( (struct event_msgqueue*)mPushQueue, arg );
 }
 
+int SP_Dispatcher :: push( const struct sockaddr_in * addr,
+		const struct timeval * timeout, SP_ConnectHandler * handler )
+{
+	SP_PushArg_t * arg = (SP_PushArg_t*)malloc( sizeof( SP_PushArg_t ) );
+	arg->mType = 3;
+	arg->mFd = -1;
+	arg->mAddr = *addr;
+	arg->mHasTimeout = NULL != timeout ? 1 : 0;
+	if( NULL != timeout ) arg->mTimeout = *timeout;
+	arg->mConnectHandler = handler;
+	arg->mEventArg = mEventArg;
+
+	return msgqueue_push( (struct event_msgqueue*)mPushQueue, arg );
+}
+
+void SP_Dispatcher :: onConnect( int fd, short events, void * arg )
+{
+	SP_PushArg_t * pushArg = (SP_PushArg_t*)arg;
+
+	if( EV_TIMEOUT & events ) {
+		pushArg->mError = ETIMEDOUT;
+	} else {
+		int error = 0;
+		socklen_t len = sizeof( error );
+		if( getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &len ) < 0 ) error = errno;
+		pushArg->mError = error;
+	}
+
+	pushArg->mEventArg->getInputResultQueue()->push(
+		new SP_SimpleTask( connected, pushArg, 1 ) );
+}
+
+void SP_Dispatcher :: connected( void * arg )
+{
+	SP_PushArg_t * pushArg = (SP_PushArg_t*)arg;
+	SP_ConnectHandler * handler = pushArg->mConnectHandler;
+	SP_EventArg * eventArg = pushArg->mEventArg;
+
+	if( 0 != pushArg->mError && pushArg->mFd >= 0 ) {
+		sp_close( pushArg->mFd );
+		pushArg->mFd = -1;
+	}
+
+	SP_Sid_t sid;
+	sid.mKey = SP_Sid_t::ePushKey;
+	sid.mSeq = SP_Sid_t::ePushSeq;
+	SP_Response * response = new SP_Response( sid );
+
+	handler->completed( pushArg->mFd, pushArg->mError, response );
+
+	delete handler;
+	free( pushArg );
+
+	msgqueue_push( (struct event_msgqueue*)eventArg->getResponseQueue(), response );
+}
+
+int SP_Dispatcher :: pushSplice( int fd1, int fd2, SP_Handler * handler, uint64_t * bytes )
+{
+	if( ! SP_SplicePump::isSupported() ) {
+		sp_close( fd1 );
+		sp_close( fd2 );
+		if( NULL != handler ) delete handler;
+		return -1;
+	}
+
+	SP_PushArg_t * arg = (SP_PushArg_t*)malloc( sizeof( SP_PushArg_t ) );
+	arg->mType = 2;
+	arg->mFd = fd1;
+	arg->mPeerFd = fd2;
+	arg->mHandler = handler;
+	arg->mSpliceCount = &mSpliceCount;
+	arg->mSpliceBytes = bytes;
+
+	SP_IOUtils::setNonblock( fd1 );
+	SP_IOUtils::setNonblock( fd2 );
+
+	return msgqueue_push( (struct event_msgqueue*)mPushQueue, arg );
+}
+
 void SP_Dispatcher :: onTimer( int, short, void * arg )
 {
 	SP_PushArg_t * pushArg = (SP_PushArg_t*)arg;
@@ -14,10 +14,12 @@ class SP_Handler;
 class SP_Message;
 class SP_BlockingQueue;
 class SP_TimerHandler;
+class SP_ConnectHandler;
 class SP_IOChannel;
 class SP_Response;
 
 class SP_EventArg;
+class SP_TopicRegistry;
 
 class SP_Dispatcher {
 public:
@@ -26,7 +28,24 @@ public:
 
 	void setTimeout( int timeout );
 
+	/**
+	 * @brief 1 : run the tasks of a session in order on one of maxThreads lanes
+	 * @note  must be called before dispatch()
+	 */
+	void setLaneMode( int laneMode );
+
+	/// a worker handles up to batchSize buffered requests into one response
+	void setBatchSize( int batchSize );
+
+	/// see SP_Server::setOutputWatermarks and SP_OutputPolicy
+	void setOutputWatermarks( int highWatermark, int lowWatermark, int policy );
+	void setOutputBudget( int budget );
+
+	/// see SP_Server::setTopicRegistry
+	void setTopicRegistry( SP_TopicRegistry * topicRegistry );
+
 	int getSessionCount();
+	int getSpliceCount();
 	int getReqQueueLength();
 
 	void shutdown();
@@ -55,6 +74,24 @@ public:
 	 */
 	int push( const struct timeval * timeout, SP_TimerHandler * handler );
 
+	/**
+	 * @brief start a non-blocking connect in the event loop
+	 * @param timeout : give up after it, NULL for no limit
+	 * @note  handler gets the result on a worker and is deleted afterwards
+	 */
+	int push( const struct sockaddr_in * addr, const struct timeval * timeout,
+			SP_ConnectHandler * handler );
+
+	/**
+	 * @brief hand a connected pair to a splice(2) pump in the event loop,
+	 *        bytes are forwarded fd1 <-> fd2 without entering user space
+	 * @param handler : optional, gets error/timeout and close when the pump ends
+	 * @param bytes : optional, [0] += fd1 -> fd2, [1] += fd2 -> fd1, in the event loop
+	 * @return 0 : OK, -1 : Fail, splice is not supported
+	 * @note  both fds are closed and handler is deleted by dispatcher
+	 */
+	int pushSplice( int fd1, int fd2, SP_Handler * handler = 0, uint64_t * bytes = 0 );
+
 	/**
 	 * @brief push a response
 	 */
@@ -64,6 +101,7 @@ private:
 	int mIsShutdown;
 	int mIsRunning;
 	int mMaxThreads;
+	int mSpliceCount;
 
 	SP_EventArg * mEventArg;
 	SP_CompletionHandler * mCompletionHandler;
@@ -76,10 +114,11 @@ private:
 
 	static void onPush( void * queueData, void * arg );
 
-	static void outputCompleted( void * arg );
-
 	static void onTimer( int, short, void * arg );
 	static void timer( void * arg );
+
+	static void onConnect( int fd, short events, void * arg );
+	static void connected( void * arg );
 };
 
 #endif
@@ -24,10 +24,31 @@
 #include "spmsgblock.hpp"
 #include "spiochannel.hpp"
 #include "spioutils.hpp"
+#include "sptopic.hpp"
 
 #include "event_msgqueue.h"
 #include "event.h"
 
+// an empty input buffer bigger than this is released, so idle sessions
+// do not keep the memory of a burst
+static const int SP_MAX_IDLE_INBUFFER = 4096;
+
+// stop reading a session whose worker is behind by this much input,
+// such as a large message spooled to disk, onResponse reads it again
+static const int SP_MAX_PENDING_INBUFFER = 1024 * 256;
+
+// the input beyond the free space of a session's buffer is read into this
+static const int SP_READ_CHUNK = 64 * 1024;
+
+// finished messages handed to the completion handler at once
+static const int SP_COMPLETION_BATCH = 64;
+
+typedef struct tagSP_CompletionBatch {
+	SP_CompletionHandler * mHandler;
+	int mCount;
+	SP_Message * mMsgs[ SP_COMPLETION_BATCH ];
+} SP_CompletionBatch_t;
+
 SP_EventArg :: SP_EventArg( int timeout )
 {
 	mEventBase = (struct event_base*)event_init();
@@ -42,10 +63,23 @@ SP_EventArg :: SP_EventArg( int timeout )
 	mSessionManager = new SP_SessionManager();
 
 	mTimeout = timeout;
+	mLaneMode = 0;
+	mBatchSize = 1;
+
+	mHighWatermark = mLowWatermark = 0;
+	mOutputPolicy = SP_OutputPolicy::eDrop;
+	mOutputBudget = mOutBytes = 0;
+
+	mTopicRegistry = NULL;
+
+	mReadChunk = NULL;
 }
 
 SP_EventArg :: ~SP_EventArg()
 {
+	if( NULL != mReadChunk ) free( mReadChunk );
+	mReadChunk = NULL;
+
 	delete mInputResultQueue;
 	delete mOutputResultQueue;
 
@@ -90,26 +124,163 @@ int SP_EventArg :: getTimeout() const
 	return mTimeout;
 }
 
+void SP_EventArg :: setLaneMode( int laneMode )
+{
+	mLaneMode = laneMode;
+}
+
+int SP_EventArg :: getLaneMode() const
+{
+	return mLaneMode;
+}
+
+void SP_EventArg :: setBatchSize( int batchSize )
+{
+	mBatchSize = batchSize > 0 ? batchSize : 1;
+}
+
+int SP_EventArg :: getBatchSize() const
+{
+	return mBatchSize;
+}
+
+void SP_EventArg :: setOutputWatermarks( int highWatermark, int lowWatermark, int policy )
+{
+	mHighWatermark = highWatermark > 0 ? highWatermark : 0;
+	mLowWatermark = lowWatermark >= 0 && lowWatermark < mHighWatermark
+			? lowWatermark : mHighWatermark / 2;
+	mOutputPolicy = policy;
+}
+
+int SP_EventArg :: getHighWatermark() const
+{
+	return mHighWatermark;
+}
+
+int SP_EventArg :: getLowWatermark() const
+{
+	return mLowWatermark;
+}
+
+int SP_EventArg :: getOutputPolicy() const
+{
+	return mOutputPolicy;
+}
+
+void SP_EventArg :: setOutputBudget( int budget )
+{
+	mOutputBudget = budget > 0 ? budget : 0;
+}
+
+int SP_EventArg :: getOutputBudget() const
+{
+	return mOutputBudget;
+}
+
+int SP_EventArg :: getOutBytes() const
+{
+	return mOutBytes;
+}
+
+void SP_EventArg :: addOutBytes( int len )
+{
+	mOutBytes += len;
+}
+
+int SP_EventArg :: isOutputFull( SP_Session * session ) const
+{
+	if( mHighWatermark > 0 && session->getOutBytes() >= mHighWatermark ) return 1;
+
+	// over the budget, only the sessions with little queued still get more
+	return mOutputBudget > 0 && mOutBytes >= mOutputBudget
+			&& session->getOutBytes() > mLowWatermark;
+}
+
+void SP_EventArg :: setTopicRegistry( SP_TopicRegistry * topicRegistry )
+{
+	mTopicRegistry = topicRegistry;
+}
+
+SP_TopicRegistry * SP_EventArg :: getTopicRegistry() const
+{
+	return mTopicRegistry;
+}
+
+char * SP_EventArg :: getReadChunk( int * size )
+{
+	if( NULL == mReadChunk ) mReadChunk = (char*)malloc( SP_READ_CHUNK );
+
+	*size = SP_READ_CHUNK;
+
+	return mReadChunk;
+}
+
+// queue a message to the session, counted for the output limits
+static void appendOutput( SP_Session * session, SP_Message * msg )
+{
+	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
+
+	session->getOutList()->append( msg );
+	msg->addPending( 1 );
+	session->addOutBytes( msg->getTotalSize() );
+	eventArg->addOutBytes( msg->getTotalSize() );
+}
+
 //-------------------------------------------------------------------
 
-void SP_EventCallback :: onAccept( int fd, short events, void * arg )
+void SP_EventCallback :: setAcceptEvent( struct event * event, int listenFD,
+		SP_AcceptArg_t * acceptArg, const char * bindIP )
 {
-	int clientFD;
-	struct sockaddr_in addr;
-	socklen_t addrLen = sizeof( addr );
+	// every connection has the same local address unless bound to a wildcard
+	struct in_addr addr;
+	if( NULL != bindIP && '\0' != *bindIP && 0 != sp_inet_aton( bindIP, &addr )
+			&& INADDR_ANY != addr.s_addr ) {
+		SP_IOUtils::inetNtoa( &addr, acceptArg->mServerIP, sizeof( acceptArg->mServerIP ) );
+	}
+
+	// level-triggered, a backlog left by a full batch is reported again
+	event_set( event, listenFD, EV_READ | EV_PERSIST, onAccept, acceptArg );
+	event_base_set( acceptArg->mEventArg->getEventBase(), event );
+}
 
+void SP_EventCallback :: onAccept( int fd, short events, void * arg )
+{
 	SP_AcceptArg_t * acceptArg = (SP_AcceptArg_t*)arg;
-	SP_EventArg * eventArg = acceptArg->mEventArg;
 
-	clientFD = accept( fd, (struct sockaddr *)&addr, &addrLen );
-	if( -1 == clientFD ) {
-		sp_syslog( LOG_WARNING, "accept failed" );
-		return;
-	}
+	int batch = acceptArg->mAcceptBatch > 0 ? acceptArg->mAcceptBatch : 1;
+
+	int count = 0;
+	for( ; count < batch; count++ ) {
+		struct sockaddr_in addr;
+		socklen_t addrLen = sizeof( addr );
+		memset( &addr, 0, sizeof( addr ) );
+
+#if defined( SOCK_NONBLOCK ) && defined( SOCK_CLOEXEC )
+		int clientFD = accept4( fd, (struct sockaddr *)&addr, &addrLen,
+				SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else
+		int clientFD = accept( fd, (struct sockaddr *)&addr, &addrLen );
+		if( clientFD >= 0 && SP_IOUtils::setNonblock( clientFD ) < 0 ) {
+			sp_syslog( LOG_WARNING, "failed to set client socket non-blocking" );
+		}
+#endif
+
+		if( -1 == clientFD ) {
+			if( EINTR == errno ) continue;
+			if( EAGAIN != errno && EWOULDBLOCK != errno ) {
+				sp_syslog( LOG_WARNING, "accept failed, errno %d, %s", errno, strerror( errno ) );
+			}
+			break;
+		}
 
-	if( SP_IOUtils::setNonblock( clientFD ) < 0 ) {
-		sp_syslog( LOG_WARNING, "failed to set client socket non-blocking" );
+		acceptSession( acceptArg, clientFD, &addr );
 	}
+}
+
+void SP_EventCallback :: acceptSession( SP_AcceptArg_t * acceptArg, int clientFD,
+		struct sockaddr_in * addr )
+{
+	SP_EventArg * eventArg = acceptArg->mEventArg;
 
 	SP_Sid_t sid;
 	sid.mKey = eventArg->getSessionManager()->allocKey( &sid.mSeq );
@@ -118,13 +289,19 @@ void SP_EventCallback :: onAccept( int fd, short events, void * arg )
 	SP_Session * session = new SP_Session( sid );
 
 	char strip[ 32 ] = { 0 };
-	SP_IOUtils::inetNtoa( &( addr.sin_addr ), strip, sizeof( strip ) );
+	SP_IOUtils::inetNtoa( &( addr->sin_addr ), strip, sizeof( strip ) );
 	session->getRequest()->setClientIP( strip );
-	session->getRequest()->setClientPort( ntohs( addr.sin_port ) );
+	session->getRequest()->setClientPort( ntohs( addr->sin_port ) );
 
-	if( 0 == getsockname( clientFD, (struct sockaddr*)&addr, &addrLen ) ) {
-		SP_IOUtils::inetNtoa( &( addr.sin_addr ), strip, sizeof( strip ) );
-		session->getRequest()->setServerIP( strip );
+	if( '\0' != acceptArg->mServerIP[0] ) {
+		session->getRequest()->setServerIP( acceptArg->mServerIP );
+	} else {
+		socklen_t addrLen = sizeof( *addr );
+		if( 0 == getsockname( clientFD, (struct sockaddr*)addr, &addrLen )
+				&& AF_INET == addr->sin_family ) {
+			SP_IOUtils::inetNtoa( &( addr->sin_addr ), strip, sizeof( strip ) );
+			session->getRequest()->setServerIP( strip );
+		}
 	}
 
 	if( NULL != session ) {
@@ -146,7 +323,7 @@ void SP_EventCallback :: onAccept( int fd, short events, void * arg )
 			SP_Message * msg = new SP_Message();
 			msg->getMsg()->append( acceptArg->mRefusedMsg );
 			msg->getMsg()->append( "\r\n" );
-			session->getOutList()->append( msg );
+			appendOutput( session, msg );
 			session->setStatus( SP_Session::eExit );
 
 			addEvent( session, EV_WRITE, clientFD );
@@ -169,17 +346,42 @@ void SP_EventCallback :: onRead( int fd, short events, void * arg )
 	SP_Sid_t sid = session->getSid();
 
 	if( EV_READ & events ) {
-		int len = session->getIOChannel()->receive( session );
+		SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
+
+		// a stale EAGAIN, such as the one ending the accept loop,
+		// must not be mistaken for the result of a receive returning 0
+		errno = 0;
+
+		// the lane worker and the batch worker decode while the input is received
+		int len = 0;
+		if( eventArg->getLaneMode() || eventArg->getBatchSize() > 1 ) {
+			session->lockInBuffer();
+			len = session->getIOChannel()->receive( session );
+			int saved = errno;
+			session->unlockInBuffer();
+			errno = saved;
+		} else {
+			len = session->getIOChannel()->receive( session );
+		}
 
 		if( len > 0 ) {
 			session->addRead( len );
-			if( 0 == session->getRunning() ) {
+			if( eventArg->getLaneMode() ) {
+				SP_EventHelper::doLaneWork( session );
+			} else if( 0 == session->getRunning() ) {
 				SP_MsgDecoder * decoder = session->getRequest()->getMsgDecoder();
 				if( SP_MsgDecoder::eOK == decoder->decode( session->getInBuffer() ) ) {
 					SP_EventHelper::doWork( session );
 				}
+				session->getInBuffer()->shrink( SP_MAX_IDLE_INBUFFER );
+			}
+
+			if( 0 == eventArg->getLaneMode() && session->getRunning()
+					&& (int)session->getInBuffer()->getSize() >= SP_MAX_PENDING_INBUFFER ) {
+				// the read event is added by onResponse
+			} else {
+				addEvent( session, EV_READ, -1 );
 			}
-			addEvent( session, EV_READ, -1 );
 		} else {
 			int saved = errno;
 
@@ -222,16 +424,27 @@ void SP_EventCallback :: onWrite( int fd, short events, void * arg )
 	SP_Sid_t sid = session->getSid();
 
 	if( EV_WRITE & events ) {
+		SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
 		int ret = 0;
 
 		if( session->getOutList()->getCount() > 0 ) {
 			int len = session->getIOChannel()->transmit( session );
 			if( len > 0 ) {
 				session->addWrite( len );
+				session->addOutBytes( -len );
+				eventArg->addOutBytes( -len );
+
+				if( NULL != session->getPausedSenders()
+						&& session->getOutBytes() <= eventArg->getLowWatermark() ) {
+					SP_EventHelper::resumeSenders( session );
+				}
+
 				if( session->getOutList()->getCount() > 0 ) {
 					// left for next write event
 					addEvent( session, EV_WRITE, -1 );
 				}
+			} else if( EINPROGRESS == errno ) {
+				// submitted by the io channel, which calls onWrite with the result
 			} else {
 				if( EAGAIN != errno ) {
 					ret = -1;
@@ -266,12 +479,13 @@ void SP_EventCallback :: onWrite( int fd, short events, void * arg )
 			}
 		}
 
-		if( 0 == ret ) {
+		if( 0 == ret && 0 == eventArg->getLaneMode() ) {
 			if( 0 == session->getRunning() ) {
 				SP_MsgDecoder * decoder = session->getRequest()->getMsgDecoder();
 				if( SP_MsgDecoder::eOK == decoder->decode( session->getInBuffer() ) ) {
 					SP_EventHelper::doWork( session );
 				}
+				session->getInBuffer()->shrink( SP_MAX_IDLE_INBUFFER );
 			} else {
 				// If this session is running, then onResponse will add write event for this session.
 				// So no need to add write event here.
@@ -322,6 +536,8 @@ void SP_EventCallback :: onResponse( void * queueData, void * arg )
 	for( SP_Message * msg = response->takeMessage();
 			NULL != msg; msg = response->takeMessage() ) {
 
+		// the to-list may be shared by many messages, so it is only read,
+		// the sessions the message is queued to are counted instead
 		SP_SidList * sidList = msg->getToList();
 
 		if( msg->getTotalSize() > 0 ) {
@@ -331,26 +547,33 @@ void SP_EventCallback :: onResponse( void * queueData, void * arg )
 				if( seq == sid.mSeq && NULL != session ) {
 					if( 0 != memcmp( &fromSid, &sid, sizeof( sid ) )
 							&& SP_Session::eExit == session->getStatus() ) {
-						sidList->take( i );
 						msg->getFailure()->add( sid );
 						sp_syslog( LOG_WARNING, "session(%d.%d) would exit, invalid TO", sid.mKey, sid.mSeq );
+					} else if( SP_OutputPolicy::ePause != eventArg->getOutputPolicy()
+							&& eventArg->isOutputFull( session ) ) {
+						msg->getFailure()->add( sid );
+						SP_EventHelper::doOverflow( session, msg );
 					} else {
-						session->getOutList()->append( msg );
+						appendOutput( session, msg );
 						addEvent( session, EV_WRITE, -1 );
+
+						if( SP_OutputPolicy::ePause == eventArg->getOutputPolicy()
+								&& eventArg->isOutputFull( session ) ) {
+							SP_EventHelper::pauseSender( session, fromSid );
+						}
 					}
 				} else {
-					sidList->take( i );
 					msg->getFailure()->add( sid );
 					sp_syslog( LOG_WARNING, "session(%d.%d) invalid, unknown TO", sid.mKey, sid.mSeq );
 				}
 			}
 		} else {
-			for( ; sidList->getCount() > 0; ) {
-				msg->getFailure()->add( sidList->take( SP_ArrayList::LAST_INDEX ) );
+			for( int i = sidList->getCount() - 1; i >= 0; i-- ) {
+				msg->getFailure()->add( sidList->get( i ) );
 			}
 		}
 
-		if( msg->getToList()->getCount() <= 0 ) {
+		if( msg->getPending() <= 0 ) {
 			SP_EventHelper::doCompletion( eventArg, msg );
 		}
 	}
@@ -387,7 +610,7 @@ void SP_EventCallback :: addEvent( SP_Session * session, short events, int fd )
 		event_add( session->getWriteEvent(), &timeout );
 	}
 
-	if( events & EV_READ && 0 == session->getReading() ) {
+	if( events & EV_READ && 0 == session->getReading() && 0 == session->getPaused() ) {
 		session->setReading( 1 );
 
 		if( fd < 0 ) fd = EVENT_FD( session->getWriteEvent() );
@@ -410,19 +633,102 @@ int SP_EventHelper :: isSystemSid( SP_Sid_t * sid )
 			|| ( sid->mKey == SP_Sid_t::ePushKey && sid->mSeq == SP_Sid_t::ePushSeq );
 }
 
+void SP_EventHelper :: doOverflow( SP_Session * session, SP_Message * msg )
+{
+	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
+	SP_Sid_t sid = session->getSid();
+
+	if( SP_OutputPolicy::eClose != eventArg->getOutputPolicy() ) {
+		sp_syslog( LOG_DEBUG, "session(%d.%d) output %d bytes, drop %d bytes",
+				sid.mKey, sid.mSeq, session->getOutBytes(), (int)msg->getTotalSize() );
+		return;
+	}
+
+	sp_syslog( LOG_WARNING, "session(%d.%d) output %d bytes, total %d bytes, close",
+			sid.mKey, sid.mSeq, session->getOutBytes(), eventArg->getOutBytes() );
+
+	if( 0 == session->getRunning() ) {
+		doError( session );
+	} else {
+		// refuse the messages from now on, closed when the worker is done
+		session->setStatus( SP_Session::eExit );
+	}
+}
+
+void SP_EventHelper :: pauseSender( SP_Session * receiver, SP_Sid_t fromSid )
+{
+	if( isSystemSid( &fromSid ) ) return;
+
+	SP_EventArg * eventArg = (SP_EventArg*)receiver->getArg();
+
+	uint16_t seq = 0;
+	SP_Session * sender = eventArg->getSessionManager()->get( fromSid.mKey, &seq );
+	if( seq != fromSid.mSeq || NULL == sender ) return;
+
+	receiver->addPausedSender( fromSid );
+
+	if( 0 == sender->getPaused() ) {
+		sender->setPaused( 1 );
+		if( sender->getReading() ) {
+			event_del( sender->getReadEvent() );
+			sender->setReading( 0 );
+		}
+	}
+}
+
+void SP_EventHelper :: resumeSenders( SP_Session * receiver )
+{
+	SP_EventArg * eventArg = (SP_EventArg*)receiver->getArg();
+	SP_SidList * senders = receiver->getPausedSenders();
+
+	for( ; NULL != senders && senders->getCount() > 0; ) {
+		SP_Sid_t sid = senders->take( senders->getCount() - 1 );
+
+		uint16_t seq = 0;
+		SP_Session * sender = eventArg->getSessionManager()->get( sid.mKey, &seq );
+		if( seq == sid.mSeq && NULL != sender && sender->getPaused() ) {
+			sender->setPaused( 0 );
+			if( SP_Session::eNormal == sender->getStatus() ) {
+				SP_EventCallback::addEvent( sender, EV_READ, -1 );
+			}
+		}
+	}
+}
+
+void SP_EventHelper :: releaseOutput( SP_Session * session )
+{
+	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
+
+	eventArg->addOutBytes( -session->getOutBytes() );
+	session->addOutBytes( -session->getOutBytes() );
+
+	resumeSenders( session );
+}
+
+void SP_EventHelper :: releaseTopics( SP_Session * session )
+{
+	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
+
+	// before the handler is closed, so no more broadcasts are sent to it
+	if( NULL != eventArg->getTopicRegistry() ) {
+		eventArg->getTopicRegistry()->unsubscribeAll( session->getSid() );
+	}
+}
+
 void SP_EventHelper :: doWork( SP_Session * session )
 {
 	if( SP_Session::eNormal == session->getStatus() ) {
 		session->setRunning( 1 );
 		SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
-		eventArg->getInputResultQueue()->push( new SP_SimpleTask( worker, session, 1 ) );
+		eventArg->getInputResultQueue()->push( new SP_SimpleTask( worker, session, 1,
+				session->getSid().mKey ) );
 	} else {
 		SP_Sid_t sid = session->getSid();
 
 		char buffer[ 16 ] = { 0 };
 		session->getInBuffer()->take( buffer, sizeof( buffer ) );
 		sp_syslog( LOG_WARNING, "session(%d.%d) status is %d, ignore [%s...] (%dB)",
-			sid.mKey, sid.mSeq, session->getStatus(), buffer, session->getInBuffer()->getSize() );
+			sid.mKey, sid.mSeq, session->getStatus(), buffer, (int)session->getInBuffer()->getSize() );
 		session->getInBuffer()->reset();
 	}
 }
@@ -438,11 +744,88 @@ void SP_EventHelper :: worker( void * arg )
 		session->setStatus( SP_Session::eWouldExit );
 	}
 
+	// the requests already buffered are handled into the same response,
+	// instead of one round-trip through onResponse and onWrite each
+	for( int count = 1; count < eventArg->getBatchSize(); count++ ) {
+		int ret = SP_MsgDecoder::eMoreData;
+
+		session->lockInBuffer();
+		if( SP_Session::eNormal == session->getStatus() ) {
+			SP_MsgDecoder * decoder = session->getRequest()->getMsgDecoder();
+			ret = decoder->decode( session->getInBuffer() );
+		}
+		session->unlockInBuffer();
+
+		if( SP_MsgDecoder::eOK != ret ) break;
+
+		if( 0 != handler->handle( session->getRequest(), response ) ) {
+			session->setStatus( SP_Session::eWouldExit );
+		}
+	}
+
 	session->setRunning( 0 );
 
 	msgqueue_push( (struct event_msgqueue*)eventArg->getResponseQueue(), response );
 }
 
+void SP_EventHelper :: doLaneWork( SP_Session * session )
+{
+	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
+	SP_Sid_t sid = session->getSid();
+
+	session->lockInBuffer();
+
+	if( SP_Session::eNormal == session->getStatus() ) {
+		// one pending worker per session is enough, it drains the input buffer
+		if( 0 == session->getLaneQueued() ) {
+			session->setLaneQueued( 1 );
+			eventArg->getInputResultQueue()->push(
+				new SP_SimpleTask( laneWorker, session, 1, sid.mKey ) );
+		}
+	} else {
+		char buffer[ 16 ] = { 0 };
+		session->getInBuffer()->take( buffer, sizeof( buffer ) );
+		sp_syslog( LOG_WARNING, "session(%d.%d) status is %d, ignore [%s...] (%dB)",
+			sid.mKey, sid.mSeq, session->getStatus(), buffer, (int)session->getInBuffer()->getSize() );
+		session->getInBuffer()->reset();
+	}
+
+	session->unlockInBuffer();
+}
+
+void SP_EventHelper :: laneWorker( void * arg )
+{
+	SP_Session * session = (SP_Session*)arg;
+	SP_Handler * handler = session->getHandler();
+	SP_EventArg * eventArg = (SP_EventArg *)session->getArg();
+
+	// the lane runs all tasks of this session in order, so the next request
+	// can be decoded here without waiting for the response to be sent
+	for( ; ; ) {
+		int ret = SP_MsgDecoder::eMoreData;
+
+		session->lockInBuffer();
+		if( SP_Session::eNormal == session->getStatus() ) {
+			SP_MsgDecoder * decoder = session->getRequest()->getMsgDecoder();
+			ret = decoder->decode( session->getInBuffer() );
+		}
+		if( SP_MsgDecoder::eOK != ret ) {
+			session->setLaneQueued( 0 );
+			session->getInBuffer()->shrink( SP_MAX_IDLE_INBUFFER );
+		}
+		session->unlockInBuffer();
+
+		if( SP_MsgDecoder::eOK != ret ) break;
+
+		SP_Response * response = new SP_Response( session->getSid() );
+		if( 0 != handler->handle( session->getRequest(), response ) ) {
+			session->setStatus( SP_Session::eWouldExit );
+		}
+
+		msgqueue_push( (struct event_msgqueue*)eventArg->getResponseQueue(), response );
+	}
+}
+
 void SP_EventHelper :: doError( SP_Session * session )
 {
 	SP_EventArg * eventArg = (SP_EventArg *)session->getArg();
@@ -452,15 +835,13 @@ void SP_EventHelper :: doError( SP_Session * session )
 
 	SP_Sid_t sid = session->getSid();
 
-	SP_ArrayList * outList = session->getOutList();
+	SP_CircleList * outList = session->getOutList();
 	for( ; outList->getCount() > 0; ) {
-		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_ArrayList::LAST_INDEX );
+		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_CircleList::LAST_INDEX );
 
-		int index = msg->getToList()->find( sid );
-		if( index >= 0 ) msg->getToList()->take( index );
 		msg->getFailure()->add( sid );
 
-		if( msg->getToList()->getCount() <= 0 ) {
+		if( msg->addPending( -1 ) <= 0 ) {
 			doCompletion( eventArg, msg );
 		}
 	}
@@ -468,7 +849,11 @@ void SP_EventHelper :: doError( SP_Session * session )
 	// remove session from SessionManager, onResponse will ignore this session
 	eventArg->getSessionManager()->remove( sid.mKey, sid.mSeq );
 
-	eventArg->getInputResultQueue()->push( new SP_SimpleTask( error, session, 1 ) );
+	releaseOutput( session );
+	releaseTopics( session );
+
+	eventArg->getInputResultQueue()->push( new SP_SimpleTask( error, session, 1,
+			session->getSid().mKey ) );
 }
 
 void SP_EventHelper :: error( void * arg )
@@ -504,15 +889,13 @@ void SP_EventHelper :: doTimeout( SP_Session * session )
 
 	SP_Sid_t sid = session->getSid();
 
-	SP_ArrayList * outList = session->getOutList();
+	SP_CircleList * outList = session->getOutList();
 	for( ; outList->getCount() > 0; ) {
-		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_ArrayList::LAST_INDEX );
+		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_CircleList::LAST_INDEX );
 
-		int index = msg->getToList()->find( sid );
-		if( index >= 0 ) msg->getToList()->take( index );
 		msg->getFailure()->add( sid );
 
-		if( msg->getToList()->getCount() <= 0 ) {
+		if( msg->addPending( -1 ) <= 0 ) {
 			doCompletion( eventArg, msg );
 		}
 	}
@@ -520,7 +903,11 @@ void SP_EventHelper :: doTimeout( SP_Session * session )
 	// remove session from SessionManager, onResponse will ignore this session
 	eventArg->getSessionManager()->remove( sid.mKey, sid.mSeq );
 
-	eventArg->getInputResultQueue()->push( new SP_SimpleTask( timeout, session, 1 ) );
+	releaseOutput( session );
+	releaseTopics( session );
+
+	eventArg->getInputResultQueue()->push( new SP_SimpleTask( timeout, session, 1,
+			session->getSid().mKey ) );
 }
 
 void SP_EventHelper :: timeout( void * arg )
@@ -557,7 +944,11 @@ void SP_EventHelper :: doClose( SP_Session * session )
 
 	eventArg->getSessionManager()->remove( sid.mKey, sid.mSeq );
 
-	eventArg->getInputResultQueue()->push( new SP_SimpleTask( myclose, session, 1 ) );
+	releaseOutput( session );
+	releaseTopics( session );
+
+	eventArg->getInputResultQueue()->push( new SP_SimpleTask( myclose, session, 1,
+			session->getSid().mKey ) );
 }
 
 void SP_EventHelper :: myclose( void * arg )
@@ -581,7 +972,8 @@ void SP_EventHelper :: doStart( SP_Session * session )
 {
 	session->setRunning( 1 );
 	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
-	eventArg->getInputResultQueue()->push( new SP_SimpleTask( start, session, 1 ) );
+	eventArg->getInputResultQueue()->push( new SP_SimpleTask( start, session, 1,
+			session->getSid().mKey ) );
 }
 
 void SP_EventHelper :: start( void * arg )
@@ -614,6 +1006,35 @@ void SP_EventHelper :: start( void * arg )
 
 void SP_EventHelper :: doCompletion( SP_EventArg * eventArg, SP_Message * msg )
 {
+	// every sid is in the success or the failure list now
+	msg->getToList()->reset();
+
 	eventArg->getOutputResultQueue()->push( msg );
 }
 
+void SP_EventHelper :: doCompletions( SP_BlockingQueue * queue,
+		SP_CompletionHandler * handler, SP_Executor * executor )
+{
+	for( int count = SP_COMPLETION_BATCH; count >= SP_COMPLETION_BATCH; ) {
+		SP_Message * msgs[ SP_COMPLETION_BATCH ];
+		count = queue->drain( (void**)msgs, SP_COMPLETION_BATCH );
+		if( count <= 0 ) break;
+
+		SP_CompletionBatch_t * batch = (SP_CompletionBatch_t*)malloc( sizeof( SP_CompletionBatch_t ) );
+		batch->mHandler = handler;
+		batch->mCount = count;
+		memcpy( batch->mMsgs, msgs, sizeof( msgs[0] ) * count );
+
+		executor->execute( completions, batch );
+	}
+}
+
+void SP_EventHelper :: completions( void * arg )
+{
+	SP_CompletionBatch_t * batch = (SP_CompletionBatch_t*)arg;
+
+	batch->mHandler->completionMessages( batch->mMsgs, batch->mCount );
+
+	free( batch );
+}
+
@@ -12,6 +12,9 @@ class SP_Session;
 class SP_BlockingQueue;
 class SP_Message;
 class SP_IOChannelFactory;
+class SP_CompletionHandler;
+class SP_Executor;
+class SP_TopicRegistry;
 
 struct event_base;
 typedef struct tagSP_Sid SP_Sid_t;
@@ -30,6 +33,37 @@ public:
 	void setTimeout( int timeout );
 	int getTimeout() const;
 
+	// 1 : tasks of one session are run in order on one lane, see SP_LaneExecutor
+	void setLaneMode( int laneMode );
+	int getLaneMode() const;
+
+	// a worker handles at most batchSize buffered requests into one response
+	void setBatchSize( int batchSize );
+	int getBatchSize() const;
+
+	// see SP_Server::setOutputWatermarks and setOutputBudget
+	void setOutputWatermarks( int highWatermark, int lowWatermark, int policy );
+	int getHighWatermark() const;
+	int getLowWatermark() const;
+	int getOutputPolicy() const;
+	void setOutputBudget( int budget );
+	int getOutputBudget() const;
+
+	// bytes queued to all the sessions
+	int getOutBytes() const;
+	void addOutBytes( int len );
+
+	// 1 : a message to the session is subject to the output policy
+	int isOutputFull( SP_Session * session ) const;
+
+	// see SP_Server::setTopicRegistry
+	void setTopicRegistry( SP_TopicRegistry * topicRegistry );
+	SP_TopicRegistry * getTopicRegistry() const;
+
+	// the sessions of this event loop receive into it, see SP_DefaultIOChannel
+	// @return NULL : out of memory
+	char * getReadChunk( int * size );
+
 private:
 	struct event_base * mEventBase;
 	void * mResponseQueue;
@@ -40,6 +74,15 @@ private:
 	SP_SessionManager * mSessionManager;
 
 	int mTimeout;
+	int mLaneMode;
+	int mBatchSize;
+
+	int mHighWatermark, mLowWatermark, mOutputPolicy;
+	int mOutputBudget, mOutBytes;
+
+	SP_TopicRegistry * mTopicRegistry;
+
+	char * mReadChunk;
 };
 
 typedef struct tagSP_AcceptArg {
@@ -50,11 +93,20 @@ typedef struct tagSP_AcceptArg {
 	int mReqQueueSize;
 	int mMaxConnections;
 	char * mRefusedMsg;
+
+	// accept at most mAcceptBatch connections per event, 0 : one
+	int mAcceptBatch;
+	// '\0' : bound to a wildcard address, lookup per connection
+	char mServerIP[ 32 ];
 } SP_AcceptArg_t;
 
 class SP_EventCallback {
 public:
 	static void onAccept( int fd, short events, void * arg );
+
+	/// prepare the accept event of a listener, event_add is left to the caller
+	static void setAcceptEvent( struct event * event, int listenFD,
+			SP_AcceptArg_t * acceptArg, const char * bindIP );
 	static void onRead( int fd, short events, void * arg );
 	static void onWrite( int fd, short events, void * arg );
 
@@ -63,6 +115,9 @@ public:
 	static void addEvent( SP_Session * session, short events, int fd );
 
 private:
+	static void acceptSession( SP_AcceptArg_t * acceptArg, int clientFD,
+			struct sockaddr_in * addr );
+
 	SP_EventCallback();
 	~SP_EventCallback();
 };
@@ -75,6 +130,9 @@ public:
 	static void doWork( SP_Session * session );
 	static void worker( void * arg );
 
+	static void doLaneWork( SP_Session * session );
+	static void laneWorker( void * arg );
+
 	static void doError( SP_Session * session );
 	static void error( void * arg );
 
@@ -86,8 +144,27 @@ public:
 
 	static void doCompletion( SP_EventArg * eventArg, SP_Message * msg );
 
+	/// hand the finished messages of the queue to the handler in batches,
+	/// one task per batch on the executor
+	static void doCompletions( SP_BlockingQueue * queue,
+			SP_CompletionHandler * handler, SP_Executor * executor );
+	static void completions( void * arg );
+
 	static int isSystemSid( SP_Sid_t * sid );
 
+	/// a message to a session above its watermark is dropped or the session closed
+	static void doOverflow( SP_Session * session, SP_Message * msg );
+
+	/// stop reading the sender until the output of the receiver drains
+	static void pauseSender( SP_Session * receiver, SP_Sid_t fromSid );
+	static void resumeSenders( SP_Session * receiver );
+
+	/// the session is gone, give back its queued output and resume its senders
+	static void releaseOutput( SP_Session * session );
+
+	/// the session is gone, remove it from the topics it subscribes
+	static void releaseTopics( SP_Session * session );
+
 private:
 	SP_EventHelper();
 	~SP_EventHelper();
@@ -6,6 +6,9 @@
 
 #include <sys/types.h>
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "spporting.hpp"
 
@@ -18,14 +21,21 @@ SP_Task :: ~SP_Task()
 {
 }
 
+unsigned int SP_Task :: getLaneKey()
+{
+	return 0;
+}
+
 //===================================================================
 
-SP_SimpleTask :: SP_SimpleTask( ThreadFunc_t func, void * arg, int deleteAfterRun )
+SP_SimpleTask :: SP_SimpleTask( ThreadFunc_t func, void * arg, int deleteAfterRun,
+		unsigned int laneKey )
 {
 	mFunc = func;
 	mArg = arg;
 
 	mDeleteAfterRun = deleteAfterRun;
+	mLaneKey = laneKey;
 }
 
 SP_SimpleTask :: ~SP_SimpleTask()
@@ -39,6 +49,11 @@ void SP_SimpleTask :: run()
 	if( mDeleteAfterRun ) delete this;
 }
 
+unsigned int SP_SimpleTask :: getLaneKey()
+{
+	return mLaneKey;
+}
+
 //===================================================================
 
 SP_Executor :: SP_Executor( int maxThreads, const char * tag )
@@ -51,6 +66,9 @@ SP_Executor :: SP_Executor( int maxThreads, const char * tag )
 
 	mIsShutdown = 0;
 
+	mCpuList = NULL;
+	mIsPinned = 0;
+
 	sp_thread_mutex_init( &mMutex, NULL );
 	sp_thread_cond_init( &mCond, NULL );
 
@@ -87,6 +105,9 @@ SP_Executor :: ~SP_Executor()
 
 	delete mQueue;
 	mQueue = NULL;
+
+	if( NULL != mCpuList ) free( mCpuList );
+	mCpuList = NULL;
 }
 
 void SP_Executor :: shutdown()
@@ -108,6 +129,11 @@ sp_thread_result_t SP_THREAD_CALL  SP_Executor :: eventLoop( void * arg )
 	while( 0 == executor->mIsShutdown ) {
 		void * queueData = executor->mQueue->pop();
 
+		if( NULL != executor->mCpuList && 0 == executor->mIsPinned ) {
+			SP_ThreadPool::setCpuAffinity( executor->mCpuList );
+			executor->mIsPinned = 1;
+		}
+
 		if( executor->mThreadPool->getMaxThreads() > 1 ) {
 			if( 0 != executor->mThreadPool->dispatch( worker, queueData ) ) {
 				worker( queueData );
@@ -149,3 +175,85 @@ int SP_Executor :: getQueueLength()
 	return mQueue->getLength();
 }
 
+void SP_Executor :: setAdaptive( int minThreads, int highWaitUsec, int lowUtilization )
+{
+	mThreadPool->setAdaptive( minThreads, highWaitUsec, lowUtilization );
+}
+
+int SP_Executor :: adjust()
+{
+	return mThreadPool->adjust();
+}
+
+void SP_Executor :: getStat( SP_ThreadPoolStat_t * stat )
+{
+	mThreadPool->getStat( stat );
+}
+
+void SP_Executor :: setCpuList( const char * cpuList )
+{
+	mThreadPool->setCpuList( cpuList );
+
+	if( NULL != mCpuList ) free( mCpuList );
+	mCpuList = NULL;
+
+	if( NULL != cpuList && '\0' != *cpuList ) mCpuList = strdup( cpuList );
+}
+
+
+//===================================================================
+
+SP_LaneExecutor :: SP_LaneExecutor( int lanes, const char * tag )
+{
+	tag = NULL == tag ? "lane" : tag;
+
+	mLanes = lanes > 0 ? lanes : 1;
+	mLaneList = (SP_Executor**)malloc( sizeof( void * ) * mLanes );
+
+	for( int i = 0; i < mLanes; i++ ) {
+		char laneTag[ 64 ] = { 0 };
+		snprintf( laneTag, sizeof( laneTag ), "%s#%d", tag, i );
+		mLaneList[ i ] = new SP_Executor( 1, laneTag );
+	}
+}
+
+SP_LaneExecutor :: ~SP_LaneExecutor()
+{
+	for( int i = 0; i < mLanes; i++ ) {
+		delete mLaneList[ i ];
+		mLaneList[ i ] = NULL;
+	}
+
+	free( mLaneList );
+	mLaneList = NULL;
+}
+
+void SP_LaneExecutor :: execute( SP_Task * task )
+{
+	mLaneList[ task->getLaneKey() % mLanes ]->execute( task );
+}
+
+int SP_LaneExecutor :: getQueueLength()
+{
+	int len = 0;
+
+	for( int i = 0; i < mLanes; i++ ) {
+		len += mLaneList[ i ]->getQueueLength();
+	}
+
+	return len;
+}
+
+void SP_LaneExecutor :: shutdown()
+{
+	for( int i = 0; i < mLanes; i++ ) {
+		mLaneList[ i ]->shutdown();
+	}
+}
+
+void SP_LaneExecutor :: setCpuList( const char * cpuList )
+{
+	for( int i = 0; i < mLanes; i++ ) {
+		mLaneList[ i ]->setCpuList( cpuList );
+	}
+}
@@ -12,26 +12,35 @@
 class SP_ThreadPool;
 class SP_BlockingQueue;
 
+typedef struct tagSP_ThreadPoolStat SP_ThreadPoolStat_t;
+
 class SP_Task {
 public:
 	virtual ~SP_Task();
 	virtual void run() = 0;
+
+	// tasks with the same lane key are run in order by SP_LaneExecutor
+	virtual unsigned int getLaneKey();
 };
 
 class SP_SimpleTask : public SP_Task {
 public:
 	typedef void ( * ThreadFunc_t ) ( void * );
 
-	SP_SimpleTask( ThreadFunc_t func, void * arg, int deleteAfterRun );
+	SP_SimpleTask( ThreadFunc_t func, void * arg, int deleteAfterRun,
+			unsigned int laneKey = 0 );
 	virtual ~SP_SimpleTask();
 
 	virtual void run();
 
+	virtual unsigned int getLaneKey();
+
 private:
 	ThreadFunc_t mFunc;
 	void * mArg;
 
 	int mDeleteAfterRun;
+	unsigned int mLaneKey;
 };
 
 class SP_Executor {
@@ -44,6 +53,18 @@ public:
 	int getQueueLength();
 	void shutdown();
 
+	/// see SP_ThreadPool::setAdaptive, maxThreads is the one of the ctor
+	void setAdaptive( int minThreads, int highWaitUsec = 2000, int lowUtilization = 30 );
+
+	/// re-evaluate the pool size, call it periodically when tasks may stop coming
+	int adjust();
+
+	void getStat( SP_ThreadPoolStat_t * stat );
+
+	/// pin the event loop thread and the worker threads to a cpu list,
+	/// such as "0-3,8", call it before the first task is executed
+	void setCpuList( const char * cpuList );
+
 private:
 	static void msgQueueCallback( void * queueData, void * arg );
 	static void worker( void * arg );
@@ -54,9 +75,33 @@ private:
 
 	int mIsShutdown;
 
+	char * mCpuList;
+	int mIsPinned;
+
 	sp_thread_mutex_t mMutex;
 	sp_thread_cond_t mCond;
 };
 
+/**
+ * @brief session-affine executor, every lane is a single-threaded SP_Executor,
+ *        a task is hashed to one lane by SP_Task::getLaneKey, so tasks with
+ *        the same key are run one by one in FIFO order
+ */
+class SP_LaneExecutor {
+public:
+	SP_LaneExecutor( int lanes, const char * tag = 0 );
+	~SP_LaneExecutor();
+
+	void execute( SP_Task * task );
+	int getQueueLength();
+	void shutdown();
+
+	void setCpuList( const char * cpuList );
+
+private:
+	int mLanes;
+	SP_Executor ** mLaneList;
+};
+
 #endif
 
@@ -18,10 +18,26 @@ SP_TimerHandler :: ~SP_TimerHandler()
 
 //---------------------------------------------------------
 
+SP_ConnectHandler :: ~SP_ConnectHandler()
+{
+}
+
+//---------------------------------------------------------
+
 SP_CompletionHandler :: ~SP_CompletionHandler()
 {
 }
 
+void SP_CompletionHandler :: completionMessages( SP_Message ** msgs, int count )
+{
+	for( int i = 0; i < count; i++ ) completionMessage( msgs[i] );
+}
+
+int SP_CompletionHandler :: isThreadSafe()
+{
+	return 0;
+}
+
 //---------------------------------------------------------
 
 SP_DefaultCompletionHandler :: SP_DefaultCompletionHandler()
@@ -37,6 +53,16 @@ void SP_DefaultCompletionHandler :: completionMessage( SP_Message * msg )
 	delete msg;
 }
 
+void SP_DefaultCompletionHandler :: completionMessages( SP_Message ** msgs, int count )
+{
+	for( int i = 0; i < count; i++ ) delete msgs[i];
+}
+
+int SP_DefaultCompletionHandler :: isThreadSafe()
+{
+	return 1;
+}
+
 //---------------------------------------------------------
 
 SP_HandlerFactory :: ~SP_HandlerFactory()
@@ -40,6 +40,18 @@ public:
 	virtual int handle( SP_Response * response, struct timeval * timeout ) = 0;
 };
 
+class SP_ConnectHandler {
+public:
+	virtual ~SP_ConnectHandler();
+
+	/**
+	 * @brief a non-blocking connect is done, called on a worker
+	 * @param fd : the connected socket, owned by handler now; -1 if failed
+	 * @param error : 0 or errno, ETIMEDOUT if the connect timed out
+	 */
+	virtual void completed( int fd, int error, SP_Response * response ) = 0;
+};
+
 /**
  * @note Asynchronous Completion Token
  */
@@ -48,6 +60,16 @@ public:
 	virtual ~SP_CompletionHandler();
 
 	virtual void completionMessage( SP_Message * msg ) = 0;
+
+	/// the messages finished together, default calls completionMessage one by one
+	virtual void completionMessages( SP_Message ** msgs, int count );
+
+	/**
+	 * @brief 1 : may be called by several threads at once, so the batches
+	 *        are completed by the worker threads instead of the single
+	 *        completion thread, default is 0
+	 */
+	virtual int isThreadSafe();
 };
 
 class SP_DefaultCompletionHandler : public SP_CompletionHandler {
@@ -56,6 +78,27 @@ public:
 	~SP_DefaultCompletionHandler();
 
 	virtual void completionMessage( SP_Message * msg );
+	virtual void completionMessages( SP_Message ** msgs, int count );
+
+	/// return 1, only deletes the messages
+	virtual int isThreadSafe();
+};
+
+/**
+ * @brief what happens to a message for a session whose queued output is
+ *        above the high watermark, see SP_Server::setOutputWatermarks
+ */
+class SP_OutputPolicy {
+public:
+	enum {
+		// the message fails for that session, such as a chat to a slow client
+		eDrop,
+		// the session is closed, its queued messages fail
+		eClose,
+		// the message is queued, the sender is not read until the queue is
+		// below the low watermark, such as a tunnel or a proxy
+		ePause
+	};
 };
 
 class SP_HandlerFactory {
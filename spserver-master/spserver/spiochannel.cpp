@@ -4,6 +4,7 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #include "spporting.hpp"
@@ -40,27 +41,39 @@ int SP_IOChannel :: transmit( SP_Session * session )
 {
 #ifdef WIN32
 	const static int SP_MAX_IOV = MSG_MAXIOVLEN;
-
-    SP_IocpSession_t * iocpSession = (SP_IocpSession_t*)session->getArg();
-    SP_IocpEventArg * eventArg = iocpSession->mEventArg;
 #else
 #	ifdef IOV_MAX
 	const static int SP_MAX_IOV = IOV_MAX;
 #	else
 	const static int SP_MAX_IOV = 8;
 #	endif
-	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
 #endif
 
-	SP_ArrayList * outList = session->getOutList();
-	size_t outOffset = session->getOutOffset();
-
 	struct iovec iovArray[ SP_MAX_IOV ];
 	memset( iovArray, 0, sizeof( iovArray ) );
 
+	int iovSize = fillIov( session, iovArray, SP_MAX_IOV );
+
+	int len = write_vec( iovArray, iovSize );
+
+	if( len > 0 ) onTransmit( session, len );
+
+	if( len > 0 && session->getOutList()->getCount() > 0 ) {
+		int tmpLen = transmit( session );
+		if( tmpLen > 0 ) len += tmpLen;
+	}
+
+	return len;
+}
+
+int SP_IOChannel :: fillIov( SP_Session * session, struct iovec * iovArray, int maxIov )
+{
+	SP_CircleList * outList = session->getOutList();
+	size_t outOffset = session->getOutOffset();
+
 	int iovSize = 0;
 
-	for( int i = 0; i < outList->getCount() && iovSize < SP_MAX_IOV; i++ ) {
+	for( int i = 0; i < outList->getCount() && iovSize < maxIov; i++ ) {
 		SP_Message * msg = (SP_Message*)outList->getItem( i );
 
 		if( outOffset >= msg->getMsg()->getSize() ) {
@@ -72,7 +85,7 @@ int SP_IOChannel :: transmit( SP_Session * session )
 		}
 
 		SP_MsgBlockList * blockList = msg->getFollowBlockList();
-		for( int j = 0; j < blockList->getCount() && iovSize < SP_MAX_IOV; j++ ) {
+		for( int j = 0; j < blockList->getCount() && iovSize < maxIov; j++ ) {
 			SP_MsgBlock * block = (SP_MsgBlock*)blockList->getItem( j );
 
 			if( outOffset >= block->getSize() ) {
@@ -85,38 +98,39 @@ int SP_IOChannel :: transmit( SP_Session * session )
 		}
 	}
 
-	int len = write_vec( iovArray, iovSize );
+	return iovSize;
+}
 
-	if( len > 0 ) {
-		outOffset = session->getOutOffset() + len;
+void SP_IOChannel :: onTransmit( SP_Session * session, int len )
+{
+#ifdef WIN32
+    SP_IocpSession_t * iocpSession = (SP_IocpSession_t*)session->getArg();
+    SP_IocpEventArg * eventArg = iocpSession->mEventArg;
+#else
+	SP_EventArg * eventArg = (SP_EventArg*)session->getArg();
+#endif
 
-		for( ; outList->getCount() > 0; ) {
-			SP_Message * msg = (SP_Message*)outList->getItem( 0 );
-			if( outOffset >= msg->getTotalSize() ) {
-				msg = (SP_Message*)outList->takeItem( 0 );
-				outOffset = outOffset - msg->getTotalSize();
+	SP_CircleList * outList = session->getOutList();
+	size_t outOffset = session->getOutOffset() + len;
 
-				int index = msg->getToList()->find( session->getSid() );
-				if( index >= 0 ) msg->getToList()->take( index );
-				msg->getSuccess()->add( session->getSid() );
+	for( ; outList->getCount() > 0; ) {
+		SP_Message * msg = (SP_Message*)outList->getItem( 0 );
+		if( outOffset >= msg->getTotalSize() ) {
+			msg = (SP_Message*)outList->takeItem( 0 );
+			outOffset = outOffset - msg->getTotalSize();
 
-				if( msg->getToList()->getCount() <= 0 ) {
-					eventArg->getOutputResultQueue()->push( msg );
-				}
-			} else {
-				break;
+			msg->getSuccess()->add( session->getSid() );
+
+			if( msg->addPending( -1 ) <= 0 ) {
+				msg->getToList()->reset();
+				eventArg->getOutputResultQueue()->push( msg );
 			}
+		} else {
+			break;
 		}
-
-		session->setOutOffset( outOffset );
-	}
-
-	if( len > 0 && outList->getCount() > 0 ) {
-		int tmpLen = transmit( session );
-		if( tmpLen > 0 ) len += tmpLen;
 	}
 
-	return len;
+	session->setOutOffset( outOffset );
 }
 
 //---------------------------------------------------------
@@ -149,7 +163,38 @@ int SP_DefaultIOChannel :: receive( SP_Session * session )
 #ifdef WIN32
 	return spwin32buffer_read( getEvBuffer( session->getInBuffer() ), mFd, -1 );
 #else
-	return evbuffer_read( getEvBuffer( session->getInBuffer() ), mFd, -1 );
+	// one readv into the free tail of the input buffer plus a chunk shared by
+	// the sessions of this event loop, instead of FIONREAD and a read of at
+	// most 4KB; an idle input buffer needs no space of its own
+	int chunkSize = 0;
+	char * chunk = ( (SP_EventArg*)session->getArg() )->getReadChunk( &chunkSize );
+	if( NULL == chunk ) return evbuffer_read( getEvBuffer( session->getInBuffer() ), mFd, -1 );
+
+	SP_Buffer * inBuffer = session->getInBuffer();
+
+	struct iovec iovArray[ 2 ];
+	int iovSize = 0, space = 0;
+
+	if( inBuffer->getCapacity() > 0 ) {
+		iovArray[ iovSize ].iov_base = inBuffer->getTailSpace( 0, &space );
+		iovArray[ iovSize++ ].iov_len = space;
+	}
+
+	iovArray[ iovSize ].iov_base = chunk;
+	iovArray[ iovSize++ ].iov_len = chunkSize;
+
+	int len = readv( mFd, iovArray, iovSize );
+
+	if( len > 0 ) {
+		if( len <= space ) {
+			inBuffer->commitTailSpace( len );
+		} else {
+			inBuffer->commitTailSpace( space );
+			if( inBuffer->append( chunk, len - space ) < 0 ) return -1;
+		}
+	}
+
+	return len;
 #endif
 }
 
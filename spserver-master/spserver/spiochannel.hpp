@@ -36,6 +36,12 @@ public:
 protected:
 	static sp_evbuffer_t * getEvBuffer( SP_Buffer * buffer );
 
+	// gather the pending output of the session, return the number of iovecs
+	static int fillIov( SP_Session * session, struct iovec * iovArray, int maxIov );
+
+	// len bytes of the pending output have been sent, release finished messages
+	static void onTransmit( SP_Session * session, int len );
+
 	// returns the number of bytes written, or -1 if an error occurred.
 	virtual int write_vec( struct iovec * iovArray, int iovSize ) = 0;
 };
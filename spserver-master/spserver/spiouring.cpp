@@ -0,0 +1,483 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "spporting.hpp"
+
+#include "spiouring.hpp"
+#include "spsession.hpp"
+#include "spbuffer.hpp"
+#include "sputils.hpp"
+
+#if defined( __linux__ ) && defined( __has_include )
+#	if __has_include( <linux/io_uring.h> )
+#		define SP_HAVE_IOURING
+#	endif
+#endif
+
+#ifdef SP_HAVE_IOURING
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "speventcb.hpp"
+#include "event.h"
+
+#ifdef IOV_MAX
+static const int SP_URING_MAX_IOV = IOV_MAX;
+#else
+static const int SP_URING_MAX_IOV = 8;
+#endif
+
+static const int SP_URING_ENTRIES = 256;
+
+// a ring per event-loop thread, the sends staged during a loop iteration
+// are submitted by one io_uring_enter after it, and the ring is empty
+// between iterations
+class SP_Uring {
+public:
+	// create : 0 : only return the ring already set up by this thread
+	static SP_Uring * getThreadRing( int create = 1 );
+
+	// close the ring of this thread, the sqes left in it are discarded,
+	// the next getThreadRing sets up a new one
+	static void dropThreadRing();
+
+	~SP_Uring();
+
+	struct io_uring_sqe * getSqe();
+
+	// submit all pending sqes and wait for count completions
+	// @return 0 : OK, -1 : failed or not all the sqes were taken
+	int submitAndWait( int count );
+
+	// @return 0 : OK, -1 : no more completion
+	int popCqe( struct io_uring_cqe * cqe );
+
+	SP_ArrayList * getStaged();
+
+private:
+	SP_Uring();
+
+	int init();
+
+	static void destroyRing( void * arg );
+	static void createKey();
+
+	static pthread_key_t mKey;
+	static pthread_once_t mOnce;
+
+	int mFd;
+	unsigned mPending;
+
+	void * mSqRing, * mCqRing;
+	size_t mSqRingSize, mCqRingSize;
+	struct io_uring_sqe * mSqes;
+	size_t mSqesSize;
+
+	unsigned * mSqHead, * mSqTail, * mSqMask, * mSqArray;
+	unsigned * mCqHead, * mCqTail, * mCqMask;
+	struct io_uring_cqe * mCqes;
+
+	SP_ArrayList * mStaged;
+};
+
+pthread_key_t SP_Uring :: mKey;
+pthread_once_t SP_Uring :: mOnce = PTHREAD_ONCE_INIT;
+
+SP_Uring :: SP_Uring()
+{
+	mFd = -1;
+	mPending = 0;
+	mSqRing = mCqRing = MAP_FAILED;
+	mSqes = (struct io_uring_sqe*)MAP_FAILED;
+	mSqRingSize = mCqRingSize = mSqesSize = 0;
+
+	mStaged = new SP_ArrayList( 64 );
+}
+
+SP_Uring :: ~SP_Uring()
+{
+	if( MAP_FAILED != (void*)mSqes ) munmap( mSqes, mSqesSize );
+	if( MAP_FAILED != mCqRing && mCqRing != mSqRing ) munmap( mCqRing, mCqRingSize );
+	if( MAP_FAILED != mSqRing ) munmap( mSqRing, mSqRingSize );
+	if( mFd >= 0 ) sp_close( mFd );
+
+	delete mStaged;
+	mStaged = NULL;
+}
+
+int SP_Uring :: init()
+{
+	struct io_uring_params params;
+	memset( &params, 0, sizeof( params ) );
+
+	mFd = (int)syscall( __NR_io_uring_setup, SP_URING_ENTRIES, &params );
+	if( mFd < 0 ) return -1;
+
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+
+	if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		if( mCqRingSize > mSqRingSize ) mSqRingSize = mCqRingSize;
+		mCqRingSize = mSqRingSize;
+	}
+
+	mSqRing = mmap( NULL, mSqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING );
+	if( MAP_FAILED == mSqRing ) return -1;
+
+	if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		mCqRing = mSqRing;
+	} else {
+		mCqRing = mmap( NULL, mCqRingSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING );
+		if( MAP_FAILED == mCqRing ) return -1;
+	}
+
+	mSqesSize = params.sq_entries * sizeof( struct io_uring_sqe );
+	mSqes = (struct io_uring_sqe*)mmap( NULL, mSqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES );
+	if( MAP_FAILED == (void*)mSqes ) return -1;
+
+	char * sq = (char*)mSqRing, * cq = (char*)mCqRing;
+
+	mSqHead = (unsigned*)( sq + params.sq_off.head );
+	mSqTail = (unsigned*)( sq + params.sq_off.tail );
+	mSqMask = (unsigned*)( sq + params.sq_off.ring_mask );
+	mSqArray = (unsigned*)( sq + params.sq_off.array );
+
+	mCqHead = (unsigned*)( cq + params.cq_off.head );
+	mCqTail = (unsigned*)( cq + params.cq_off.tail );
+	mCqMask = (unsigned*)( cq + params.cq_off.ring_mask );
+	mCqes = (struct io_uring_cqe*)( cq + params.cq_off.cqes );
+
+	return 0;
+}
+
+void SP_Uring :: destroyRing( void * arg )
+{
+	delete (SP_Uring*)arg;
+}
+
+void SP_Uring :: createKey()
+{
+	pthread_key_create( &mKey, destroyRing );
+}
+
+SP_Uring * SP_Uring :: getThreadRing( int create )
+{
+	pthread_once( &mOnce, createKey );
+
+	SP_Uring * ring = (SP_Uring*)pthread_getspecific( mKey );
+
+	if( NULL == ring && create ) {
+		ring = new SP_Uring();
+		if( 0 != ring->init() ) {
+			sp_syslog( LOG_WARNING, "io_uring setup failed, errno %d, %s", errno, strerror( errno ) );
+			delete ring;
+			return NULL;
+		}
+		pthread_setspecific( mKey, ring );
+	}
+
+	return ring;
+}
+
+void SP_Uring :: dropThreadRing()
+{
+	pthread_once( &mOnce, createKey );
+
+	SP_Uring * ring = (SP_Uring*)pthread_getspecific( mKey );
+
+	if( NULL != ring ) {
+		pthread_setspecific( mKey, NULL );
+		delete ring;
+	}
+}
+
+struct io_uring_sqe * SP_Uring :: getSqe()
+{
+	unsigned tail = *mSqTail + mPending;
+
+	if( tail - __atomic_load_n( mSqHead, __ATOMIC_ACQUIRE ) > *mSqMask ) return NULL;
+
+	unsigned index = tail & *mSqMask;
+	mSqArray[ index ] = index;
+	mPending++;
+
+	struct io_uring_sqe * sqe = &( mSqes[ index ] );
+	memset( sqe, 0, sizeof( *sqe ) );
+
+	return sqe;
+}
+
+int SP_Uring :: submitAndWait( int count )
+{
+	unsigned submit = mPending;
+
+	__atomic_store_n( mSqTail, *mSqTail + mPending, __ATOMIC_RELEASE );
+	mPending = 0;
+
+	// EINTR is only returned when nothing was taken
+	int ret = 0;
+	for( ; ; ) {
+		ret = (int)syscall( __NR_io_uring_enter, mFd, submit, count, IORING_ENTER_GETEVENTS, NULL, 0 );
+		if( ret >= 0 || EINTR != errno ) break;
+	}
+
+	if( ret >= 0 && ret < (int)submit ) {
+		errno = EAGAIN;
+		ret = -1;
+	}
+
+	return ret < 0 ? -1 : 0;
+}
+
+int SP_Uring :: popCqe( struct io_uring_cqe * cqe )
+{
+	unsigned head = *mCqHead;
+
+	if( head == __atomic_load_n( mCqTail, __ATOMIC_ACQUIRE ) ) return -1;
+
+	*cqe = mCqes[ head & *mCqMask ];
+	__atomic_store_n( mCqHead, head + 1, __ATOMIC_RELEASE );
+
+	return 0;
+}
+
+SP_ArrayList * SP_Uring :: getStaged()
+{
+	return mStaged;
+}
+
+//---------------------------------------------------------
+
+SP_UringIOChannel :: SP_UringIOChannel()
+{
+	mIovArray = NULL;
+	mState = eIdle;
+	mResult = 0;
+}
+
+SP_UringIOChannel :: ~SP_UringIOChannel()
+{
+	if( NULL != mIovArray ) free( mIovArray );
+	mIovArray = NULL;
+}
+
+int SP_UringIOChannel :: transmit( SP_Session * session )
+{
+	SP_Uring * ring = SP_Uring::getThreadRing();
+
+	if( NULL == ring ) return SP_IOChannel::transmit( session );
+
+	if( eDone == mState ) {
+		mState = eIdle;
+
+		if( mResult < 0 ) {
+			errno = -mResult;
+			return -1;
+		}
+
+		if( mResult > 0 ) onTransmit( session, mResult );
+
+		return mResult;
+	}
+
+	if( eIdle == mState ) {
+		if( NULL == mIovArray ) {
+			mIovArray = (struct iovec*)malloc( sizeof( struct iovec ) * SP_URING_MAX_IOV );
+			if( NULL == mIovArray ) return SP_IOChannel::transmit( session );
+		}
+
+		mState = eStaged;
+		ring->getStaged()->append( session );
+	}
+
+	// the send is submitted after this loop iteration
+	errno = EINPROGRESS;
+	return -1;
+}
+
+void SP_UringIOChannel :: flush()
+{
+	SP_Uring * ring = SP_Uring::getThreadRing( 0 );
+
+	if( NULL == ring || ring->getStaged()->getCount() <= 0 ) return;
+
+	SP_ArrayList * staged = ring->getStaged();
+
+	struct msghdr msgArray[ SP_URING_ENTRIES ];
+
+	int isBroken = 0;
+
+	for( int i = 0; i < staged->getCount(); ) {
+		int count = 0;
+
+		for( ; i < staged->getCount() && count < SP_URING_ENTRIES; i++ ) {
+			SP_Session * session = (SP_Session*)staged->getItem( i );
+			SP_UringIOChannel * channel = (SP_UringIOChannel*)session->getIOChannel();
+
+			// the session may be closed after the send was staged
+			int iovSize = fillIov( session, channel->mIovArray, SP_URING_MAX_IOV );
+			if( iovSize <= 0 ) {
+				channel->mState = eIdle;
+				continue;
+			}
+
+			struct msghdr * msg = &( msgArray[ count ] );
+			memset( msg, 0, sizeof( *msg ) );
+			msg->msg_iov = channel->mIovArray;
+			msg->msg_iovlen = iovSize;
+
+			struct io_uring_sqe * sqe = isBroken ? NULL : ring->getSqe();
+			if( NULL == sqe ) {
+				// no room in the ring, send it the plain way
+				int len = sendmsg( channel->mFd, msg, MSG_DONTWAIT | MSG_NOSIGNAL );
+				channel->mResult = len >= 0 ? len : -errno;
+				channel->mState = eDone;
+				continue;
+			}
+
+			// a writev would wait in the ring for a full socket
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = channel->mFd;
+			sqe->addr = (unsigned long)msg;
+			sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			sqe->user_data = (unsigned long)channel;
+
+			channel->mResult = -EIO;
+			channel->mState = eDone;
+			count++;
+		}
+
+		if( count <= 0 ) continue;
+
+		if( 0 != ring->submitAndWait( count ) ) {
+			// the sqes left in the ring point to msgArray, never submit them later
+			sp_syslog( LOG_WARNING, "io_uring submit failed, errno %d, %s", errno, strerror( errno ) );
+			isBroken = 1;
+		}
+
+		struct io_uring_cqe cqe;
+		for( ; count > 0 && 0 == ring->popCqe( &cqe ); count-- ) {
+			( (SP_UringIOChannel*)cqe.user_data )->mResult = cqe.res;
+		}
+	}
+
+	for( int i = 0; i < staged->getCount(); i++ ) {
+		SP_Session * session = (SP_Session*)staged->getItem( i );
+		SP_UringIOChannel * channel = (SP_UringIOChannel*)session->getIOChannel();
+
+		// a write event added since, such as by onResponse, delivers the result
+		if( eDone == channel->mState && 0 == session->getWriting() ) {
+			SP_EventCallback::onWrite( channel->mFd, EV_WRITE, session );
+		}
+	}
+
+	staged->clean();
+
+	if( isBroken ) SP_Uring::dropThreadRing();
+}
+
+//---------------------------------------------------------
+
+SP_UringIOChannelFactory :: SP_UringIOChannelFactory()
+{
+	if( ! isSupported() ) {
+		sp_syslog( LOG_NOTICE, "io_uring is not supported, use the default io channel" );
+	}
+}
+
+SP_UringIOChannelFactory :: ~SP_UringIOChannelFactory()
+{
+}
+
+SP_IOChannel * SP_UringIOChannelFactory :: create() const
+{
+	if( isSupported() ) return new SP_UringIOChannel();
+
+	return new SP_DefaultIOChannel();
+}
+
+int SP_UringIOChannelFactory :: isSupported()
+{
+	static int supported = -1;
+
+	if( supported < 0 ) {
+		int ret = 0;
+
+		SP_Uring * ring = SP_Uring::getThreadRing();
+		struct io_uring_sqe * sqe = NULL != ring ? ring->getSqe() : NULL;
+		if( NULL != sqe ) {
+			ret = 1;
+
+			// IORING_OP_SENDMSG needs linux 5.3
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = -1;
+
+			struct io_uring_cqe cqe;
+			if( 0 != ring->submitAndWait( 1 ) || 0 != ring->popCqe( &cqe )
+					|| -EINVAL == cqe.res ) {
+				ret = 0;
+			}
+		}
+
+		supported = ret;
+	}
+
+	return supported;
+}
+
+#else
+
+//---------------------------------------------------------
+
+SP_UringIOChannel :: SP_UringIOChannel()
+{
+	mIovArray = NULL;
+	mState = eIdle;
+	mResult = 0;
+}
+
+SP_UringIOChannel :: ~SP_UringIOChannel()
+{
+}
+
+int SP_UringIOChannel :: transmit( SP_Session * session )
+{
+	return SP_IOChannel::transmit( session );
+}
+
+void SP_UringIOChannel :: flush()
+{
+}
+
+SP_UringIOChannelFactory :: SP_UringIOChannelFactory()
+{
+}
+
+SP_UringIOChannelFactory :: ~SP_UringIOChannelFactory()
+{
+}
+
+SP_IOChannel * SP_UringIOChannelFactory :: create() const
+{
+	return new SP_DefaultIOChannel();
+}
+
+int SP_UringIOChannelFactory :: isSupported()
+{
+	return 0;
+}
+
+#endif
+
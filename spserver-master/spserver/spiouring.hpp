@@ -0,0 +1,53 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spiouring_hpp__
+#define __spiouring_hpp__
+
+#include "spiochannel.hpp"
+
+class SP_Uring;
+
+/**
+ * @brief io_uring channel, transmit only stages the session, the sends of all
+ *        the sessions staged during a loop iteration go in one io_uring_enter
+ *        by flush, which hands each result to onWrite; receive is the readv
+ *        of SP_DefaultIOChannel. Falls back to SP_DefaultIOChannel when no
+ *        ring can be set up
+ */
+class SP_UringIOChannel : public SP_DefaultIOChannel {
+public:
+	SP_UringIOChannel();
+	~SP_UringIOChannel();
+
+	/// -1 with errno EINPROGRESS when staged, the bytes sent by the last
+	/// flush when called with its result
+	virtual int transmit( SP_Session * session );
+
+	/// call by the event-loop thread after each loop iteration
+	static void flush();
+
+private:
+	enum { eIdle, eStaged, eDone };
+
+	struct iovec * mIovArray;
+	int mState, mResult;
+};
+
+class SP_UringIOChannelFactory : public SP_IOChannelFactory {
+public:
+	SP_UringIOChannelFactory();
+	virtual ~SP_UringIOChannelFactory();
+
+	/// SP_DefaultIOChannel if io_uring is not supported
+	virtual SP_IOChannel * create() const;
+
+	/// probe the kernel once, io_uring may be missing or disabled
+	/// @return 1 : supported, 0 : not supported
+	static int isSupported();
+};
+
+#endif
+
@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
@@ -63,7 +64,8 @@ int SP_IOUtils :: setBlock( int fd )
 	return 0;
 }
 
-int SP_IOUtils :: tcpListen( const char * ip, int port, int * fd, int blocking )
+int SP_IOUtils :: tcpListen( const char * ip, int port, int * fd, int blocking,
+		int reusePort )
 {
 	int ret = 0;
 
@@ -90,6 +92,12 @@ int SP_IOUtils :: tcpListen( const char * ip, int port, int * fd, int blocking )
 			sp_syslog( LOG_WARNING, "failed to set socket to nodelay" );
 			ret = -1;
 		}
+#ifdef SO_REUSEPORT
+		if( reusePort && setsockopt( listenFd, SOL_SOCKET, SO_REUSEPORT, (char*)&flags, sizeof( flags ) ) < 0 ) {
+			sp_syslog( LOG_WARNING, "failed to set socket to reuseport" );
+			ret = -1;
+		}
+#endif
 	}
 
 	struct sockaddr_in addr;
@@ -132,6 +140,88 @@ int SP_IOUtils :: tcpListen( const char * ip, int port, int * fd, int blocking )
 	return ret;
 }
 
+int SP_IOUtils :: udpBind( const char * ip, int port, int * fd, int blocking,
+		int reusePort )
+{
+	int ret = 0;
+
+	int udpFd = socket( AF_INET, SOCK_DGRAM, 0 );
+	if( udpFd < 0 ) {
+		sp_syslog( LOG_WARNING, "socket failed, errno %d, %s", errno, strerror( errno ) );
+		ret = -1;
+	}
+
+	if( 0 == ret && 0 == blocking ) {
+		if( setNonblock( udpFd ) < 0 ) {
+			sp_syslog( LOG_WARNING, "failed to set socket to non-blocking" );
+			ret = -1;
+		}
+	}
+
+	if( 0 == ret ) {
+		int flags = 1;
+		if( setsockopt( udpFd, SOL_SOCKET, SO_REUSEADDR, (char*)&flags, sizeof( flags ) ) < 0 ) {
+			sp_syslog( LOG_WARNING, "failed to set setsock to reuseaddr" );
+			ret = -1;
+		}
+#ifdef SO_REUSEPORT
+		if( reusePort && setsockopt( udpFd, SOL_SOCKET, SO_REUSEPORT, (char*)&flags, sizeof( flags ) ) < 0 ) {
+			sp_syslog( LOG_WARNING, "failed to set socket to reuseport" );
+			ret = -1;
+		}
+#endif
+	}
+
+	struct sockaddr_in addr;
+
+	if( 0 == ret ) {
+		memset( &addr, 0, sizeof( addr ) );
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons( port );
+
+		addr.sin_addr.s_addr = INADDR_ANY;
+		if( '\0' != *ip ) {
+			if( 0 == sp_inet_aton( ip, &addr.sin_addr ) ) {
+				sp_syslog( LOG_WARNING, "failed to convert %s to inet_addr", ip );
+				ret = -1;
+			}
+		}
+	}
+
+	if( 0 == ret ) {
+		if( bind( udpFd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 ) {
+			sp_syslog( LOG_WARNING, "bind failed, errno %d, %s", errno, strerror( errno ) );
+			ret = -1;
+		}
+	}
+
+	if( 0 != ret && udpFd >= 0 ) sp_close( udpFd );
+
+	if( 0 == ret ) {
+		* fd = udpFd;
+		sp_syslog( LOG_NOTICE, "Bind on udp port [%d]", port );
+	}
+
+	return ret;
+}
+
+int SP_IOUtils :: setIncomingCpu( int fd, int cpu )
+{
+	int ret = -1;
+
+#ifdef SO_INCOMING_CPU
+	ret = setsockopt( fd, SOL_SOCKET, SO_INCOMING_CPU, (char*)&cpu, sizeof( cpu ) );
+	if( ret < 0 ) {
+		sp_syslog( LOG_WARNING, "failed to set incoming cpu %d, errno %d, %s",
+				cpu, errno, strerror( errno ) );
+	}
+#else
+	sp_syslog( LOG_WARNING, "SO_INCOMING_CPU is not supported, ignore cpu %d", cpu );
+#endif
+
+	return ret;
+}
+
 int SP_IOUtils :: tcpListen( const char * path, int * fd, int blocking, int mode )
 {
 	int ret = 0;
@@ -211,10 +301,111 @@ int SP_IOUtils :: tcpListen( const char * path, int * fd, int blocking, int mode
 	return ret;
 }
 
+int SP_IOUtils :: sendFds( int sock, const char * msg, int len, const int * fds, int count )
+{
+	int ret = -1;
+
+#ifndef WIN32
+
+	struct iovec iov;
+	iov.iov_base = (void*)msg;
+	iov.iov_len = len;
+
+	char control[ CMSG_SPACE( sizeof( int ) * 16 ) ];
+	memset( control, 0, sizeof( control ) );
+
+	if( count > 16 ) count = 16;
+
+	struct msghdr hdr;
+	memset( &hdr, 0, sizeof( hdr ) );
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	if( count > 0 ) {
+		hdr.msg_control = control;
+		hdr.msg_controllen = CMSG_SPACE( sizeof( int ) * count );
+
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR( &hdr );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN( sizeof( int ) * count );
+		memcpy( CMSG_DATA( cmsg ), fds, sizeof( int ) * count );
+	}
+
+	for( ; ; ) {
+		ret = sendmsg( sock, &hdr, 0 );
+		if( ret >= 0 || EINTR != errno ) break;
+	}
+
+	if( ret < 0 ) {
+		sp_syslog( LOG_WARNING, "sendmsg fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+#endif
+
+	return ret;
+}
+
+int SP_IOUtils :: recvFds( int sock, char * msg, int len, int * fds, int * count )
+{
+	int ret = -1;
+
+#ifndef WIN32
+
+	struct iovec iov;
+	iov.iov_base = msg;
+	iov.iov_len = len;
+
+	char control[ CMSG_SPACE( sizeof( int ) * 16 ) ];
+	memset( control, 0, sizeof( control ) );
+
+	struct msghdr hdr;
+	memset( &hdr, 0, sizeof( hdr ) );
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof( control );
+
+	for( ; ; ) {
+		ret = recvmsg( sock, &hdr, 0 );
+		if( ret >= 0 || EINTR != errno ) break;
+	}
+
+	int room = * count;
+	* count = 0;
+
+	if( ret >= 0 ) {
+		for( struct cmsghdr * cmsg = CMSG_FIRSTHDR( &hdr ); NULL != cmsg;
+				cmsg = CMSG_NXTHDR( &hdr, cmsg ) ) {
+			if( SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type ) continue;
+
+			int * list = (int*)CMSG_DATA( cmsg );
+			int n = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+			for( int i = 0; i < n; i++ ) {
+				// no room for it, do not leak it
+				if( * count < room ) {
+					fds[ ( * count )++ ] = list[ i ];
+				} else {
+					sp_close( list[ i ] );
+				}
+			}
+		}
+	} else {
+		sp_syslog( LOG_WARNING, "recvmsg fail, errno %d, %s", errno, strerror( errno ) );
+	}
+
+#endif
+
+	return ret;
+}
+
 int SP_IOUtils :: initDaemon( const char * workdir )
 {
 #ifndef WIN32
 
+	// started by a hot restart, the old copy is a daemon already
+	if( NULL != getenv( "SP_RESTART_FD" ) ) return 0;
+
 	int		i;
 	pid_t	pid;
 
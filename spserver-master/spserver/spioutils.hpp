@@ -16,12 +16,37 @@ public:
 
 	static int setBlock( int fd );
 
-	static int tcpListen( const char * ip, int port, int * fd, int blocking = 1 );
+	/// @param reusePort : 1 : SO_REUSEPORT, several listeners share one port
+	static int tcpListen( const char * ip, int port, int * fd, int blocking = 1,
+			int reusePort = 0 );
+
+	/// bind a datagram socket, reusePort as tcpListen
+	static int udpBind( const char * ip, int port, int * fd, int blocking = 1,
+			int reusePort = 0 );
+
+	/**
+	 * @brief SO_INCOMING_CPU, among SO_REUSEPORT listeners the kernel prefers
+	 *        the one whose cpu handles the RX queue of the connection
+	 * @return 0 : OK, -1 : failed or not supported
+	 */
+	static int setIncomingCpu( int fd, int cpu );
 
 	static int initDaemon( const char * workdir = 0 );
 
 	static int tcpListen( const char * path, int * fd, int blocking = 1, int mode = 0666 );
 
+	/**
+	 * @brief pass fds with a short message over a connected unix socket (SCM_RIGHTS)
+	 * @return bytes of msg sent, -1 : failed
+	 */
+	static int sendFds( int sock, const char * msg, int len, const int * fds, int count );
+
+	/**
+	 * @param count : in, room of fds; out, fds received
+	 * @return bytes of msg received, 0 : peer closed, -1 : failed
+	 */
+	static int recvFds( int sock, char * msg, int len, int * fds, int * count );
+
 private:
 	SP_IOUtils();
 };
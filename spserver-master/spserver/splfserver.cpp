@@ -16,12 +16,34 @@
 #include "spthreadpool.hpp"
 #include "sphandler.hpp"
 #include "spexecutor.hpp"
+#include "spsession.hpp"
 #include "sputils.hpp"
 #include "spioutils.hpp"
 #include "spiochannel.hpp"
+#include "spiouring.hpp"
+#include "sprestart.hpp"
 
 #include "event_msgqueue.h"
 
+// finished messages handed to the completion handler at once
+static const int SP_LF_COMPLETION_BATCH = 64;
+
+// one event base of the base per thread mode, with the sessions it accepted
+typedef struct tagSP_LFBaseArg {
+	SP_LFServer * mServer;
+	int mIndex;
+
+	SP_EventArg * mEventArg;
+	SP_AcceptArg_t * mAcceptArg;
+
+	struct event mEvAccept;
+	struct event mEvWakeup;
+	int mIsAccepting;
+
+	// set by the base itself when it stopped accepting and has no session
+	volatile int mIsDrained;
+} SP_LFBaseArg_t;
+
 SP_LFServer :: SP_LFServer( const char * bindIP, int port, SP_HandlerFactory * handlerFactory )
 {
 	snprintf( mBindIP, sizeof( mBindIP ), "%s", bindIP );
@@ -38,6 +60,7 @@ SP_LFServer :: SP_LFServer( const char * bindIP, int port, SP_HandlerFactory * h
 	mAcceptArg->mMaxConnections = 256;
 	mAcceptArg->mReqQueueSize = 128;
 	mAcceptArg->mRefusedMsg = strdup( "System busy, try again later." );
+	mAcceptArg->mAcceptBatch = 32;
 	mAcceptArg->mHandlerFactory = handlerFactory;
 
 	mAcceptArg->mEventArg = mEventArg;
@@ -45,10 +68,18 @@ SP_LFServer :: SP_LFServer( const char * bindIP, int port, SP_HandlerFactory * h
 	mThreadPool = NULL;
 
 	mEvAccept = mEvSigTerm = mEvSigInt = NULL;
+	mEvSigUsr2 = mEvRestart = NULL;
+	mListenFD = -1;
+	mIsListenFdGiven = 0;
+
+	mBasePerThread = 0;
+	mIsDraining = 0;
+	mBaseArgs = NULL;
 
 	mCompletionHandler = NULL;
 
 	sp_thread_mutex_init( &mMutex, NULL );
+	sp_thread_mutex_init( &mCompletionMutex, NULL );
 }
 
 SP_LFServer :: ~SP_LFServer()
@@ -61,10 +92,43 @@ SP_LFServer :: ~SP_LFServer()
 	if( NULL != mCompletionHandler ) delete mCompletionHandler;
 	mCompletionHandler = NULL;
 
-	event_del( mEvAccept );
+	if( NULL != mBaseArgs ) {
+		for( int i = 0; i < mMaxThreads; i++ ) {
+			SP_LFBaseArg_t * baseArg = &( mBaseArgs[i] );
+
+			if( baseArg->mIsAccepting ) event_del( &( baseArg->mEvAccept ) );
+			evtimer_del( &( baseArg->mEvWakeup ) );
+
+			// the first one is mEventArg and mAcceptArg
+			if( i > 0 ) {
+				delete baseArg->mEventArg;
+				free( baseArg->mAcceptArg );
+			}
+		}
+		free( mBaseArgs );
+		mBaseArgs = NULL;
+	}
+
+	if( mListenFD >= 0 ) {
+		if( NULL != mEvAccept ) event_del( mEvAccept );
+		SP_HotRestart::removeListener( mListenFD );
+		sp_close( mListenFD );
+	}
 	free( mEvAccept );
 	mEvAccept = NULL;
 
+	if( NULL != mEvSigUsr2 ) {
+		signal_del( mEvSigUsr2 );
+		free( mEvSigUsr2 );
+		mEvSigUsr2 = NULL;
+	}
+
+	if( NULL != mEvRestart ) {
+		evtimer_del( mEvRestart );
+		free( mEvRestart );
+		mEvRestart = NULL;
+	}
+
 	signal_del( mEvSigTerm );
 	free( mEvSigTerm );
 	mEvSigTerm = NULL;
@@ -83,6 +147,7 @@ SP_LFServer :: ~SP_LFServer()
 	mEventArg = NULL;
 
 	sp_thread_mutex_destroy( &mMutex );
+	sp_thread_mutex_destroy( &mCompletionMutex );
 }
 
 void SP_LFServer :: setTimeout( int timeout )
@@ -115,6 +180,48 @@ void SP_LFServer :: setIOChannelFactory( SP_IOChannelFactory * ioChannelFactory
 	mAcceptArg->mIOChannelFactory = ioChannelFactory;
 }
 
+void SP_LFServer :: setAcceptBatch( int acceptBatch )
+{
+	mAcceptArg->mAcceptBatch = acceptBatch > 0 ?
+			acceptBatch : mAcceptArg->mAcceptBatch;
+}
+
+void SP_LFServer :: setBatchSize( int batchSize )
+{
+	mEventArg->setBatchSize( batchSize );
+}
+
+void SP_LFServer :: setLaneMode( int laneMode )
+{
+	mEventArg->setLaneMode( laneMode );
+}
+
+void SP_LFServer :: setOutputWatermarks( int highWatermark, int lowWatermark, int policy )
+{
+	mEventArg->setOutputWatermarks( highWatermark, lowWatermark, policy );
+}
+
+void SP_LFServer :: setOutputBudget( int budget )
+{
+	mEventArg->setOutputBudget( budget );
+}
+
+void SP_LFServer :: setTopicRegistry( SP_TopicRegistry * topicRegistry )
+{
+	mEventArg->setTopicRegistry( topicRegistry );
+}
+
+void SP_LFServer :: setListenFd( int listenFd )
+{
+	mListenFD = listenFd;
+	mIsListenFdGiven = 1;
+}
+
+void SP_LFServer :: setBasePerThread( int basePerThread )
+{
+	mBasePerThread = basePerThread;
+}
+
 void SP_LFServer :: shutdown()
 {
 	mIsShutdown = 1;
@@ -131,6 +238,101 @@ void SP_LFServer :: sigHandler( int, short, void * arg )
 	server->shutdown();
 }
 
+void SP_LFServer :: restartHandler( int, short, void * arg )
+{
+	SP_HotRestart::restart();
+}
+
+void SP_LFServer :: wakeupTimer( int, short, void * arg )
+{
+	// only wake up the loop, the progress of a restart or a shutdown is checked after it
+	struct timeval tv = { 1, 0 };
+	evtimer_add( (struct event*)arg, &tv );
+}
+
+void SP_LFServer :: checkRestart()
+{
+	if( SP_HotRestart::eDraining != SP_HotRestart::check() ) return;
+
+	// the new copy accepts on the same socket from now on
+	if( mListenFD >= 0 ) {
+		event_del( mEvAccept );
+		SP_HotRestart::removeListener( mListenFD );
+		sp_close( mListenFD );
+		mListenFD = -1;
+
+		sp_syslog( LOG_NOTICE, "Stop listening on port [%d], drain %d sessions",
+				mPort, mEventArg->getSessionManager()->getCount() );
+	}
+
+	if( 0 == mEventArg->getSessionManager()->getCount() || SP_HotRestart::isExpired() ) {
+		shutdown();
+	}
+}
+
+void SP_LFServer :: checkDrain( SP_LFBaseArg_t * baseArg )
+{
+	// only the first thread polls the new copy
+	if( 0 == baseArg->mIndex && 0 == sp_atomic_add( &mIsDraining, 0 )
+			&& SP_HotRestart::eDraining == SP_HotRestart::check() ) {
+		SP_HotRestart::removeListener( mListenFD );
+		sp_atomic_add( &mIsDraining, 1 );
+
+		sp_syslog( LOG_NOTICE, "Stop listening on port [%d], drain the sessions", mPort );
+	}
+
+	if( 0 == sp_atomic_add( &mIsDraining, 0 ) ) return;
+
+	// the new copy accepts on the same socket from now on,
+	// it is closed when all the bases have stopped
+	if( baseArg->mIsAccepting ) {
+		event_del( &( baseArg->mEvAccept ) );
+		baseArg->mIsAccepting = 0;
+	}
+
+	// no session is accepted any more, so the count only goes down,
+	// every base reports its own and the first one collects them
+	if( 0 == baseArg->mIsDrained
+			&& 0 == baseArg->mEventArg->getSessionManager()->getCount() ) {
+		sp_atomic_add( &( baseArg->mIsDrained ), 1 );
+	}
+
+	if( 0 == baseArg->mIndex ) {
+		int drained = 0;
+		for( int i = 0; i < mMaxThreads; i++ ) {
+			drained += sp_atomic_add( &( mBaseArgs[i].mIsDrained ), 0 );
+		}
+
+		if( drained >= mMaxThreads || SP_HotRestart::isExpired() ) shutdown();
+	}
+}
+
+void SP_LFServer :: baseHandler( void * arg )
+{
+	SP_LFBaseArg_t * baseArg = (SP_LFBaseArg_t*)arg;
+	SP_LFServer * server = baseArg->mServer;
+	SP_EventArg * eventArg = baseArg->mEventArg;
+
+	// no other thread touches this base, so the tasks run right after the poll
+	for( ; 0 == server->mIsShutdown; ) {
+		event_base_loop( eventArg->getEventBase(), EVLOOP_ONCE );
+		SP_UringIOChannel::flush();
+
+		if( NULL != server->mEvRestart ) server->checkDrain( baseArg );
+
+		for( ; NULL != eventArg->getInputResultQueue()->top(); ) {
+			SP_Task * task = (SP_Task*)eventArg->getInputResultQueue()->pop();
+			task->run();
+		}
+
+		SP_Message * msgs[ SP_LF_COMPLETION_BATCH ];
+		for( int count = SP_LF_COMPLETION_BATCH; count >= SP_LF_COMPLETION_BATCH; ) {
+			count = eventArg->getOutputResultQueue()->drain( (void**)msgs, SP_LF_COMPLETION_BATCH );
+			if( count > 0 ) server->complete( msgs, count );
+		}
+	}
+}
+
 void SP_LFServer :: lfHandler( void * arg )
 {
 	SP_LFServer * server = (SP_LFServer*)arg;
@@ -143,19 +345,23 @@ void SP_LFServer :: lfHandler( void * arg )
 void SP_LFServer :: handleOneEvent()
 {
 	SP_Task * task = NULL;
-	SP_Message * msg = NULL;
+	SP_Message * msgs[ SP_LF_COMPLETION_BATCH ];
+	int count = 0;
 
 	sp_thread_mutex_lock( &mMutex );
 
-	for( ; 0 == mIsShutdown && NULL == task && NULL == msg; ) {
+	for( ; 0 == mIsShutdown && NULL == task && 0 == count; ) {
 		if( mEventArg->getInputResultQueue()->getLength() > 0 ) {
 			task = (SP_Task*)mEventArg->getInputResultQueue()->pop();
-		} else if( mEventArg->getOutputResultQueue()->getLength() > 0 ) {
-			msg = (SP_Message*)mEventArg->getOutputResultQueue()->pop();
+		} else {
+			count = mEventArg->getOutputResultQueue()->drain( (void**)msgs, SP_LF_COMPLETION_BATCH );
 		}
 
-		if( NULL == task && NULL == msg ) {
+		if( NULL == task && 0 == count ) {
 			event_base_loop( mEventArg->getEventBase(), EVLOOP_ONCE );
+			SP_UringIOChannel::flush();
+
+			if( NULL != mEvRestart ) checkRestart();
 		}
 	}
 
@@ -163,7 +369,18 @@ void SP_LFServer :: handleOneEvent()
 
 	if( NULL != task ) task->run();
 
-	if( NULL != msg ) mCompletionHandler->completionMessage( msg );
+	if( count > 0 ) complete( msgs, count );
+}
+
+void SP_LFServer :: complete( SP_Message ** msgs, int count )
+{
+	if( mCompletionHandler->isThreadSafe() ) {
+		mCompletionHandler->completionMessages( msgs, count );
+	} else {
+		sp_thread_mutex_lock( &mCompletionMutex );
+		mCompletionHandler->completionMessages( msgs, count );
+		sp_thread_mutex_unlock( &mCompletionMutex );
+	}
 }
 
 int SP_LFServer :: run()
@@ -176,9 +393,18 @@ int SP_LFServer :: run()
 	int ret = 0;
 	int listenFD = -1;
 
-	ret = SP_IOUtils::tcpListen( mBindIP, mPort, &listenFD, 0 );
+	if( mIsListenFdGiven ) {
+		listenFD = mListenFD;
+		ret = SP_IOUtils::setNonblock( listenFD ) < 0 ? -1 : 0;
+	} else {
+		listenFD = SP_HotRestart::takeListener( mBindIP, mPort );
+		if( listenFD < 0 ) ret = SP_IOUtils::tcpListen( mBindIP, mPort, &listenFD, 0 );
+	}
 
 	if( 0 == ret ) {
+		mListenFD = listenFD;
+		if( ! mIsListenFdGiven ) SP_HotRestart::addListener( mBindIP, mPort, listenFD );
+
 		// Clean close on SIGINT or SIGTERM.
 		mEvSigInt = (struct event*)malloc( sizeof( struct event ) );
 		signal_set( mEvSigInt, SIGINT, sigHandler, this );
@@ -190,11 +416,19 @@ int SP_LFServer :: run()
 		event_base_set( mEventArg->getEventBase(), mEvSigTerm );
 		signal_add( mEvSigTerm, NULL);
 
-		mEvAccept = (struct event*)malloc( sizeof( struct event ) );
-		event_set( mEvAccept, listenFD, EV_READ|EV_PERSIST,
-				SP_EventCallback::onAccept, mAcceptArg );
-		event_base_set( mEventArg->getEventBase(), mEvAccept );
-		event_add( mEvAccept, NULL );
+		// Hot restart on SIGUSR2.
+		if( SP_HotRestart::isEnabled() ) {
+			mEvSigUsr2 = (struct event*)malloc( sizeof( struct event ) );
+			signal_set( mEvSigUsr2, SIGUSR2, restartHandler, this );
+			event_base_set( mEventArg->getEventBase(), mEvSigUsr2 );
+			signal_add( mEvSigUsr2, NULL );
+
+			struct timeval tv = { 1, 0 };
+			mEvRestart = (struct event*)malloc( sizeof( struct event ) );
+			evtimer_set( mEvRestart, wakeupTimer, mEvRestart );
+			event_base_set( mEventArg->getEventBase(), mEvRestart );
+			evtimer_add( mEvRestart, &tv );
+		}
 
 		mCompletionHandler = mAcceptArg->mHandlerFactory->createCompletionHandler();
 
@@ -203,17 +437,77 @@ int SP_LFServer :: run()
 		}
 
 		mThreadPool = new SP_ThreadPool( mMaxThreads );
-		for( int i = 0; i < mMaxThreads; i++ ) {
-			mThreadPool->dispatch( lfHandler, this );
+
+		if( mBasePerThread ) {
+			startBases( listenFD );
+		} else {
+			mEvAccept = (struct event*)malloc( sizeof( struct event ) );
+			SP_EventCallback::setAcceptEvent( mEvAccept, listenFD, mAcceptArg, mBindIP );
+			event_add( mEvAccept, NULL );
+
+			for( int i = 0; i < mMaxThreads; i++ ) {
+				mThreadPool->dispatch( lfHandler, this );
+			}
 		}
 	}
 
 	return ret;
 }
 
+void SP_LFServer :: startBases( int listenFD )
+{
+	// the connections and the output are limited per base
+	int maxConnections = ( mAcceptArg->mMaxConnections + mMaxThreads - 1 ) / mMaxThreads;
+	int outputBudget = ( mEventArg->getOutputBudget() + mMaxThreads - 1 ) / mMaxThreads;
+
+	mBaseArgs = (SP_LFBaseArg_t*)calloc( mMaxThreads, sizeof( SP_LFBaseArg_t ) );
+
+	for( int i = 0; i < mMaxThreads; i++ ) {
+		SP_LFBaseArg_t * baseArg = &( mBaseArgs[i] );
+
+		baseArg->mServer = this;
+		baseArg->mIndex = i;
+
+		// the first base is the one with the signal events
+		if( 0 == i ) {
+			baseArg->mEventArg = mEventArg;
+			baseArg->mAcceptArg = mAcceptArg;
+		} else {
+			baseArg->mEventArg = new SP_EventArg( mEventArg->getTimeout() );
+			baseArg->mEventArg->setBatchSize( mEventArg->getBatchSize() );
+			baseArg->mEventArg->setLaneMode( mEventArg->getLaneMode() );
+			baseArg->mEventArg->setOutputWatermarks( mEventArg->getHighWatermark(),
+					mEventArg->getLowWatermark(), mEventArg->getOutputPolicy() );
+			baseArg->mEventArg->setTopicRegistry( mEventArg->getTopicRegistry() );
+
+			baseArg->mAcceptArg = (SP_AcceptArg_t*)malloc( sizeof( SP_AcceptArg_t ) );
+			memcpy( baseArg->mAcceptArg, mAcceptArg, sizeof( SP_AcceptArg_t ) );
+			baseArg->mAcceptArg->mEventArg = baseArg->mEventArg;
+		}
+		baseArg->mAcceptArg->mMaxConnections = maxConnections;
+		baseArg->mEventArg->setOutputBudget( outputBudget );
+
+		SP_EventCallback::setAcceptEvent( &( baseArg->mEvAccept ), listenFD,
+				baseArg->mAcceptArg, mBindIP );
+		event_add( &( baseArg->mEvAccept ), NULL );
+		baseArg->mIsAccepting = 1;
+
+		// a base may have no events, wake it up to see a shutdown
+		struct timeval tv = { 1, 0 };
+		evtimer_set( &( baseArg->mEvWakeup ), wakeupTimer, &( baseArg->mEvWakeup ) );
+		event_base_set( baseArg->mEventArg->getEventBase(), &( baseArg->mEvWakeup ) );
+		evtimer_add( &( baseArg->mEvWakeup ), &tv );
+	}
+
+	for( int i = 0; i < mMaxThreads; i++ ) {
+		mThreadPool->dispatch( baseHandler, &( mBaseArgs[i] ) );
+	}
+}
+
 void SP_LFServer :: runForever()
 {
-	run();
-	pause();
+	if( 0 == run() ) {
+		for( ; 0 == mIsShutdown; ) sleep( 1 );
+	}
 }
 
@@ -13,8 +13,11 @@ class SP_ThreadPool;
 class SP_HandlerFactory;
 class SP_CompletionHandler;
 class SP_IOChannelFactory;
+class SP_Message;
+class SP_TopicRegistry;
 
 typedef struct tagSP_AcceptArg SP_AcceptArg_t;
+typedef struct tagSP_LFBaseArg SP_LFBaseArg_t;
 
 struct event;
 
@@ -30,6 +33,41 @@ public:
 	void setReqQueueSize( int reqQueueSize, const char * refusedMsg );
 	void setIOChannelFactory( SP_IOChannelFactory * ioChannelFactory );
 
+	/// accept at most acceptBatch connections per wakeup, default is 32
+	void setAcceptBatch( int acceptBatch );
+
+	/// a worker handles up to batchSize buffered requests into one response
+	void setBatchSize( int batchSize );
+
+	/**
+	 * @brief see SP_Server::setLaneMode, a session has one lane worker at a
+	 *        time, which handles its requests in order on the thread that
+	 *        took it; with a base per thread that is the thread of the base
+	 */
+	void setLaneMode( int laneMode );
+
+	/// see SP_Server::setOutputWatermarks and SP_OutputPolicy,
+	/// with a base per thread the budget is divided over the bases
+	void setOutputWatermarks( int highWatermark, int lowWatermark, int policy );
+	void setOutputBudget( int budget );
+
+	/// see SP_Server::setTopicRegistry
+	void setTopicRegistry( SP_TopicRegistry * topicRegistry );
+
+	/// accept on a socket which is already listening instead of binding ip:port
+	void setListenFd( int listenFd );
+
+	/**
+	 * @brief 1 : every thread runs its own event base with the sessions it
+	 *        accepted, instead of taking turns on the shared one under the
+	 *        leader mutex. A response only reaches the sessions of the thread
+	 *        which handled the request, so handlers which send to other
+	 *        sessions, such as chat, should keep the default 0.
+	 *        All the bases watch the listener, setAcceptBatch( 1 ) spreads
+	 *        a burst of connections more evenly over the threads.
+	 */
+	void setBasePerThread( int basePerThread );
+
 	void shutdown();
 	int isRunning();
 
@@ -55,14 +93,41 @@ private:
 
 	struct event * mEvAccept;
 	struct event * mEvSigInt, * mEvSigTerm;
+	struct event * mEvSigUsr2, * mEvRestart;
+	int mListenFD;
+	int mIsListenFdGiven;
+
+	int mBasePerThread;
+
+	// set once by the first base, read by all of them with sp_atomic_add
+	volatile int mIsDraining;
+	SP_LFBaseArg_t * mBaseArgs;
 
 	sp_thread_mutex_t mMutex;
 
+	// serialize the completion handler unless it is thread-safe
+	sp_thread_mutex_t mCompletionMutex;
+
 	void handleOneEvent();
 
+	void complete( SP_Message ** msgs, int count );
+
+	// stop accepting and shutdown when drained, called by the leader
+	void checkRestart();
+
+	// the same for one of the per-thread bases
+	void checkDrain( SP_LFBaseArg_t * baseArg );
+
+	// one event base and accept event per thread, then start the threads
+	void startBases( int listenFD );
+
 	static void lfHandler( void * arg );
 
+	static void baseHandler( void * arg );
+
 	static void sigHandler( int, short, void * arg );
+	static void restartHandler( int, short, void * arg );
+	static void wakeupTimer( int, short, void * arg );
 };
 
 #endif
@@ -35,8 +35,7 @@ int SP_DefaultMsgDecoder :: decode( SP_Buffer * inBuffer )
 {
 	if( inBuffer->getSize() > 0 ) {
 		mBuffer->reset();
-		mBuffer->append( inBuffer );
-		inBuffer->reset();
+		mBuffer->swap( inBuffer );
 
 		return eOK;
 	}
@@ -294,3 +293,202 @@ char * SP_DotTermChunkMsgDecoder :: getMsg()
 	return ret;
 }
 
+//-------------------------------------------------------------------
+
+SP_DotTermStreamMsgDecoder :: SP_DotTermStreamMsgDecoder( int chunkSize )
+{
+	mChunkSize = chunkSize > 0 ? chunkSize : DEFAULT_CHUNK_SIZE;
+	mChunk = new SP_Buffer();
+
+	mIsLast = 0;
+	mIsReady = 0;
+	mLineStart = 1;
+}
+
+SP_DotTermStreamMsgDecoder :: ~SP_DotTermStreamMsgDecoder()
+{
+	delete mChunk, mChunk = NULL;
+}
+
+int SP_DotTermStreamMsgDecoder :: decode( SP_Buffer * inBuffer )
+{
+	if( mIsReady ) {
+		mChunk->reset();
+		mIsReady = 0;
+	}
+
+	if( mIsLast ) return eMoreData;
+
+	for( ; inBuffer->getSize() > 0; ) {
+		const char * data = (char*)inBuffer->getRawBuffer();
+		int size = inBuffer->getSize();
+
+		const char * eol = (char*)memchr( data, '\n', size );
+
+		int len = size;
+		if( NULL != eol ) {
+			len = eol - data + 1;
+		} else if( size < mChunkSize ) {
+			// wait for the whole line, it may be the <CRLF>.<CRLF>
+			break;
+		}
+
+		int skip = 0;
+		if( mLineStart && '.' == data[0] ) {
+			if( NULL != eol && ( 2 == len || ( 3 == len && '\r' == data[1] ) ) ) {
+				inBuffer->erase( len );
+				mIsLast = 1;
+				mIsReady = 1;
+				return eOK;
+			}
+			skip = 1;
+		}
+
+		mChunk->append( data + skip, len - skip );
+		inBuffer->erase( len );
+
+		mLineStart = ( NULL != eol );
+
+		if( (int)mChunk->getSize() >= mChunkSize ) {
+			mIsReady = 1;
+			return eOK;
+		}
+	}
+
+	return eMoreData;
+}
+
+SP_Buffer * SP_DotTermStreamMsgDecoder :: getChunk()
+{
+	return mChunk;
+}
+
+int SP_DotTermStreamMsgDecoder :: isLast()
+{
+	return mIsLast;
+}
+
+//-------------------------------------------------------------------
+
+SP_FrameMsgDecoder :: SP_FrameMsgDecoder( int maxFrameSize )
+{
+	mMaxFrameSize = maxFrameSize > 0 ? maxFrameSize : DEFAULT_MAX_FRAME_SIZE;
+	mError = 0;
+
+	mBuffer = new SP_Buffer();
+
+	mMaxCount = 64;
+	mFrames = (int*)malloc( sizeof( int ) * 2 * mMaxCount );
+	mCount = 0;
+}
+
+SP_FrameMsgDecoder :: ~SP_FrameMsgDecoder()
+{
+	delete mBuffer, mBuffer = NULL;
+
+	free( mFrames ), mFrames = NULL;
+}
+
+static inline unsigned int sp_frame_length( const unsigned char * pos )
+{
+	return ( (unsigned int)pos[0] << 24 ) | ( (unsigned int)pos[1] << 16 )
+			| ( (unsigned int)pos[2] << 8 ) | (unsigned int)pos[3];
+}
+
+int SP_FrameMsgDecoder :: decode( SP_Buffer * inBuffer )
+{
+	mCount = 0;
+	mError = 0;
+
+	size_t size = inBuffer->getSize();
+	if( size < HEADER_SIZE ) return eMoreData;
+
+	const unsigned char * data = (unsigned char*)inBuffer->getRawBuffer();
+
+	// the usual case of a large frame, only part of the first frame is here
+	unsigned int len = sp_frame_length( data );
+	if( len > (unsigned int)mMaxFrameSize ) {
+		mError = -1;
+		inBuffer->reset();
+		return eOK;
+	}
+	if( HEADER_SIZE + len > size ) {
+		// grow once for the whole frame, instead of with every read
+		inBuffer->reserve( HEADER_SIZE + len );
+		return eMoreData;
+	}
+
+	size_t pos = 0;
+
+	for( ; pos + HEADER_SIZE <= size; ) {
+		len = sp_frame_length( data + pos );
+
+		// stop here, reported by the next decode
+		if( len > (unsigned int)mMaxFrameSize ) break;
+		if( pos + HEADER_SIZE + len > size ) break;
+
+		if( mCount >= mMaxCount ) {
+			mMaxCount = mMaxCount * 2;
+			mFrames = (int*)realloc( mFrames, sizeof( int ) * 2 * mMaxCount );
+		}
+
+		mFrames[ 2 * mCount ] = pos + HEADER_SIZE;
+		mFrames[ 2 * mCount + 1 ] = len;
+		mCount++;
+
+		pos += HEADER_SIZE + len;
+	}
+
+	mBuffer->reset();
+
+	// copy the smaller side, the complete frames or the incomplete one at the end
+	if( pos >= size - pos ) {
+		mBuffer->swap( inBuffer );
+		if( pos < size ) {
+			inBuffer->append( (char*)mBuffer->getRawBuffer() + pos, size - pos );
+			mBuffer->truncate( pos );
+		}
+	} else {
+		mBuffer->append( data, pos );
+		inBuffer->erase( pos );
+	}
+
+	if( size - pos >= HEADER_SIZE ) {
+		len = sp_frame_length( (unsigned char*)inBuffer->getRawBuffer() );
+		if( len <= (unsigned int)mMaxFrameSize ) inBuffer->reserve( HEADER_SIZE + len );
+	}
+
+	return eOK;
+}
+
+int SP_FrameMsgDecoder :: getCount()
+{
+	return mCount;
+}
+
+const char * SP_FrameMsgDecoder :: getFrame( int index, int * len )
+{
+	if( index < 0 || index >= mCount ) return NULL;
+
+	if( NULL != len ) *len = mFrames[ 2 * index + 1 ];
+
+	return (char*)mBuffer->getRawBuffer() + mFrames[ 2 * index ];
+}
+
+int SP_FrameMsgDecoder :: getError()
+{
+	return mError;
+}
+
+void SP_FrameMsgDecoder :: appendFrame( SP_Buffer * buffer, const void * data, int len )
+{
+	unsigned char header[ HEADER_SIZE ] = { 0 };
+	header[0] = ( len >> 24 ) & 0xff;
+	header[1] = ( len >> 16 ) & 0xff;
+	header[2] = ( len >> 8 ) & 0xff;
+	header[3] = len & 0xff;
+
+	buffer->append( header, HEADER_SIZE );
+	if( len > 0 ) buffer->append( data, len );
+}
+
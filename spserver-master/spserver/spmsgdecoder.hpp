@@ -96,5 +96,76 @@ private:
 	SP_ArrayList * mList;
 };
 
+/**
+ * @brief the data before <CRLF>.<CRLF> in dot-unstuffed chunks, so a large
+ *        message can be spooled without being held in memory
+ */
+class SP_DotTermStreamMsgDecoder : public SP_MsgDecoder {
+public:
+	enum { DEFAULT_CHUNK_SIZE = 1024 * 64 };
+
+public:
+	SP_DotTermStreamMsgDecoder( int chunkSize = DEFAULT_CHUNK_SIZE );
+	virtual ~SP_DotTermStreamMsgDecoder();
+
+	// return SP_MsgDecoder::eOK when a chunk is full or <CRLF>.<CRLF> is met
+	virtual int decode( SP_Buffer * inBuffer );
+
+	// the lines of the chunk keep their CRLF, valid until the next decode
+	SP_Buffer * getChunk();
+
+	// 1 : <CRLF>.<CRLF> is met, this is the last chunk
+	int isLast();
+
+private:
+	int mChunkSize;
+	SP_Buffer * mChunk;
+
+	int mIsLast;
+	int mIsReady;
+
+	// the next byte starts a line
+	int mLineStart;
+};
+
+/**
+ * @brief 4-byte big-endian length prefixed frames, all the complete frames
+ *        of the input are decoded at once into views over one buffer, which
+ *        is swapped out of the input, so no complete frame is copied
+ */
+class SP_FrameMsgDecoder : public SP_MsgDecoder {
+public:
+	enum { HEADER_SIZE = 4, DEFAULT_MAX_FRAME_SIZE = 1024 * 1024 * 16 };
+
+public:
+	SP_FrameMsgDecoder( int maxFrameSize = DEFAULT_MAX_FRAME_SIZE );
+	virtual ~SP_FrameMsgDecoder();
+
+	// return SP_MsgDecoder::eMoreData until a frame is complete,
+	// a frame over maxFrameSize also returns eOK, check getError
+	virtual int decode( SP_Buffer * inBuffer );
+
+	int getCount();
+
+	// return the frame without the length prefix, valid until the next decode
+	const char * getFrame( int index, int * len );
+
+	// 0 : OK, -1 : a frame is over maxFrameSize, the input is dropped
+	int getError();
+
+	// append the length prefix and data to buffer, such as a reply
+	static void appendFrame( SP_Buffer * buffer, const void * data, int len );
+
+private:
+	int mMaxFrameSize;
+	int mError;
+
+	SP_Buffer * mBuffer;
+
+	// [ 2 * i ] : offset in mBuffer, [ 2 * i + 1 ] : length
+	int * mFrames;
+	int mCount, mMaxCount;
+};
+
 #endif
 
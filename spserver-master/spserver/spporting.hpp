@@ -36,6 +36,9 @@
 #define sp_socketpair   socketpair
 #define sp_gettimeofday gettimeofday
 
+// add to an int shared by threads, return the new value
+#define sp_atomic_add( ptr, n ) __sync_add_and_fetch( ( ptr ), ( n ) )
+
 inline int sp_initsock()
 {
 	return 0;
@@ -4,6 +4,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "spresponse.hpp"
 #include "spbuffer.hpp"
@@ -12,67 +13,146 @@
 
 //-------------------------------------------------------------------
 
+SP_SidSnapshot :: SP_SidSnapshot( const SP_Sid_t * sids, int count )
+{
+	mRefCount = 1;
+	mCount = count;
+	mSids = (SP_Sid_t*)malloc( sizeof( SP_Sid_t ) * ( count > 0 ? count : 1 ) );
+	if( count > 0 ) memcpy( mSids, sids, sizeof( SP_Sid_t ) * count );
+}
+
+SP_SidSnapshot :: ~SP_SidSnapshot()
+{
+	free( mSids );
+	mSids = NULL;
+}
+
+void SP_SidSnapshot :: addRef()
+{
+	sp_atomic_add( &mRefCount, 1 );
+}
+
+void SP_SidSnapshot :: release()
+{
+	if( 0 == sp_atomic_add( &mRefCount, -1 ) ) delete this;
+}
+
+int SP_SidSnapshot :: getCount() const
+{
+	return mCount;
+}
+
+const SP_Sid_t * SP_SidSnapshot :: getSids() const
+{
+	return mSids;
+}
+
+//-------------------------------------------------------------------
+
 SP_SidList :: SP_SidList()
 {
-	mList = new SP_ArrayList();
+	mSids = NULL;
+	mCount = mMaxCount = 0;
+	mShared = NULL;
 }
 
 SP_SidList :: ~SP_SidList()
 {
-	for( int i = 0; i < mList->getCount(); i++ ) {
-		free( (void*)mList->getItem( i ) );
-	}
+	reset();
 
-	delete mList;
-	mList = NULL;
+	if( NULL != mSids ) free( mSids );
+	mSids = NULL;
 }
 
 void SP_SidList :: reset()
 {
-	for( ; mList->getCount() > 0; ) {
-		free( (void*)mList->takeItem( SP_ArrayList::LAST_INDEX ) );
+	if( NULL != mShared ) {
+		mShared->release();
+		mShared = NULL;
+		mSids = NULL;
+		mMaxCount = 0;
 	}
+
+	mCount = 0;
+}
+
+void SP_SidList :: detach()
+{
+	if( NULL == mShared ) return;
+
+	const SP_Sid_t * sids = mShared->getSids();
+
+	mMaxCount = mCount > 2 ? mCount : 2;
+	mSids = (SP_Sid_t*)malloc( sizeof( SP_Sid_t ) * mMaxCount );
+	memcpy( mSids, sids, sizeof( SP_Sid_t ) * mCount );
+
+	mShared->release();
+	mShared = NULL;
+}
+
+void SP_SidList :: share( SP_SidSnapshot * snapshot )
+{
+	reset();
+
+	if( NULL != mSids ) free( mSids );
+
+	snapshot->addRef();
+	mShared = snapshot;
+	mSids = (SP_Sid_t*)snapshot->getSids();
+	mCount = snapshot->getCount();
+	mMaxCount = 0;
 }
 
 int SP_SidList :: getCount() const
 {
-	return mList->getCount();
+	return mCount;
 }
 
 void SP_SidList :: add( SP_Sid_t sid )
 {
-	SP_Sid_t * p = (SP_Sid_t*)malloc( sizeof( SP_Sid_t ) );
-	*p = sid;
+	detach();
 
-	mList->append( p );
+	if( mCount >= mMaxCount ) {
+		mMaxCount = ( mMaxCount * 3 ) / 2 + 2;
+		mSids = (SP_Sid_t*)realloc( mSids, sizeof( SP_Sid_t ) * mMaxCount );
+	}
+
+	mSids[ mCount++ ] = sid;
 }
 
 SP_Sid_t SP_SidList :: get( int index ) const
 {
 	SP_Sid_t ret = { 0, 0 };
 
-	SP_Sid_t * p = (SP_Sid_t*)mList->getItem( index );
-	if( NULL != p ) ret = *p;
+	if( SP_ArrayList::LAST_INDEX == index ) index = mCount - 1;
+	if( index >= 0 && index < mCount ) ret = mSids[ index ];
 
 	return ret;
 }
 
 SP_Sid_t SP_SidList :: take( int index )
 {
-	SP_Sid_t ret = get( index );
+	SP_Sid_t ret = { 0, 0 };
+
+	if( SP_ArrayList::LAST_INDEX == index ) index = mCount - 1;
+	if( index < 0 || index >= mCount ) return ret;
 
-	void * p = mList->takeItem( index );
-	if( NULL != p ) free( p );
+	detach();
+
+	ret = mSids[ index ];
+
+	mCount--;
+	if( index < mCount ) {
+		memmove( mSids + index, mSids + index + 1, ( mCount - index ) * sizeof( SP_Sid_t ) );
+	}
 
 	return ret;
 }
 
 int SP_SidList :: find( SP_Sid_t sid ) const
 {
-	for( int i = 0; i < mList->getCount(); i++ ) {
-		SP_Sid_t * p = (SP_Sid_t*)mList->getItem( i );
-
-		if( p->mKey == sid.mKey && p->mSeq == sid.mSeq ) return i;
+	for( int i = 0; i < mCount; i++ ) {
+		if( mSids[i].mKey == sid.mKey && mSids[i].mSeq == sid.mSeq ) return i;
 	}
 
 	return -1;
@@ -88,6 +168,8 @@ SP_Message :: SP_Message( int completionKey )
 	mFollowBlockList = NULL;
 
 	mToList = mSuccess = mFailure = NULL;
+
+	mPending = 0;
 }
 
 SP_Message :: ~SP_Message()
@@ -119,6 +201,8 @@ void SP_Message :: reset()
 	if( NULL != mSuccess ) mSuccess->reset();
 
 	if( NULL != mFailure ) mFailure->reset();
+
+	mPending = 0;
 }
 
 SP_SidList * SP_Message :: getToList()
@@ -176,6 +260,17 @@ int SP_Message :: getCompletionKey()
 	return mCompletionKey;
 }
 
+int SP_Message :: addPending( int count )
+{
+	// the sessions of a message may be written by several threads
+	return sp_atomic_add( &mPending, count );
+}
+
+int SP_Message :: getPending()
+{
+	return mPending;
+}
+
 //-------------------------------------------------------------------
 
 SP_Response :: SP_Response( SP_Sid_t fromSid )
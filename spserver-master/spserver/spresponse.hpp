@@ -28,6 +28,30 @@ typedef struct tagSP_Sid {
 	};
 } SP_Sid_t;
 
+// an immutable array of sids, shared by reference, see SP_SidList::share
+class SP_SidSnapshot {
+public:
+	// copy the sids, the snapshot has one reference
+	SP_SidSnapshot( const SP_Sid_t * sids, int count );
+
+	void addRef();
+
+	// delete the snapshot with the last reference
+	void release();
+
+	int getCount() const;
+	const SP_Sid_t * getSids() const;
+
+private:
+	SP_SidSnapshot( SP_SidSnapshot & );
+	SP_SidSnapshot & operator=( SP_SidSnapshot & );
+	~SP_SidSnapshot();
+
+	volatile int mRefCount;
+	int mCount;
+	SP_Sid_t * mSids;
+};
+
 class SP_SidList {
 public:
 	SP_SidList();
@@ -42,11 +66,23 @@ public:
 
 	int find( SP_Sid_t sid ) const;
 
+	/**
+	 * @brief replace the content with the sids of a snapshot, by reference;
+	 *        they are copied only when the list is changed later
+	 */
+	void share( SP_SidSnapshot * snapshot );
+
 private:
 	SP_SidList( SP_SidList & );
 	SP_SidList & operator=( SP_SidList & );
 
-	SP_ArrayList * mList;
+	// copy the shared sids before a change
+	void detach();
+
+	SP_Sid_t * mSids;
+	int mCount, mMaxCount;
+
+	SP_SidSnapshot * mShared;
 };
 
 class SP_Message {
@@ -69,6 +105,14 @@ public:
 	void setCompletionKey( int completionKey );
 	int getCompletionKey();
 
+	/**
+	 * @brief the event loop counts the sessions the message is queued to,
+	 *        the to-list is left as it is until all of them are done
+	 * @return the count after the change
+	 */
+	int addPending( int count );
+	int getPending();
+
 private:
 	SP_Message( SP_Message & );
 	SP_Message & operator=( SP_Message & );
@@ -81,6 +125,7 @@ private:
 	SP_SidList * mFailure;
 
 	int mCompletionKey;
+	volatile int mPending;
 };
 
 class SP_Response {
@@ -0,0 +1,355 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/wait.h>
+
+#include "spporting.hpp"
+
+#include "sprestart.hpp"
+#include "spioutils.hpp"
+#include "spthread.hpp"
+
+extern char ** environ;
+
+static const int SP_RESTART_MAX_LISTENERS = 64;
+
+// the fd of the unix socket in the new copy
+static const int SP_RESTART_FD = 3;
+
+typedef struct tagSP_RestartListener {
+	char mName[ 96 ];
+	int mFd;
+} SP_RestartListener_t;
+
+typedef struct tagSP_RestartState {
+	int mIsEnabled;
+	char ** mArgv;
+	char mPath[ PATH_MAX ];
+	int mDrainTimeout;
+
+	sp_thread_mutex_t mMutex;
+
+	// to the old copy, -1 after ready
+	int mParentSock;
+	int mIsRestarted;
+	SP_RestartListener_t mInherited[ SP_RESTART_MAX_LISTENERS ];
+	int mInheritedCount;
+
+	SP_RestartListener_t mListeners[ SP_RESTART_MAX_LISTENERS ];
+	int mListenerCount;
+
+	// to the new copy
+	int mState;
+	int mChildSock;
+	pid_t mChildPid;
+	time_t mDeadline;
+} SP_RestartState_t;
+
+static SP_RestartState_t gRestart = { 0 };
+
+// the PATH search of execvp, which the child cannot do after fork
+static int searchPath( const char * name, char * path, int size )
+{
+	const char * dirs = getenv( "PATH" );
+	if( NULL == dirs ) dirs = "/usr/bin:/bin";
+
+	for( const char * pos = dirs; ; ) {
+		const char * end = strchr( pos, ':' );
+		int len = NULL == end ? (int)strlen( pos ) : (int)( end - pos );
+
+		// an empty entry is the working directory
+		if( 0 == len ) {
+			snprintf( path, size, "%s", name );
+		} else {
+			snprintf( path, size, "%.*s/%s", len, pos, name );
+		}
+		if( 0 == access( path, X_OK ) ) return 0;
+
+		if( NULL == end ) break;
+		pos = end + 1;
+	}
+
+	snprintf( path, size, "%s", name );
+
+	return -1;
+}
+
+int SP_HotRestart :: init( int argc, char * argv[], int drainTimeout )
+{
+	if( gRestart.mIsEnabled ) return 0;
+
+	sp_thread_mutex_init( &gRestart.mMutex, NULL );
+
+	gRestart.mArgv = argv;
+	gRestart.mDrainTimeout = drainTimeout > 0 ? drainTimeout : 30;
+	gRestart.mParentSock = -1;
+	gRestart.mChildSock = -1;
+	gRestart.mState = eIdle;
+
+	// initDaemon may change the working directory
+	if( NULL == strchr( argv[0], '/' ) ) {
+		if( 0 != searchPath( argv[0], gRestart.mPath, sizeof( gRestart.mPath ) ) ) {
+			sp_syslog( LOG_WARNING, "restart: %s is not found in PATH", argv[0] );
+		}
+	} else if( NULL == realpath( argv[0], gRestart.mPath ) ) {
+		snprintf( gRestart.mPath, sizeof( gRestart.mPath ), "%s", argv[0] );
+	}
+
+	gRestart.mIsEnabled = 1;
+
+	const char * env = getenv( "SP_RESTART_FD" );
+	if( NULL == env ) return 0;
+
+	gRestart.mIsRestarted = 1;
+	gRestart.mParentSock = atoi( env );
+
+	for( ; gRestart.mInheritedCount < SP_RESTART_MAX_LISTENERS; ) {
+		SP_RestartListener_t * listener = &( gRestart.mInherited[ gRestart.mInheritedCount ] );
+
+		int count = 1;
+		int len = SP_IOUtils::recvFds( gRestart.mParentSock, listener->mName,
+				sizeof( listener->mName ) - 1, &( listener->mFd ), &count );
+		if( len <= 0 ) break;
+
+		listener->mName[ len ] = '\0';
+		if( 0 == count ) break;
+
+		gRestart.mInheritedCount++;
+	}
+
+	sp_syslog( LOG_NOTICE, "restart: take over %d listeners from pid %d",
+			gRestart.mInheritedCount, (int)getppid() );
+
+	if( 0 == gRestart.mInheritedCount ) ready();
+
+	return 0;
+}
+
+int SP_HotRestart :: isEnabled()
+{
+	return gRestart.mIsEnabled;
+}
+
+int SP_HotRestart :: isRestarted()
+{
+	return gRestart.mIsRestarted;
+}
+
+int SP_HotRestart :: takeListener( const char * ip, int port )
+{
+	if( ! gRestart.mIsEnabled ) return -1;
+
+	char name[ 96 ] = { 0 };
+	snprintf( name, sizeof( name ), "%s:%d", ip, port );
+
+	int fd = -1, isLast = 0;
+
+	sp_thread_mutex_lock( &gRestart.mMutex );
+
+	for( int i = 0; i < gRestart.mInheritedCount; i++ ) {
+		if( 0 == strcmp( gRestart.mInherited[i].mName, name ) ) {
+			fd = gRestart.mInherited[i].mFd;
+			gRestart.mInherited[i] = gRestart.mInherited[ --gRestart.mInheritedCount ];
+			isLast = ( 0 == gRestart.mInheritedCount );
+			break;
+		}
+	}
+
+	sp_thread_mutex_unlock( &gRestart.mMutex );
+
+	if( fd >= 0 ) sp_syslog( LOG_NOTICE, "restart: listen on [%s] by fd %d", name, fd );
+
+	if( isLast ) ready();
+
+	return fd;
+}
+
+void SP_HotRestart :: ready()
+{
+	if( ! gRestart.mIsEnabled ) return;
+
+	sp_thread_mutex_lock( &gRestart.mMutex );
+
+	if( gRestart.mParentSock >= 0 ) {
+		SP_IOUtils::sendFds( gRestart.mParentSock, "ready", 5, NULL, 0 );
+		sp_close( gRestart.mParentSock );
+		gRestart.mParentSock = -1;
+	}
+
+	for( int i = 0; i < gRestart.mInheritedCount; i++ ) {
+		sp_syslog( LOG_NOTICE, "restart: [%s] is not used, close it",
+				gRestart.mInherited[i].mName );
+		sp_close( gRestart.mInherited[i].mFd );
+	}
+	gRestart.mInheritedCount = 0;
+
+	sp_thread_mutex_unlock( &gRestart.mMutex );
+}
+
+void SP_HotRestart :: addListener( const char * ip, int port, int fd )
+{
+	if( ! gRestart.mIsEnabled ) return;
+
+	sp_thread_mutex_lock( &gRestart.mMutex );
+
+	if( gRestart.mListenerCount < SP_RESTART_MAX_LISTENERS ) {
+		SP_RestartListener_t * listener = &( gRestart.mListeners[ gRestart.mListenerCount++ ] );
+		snprintf( listener->mName, sizeof( listener->mName ), "%s:%d", ip, port );
+		listener->mFd = fd;
+	}
+
+	sp_thread_mutex_unlock( &gRestart.mMutex );
+}
+
+void SP_HotRestart :: removeListener( int fd )
+{
+	if( ! gRestart.mIsEnabled ) return;
+
+	sp_thread_mutex_lock( &gRestart.mMutex );
+
+	for( int i = 0; i < gRestart.mListenerCount; i++ ) {
+		if( fd == gRestart.mListeners[i].mFd ) {
+			gRestart.mListeners[i] = gRestart.mListeners[ --gRestart.mListenerCount ];
+			break;
+		}
+	}
+
+	sp_thread_mutex_unlock( &gRestart.mMutex );
+}
+
+int SP_HotRestart :: restart()
+{
+	if( ! gRestart.mIsEnabled ) return -1;
+
+	int ret = -1;
+
+	sp_thread_mutex_lock( &gRestart.mMutex );
+
+	int socks[ 2 ] = { -1, -1 };
+
+	int envCount = 0;
+	for( ; NULL != environ[ envCount ]; ) envCount++;
+
+	// the child only calls dup2, close, execve and _exit, which are
+	// async-signal-safe, so the path and the environment are prepared here
+	char ** envp = NULL;
+
+	if( eIdle != gRestart.mState ) {
+		sp_syslog( LOG_WARNING, "restart: already in progress" );
+	} else if( 0 != access( gRestart.mPath, X_OK ) ) {
+		sp_syslog( LOG_WARNING, "restart: cannot execute %s, errno %d, %s",
+				gRestart.mPath, errno, strerror( errno ) );
+	} else if( NULL == ( envp = (char**)malloc( sizeof( char * ) * ( envCount + 2 ) ) ) ) {
+		sp_syslog( LOG_WARNING, "restart: out of memory for %d environment variables", envCount );
+	} else if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, socks ) < 0 ) {
+		sp_syslog( LOG_WARNING, "restart: socketpair fail, errno %d, %s",
+				errno, strerror( errno ) );
+	} else {
+		int n = 0;
+		for( int i = 0; i < envCount; i++ ) {
+			if( 0 != strncmp( environ[i], "SP_RESTART_FD=", 14 ) ) envp[ n++ ] = environ[i];
+		}
+		char fdEnv[ 32 ] = { 0 };
+		snprintf( fdEnv, sizeof( fdEnv ), "SP_RESTART_FD=%d", SP_RESTART_FD );
+		envp[ n++ ] = fdEnv;
+		envp[ n ] = NULL;
+
+		int maxFd = (int)sysconf( _SC_OPEN_MAX );
+		if( maxFd <= 0 ) maxFd = 1024;
+
+		pid_t pid = fork();
+
+		if( 0 == pid ) {
+			// the sessions must not stay open in the new copy
+			dup2( socks[1], SP_RESTART_FD );
+			for( int fd = SP_RESTART_FD + 1; fd < maxFd; fd++ ) close( fd );
+
+			execve( gRestart.mPath, gRestart.mArgv, envp );
+			_exit( 127 );
+		}
+
+		sp_close( socks[1] );
+
+		if( pid < 0 ) {
+			sp_syslog( LOG_WARNING, "restart: fork fail, errno %d, %s", errno, strerror( errno ) );
+			sp_close( socks[0] );
+		} else {
+			for( int i = 0; i < gRestart.mListenerCount; i++ ) {
+				SP_RestartListener_t * listener = &( gRestart.mListeners[i] );
+				SP_IOUtils::sendFds( socks[0], listener->mName, strlen( listener->mName ),
+						&( listener->mFd ), 1 );
+			}
+			SP_IOUtils::sendFds( socks[0], "end", 3, NULL, 0 );
+
+			SP_IOUtils::setNonblock( socks[0] );
+
+			gRestart.mChildSock = socks[0];
+			gRestart.mChildPid = pid;
+			gRestart.mState = eSpawned;
+
+			sp_syslog( LOG_NOTICE, "restart: pass %d listeners to pid %d",
+					gRestart.mListenerCount, (int)pid );
+
+			ret = 0;
+		}
+	}
+
+	free( envp );
+
+	sp_thread_mutex_unlock( &gRestart.mMutex );
+
+	return ret;
+}
+
+int SP_HotRestart :: check()
+{
+	if( ! gRestart.mIsEnabled ) return eIdle;
+
+	sp_thread_mutex_lock( &gRestart.mMutex );
+
+	if( eSpawned == gRestart.mState ) {
+		char buffer[ 16 ] = { 0 };
+		int len = recv( gRestart.mChildSock, buffer, sizeof( buffer ), 0 );
+
+		if( len > 0 ) {
+			gRestart.mState = eDraining;
+			gRestart.mDeadline = time( NULL ) + gRestart.mDrainTimeout;
+
+			sp_syslog( LOG_NOTICE, "restart: pid %d is ready, drain in %d seconds",
+					(int)gRestart.mChildPid, gRestart.mDrainTimeout );
+		} else if( 0 == len || ( EAGAIN != errno && EINTR != errno ) ) {
+			int status = 0;
+			waitpid( gRestart.mChildPid, &status, WNOHANG );
+
+			gRestart.mState = eIdle;
+
+			sp_syslog( LOG_WARNING, "restart: pid %d failed, keep running",
+					(int)gRestart.mChildPid );
+		}
+
+		if( eSpawned != gRestart.mState ) {
+			sp_close( gRestart.mChildSock );
+			gRestart.mChildSock = -1;
+		}
+	}
+
+	int state = gRestart.mState;
+
+	sp_thread_mutex_unlock( &gRestart.mMutex );
+
+	return state;
+}
+
+int SP_HotRestart :: isExpired()
+{
+	return eDraining == gRestart.mState && time( NULL ) >= gRestart.mDeadline;
+}
+
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __sprestart_hpp__
+#define __sprestart_hpp__
+
+/**
+ * @brief zero-downtime restart, on SIGUSR2 the servers fork and exec a new
+ *        copy of the program and pass their listening sockets to it over a
+ *        unix socket (SCM_RIGHTS). The new copy takes the sockets instead of
+ *        binding the ports again, so no connection is refused. When it has
+ *        taken them, the old copy stops accepting, drains the sessions until
+ *        they are done or the drain timeout, and then exits.
+ *
+ *        Only enabled after init is called, SP_Server and SP_LFServer use it.
+ */
+class SP_HotRestart {
+public:
+	enum { eIdle, eSpawned, eDraining };
+
+	/**
+	 * @brief call it first in main, argv is kept to exec the new copy,
+	 *        argv[0] is resolved by PATH here when it has no '/',
+	 *        and the listeners passed by the old copy are received
+	 * @param drainTimeout : seconds to wait for the sessions of the old copy
+	 */
+	static int init( int argc, char * argv[], int drainTimeout = 30 );
+
+	static int isEnabled();
+
+	/// 1 : started by a restart
+	static int isRestarted();
+
+	/// return a listener of ip:port passed by the old copy, -1 : none
+	static int takeListener( const char * ip, int port );
+
+	/**
+	 * @brief tell the old copy to stop accepting, done by takeListener when
+	 *        the last listener is taken, the listeners not taken are closed
+	 */
+	static void ready();
+
+	/// listeners to pass to the new copy
+	static void addListener( const char * ip, int port, int fd );
+	static void removeListener( int fd );
+
+	/// fork and exec the new copy, return 0 : spawned, -1 : failed or busy
+	static int restart();
+
+	/// poll the new copy, return eIdle, eSpawned or eDraining
+	static int check();
+
+	/// 1 : the drain timeout is over
+	static int isExpired();
+
+private:
+	SP_HotRestart();
+};
+
+#endif
+
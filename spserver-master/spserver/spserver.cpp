@@ -18,7 +18,10 @@
 #include "spexecutor.hpp"
 #include "sputils.hpp"
 #include "spiochannel.hpp"
+#include "spiouring.hpp"
 #include "spioutils.hpp"
+#include "spthreadpool.hpp"
+#include "sprestart.hpp"
 
 #include "event_msgqueue.h"
 
@@ -38,6 +41,19 @@ SP_Server :: SP_Server( const char * bindIP, int port,
 	mReqQueueSize = 128;
 	mMaxConnections = 256;
 	mRefusedMsg = strdup( "System busy, try again later." );
+	mLaneMode = 0;
+	mBatchSize = 1;
+	mHighWatermark = mLowWatermark = 0;
+	mOutputPolicy = SP_OutputPolicy::eDrop;
+	mOutputBudget = 0;
+	mTopicRegistry = NULL;
+	mAcceptBatch = 32;
+	mMinThreads = 0;
+	mThreadCount = mTargetThreads = 0;
+	mReactorCpus = NULL;
+	mWorkerCpus = NULL;
+	mIncomingCpu = -1;
+	mListenFd = -1;
 }
 
 SP_Server :: ~SP_Server()
@@ -50,6 +66,12 @@ SP_Server :: ~SP_Server()
 
 	if( NULL != mRefusedMsg ) free( mRefusedMsg );
 	mRefusedMsg = NULL;
+
+	if( NULL != mReactorCpus ) free( mReactorCpus );
+	mReactorCpus = NULL;
+
+	if( NULL != mWorkerCpus ) free( mWorkerCpus );
+	mWorkerCpus = NULL;
 }
 
 void SP_Server :: setIOChannelFactory( SP_IOChannelFactory * ioChannelFactory )
@@ -80,6 +102,78 @@ void SP_Server :: setReqQueueSize( int reqQueueSize, const char * refusedMsg )
 	mRefusedMsg = strdup( refusedMsg );
 }
 
+void SP_Server :: setAcceptBatch( int acceptBatch )
+{
+	mAcceptBatch = acceptBatch > 0 ? acceptBatch : mAcceptBatch;
+}
+
+void SP_Server :: setLaneMode( int laneMode )
+{
+	mLaneMode = laneMode;
+}
+
+void SP_Server :: setBatchSize( int batchSize )
+{
+	mBatchSize = batchSize;
+}
+
+void SP_Server :: setOutputWatermarks( int highWatermark, int lowWatermark, int policy )
+{
+	mHighWatermark = highWatermark;
+	mLowWatermark = lowWatermark;
+	mOutputPolicy = policy;
+}
+
+void SP_Server :: setOutputBudget( int budget )
+{
+	mOutputBudget = budget;
+}
+
+void SP_Server :: setTopicRegistry( SP_TopicRegistry * topicRegistry )
+{
+	mTopicRegistry = topicRegistry;
+}
+
+void SP_Server :: setAdaptiveThreads( int minThreads, int maxThreads )
+{
+	setMaxThreads( maxThreads );
+	mMinThreads = minThreads > 0 ? minThreads : 1;
+	if( mMinThreads > mMaxThreads ) mMinThreads = mMaxThreads;
+}
+
+int SP_Server :: getThreadCount()
+{
+	// written by the event loop
+	return sp_atomic_add( &mThreadCount, 0 );
+}
+
+int SP_Server :: getTargetThreads()
+{
+	return sp_atomic_add( &mTargetThreads, 0 );
+}
+
+void SP_Server :: setReactorCpus( const char * cpuList )
+{
+	if( NULL != mReactorCpus ) free( mReactorCpus );
+	mReactorCpus = NULL != cpuList ? strdup( cpuList ) : NULL;
+}
+
+void SP_Server :: setWorkerCpus( const char * cpuList )
+{
+	if( NULL != mWorkerCpus ) free( mWorkerCpus );
+	mWorkerCpus = NULL != cpuList ? strdup( cpuList ) : NULL;
+}
+
+void SP_Server :: setIncomingCpu( int cpu )
+{
+	mIncomingCpu = cpu;
+}
+
+void SP_Server :: setListenFd( int listenFd )
+{
+	mListenFd = listenFd;
+}
+
 void SP_Server :: shutdown()
 {
 	mIsShutdown = 1;
@@ -137,14 +231,17 @@ void SP_Server :: sigHandler( int, short, void * arg )
 	server->shutdown();
 }
 
-void SP_Server :: outputCompleted( void * arg )
+void SP_Server :: restartHandler( int, short, void * arg )
 {
-	SP_CompletionHandler * handler = ( SP_CompletionHandler * ) ((void**)arg)[0];
-	SP_Message * msg = ( SP_Message * ) ((void**)arg)[ 1 ];
-
-	handler->completionMessage( msg );
+	SP_HotRestart::restart();
+}
 
-	free( arg );
+void SP_Server :: adjustTimer( int, short, void * arg )
+{
+	// only wake up the event loop, so an idle pool can shrink
+	// and the progress of a restart is checked
+	struct timeval tv = { 1, 0 };
+	evtimer_add( (struct event*)arg, &tv );
 }
 
 int SP_Server :: start()
@@ -157,11 +254,36 @@ int SP_Server :: start()
 	int ret = 0;
 	int listenFD = -1;
 
-	ret = SP_IOUtils::tcpListen( mBindIP, mPort, &listenFD, 0 );
+	// deleted after the executors, which may still be completing messages
+	SP_CompletionHandler * completionHandler = NULL;
+
+	// pin before anything is allocated, so the memory is local to the loop
+	if( NULL != mReactorCpus ) SP_ThreadPool::setCpuAffinity( mReactorCpus );
+
+	if( mListenFd >= 0 ) {
+		listenFD = mListenFd;
+		ret = SP_IOUtils::setNonblock( listenFD ) < 0 ? -1 : 0;
+	} else {
+		listenFD = SP_HotRestart::takeListener( mBindIP, mPort );
+		if( listenFD < 0 ) {
+			ret = SP_IOUtils::tcpListen( mBindIP, mPort, &listenFD, 0, mIncomingCpu >= 0 );
+		}
+	}
+
+	if( 0 == ret && mIncomingCpu >= 0 && mListenFd < 0 ) {
+		SP_IOUtils::setIncomingCpu( listenFD, mIncomingCpu );
+	}
+
+	if( 0 == ret && mListenFd < 0 ) SP_HotRestart::addListener( mBindIP, mPort, listenFD );
 
 	if( 0 == ret ) {
 
 		SP_EventArg eventArg( mTimeout );
+		eventArg.setLaneMode( mLaneMode );
+		eventArg.setBatchSize( mBatchSize );
+		eventArg.setOutputWatermarks( mHighWatermark, mLowWatermark, mOutputPolicy );
+		eventArg.setOutputBudget( mOutputBudget );
+		eventArg.setTopicRegistry( mTopicRegistry );
 
 		// Clean close on SIGINT or SIGTERM.
 		struct event evSigInt, evSigTerm;
@@ -172,6 +294,20 @@ int SP_Server :: start()
 		event_base_set( eventArg.getEventBase(), &evSigTerm );
 		signal_add( &evSigTerm, NULL);
 
+		// Hot restart on SIGUSR2.
+		int isRestartable = SP_HotRestart::isEnabled();
+		struct event evSigUsr2, evRestart;
+		if( isRestartable ) {
+			signal_set( &evSigUsr2, SIGUSR2, restartHandler, this );
+			event_base_set( eventArg.getEventBase(), &evSigUsr2 );
+			signal_add( &evSigUsr2, NULL );
+
+			struct timeval tv = { 1, 0 };
+			evtimer_set( &evRestart, adjustTimer, &evRestart );
+			event_base_set( eventArg.getEventBase(), &evRestart );
+			evtimer_add( &evRestart, &tv );
+		}
+
 		SP_AcceptArg_t acceptArg;
 		memset( &acceptArg, 0, sizeof( SP_AcceptArg_t ) );
 
@@ -184,49 +320,109 @@ int SP_Server :: start()
 		acceptArg.mReqQueueSize = mReqQueueSize;
 		acceptArg.mMaxConnections = mMaxConnections;
 		acceptArg.mRefusedMsg = mRefusedMsg;
+		acceptArg.mAcceptBatch = mAcceptBatch;
 
 		struct event evAccept;
-		event_set( &evAccept, listenFD, EV_READ|EV_PERSIST,
-				SP_EventCallback::onAccept, &acceptArg );
-		event_base_set( eventArg.getEventBase(), &evAccept );
+		SP_EventCallback::setAcceptEvent( &evAccept, listenFD, &acceptArg, mBindIP );
 		event_add( &evAccept, NULL );
 
-		SP_Executor workerExecutor( mMaxThreads, "work" );
+		SP_Executor workerExecutor( mLaneMode ? 1 : mMaxThreads, "work" );
 		SP_Executor actExecutor( 1, "act" );
-		SP_CompletionHandler * completionHandler = mHandlerFactory->createCompletionHandler();
+		SP_LaneExecutor * laneExecutor = NULL;
+		if( mLaneMode ) laneExecutor = new SP_LaneExecutor( mMaxThreads, "lane" );
+
+		if( NULL != mWorkerCpus ) {
+			workerExecutor.setCpuList( mWorkerCpus );
+			actExecutor.setCpuList( mWorkerCpus );
+			if( NULL != laneExecutor ) laneExecutor->setCpuList( mWorkerCpus );
+		}
+		completionHandler = mHandlerFactory->createCompletionHandler();
+		SP_Executor * completionExecutor = completionHandler->isThreadSafe()
+				? &workerExecutor : &actExecutor;
+
+		int isAdaptive = mMinThreads > 0 && NULL == laneExecutor;
+
+		struct event evAdjust;
+		if( isAdaptive ) {
+			workerExecutor.setAdaptive( mMinThreads );
+
+			struct timeval tv = { 1, 0 };
+			evtimer_set( &evAdjust, adjustTimer, &evAdjust );
+			event_base_set( eventArg.getEventBase(), &evAdjust );
+			evtimer_add( &evAdjust, &tv );
+		}
 
 		/* Start the event loop. */
 		while( 0 == mIsShutdown ) {
 			event_base_loop( eventArg.getEventBase(), EVLOOP_ONCE );
+			SP_UringIOChannel::flush();
+
+			if( isAdaptive ) {
+				workerExecutor.adjust();
+
+				SP_ThreadPoolStat_t stat;
+				workerExecutor.getStat( &stat );
+				mThreadCount = stat.mTotal;
+				mTargetThreads = stat.mLimit;
+			}
+
+			if( isRestartable && SP_HotRestart::eDraining == SP_HotRestart::check() ) {
+				// the new copy accepts on the same socket from now on
+				if( listenFD >= 0 ) {
+					event_del( &evAccept );
+					SP_HotRestart::removeListener( listenFD );
+					sp_close( listenFD );
+					listenFD = -1;
+
+					sp_syslog( LOG_NOTICE, "Stop listening on port [%d], drain %d sessions",
+							mPort, eventArg.getSessionManager()->getCount() );
+				}
+
+				if( 0 == eventArg.getSessionManager()->getCount()
+						|| SP_HotRestart::isExpired() ) {
+					mIsShutdown = 1;
+				}
+			}
 
 			for( ; NULL != eventArg.getInputResultQueue()->top(); ) {
 				SP_Task * task = (SP_Task*)eventArg.getInputResultQueue()->pop();
-				workerExecutor.execute( task );
+				if( NULL != laneExecutor ) {
+					laneExecutor->execute( task );
+				} else {
+					workerExecutor.execute( task );
+				}
 			}
 
-			for( ; NULL != eventArg.getOutputResultQueue()->top(); ) {
-				SP_Message * msg = (SP_Message*)eventArg.getOutputResultQueue()->pop();
+			SP_EventHelper::doCompletions( eventArg.getOutputResultQueue(),
+					completionHandler, completionExecutor );
+		}
 
-				void ** arg = ( void** )malloc( sizeof( void * ) * 2 );
-				arg[ 0 ] = (void*)completionHandler;
-				arg[ 1 ] = (void*)msg;
+		if( NULL != laneExecutor ) delete laneExecutor;
 
-				actExecutor.execute( outputCompleted, arg );
-			}
+		if( isAdaptive ) {
+			evtimer_del( &evAdjust );
+			mThreadCount = mTargetThreads = 0;
 		}
 
-		delete completionHandler;
-
 		sp_syslog( LOG_NOTICE, "Server is shutdown." );
 
-		event_del( &evAccept );
+		if( isRestartable ) {
+			evtimer_del( &evRestart );
+			signal_del( &evSigUsr2 );
+		}
 
 		signal_del( &evSigTerm );
 		signal_del( &evSigInt );
 
-		sp_close( listenFD );
+		if( listenFD >= 0 ) {
+			event_del( &evAccept );
+			SP_HotRestart::removeListener( listenFD );
+			sp_close( listenFD );
+		}
 	}
 
+	if( NULL != completionHandler ) delete completionHandler;
+
 	return ret;
 }
 
@@ -14,6 +14,7 @@ class SP_HandlerFactory;
 class SP_Session;
 class SP_Executor;
 class SP_IOChannelFactory;
+class SP_TopicRegistry;
 
 struct event;
 
@@ -29,6 +30,75 @@ public:
 	void setReqQueueSize( int reqQueueSize, const char * refusedMsg );
 	void setIOChannelFactory( SP_IOChannelFactory * ioChannelFactory );
 
+	/// accept at most acceptBatch connections per wakeup, default is 32
+	void setAcceptBatch( int acceptBatch );
+
+	/**
+	 * @brief 1 : hash every session to one of maxThreads lanes, the requests
+	 *        of a session are handled in order without waiting for the
+	 *        previous response to be written, 0 : shared thread pool (default)
+	 */
+	void setLaneMode( int laneMode );
+
+	/**
+	 * @brief a worker handles up to batchSize requests already buffered for
+	 *        a session and sends one combined response, default is 1
+	 */
+	void setBatchSize( int batchSize );
+
+	/**
+	 * @brief bound the output queued to a session, a message to a session
+	 *        with highWatermark bytes queued is handled by the policy,
+	 *        see SP_OutputPolicy; a paused sender is read again when the
+	 *        queue is below lowWatermark. 0 : unlimited (default)
+	 */
+	void setOutputWatermarks( int highWatermark, int lowWatermark, int policy );
+
+	/// over budget bytes queued to all the sessions, the policy applies to
+	/// every session above its low watermark, 0 : unlimited (default)
+	void setOutputBudget( int budget );
+
+	/**
+	 * @brief remove the sid of a closed session from the topics it subscribes,
+	 *        the registry is shared with the handlers, not deleted by the server
+	 */
+	void setTopicRegistry( SP_TopicRegistry * topicRegistry );
+
+	/**
+	 * @brief size the worker pool between minThreads and maxThreads by the
+	 *        measured queue wait and utilization, overrides setMaxThreads;
+	 *        ignored in lane mode
+	 */
+	void setAdaptiveThreads( int minThreads, int maxThreads );
+
+	/// worker threads alive and the size the adaptive pool aims at,
+	/// 0 if the pool is not adaptive or the server is not running
+	int getThreadCount();
+	int getTargetThreads();
+
+	/**
+	 * @brief pin the event loop thread to a cpu list, such as "0-3,8";
+	 *        sessions and their buffers are allocated by the event loop,
+	 *        so with the default first-touch policy they stay on its NUMA node
+	 */
+	void setReactorCpus( const char * cpuList );
+
+	/// pin the worker threads, better on the same NUMA node as the reactor
+	void setWorkerCpus( const char * cpuList );
+
+	/**
+	 * @brief listen with SO_REUSEPORT and SO_INCOMING_CPU, run one server per
+	 *        NIC RX queue on the same port, with the reactor pinned to the cpu
+	 *        which handles the queue's interrupt
+	 */
+	void setIncomingCpu( int cpu );
+
+	/**
+	 * @brief accept on a socket which is already listening, such as a unix
+	 *        socket, instead of binding ip:port; the server closes it
+	 */
+	void setListenFd( int listenFd );
+
 	void shutdown();
 	int isRunning();
 	int run();
@@ -48,14 +118,26 @@ private:
 	int mMaxConnections;
 	int mReqQueueSize;
 	char * mRefusedMsg;
+	int mLaneMode;
+	int mBatchSize;
+	int mHighWatermark, mLowWatermark, mOutputPolicy;
+	int mOutputBudget;
+	SP_TopicRegistry * mTopicRegistry;
+	int mAcceptBatch;
+	int mMinThreads;
+	int mThreadCount, mTargetThreads;
+	char * mReactorCpus;
+	char * mWorkerCpus;
+	int mIncomingCpu;
+	int mListenFd;
 
 	static sp_thread_result_t SP_THREAD_CALL eventLoop( void * arg );
 
 	int start();
 
 	static void sigHandler( int, short, void * arg );
-
-	static void outputCompleted( void * arg );
+	static void restartHandler( int, short, void * arg );
+	static void adjustTimer( int, short, void * arg );
 };
 
 #endif
@@ -189,12 +189,19 @@ SP_Session :: SP_Session( SP_Sid_t sid )
 	mRequest = new SP_Request();
 
 	mOutOffset = 0;
-	mOutList = new SP_ArrayList();
+	mOutList = new SP_CircleList();
 
 	mStatus = eNormal;
 	mRunning = 0;
 	mWriting = 0;
 	mReading = 0;
+	mLaneQueued = 0;
+	mPaused = 0;
+
+	mOutBytes = 0;
+	mPausedSenders = NULL;
+
+	sp_thread_mutex_init( &mInMutex, NULL );
 
 	mTotalRead = mTotalWrite = 0;
 
@@ -223,10 +230,15 @@ SP_Session :: ~SP_Session()
 	delete mOutList;
 	mOutList = NULL;
 
+	if( NULL != mPausedSenders ) delete mPausedSenders;
+	mPausedSenders = NULL;
+
 	if( NULL != mIOChannel ) {
 		delete mIOChannel;
 		mIOChannel = NULL;
 	}
+
+	sp_thread_mutex_destroy( &mInMutex );
 }
 
 struct event * SP_Session :: getReadEvent()
@@ -284,7 +296,7 @@ int SP_Session :: getOutOffset()
 	return mOutOffset;
 }
 
-SP_ArrayList * SP_Session :: getOutList()
+SP_CircleList * SP_Session :: getOutList()
 {
 	return mOutList;
 }
@@ -329,6 +341,26 @@ void SP_Session :: setReading( int reading )
 	mReading = reading;
 }
 
+void SP_Session :: lockInBuffer()
+{
+	sp_thread_mutex_lock( &mInMutex );
+}
+
+void SP_Session :: unlockInBuffer()
+{
+	sp_thread_mutex_unlock( &mInMutex );
+}
+
+int SP_Session :: getLaneQueued()
+{
+	return mLaneQueued;
+}
+
+void SP_Session :: setLaneQueued( int laneQueued )
+{
+	mLaneQueued = laneQueued;
+}
+
 SP_IOChannel * SP_Session :: getIOChannel()
 {
 	return mIOChannel;
@@ -358,3 +390,35 @@ void SP_Session :: addWrite( int len )
 {
 	mTotalWrite += len;
 }
+
+int SP_Session :: getOutBytes()
+{
+	return mOutBytes;
+}
+
+void SP_Session :: addOutBytes( int len )
+{
+	mOutBytes += len;
+}
+
+int SP_Session :: getPaused()
+{
+	return mPaused;
+}
+
+void SP_Session :: setPaused( int paused )
+{
+	mPaused = paused;
+}
+
+SP_SidList * SP_Session :: getPausedSenders()
+{
+	return mPausedSenders;
+}
+
+void SP_Session :: addPausedSender( SP_Sid_t sid )
+{
+	if( NULL == mPausedSenders ) mPausedSenders = new SP_SidList();
+
+	if( mPausedSenders->find( sid ) < 0 ) mPausedSenders->add( sid );
+}
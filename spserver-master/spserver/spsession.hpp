@@ -8,11 +8,12 @@
 #define __spsession_hpp__
 
 #include "spresponse.hpp"
+#include "spthread.hpp"
 
 class SP_Handler;
 class SP_Buffer;
 class SP_Session;
-class SP_ArrayList;
+class SP_CircleList;
 class SP_Request;
 class SP_IOChannel;
 
@@ -39,7 +40,7 @@ public:
 
 	void setOutOffset( int offset );
 	int getOutOffset();
-	SP_ArrayList * getOutList();
+	SP_CircleList * getOutList();
 
 	enum { eNormal, eWouldExit, eExit };
 	void setStatus( int status );
@@ -54,6 +55,13 @@ public:
 	int getWriting();
 	void setWriting( int writing );
 
+	// guard the input buffer and decoder when the session runs on a lane
+	void lockInBuffer();
+	void unlockInBuffer();
+
+	int getLaneQueued();
+	void setLaneQueued( int laneQueued );
+
 	SP_IOChannel * getIOChannel();
 	void setIOChannel( SP_IOChannel * ioChannel );
 
@@ -63,6 +71,18 @@ public:
 	unsigned int getTotalWrite();
 	void addWrite( int len );
 
+	// bytes in the out list which are not written yet
+	int getOutBytes();
+	void addOutBytes( int len );
+
+	// 1 : not read until the receivers of its messages drain their output
+	int getPaused();
+	void setPaused( int paused );
+
+	// the senders paused by the output of this session, NULL : none
+	SP_SidList * getPausedSenders();
+	void addPausedSender( SP_Sid_t sid );
+
 private:
 
 	SP_Session( SP_Session & );
@@ -80,12 +100,19 @@ private:
 	SP_Request * mRequest;
 
 	int mOutOffset;
-	SP_ArrayList * mOutList;
+	SP_CircleList * mOutList;
 
 	char mStatus;
 	char mRunning;
 	char mWriting;
 	char mReading;
+	char mLaneQueued;
+	char mPaused;
+
+	int mOutBytes;
+	SP_SidList * mPausedSenders;
+
+	sp_thread_mutex_t mInMutex;
 
 	unsigned int mTotalRead, mTotalWrite;
 
@@ -5,6 +5,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 
 #include "spsmtp.hpp"
@@ -16,8 +17,15 @@
 #include "spmsgdecoder.hpp"
 #include "sputils.hpp"
 
+SP_SmtpHandler :: SP_SmtpHandler()
+{
+	mData = NULL;
+}
+
 SP_SmtpHandler :: ~SP_SmtpHandler()
 {
+	if( NULL != mData ) delete mData;
+	mData = NULL;
 }
 
 void SP_SmtpHandler :: error()
@@ -52,6 +60,7 @@ int SP_SmtpHandler :: helo( const char * args, SP_Buffer * reply )
 int SP_SmtpHandler :: ehlo( const char * args, SP_Buffer * reply )
 {
 	reply->append( "250-OK\n" );
+	reply->append( "250-PIPELINING\n" );
 	reply->append( "250-AUTH=LOGIN\n" );
 	reply->append( "250 HELP\n" );
 
@@ -72,6 +81,28 @@ int SP_SmtpHandler :: noop( const char * args, SP_Buffer * reply )
 	return eAccept;
 }
 
+int SP_SmtpHandler :: dataChunk( const char * chunk, int len, int isLast, SP_Buffer * reply )
+{
+	if( NULL == mData ) mData = new SP_Buffer();
+	if( len > 0 ) mData->append( chunk, len );
+
+	if( ! isLast ) return eAccept;
+
+	// data() gets the message without the CRLF before <CRLF>.<CRLF>
+	int size = mData->getSize();
+	const char * buffer = (char*)mData->getRawBuffer();
+	if( size > 0 && '\n' == buffer[ size - 1 ] ) size--;
+	if( size > 0 && '\r' == buffer[ size - 1 ] ) size--;
+	mData->truncate( size );
+
+	int ret = data( (char*)mData->getBuffer(), reply );
+
+	delete mData;
+	mData = NULL;
+
+	return ret;
+}
+
 //---------------------------------------------------------
 
 SP_SmtpHandlerList :: SP_SmtpHandlerList()
@@ -141,6 +172,11 @@ public:
 	void setDataMode( int mode );
 	int  getDataMode();
 
+	// the result of dataChunk, and the reply sent after the last chunk
+	void setDataRet( int ret );
+	int  getDataRet();
+	SP_Buffer * getDataReply();
+
 	int  getSeenData();
 
 	void reset();
@@ -159,6 +195,8 @@ private:
 	int mSeenData;
 
 	int mDataMode;
+	int mDataRet;
+	SP_Buffer * mDataReply;
 
 	SP_SmtpHandler * mHandler;
 
@@ -177,12 +215,16 @@ SP_SmtpSession :: SP_SmtpSession( SP_SmtpHandlerFactory * handlerFactory )
 	memset( mUser, 0, sizeof( mUser ) );
 	memset( mPass, 0, sizeof( mPass ) );
 
+	mDataReply = new SP_Buffer();
+
 	reset();
 }
 
 SP_SmtpSession :: ~SP_SmtpSession()
 {
 	if( NULL != mHandler ) delete mHandler;
+
+	delete mDataReply;
 }
 
 void SP_SmtpSession :: reset()
@@ -192,6 +234,8 @@ void SP_SmtpSession :: reset()
 	mSeenData = 0;
 
 	mDataMode = 0;
+	mDataRet = SP_SmtpHandler::eAccept;
+	mDataReply->reset();
 }
 
 void SP_SmtpSession :: setAuthStep( int step )
@@ -268,7 +312,11 @@ void SP_SmtpSession :: setDataMode( int mode )
 {
 	mDataMode = mode;
 
-	if( 1 == mode ) mSeenData = 1;
+	if( 1 == mode ) {
+		mSeenData = 1;
+		mDataRet = SP_SmtpHandler::eAccept;
+		mDataReply->reset();
+	}
 }
 
 int  SP_SmtpSession :: getDataMode()
@@ -276,6 +324,21 @@ int  SP_SmtpSession :: getDataMode()
 	return mDataMode;
 }
 
+void SP_SmtpSession :: setDataRet( int ret )
+{
+	mDataRet = ret;
+}
+
+int  SP_SmtpSession :: getDataRet()
+{
+	return mDataRet;
+}
+
+SP_Buffer * SP_SmtpSession :: getDataReply()
+{
+	return mDataReply;
+}
+
 int  SP_SmtpSession :: getSeenData()
 {
 	return mSeenData;
@@ -290,6 +353,81 @@ SP_SmtpHandler * SP_SmtpSession :: getHandler()
 
 //---------------------------------------------------------
 
+// all the complete command lines, up to the end of a pipelined group (RFC 2920)
+class SP_SmtpCmdMsgDecoder : public SP_MsgDecoder {
+public:
+	SP_SmtpCmdMsgDecoder();
+	virtual ~SP_SmtpCmdMsgDecoder();
+
+	virtual int decode( SP_Buffer * inBuffer );
+
+	// caller need to free the lines
+	SP_CircleQueue * getQueue();
+
+private:
+	SP_CircleQueue * mQueue;
+
+	static int isGroupEnd( const char * line );
+};
+
+SP_SmtpCmdMsgDecoder :: SP_SmtpCmdMsgDecoder()
+{
+	mQueue = new SP_CircleQueue();
+}
+
+SP_SmtpCmdMsgDecoder :: ~SP_SmtpCmdMsgDecoder()
+{
+	for( ; NULL != mQueue->top(); ) {
+		free( mQueue->pop() );
+	}
+
+	delete mQueue, mQueue = NULL;
+}
+
+int SP_SmtpCmdMsgDecoder :: decode( SP_Buffer * inBuffer )
+{
+	int ret = eMoreData;
+
+	for( ; ; ) {
+		// getLine also ends a line at a CR, so a CRLF split across the
+		// reads would leave the LF as an empty command, wait for the LF
+		if( NULL == inBuffer->find( "\n", 1 ) ) break;
+
+		char * line = inBuffer->getLine();
+		if( NULL == line ) break;
+
+		mQueue->push( line );
+		ret = eOK;
+
+		// the lines after it may be message data or a new greeting
+		if( isGroupEnd( line ) ) break;
+	}
+
+	return ret;
+}
+
+SP_CircleQueue * SP_SmtpCmdMsgDecoder :: getQueue()
+{
+	return mQueue;
+}
+
+int SP_SmtpCmdMsgDecoder :: isGroupEnd( const char * line )
+{
+	static const char * cmdList[] = { "EHLO", "HELO", "DATA", "AUTH",
+			"QUIT", "NOOP", "VRFY", "EXPN", "TURN", NULL };
+
+	char cmd[ 16 ] = { 0 };
+	sp_strtok( line, 0, cmd, sizeof( cmd ), ' ', NULL );
+
+	for( int i = 0; NULL != cmdList[i]; i++ ) {
+		if( 0 == strcasecmp( cmd, cmdList[i] ) ) return 1;
+	}
+
+	return 0;
+}
+
+//---------------------------------------------------------
+
 class SP_SmtpHandlerAdapter : public SP_Handler {
 public:
 	SP_SmtpHandlerAdapter( SP_SmtpHandlerFactory * handlerFactory );
@@ -310,6 +448,10 @@ public:
 
 private:
 	SP_SmtpSession * mSession;
+
+	int handleData( SP_Request * request, SP_Buffer * reply );
+
+	int handleCommand( const char * line, SP_Buffer * reply );
 };
 
 SP_SmtpHandlerAdapter :: SP_SmtpHandlerAdapter( SP_SmtpHandlerFactory * handlerFactory )
@@ -331,43 +473,82 @@ int SP_SmtpHandlerAdapter :: start( SP_Request * request, SP_Response * response
 
 	if( NULL == reply->find( "\n", 1 ) ) reply->append( "\n" );
 
-	request->setMsgDecoder( new SP_LineMsgDecoder() );
+	request->setMsgDecoder( new SP_SmtpCmdMsgDecoder() );
 
 	return ret;
 }
 
 int SP_SmtpHandlerAdapter :: handle( SP_Request * request, SP_Response * response )
 {
+	SP_Buffer * reply = response->getReply()->getMsg();
+
+	if( mSession->getDataMode() ) return handleData( request, reply );
+
 	int ret = SP_SmtpHandler::eAccept;
 
-	SP_Buffer * reply = response->getReply()->getMsg();
+	// the replies of a pipelined command group are sent in one write
+	SP_CircleQueue * queue = ((SP_SmtpCmdMsgDecoder*)request->getMsgDecoder())->getQueue();
+	for( ; NULL != queue->top(); ) {
+		char * line = (char*)queue->pop();
 
-	if( mSession->getDataMode() ) {
-		SP_DotTermChunkMsgDecoder * decoder = (SP_DotTermChunkMsgDecoder*)request->getMsgDecoder();
+		size_t prevSize = reply->getSize();
 
-		char * data = (char*)decoder->getMsg();
-		ret = mSession->getHandler()->data( data, reply );
-		free( data );
+		ret = handleCommand( line, reply );
+		free( line );
+
+		if( NULL == memchr( (char*)reply->getBuffer() + prevSize, '\n',
+				reply->getSize() - prevSize ) ) {
+			reply->append( "\n" );
+		}
+
+		if( SP_SmtpHandler::eClose == ret || mSession->getDataMode() ) break;
+	}
+
+	if( mSession->getDataMode() ) request->setMsgDecoder( new SP_DotTermStreamMsgDecoder() );
+
+	return SP_SmtpHandler::eClose == ret ? -1 : 0;
+}
+
+int SP_SmtpHandlerAdapter :: handleData( SP_Request * request, SP_Buffer * reply )
+{
+	SP_DotTermStreamMsgDecoder * decoder = (SP_DotTermStreamMsgDecoder*)request->getMsgDecoder();
+
+	// after a reject, the rest of the message is only drained
+	if( SP_SmtpHandler::eAccept == mSession->getDataRet() ) {
+		SP_Buffer * chunk = decoder->getChunk();
+		mSession->setDataRet( mSession->getHandler()->dataChunk( (char*)chunk->getBuffer(),
+				chunk->getSize(), decoder->isLast(), mSession->getDataReply() ) );
+	}
+
+	int ret = mSession->getDataRet();
+
+	if( decoder->isLast() || SP_SmtpHandler::eClose == ret ) {
+		reply->append( mSession->getDataReply() );
+		if( NULL == reply->find( "\n", 1 ) ) reply->append( "\n" );
 
 		mSession->setDataMode( 0 );
-		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		request->setMsgDecoder( new SP_SmtpCmdMsgDecoder() );
+	}
 
-	} else if( SP_SmtpSession::eStepUser == mSession->getAuthStep() ) {
-		const char * line = ((SP_LineMsgDecoder*)(request->getMsgDecoder()))->getMsg();
+	return SP_SmtpHandler::eClose == ret ? -1 : 0;
+}
+
+int SP_SmtpHandlerAdapter :: handleCommand( const char * line, SP_Buffer * reply )
+{
+	int ret = SP_SmtpHandler::eAccept;
+
+	if( SP_SmtpSession::eStepUser == mSession->getAuthStep() ) {
 		mSession->setUser( line );
 		mSession->setAuthStep( SP_SmtpSession::eStepPass );
 		reply->append( "334 UGFzc3dvcmQ6\r\n" );
 
 	} else if( SP_SmtpSession::eStepPass == mSession->getAuthStep() ) {
-		const char * line = ((SP_LineMsgDecoder*)(request->getMsgDecoder()))->getMsg();
 		mSession->setPass( line );
 		mSession->setAuthStep( SP_SmtpSession::eStepOther );
 		ret = mSession->getHandler()->auth( mSession->getUser(), mSession->getPass(), reply );
 		if( SP_SmtpHandler::eAccept == ret ) mSession->setSeenAuth( 1 );
 
 	} else {
-		const char * line = ((SP_LineMsgDecoder*)(request->getMsgDecoder()))->getMsg();
-
 		char cmd[ 128 ] = { 0 };
 		const char * args = NULL;
 
@@ -457,7 +638,6 @@ int SP_SmtpHandlerAdapter :: handle( SP_Request * request, SP_Response * respons
 			} else if( mSession->getRcptCount() <= 0 ) {
 				reply->append( "503 Error: need RCPT command\r\n" );
 			} else {
-				request->setMsgDecoder( new SP_DotTermChunkMsgDecoder() );
 				reply->append( "354 Start mail input; end with <CRLF>.<CRLF>\r\n" );
 				mSession->setDataMode( 1 );
 			}
@@ -481,9 +661,7 @@ int SP_SmtpHandlerAdapter :: handle( SP_Request * request, SP_Response * respons
 		}
 	}
 
-	if( NULL == reply->find( "\n", 1 ) ) reply->append( "\n" );
-
-	return SP_SmtpHandler::eClose == ret ? -1 : 0;
+	return ret;
 }
 
 void SP_SmtpHandlerAdapter :: error( SP_Response * response )
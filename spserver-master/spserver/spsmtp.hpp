@@ -13,6 +13,7 @@ class SP_ArrayList;
 
 class SP_SmtpHandler {
 public:
+	SP_SmtpHandler();
 	virtual ~SP_SmtpHandler();
 
 	virtual void error();
@@ -66,11 +67,25 @@ public:
 	 */
 	virtual int data( const char * data, SP_Buffer * reply ) = 0;
 
+	/**
+	 * The streaming variant of data(), called for every chunk of the DATA
+	 * part as it arrives, so a large message can be spooled to a file.
+	 * The default implementation collects the chunks and calls data().
+	 *
+	 * @param chunk is dot-unstuffed, the lines keep their CRLF
+	 * @param isLast is 1 for the last chunk, after which the reply is sent;
+	 *        return eReject to skip the rest of the message
+	 */
+	virtual int dataChunk( const char * chunk, int len, int isLast, SP_Buffer * reply );
+
 	/**
 	 * This method is called whenever a RSET command is sent. It should
 	 * be used to clean up any pending deliveries.
 	 */
 	virtual int rset( SP_Buffer * reply ) = 0;
+
+private:
+	SP_Buffer * mData;
 };
 
 class SP_SmtpHandlerList {
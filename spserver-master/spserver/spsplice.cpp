@@ -0,0 +1,271 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "spporting.hpp"
+
+#include "spsplice.hpp"
+#include "speventcb.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "spexecutor.hpp"
+#include "sputils.hpp"
+
+#include "event_msgqueue.h"
+
+#include "event.h"
+
+#if defined( SPLICE_F_MOVE ) && defined( SPLICE_F_NONBLOCK )
+#define SP_HAVE_SPLICE
+#endif
+
+static const int SP_SPLICE_PIPE_SIZE = 256 * 1024;
+
+// rounds of splice per callback, keeps one busy pair from starving the loop
+static const int SP_SPLICE_MAX_ROUNDS = 16;
+
+struct tagSP_SpliceDir {
+	int mFrom, mTo;
+	int mPipe[ 2 ];
+	int mPending;   // bytes parked in the pipe
+	int mIsEof;
+	int mIsDone;
+	struct event mReadEvent;
+	struct event mWriteEvent;
+};
+
+int SP_SplicePump :: isSupported()
+{
+#ifdef SP_HAVE_SPLICE
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+SP_SplicePump :: SP_SplicePump( SP_EventArg * eventArg, int fd1, int fd2,
+		SP_Handler * handler, int * count, uint64_t * bytes )
+{
+	mEventArg = eventArg;
+	mHandler = handler;
+	mCount = count;
+	mBytes = bytes;
+
+	mDir = (SP_SpliceDir_t*)calloc( 2, sizeof( SP_SpliceDir_t ) );
+	mDir[ 0 ].mFrom = mDir[ 1 ].mTo = fd1;
+	mDir[ 0 ].mTo = mDir[ 1 ].mFrom = fd2;
+	for( int i = 0; i < 2; i++ ) mDir[ i ].mPipe[ 0 ] = mDir[ i ].mPipe[ 1 ] = -1;
+
+	mLastActive = time( NULL );
+	mStatus = eNormal;
+
+	if( NULL != mCount ) sp_atomic_add( mCount, 1 );
+}
+
+SP_SplicePump :: ~SP_SplicePump()
+{
+	free( mDir );
+	mDir = NULL;
+}
+
+int SP_SplicePump :: start()
+{
+	int ret = 0;
+
+#ifdef SP_HAVE_SPLICE
+	for( int i = 0; i < 2 && 0 == ret; i++ ) {
+		SP_SpliceDir_t * dir = &( mDir[ i ] );
+
+		ret = pipe2( dir->mPipe, O_NONBLOCK | O_CLOEXEC );
+		if( 0 != ret ) {
+			sp_syslog( LOG_WARNING, "splice: pipe2 fail, errno %d, %s", errno, strerror( errno ) );
+			break;
+		}
+#ifdef F_SETPIPE_SZ
+		fcntl( dir->mPipe[ 1 ], F_SETPIPE_SZ, SP_SPLICE_PIPE_SIZE );
+#endif
+
+		event_set( &( dir->mReadEvent ), dir->mFrom, EV_READ, onRead, this );
+		event_base_set( mEventArg->getEventBase(), &( dir->mReadEvent ) );
+		event_set( &( dir->mWriteEvent ), dir->mTo, EV_WRITE, onWrite, this );
+		event_base_set( mEventArg->getEventBase(), &( dir->mWriteEvent ) );
+	}
+#else
+	sp_syslog( LOG_WARNING, "splice: not supported on this platform" );
+	ret = -1;
+#endif
+
+	if( 0 == ret ) {
+		addEvent( &( mDir[ 0 ] ), EV_READ );
+		addEvent( &( mDir[ 1 ] ), EV_READ );
+	} else {
+		mStatus = eError;
+		stop();
+	}
+
+	return ret;
+}
+
+void SP_SplicePump :: addEvent( SP_SpliceDir_t * dir, short events )
+{
+	struct timeval timeout;
+	memset( &timeout, 0, sizeof( timeout ) );
+	timeout.tv_sec = mEventArg->getTimeout();
+
+	if( EV_READ & events ) {
+		event_add( &( dir->mReadEvent ), timeout.tv_sec > 0 ? &timeout : NULL );
+	} else {
+		event_add( &( dir->mWriteEvent ), timeout.tv_sec > 0 ? &timeout : NULL );
+	}
+}
+
+int SP_SplicePump :: pump( SP_SpliceDir_t * dir )
+{
+#ifdef SP_HAVE_SPLICE
+	int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+
+	for( int round = 0; round < SP_SPLICE_MAX_ROUNDS; round++ ) {
+		int progress = 0;
+
+		if( 0 == dir->mIsEof ) {
+			ssize_t len = splice( dir->mFrom, NULL, dir->mPipe[ 1 ], NULL,
+					SP_SPLICE_PIPE_SIZE, flags );
+			if( len > 0 ) {
+				dir->mPending += len;
+				progress = 1;
+			} else if( 0 == len ) {
+				dir->mIsEof = 1;
+			} else if( EAGAIN != errno && EINTR != errno ) {
+				sp_syslog( LOG_INFO, "splice: read fd %d fail, errno %d, %s",
+						dir->mFrom, errno, strerror( errno ) );
+				return -1;
+			}
+		}
+
+		if( dir->mPending > 0 ) {
+			ssize_t len = splice( dir->mPipe[ 0 ], NULL, dir->mTo, NULL,
+					dir->mPending, flags );
+			if( len > 0 ) {
+				dir->mPending -= len;
+				progress = 1;
+				if( NULL != mBytes ) sp_atomic_add( &( mBytes[ dir == mDir ? 0 : 1 ] ), (uint64_t)len );
+			} else if( len < 0 && EAGAIN != errno && EINTR != errno ) {
+				sp_syslog( LOG_INFO, "splice: write fd %d fail, errno %d, %s",
+						dir->mTo, errno, strerror( errno ) );
+				return -1;
+			}
+		}
+
+		if( progress ) mLastActive = time( NULL );
+
+		if( 0 == progress ) break;
+	}
+
+	if( dir->mIsEof && 0 == dir->mPending ) {
+		// pass the half-close on, the other direction may still be busy
+		shutdown( dir->mTo, SHUT_WR );
+		dir->mIsDone = 1;
+		return 1;
+	}
+
+	// hold the reader back until the pipe is drained
+	addEvent( dir, dir->mPending > 0 ? EV_WRITE : EV_READ );
+#endif
+
+	return 0;
+}
+
+void SP_SplicePump :: onRead( int fd, short events, void * arg )
+{
+	SP_SplicePump * pump = (SP_SplicePump*)arg;
+	SP_SpliceDir_t * dir = &( pump->mDir[ fd == pump->mDir[ 0 ].mFrom ? 0 : 1 ] );
+
+	int ret = 0;
+
+	if( EV_TIMEOUT & events ) {
+		if( time( NULL ) - pump->mLastActive < pump->mEventArg->getTimeout() ) {
+			// the other direction is moving, only this side is idle
+			pump->addEvent( dir, EV_READ );
+			return;
+		}
+		pump->mStatus = eTimeout;
+		ret = -1;
+	} else {
+		ret = pump->pump( dir );
+		if( ret < 0 ) pump->mStatus = eError;
+	}
+
+	if( ret < 0 || ( pump->mDir[ 0 ].mIsDone && pump->mDir[ 1 ].mIsDone ) ) pump->stop();
+}
+
+void SP_SplicePump :: onWrite( int fd, short events, void * arg )
+{
+	SP_SplicePump * pump = (SP_SplicePump*)arg;
+	SP_SpliceDir_t * dir = &( pump->mDir[ fd == pump->mDir[ 0 ].mTo ? 0 : 1 ] );
+
+	int ret = 0;
+
+	if( EV_TIMEOUT & events ) {
+		// the peer has not taken anything for a whole timeout
+		pump->mStatus = eTimeout;
+		ret = -1;
+	} else {
+		ret = pump->pump( dir );
+		if( ret < 0 ) pump->mStatus = eError;
+	}
+
+	if( ret < 0 || ( pump->mDir[ 0 ].mIsDone && pump->mDir[ 1 ].mIsDone ) ) pump->stop();
+}
+
+void SP_SplicePump :: stop()
+{
+	for( int i = 0; i < 2; i++ ) {
+		SP_SpliceDir_t * dir = &( mDir[ i ] );
+
+		if( dir->mPipe[ 0 ] >= 0 ) {
+			event_del( &( dir->mReadEvent ) );
+			event_del( &( dir->mWriteEvent ) );
+			sp_close( dir->mPipe[ 0 ] );
+			sp_close( dir->mPipe[ 1 ] );
+		}
+	}
+
+	sp_close( mDir[ 0 ].mFrom );
+	sp_close( mDir[ 0 ].mTo );
+
+	if( NULL != mCount ) sp_atomic_add( mCount, -1 );
+
+	if( NULL != mHandler ) {
+		mEventArg->getInputResultQueue()->push( new SP_SimpleTask( closed, this, 1 ) );
+	} else {
+		delete this;
+	}
+}
+
+void SP_SplicePump :: closed( void * arg )
+{
+	SP_SplicePump * pump = (SP_SplicePump*)arg;
+	SP_Handler * handler = pump->mHandler;
+
+	SP_Sid_t sid;
+	sid.mKey = SP_Sid_t::ePushKey;
+	sid.mSeq = SP_Sid_t::ePushSeq;
+	SP_Response * response = new SP_Response( sid );
+
+	if( eError == pump->mStatus ) handler->error( response );
+	if( eTimeout == pump->mStatus ) handler->timeout( response );
+	handler->close();
+
+	msgqueue_push( (struct event_msgqueue*)pump->mEventArg->getResponseQueue(), response );
+
+	delete handler;
+	delete pump;
+}
+
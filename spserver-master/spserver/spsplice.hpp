@@ -0,0 +1,66 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spsplice_hpp__
+#define __spsplice_hpp__
+
+#include "spporting.hpp"
+
+class SP_EventArg;
+class SP_Handler;
+
+typedef struct tagSP_SpliceDir SP_SpliceDir_t;
+
+/**
+ * @brief forward bytes between two connected sockets with splice(2),
+ *        socket -> pipe -> socket in both directions, on the event loop;
+ *        the data never enters user space and never touches a worker
+ */
+class SP_SplicePump {
+public:
+	/// @return 1 : splice(2) is available
+	static int isSupported();
+
+	/**
+	 * @param handler : optional, error/timeout and close are called on
+	 *        a worker when the pump ends, then it is deleted
+	 * @param count : counter of running pumps, only touched in the event loop
+	 * @param bytes : optional, [0] += fd1 -> fd2, [1] += fd2 -> fd1, with sp_atomic_add
+	 */
+	SP_SplicePump( SP_EventArg * eventArg, int fd1, int fd2,
+			SP_Handler * handler, int * count, uint64_t * bytes = 0 );
+	~SP_SplicePump();
+
+	/// must be called in the event loop thread, the pump deletes itself
+	/// @return 0 : OK, -1 : Fail, fds have been closed
+	int start();
+
+private:
+	enum { eNormal, eError, eTimeout };
+
+	SP_EventArg * mEventArg;
+	SP_Handler * mHandler;
+	int * mCount;
+	uint64_t * mBytes;
+
+	SP_SpliceDir_t * mDir;   // [0] : fd1 -> fd2, [1] : fd2 -> fd1
+	time_t mLastActive;
+	int mStatus;
+
+	void addEvent( SP_SpliceDir_t * dir, short events );
+
+	/// @return 0 : wait for more, 1 : this direction is done, -1 : error
+	int pump( SP_SpliceDir_t * dir );
+
+	void stop();
+
+	static void onRead( int fd, short events, void * arg );
+	static void onWrite( int fd, short events, void * arg );
+
+	static void closed( void * arg );
+};
+
+#endif
+
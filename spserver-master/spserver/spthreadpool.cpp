@@ -6,6 +6,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
 
 #include "spporting.hpp"
 
@@ -20,6 +27,30 @@ typedef struct tagSP_Thread {
 	SP_ThreadPool * mParent;
 } SP_Thread_t;
 
+// adaptive sizing
+static const double SP_ADJUST_INTERVAL_USEC = 1000000;
+static const int SP_GROW_SAMPLES = 2;
+static const int SP_SHRINK_SAMPLES = 5;
+
+static double sp_nowusec()
+{
+	struct timeval now;
+	sp_gettimeofday( &now, NULL );
+	return now.tv_sec * 1000000.0 + now.tv_usec;
+}
+
+// @return -1 : unknown
+static double sp_cpuusec()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec now;
+	if( 0 == clock_gettime( CLOCK_THREAD_CPUTIME_ID, &now ) ) {
+		return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+	}
+#endif
+	return -1;
+}
+
 SP_ThreadPool :: SP_ThreadPool( int maxThreads, const char * tag )
 {
 	if( maxThreads <= 0 ) maxThreads = 2;
@@ -29,13 +60,33 @@ SP_ThreadPool :: SP_ThreadPool( int maxThreads, const char * tag )
 	sp_thread_cond_init( &mFullCond, NULL );
 	sp_thread_cond_init( &mEmptyCond, NULL );
 	mMaxThreads = maxThreads;
+	mMinThreads = maxThreads;
+	mLimit = maxThreads;
 	mIndex = 0;
 	mIsShutdown = 0;
 	mTotal = 0;
 
+	mAdaptive = 0;
+	mRetiring = 0;
+	mHighWaitUsec = 0;
+	mLowUtilization = 0;
+#ifdef _SC_NPROCESSORS_ONLN
+	mNumCpus = (int)sysconf( _SC_NPROCESSORS_ONLN );
+#else
+	mNumCpus = 0;
+#endif
+	mGrowVotes = mShrinkVotes = 0;
+	mLastAdjust = 0;
+	mWaitUsec = mBusyUsec = mCpuUsec = 0;
+	mDispatchCount = 0;
+	memset( &mStat, 0, sizeof( mStat ) );
+	mStat.mCpuPercent = -1;
+
 	tag = NULL == tag ? "unknown" : tag;
 	mTag = strdup( tag );
 
+	mCpuList = NULL;
+
 	mThreadList = ( SP_Thread_t ** )malloc( sizeof( void * ) * mMaxThreads );
 	memset( mThreadList, 0, sizeof( void * ) * mMaxThreads );
 }
@@ -88,6 +139,69 @@ SP_ThreadPool :: ~SP_ThreadPool()
 
 	free( mTag );
 	mTag = NULL;
+
+	if( NULL != mCpuList ) free( mCpuList );
+	mCpuList = NULL;
+}
+
+void SP_ThreadPool :: setCpuList( const char * cpuList )
+{
+	sp_thread_mutex_lock( &mMainMutex );
+
+	if( NULL != mCpuList ) free( mCpuList );
+	mCpuList = NULL;
+
+	if( NULL != cpuList && '\0' != *cpuList ) mCpuList = strdup( cpuList );
+
+	sp_thread_mutex_unlock( &mMainMutex );
+}
+
+int SP_ThreadPool :: setCpuAffinity( const char * cpuList )
+{
+	int ret = -1;
+
+#if defined( __linux__ ) && defined( CPU_SET )
+	cpu_set_t cpuSet;
+	CPU_ZERO( &cpuSet );
+
+	int count = 0;
+	const char * pos = cpuList;
+
+	for( ; NULL != pos && '\0' != *pos; ) {
+		char * end = NULL;
+		int first = strtol( pos, &end, 10 ), last = first;
+		if( end == pos || first < 0 ) break;
+
+		if( '-' == *end ) {
+			pos = end + 1;
+			last = strtol( pos, &end, 10 );
+			if( end == pos || last < first ) break;
+		}
+
+		for( int i = first; i <= last && i < CPU_SETSIZE; i++ ) {
+			CPU_SET( i, &cpuSet );
+			count++;
+		}
+
+		pos = end;
+		if( ',' == *pos ) pos++;
+	}
+
+	if( count > 0 && NULL != pos && '\0' == *pos ) {
+		ret = pthread_setaffinity_np( pthread_self(), sizeof( cpuSet ), &cpuSet );
+		if( 0 != ret ) {
+			sp_syslog( LOG_WARNING, "cannot bind thread to cpu %s, errno %d, %s",
+					cpuList, ret, strerror( ret ) );
+			ret = -1;
+		}
+	} else {
+		sp_syslog( LOG_WARNING, "invalid cpu list <%s>", NULL == cpuList ? "" : cpuList );
+	}
+#else
+	sp_syslog( LOG_WARNING, "cpu affinity is not supported, ignore %s", cpuList );
+#endif
+
+	return ret;
 }
 
 int SP_ThreadPool :: getMaxThreads()
@@ -95,6 +209,166 @@ int SP_ThreadPool :: getMaxThreads()
 	return mMaxThreads;
 }
 
+void SP_ThreadPool :: setAdaptive( int minThreads, int highWaitUsec, int lowUtilization )
+{
+	sp_thread_mutex_lock( &mMainMutex );
+
+	if( minThreads <= 0 ) minThreads = 1;
+	if( minThreads > mMaxThreads ) minThreads = mMaxThreads;
+
+	mAdaptive = 1;
+	mMinThreads = minThreads;
+	mLimit = minThreads;
+	mHighWaitUsec = highWaitUsec > 0 ? highWaitUsec : 2000;
+	mLowUtilization = lowUtilization > 0 ? lowUtilization : 30;
+	mLastAdjust = sp_nowusec();
+
+	sp_syslog( LOG_NOTICE, "[tp@%s] adaptive size %d..%d, wait %dus, util %d%%\n",
+			mTag, mMinThreads, mMaxThreads, mHighWaitUsec, mLowUtilization );
+
+	evictIdle();
+
+	sp_thread_mutex_unlock( &mMainMutex );
+}
+
+int SP_ThreadPool :: adjust()
+{
+	int ret = 0;
+
+	if( 0 == mAdaptive ) return ret;
+
+	sp_thread_mutex_lock( &mMainMutex );
+	ret = doAdjust( sp_nowusec() );
+	sp_thread_mutex_unlock( &mMainMutex );
+
+	return ret;
+}
+
+int SP_ThreadPool :: adjust( int waitUsec, int utilization, int cpuPercent )
+{
+	int ret = 0;
+
+	if( 0 == mAdaptive ) return ret;
+
+	sp_thread_mutex_lock( &mMainMutex );
+	ret = vote( waitUsec, utilization, cpuPercent );
+	sp_thread_mutex_unlock( &mMainMutex );
+
+	return ret;
+}
+
+int SP_ThreadPool :: doAdjust( double now )
+{
+	double elapsed = now - mLastAdjust;
+
+	if( elapsed < SP_ADJUST_INTERVAL_USEC ) return 0;
+
+	int waitUsec = mDispatchCount > 0 ? (int)( mWaitUsec / mDispatchCount ) : 0;
+
+	// a long task finished in this interval counts busy for all of it,
+	// a running one is caught by the busy thread count
+	int busyNow = ( mTotal - mRetiring - mIndex ) * 100 / mLimit;
+	int util = (int)( mBusyUsec * 100 / ( elapsed * mLimit ) );
+	if( busyNow > util ) util = busyNow;
+	if( util > 100 ) util = 100;
+
+	int cpuPercent = -1;
+	if( mCpuUsec >= 0 && mBusyUsec > 0 ) {
+		cpuPercent = (int)( mCpuUsec * 100 / mBusyUsec );
+		if( cpuPercent > 100 ) cpuPercent = 100;
+	}
+
+	int decision = vote( waitUsec, util, cpuPercent );
+
+	mLastAdjust = now;
+	mWaitUsec = mBusyUsec = mCpuUsec = 0;
+	mDispatchCount = 0;
+
+	return decision;
+}
+
+int SP_ThreadPool :: vote( int waitUsec, int util, int cpuPercent )
+{
+	int decision = 0;
+
+	// the tasks hardly block, more threads than cpus only add contention
+	int cpuBound = cpuPercent >= 80 && mNumCpus > 0 && mLimit >= mNumCpus;
+
+	if( mLimit < mMaxThreads && 0 == cpuBound
+			&& ( waitUsec >= mHighWaitUsec || util >= 90 ) ) {
+		mGrowVotes++;
+		mShrinkVotes = 0;
+	} else if( mLimit > mMinThreads
+			&& ( ( util < mLowUtilization && waitUsec < mHighWaitUsec )
+				|| ( cpuBound && mLimit > mNumCpus ) ) ) {
+		mShrinkVotes++;
+		mGrowVotes = 0;
+	} else {
+		mGrowVotes = mShrinkVotes = 0;
+	}
+
+	int oldLimit = mLimit;
+
+	if( mGrowVotes >= SP_GROW_SAMPLES ) {
+		mLimit += mLimit / 2 > 0 ? mLimit / 2 : 1;
+		if( mLimit > mMaxThreads ) mLimit = mMaxThreads;
+		mStat.mGrowCount++;
+		decision = 1;
+
+		// wake up the dispatcher waiting for an idle thread
+		sp_thread_cond_signal( &mIdleCond );
+	} else if( mShrinkVotes >= SP_SHRINK_SAMPLES ) {
+		mLimit--;
+		mStat.mShrinkCount++;
+		decision = -1;
+
+		evictIdle();
+	}
+
+	if( 0 != decision ) {
+		mGrowVotes = mShrinkVotes = 0;
+		sp_syslog( LOG_NOTICE, "[tp@%s] %s %d -> %d, wait %dus, util %d%%, cpu %d%%\n",
+				mTag, decision > 0 ? "grow" : "shrink", oldLimit, mLimit,
+				waitUsec, util, cpuPercent );
+	}
+
+	mStat.mWaitUsec = waitUsec;
+	mStat.mUtilization = util;
+	mStat.mCpuPercent = cpuPercent;
+	mStat.mLastDecision = decision;
+
+	return decision;
+}
+
+void SP_ThreadPool :: evictIdle()
+{
+	for( ; mTotal - mRetiring > mLimit && mIndex > 0; ) {
+		mIndex--;
+		SP_Thread_t * thread = mThreadList[ mIndex ];
+		mThreadList[ mIndex ] = NULL;
+		mRetiring++;
+
+		sp_thread_mutex_lock( &thread->mMutex );
+		thread->mFunc = NULL;
+		sp_thread_cond_signal( &thread->mCond ) ;
+		sp_thread_mutex_unlock ( &thread->mMutex );
+	}
+}
+
+void SP_ThreadPool :: getStat( SP_ThreadPoolStat_t * stat )
+{
+	sp_thread_mutex_lock( &mMainMutex );
+
+	*stat = mStat;
+	stat->mMinThreads = mMinThreads;
+	stat->mMaxThreads = mMaxThreads;
+	stat->mLimit = mLimit;
+	stat->mTotal = mTotal - mRetiring;
+	stat->mIdle = mIndex;
+
+	sp_thread_mutex_unlock( &mMainMutex );
+}
+
 int SP_ThreadPool :: dispatch( DispatchFunc_t dispatchFunc, void *arg )
 {
 	int ret = 0;
@@ -104,8 +378,20 @@ int SP_ThreadPool :: dispatch( DispatchFunc_t dispatchFunc, void *arg )
 
 	sp_thread_mutex_lock( &mMainMutex );
 
-	for( ; mIndex <= 0 && mTotal >= mMaxThreads; ) {
-		sp_thread_cond_wait( &mIdleCond, &mMainMutex );
+	if( mIndex <= 0 && mTotal - mRetiring >= mLimit ) {
+		double waitStart = mAdaptive ? sp_nowusec() : 0;
+
+		for( ; mIndex <= 0 && mTotal - mRetiring >= mLimit; ) {
+			sp_thread_cond_wait( &mIdleCond, &mMainMutex );
+			if( mAdaptive ) doAdjust( sp_nowusec() );
+		}
+
+		if( mAdaptive ) mWaitUsec += sp_nowusec() - waitStart;
+	}
+
+	if( mAdaptive ) {
+		mDispatchCount++;
+		doAdjust( sp_nowusec() );
 	}
 
 	if( mIndex <= 0 ) {
@@ -153,16 +439,39 @@ int SP_ThreadPool :: dispatch( DispatchFunc_t dispatchFunc, void *arg )
 sp_thread_result_t SP_THREAD_CALL SP_ThreadPool :: wrapperFunc( void * arg )
 {
 	SP_Thread_t * thread = ( SP_Thread_t * )arg;
+	SP_ThreadPool * parent = thread->mParent;
+
+	int isRetired = 0;
+
+	if( NULL != parent->mCpuList ) setCpuAffinity( parent->mCpuList );
+
+	for( ; 0 == parent->mIsShutdown; ) {
+		double startUsec = 0, startCpu = 0, busyUsec = 0, cpuUsec = 0;
+
+		if( parent->mAdaptive ) {
+			startUsec = sp_nowusec();
+			startCpu = sp_cpuusec();
+		}
 
-	for( ; 0 == thread->mParent->mIsShutdown; ) {
 		thread->mFunc( thread->mArg );
 
-		if( 0 != thread->mParent->mIsShutdown ) break;
+		if( parent->mAdaptive ) {
+			busyUsec = sp_nowusec() - startUsec;
+			cpuUsec = startCpu < 0 ? -1 : sp_cpuusec() - startCpu;
+		}
+
+		if( 0 != parent->mIsShutdown ) break;
 
 		sp_thread_mutex_lock( &thread->mMutex );
-		if( 0 == thread->mParent->saveThread( thread ) ) {
+		if( 0 == parent->saveThread( thread, busyUsec, cpuUsec ) ) {
 			sp_thread_cond_wait( &thread->mCond, &thread->mMutex );
 			sp_thread_mutex_unlock( &thread->mMutex );
+
+			// evicted by the shrink policy
+			if( NULL == thread->mFunc ) {
+				isRetired = 1;
+				break;
+			}
 		} else {
 			sp_thread_mutex_unlock( &thread->mMutex );
 			sp_thread_cond_destroy( &thread->mCond );
@@ -175,24 +484,45 @@ sp_thread_result_t SP_THREAD_CALL SP_ThreadPool :: wrapperFunc( void * arg )
 	}
 
 	if( NULL != thread ) {
-		sp_thread_mutex_lock( &thread->mParent->mMainMutex );
-		thread->mParent->mTotal--;
-		if( thread->mParent->mTotal <= 0 ) {
-			sp_thread_cond_signal( &thread->mParent->mEmptyCond );
+		sp_thread_mutex_lock( &parent->mMainMutex );
+		parent->mTotal--;
+		if( isRetired ) {
+			parent->mRetiring--;
+			if( parent->mIndex >= parent->mTotal ) {
+				sp_thread_cond_signal( &parent->mFullCond );
+			}
+		}
+		if( parent->mTotal <= 0 ) {
+			sp_thread_cond_signal( &parent->mEmptyCond );
+		}
+		sp_thread_mutex_unlock( &parent->mMainMutex );
+
+		if( isRetired ) {
+			sp_thread_cond_destroy( &thread->mCond );
+			sp_thread_mutex_destroy( &thread->mMutex );
+			free( thread );
 		}
-		sp_thread_mutex_unlock( &thread->mParent->mMainMutex );
 	}
 
 	return 0;
 }
 
-int SP_ThreadPool :: saveThread( SP_Thread_t * thread )
+int SP_ThreadPool :: saveThread( SP_Thread_t * thread, double busyUsec, double cpuUsec )
 {
 	int ret = -1;
 
 	sp_thread_mutex_lock( &mMainMutex );
 
-	if( mIndex < mMaxThreads ) {
+	if( mAdaptive ) {
+		mBusyUsec += busyUsec;
+		if( cpuUsec < 0 || mCpuUsec < 0 ) {
+			mCpuUsec = -1;
+		} else {
+			mCpuUsec += cpuUsec;
+		}
+	}
+
+	if( mIndex < mMaxThreads && mTotal - mRetiring <= mLimit ) {
 		mThreadList[ mIndex ] = thread;
 		mIndex++;
 		ret = 0;
@@ -202,6 +532,19 @@ int SP_ThreadPool :: saveThread( SP_Thread_t * thread )
 		if( mIndex >= mTotal ) {
 			sp_thread_cond_signal( &mFullCond );
 		}
+	} else {
+		// the pool has been shrunk, let the thread exit
+		mTotal--;
+		sp_syslog( LOG_NOTICE, "[tp@%s] retire a busy thread, %d left\n", mTag, mTotal );
+
+		sp_thread_cond_signal( &mIdleCond );
+
+		if( mIndex >= mTotal ) {
+			sp_thread_cond_signal( &mFullCond );
+		}
+		if( mTotal <= 0 ) {
+			sp_thread_cond_signal( &mEmptyCond );
+		}
 	}
 
 	sp_thread_mutex_unlock( &mMainMutex );
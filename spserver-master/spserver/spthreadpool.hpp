@@ -11,6 +11,20 @@
 
 typedef struct tagSP_Thread SP_Thread_t;
 
+typedef struct tagSP_ThreadPoolStat {
+	int mMinThreads;
+	int mMaxThreads;
+	int mLimit;         // current size limit, in [ mMinThreads, mMaxThreads ]
+	int mTotal;         // threads alive
+	int mIdle;          // threads parked
+	int mWaitUsec;      // average dispatch wait in the last interval
+	int mUtilization;   // percent of mLimit busy in the last interval
+	int mCpuPercent;    // percent of task time spent on cpu, -1 : unknown
+	int mGrowCount;
+	int mShrinkCount;
+	int mLastDecision;  // 1 : grow, -1 : shrink, 0 : keep
+} SP_ThreadPoolStat_t;
+
 class SP_ThreadPool {
 public:
 	typedef void ( * DispatchFunc_t )( void * );
@@ -23,10 +37,45 @@ public:
 
 	int getMaxThreads();
 
+	/**
+	 * @brief grow and shrink the pool between minThreads and maxThreads,
+	 *        grow when a dispatch waits longer than highWaitUsec for an idle
+	 *        thread or the pool is saturated, shrink when the utilization
+	 *        stays below lowUtilization percent; a decision needs several
+	 *        consecutive samples, so the size does not flap
+	 */
+	void setAdaptive( int minThreads, int highWaitUsec = 2000, int lowUtilization = 30 );
+
+	/// re-evaluate the size limit, at most once per interval
+	/// @return 1 : grow, -1 : shrink, 0 : keep
+	int adjust();
+
+	/**
+	 * @brief one interval with given measurements instead of the measured
+	 *        ones, so the grow and shrink votes can be replayed by tests
+	 * @param cpuPercent : percent of task time on cpu, -1 : unknown
+	 * @return as adjust()
+	 */
+	int adjust( int waitUsec, int utilization, int cpuPercent = -1 );
+
+	void getStat( SP_ThreadPoolStat_t * stat );
+
+	/// pin the threads of this pool to a cpu list, such as "0-3,8",
+	/// call it before the first dispatch
+	void setCpuList( const char * cpuList );
+
+	/**
+	 * @brief pin the calling thread to a cpu list, such as "0-3,8"
+	 * @return 0 : OK, -1 : bad list or not supported on this platform
+	 */
+	static int setCpuAffinity( const char * cpuList );
+
 private:
 	char * mTag;
 
 	int mMaxThreads;
+	int mMinThreads;
+	int mLimit;
 	int mIndex;
 	int mTotal;
 	int mIsShutdown;
@@ -38,8 +87,30 @@ private:
 
 	SP_Thread_t ** mThreadList;
 
+	char * mCpuList;
+
+	// adaptive sizing
+	int mAdaptive;
+	int mRetiring;
+	int mHighWaitUsec;
+	int mLowUtilization;
+	int mNumCpus;
+	int mGrowVotes;
+	int mShrinkVotes;
+	double mLastAdjust;
+	double mWaitUsec;
+	double mBusyUsec;
+	double mCpuUsec;
+	int mDispatchCount;
+	SP_ThreadPoolStat_t mStat;
+
 	static sp_thread_result_t SP_THREAD_CALL wrapperFunc( void * );
-	int saveThread( SP_Thread_t * thread );
+	int saveThread( SP_Thread_t * thread, double busyUsec, double cpuUsec );
+	void evictIdle();
+	int doAdjust( double now );
+
+	// count the votes of one interval, with mMainMutex held
+	int vote( int waitUsec, int util, int cpuPercent );
 };
 
 #endif
@@ -0,0 +1,515 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sptopic.hpp"
+#include "spthread.hpp"
+#include "sputils.hpp"
+
+// the head of the nodes of the chained hash tables below
+typedef struct tagSP_TopicNode {
+	unsigned int mHash;
+	struct tagSP_TopicNode * mNext;
+} SP_TopicNode_t;
+
+typedef struct tagSP_TopicTable {
+	SP_TopicNode_t ** mBuckets;
+	int mSize;
+	int mCount;
+} SP_TopicTable_t;
+
+typedef struct tagSP_TopicMember {
+	SP_TopicNode_t mNode;
+	SP_Sid_t mSid;
+
+	// in mSids of the topic
+	int mIndex;
+} SP_TopicMember_t;
+
+struct tagSP_Topic {
+	SP_TopicNode_t mNode;
+	char * mName;
+
+	// dense, a removed sid is replaced by the last one
+	SP_Sid_t * mSids;
+	int mCount, mMaxCount;
+
+	// sid -> SP_TopicMember_t
+	SP_TopicTable_t mMembers;
+
+	// NULL after a change, built by the next publish
+	SP_SidSnapshot * mSnapshot;
+};
+
+// the topics of a sid, to remove it from all of them
+typedef struct tagSP_TopicSubscriber {
+	SP_TopicNode_t mNode;
+	SP_Sid_t mSid;
+	SP_ArrayList * mTopics;
+} SP_TopicSubscriber_t;
+
+struct tagSP_TopicShard {
+	sp_thread_mutex_t mMutex;
+
+	// name -> SP_Topic_t, sid -> SP_TopicSubscriber_t
+	SP_TopicTable_t mTopics;
+	SP_TopicTable_t mSubscribers;
+};
+
+//-------------------------------------------------------------------
+
+static unsigned int sp_topic_mix( unsigned int hash )
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static unsigned int sp_topic_hash( const char * topic )
+{
+	unsigned int hash = 2166136261U;
+	for( const unsigned char * p = (const unsigned char*)topic; '\0' != *p; p++ ) {
+		hash = ( hash ^ *p ) * 16777619U;
+	}
+
+	return sp_topic_mix( hash );
+}
+
+static unsigned int sp_sid_hash( SP_Sid_t sid )
+{
+	return sp_topic_mix( sid.mKey * 2654435761U + sid.mSeq );
+}
+
+static void sp_table_init( SP_TopicTable_t * table )
+{
+	table->mSize = 8;
+	table->mCount = 0;
+	table->mBuckets = (SP_TopicNode_t**)calloc( table->mSize, sizeof( SP_TopicNode_t * ) );
+}
+
+static SP_TopicNode_t * sp_table_head( SP_TopicTable_t * table, unsigned int hash )
+{
+	return table->mBuckets[ hash & ( table->mSize - 1 ) ];
+}
+
+static void sp_table_add( SP_TopicTable_t * table, SP_TopicNode_t * node )
+{
+	// keep the chains short, the size is a power of 2
+	if( table->mCount >= table->mSize ) {
+		int size = table->mSize * 2;
+		SP_TopicNode_t ** buckets = (SP_TopicNode_t**)calloc( size, sizeof( SP_TopicNode_t * ) );
+
+		for( int i = 0; i < table->mSize; i++ ) {
+			for( SP_TopicNode_t * iter = table->mBuckets[i]; NULL != iter; ) {
+				SP_TopicNode_t * next = iter->mNext;
+				SP_TopicNode_t ** head = &( buckets[ iter->mHash & ( size - 1 ) ] );
+				iter->mNext = *head;
+				*head = iter;
+				iter = next;
+			}
+		}
+
+		free( table->mBuckets );
+		table->mBuckets = buckets;
+		table->mSize = size;
+	}
+
+	SP_TopicNode_t ** head = &( table->mBuckets[ node->mHash & ( table->mSize - 1 ) ] );
+	node->mNext = *head;
+	*head = node;
+	table->mCount++;
+}
+
+static void sp_table_remove( SP_TopicTable_t * table, SP_TopicNode_t * node )
+{
+	SP_TopicNode_t ** iter = &( table->mBuckets[ node->mHash & ( table->mSize - 1 ) ] );
+	for( ; NULL != *iter; iter = &( (*iter)->mNext ) ) {
+		if( *iter == node ) {
+			*iter = node->mNext;
+			table->mCount--;
+			break;
+		}
+	}
+}
+
+static SP_TopicMember_t * sp_topic_find_member( SP_Topic_t * topic, SP_Sid_t sid, unsigned int hash )
+{
+	SP_TopicNode_t * iter = sp_table_head( &( topic->mMembers ), hash );
+	for( ; NULL != iter; iter = iter->mNext ) {
+		SP_TopicMember_t * member = (SP_TopicMember_t*)iter;
+		if( iter->mHash == hash && member->mSid.mKey == sid.mKey
+				&& member->mSid.mSeq == sid.mSeq ) {
+			return member;
+		}
+	}
+
+	return NULL;
+}
+
+static void sp_topic_free( SP_Topic_t * topic )
+{
+	for( int i = 0; i < topic->mMembers.mSize; i++ ) {
+		for( SP_TopicNode_t * iter = topic->mMembers.mBuckets[i]; NULL != iter; ) {
+			SP_TopicNode_t * next = iter->mNext;
+			free( iter );
+			iter = next;
+		}
+	}
+	free( topic->mMembers.mBuckets );
+
+	if( NULL != topic->mSnapshot ) topic->mSnapshot->release();
+
+	free( topic->mSids );
+	free( topic->mName );
+	free( topic );
+}
+
+//-------------------------------------------------------------------
+
+SP_TopicRegistry :: SP_TopicRegistry( int shardCount )
+{
+	mShardCount = shardCount > 0 ? shardCount : 16;
+	mShards = (SP_TopicShard_t*)calloc( mShardCount, sizeof( SP_TopicShard_t ) );
+
+	for( int i = 0; i < mShardCount; i++ ) {
+		sp_thread_mutex_init( &( mShards[i].mMutex ), NULL );
+		sp_table_init( &( mShards[i].mTopics ) );
+		sp_table_init( &( mShards[i].mSubscribers ) );
+	}
+}
+
+SP_TopicRegistry :: ~SP_TopicRegistry()
+{
+	for( int i = 0; i < mShardCount; i++ ) {
+		SP_TopicShard_t * shard = &( mShards[i] );
+
+		for( int j = 0; j < shard->mTopics.mSize; j++ ) {
+			for( SP_TopicNode_t * iter = shard->mTopics.mBuckets[j]; NULL != iter; ) {
+				SP_TopicNode_t * next = iter->mNext;
+				sp_topic_free( (SP_Topic_t*)iter );
+				iter = next;
+			}
+		}
+		free( shard->mTopics.mBuckets );
+
+		for( int j = 0; j < shard->mSubscribers.mSize; j++ ) {
+			for( SP_TopicNode_t * iter = shard->mSubscribers.mBuckets[j]; NULL != iter; ) {
+				SP_TopicNode_t * next = iter->mNext;
+				SP_TopicSubscriber_t * subscriber = (SP_TopicSubscriber_t*)iter;
+				for( ; subscriber->mTopics->getCount() > 0; ) {
+					free( subscriber->mTopics->takeItem( SP_ArrayList::LAST_INDEX ) );
+				}
+				delete subscriber->mTopics;
+				free( subscriber );
+				iter = next;
+			}
+		}
+		free( shard->mSubscribers.mBuckets );
+
+		sp_thread_mutex_destroy( &( shard->mMutex ) );
+	}
+
+	free( mShards );
+	mShards = NULL;
+}
+
+SP_TopicShard_t * SP_TopicRegistry :: getShard( unsigned int hash )
+{
+	// the buckets take the low bits
+	return &( mShards[ ( hash >> 16 ) % mShardCount ] );
+}
+
+void SP_TopicRegistry :: lockShards( SP_TopicShard_t * shard1, SP_TopicShard_t * shard2 )
+{
+	if( shard1 > shard2 ) {
+		SP_TopicShard_t * tmp = shard1;
+		shard1 = shard2;
+		shard2 = tmp;
+	}
+
+	sp_thread_mutex_lock( &( shard1->mMutex ) );
+	if( shard1 != shard2 ) sp_thread_mutex_lock( &( shard2->mMutex ) );
+}
+
+void SP_TopicRegistry :: unlockShards( SP_TopicShard_t * shard1, SP_TopicShard_t * shard2 )
+{
+	sp_thread_mutex_unlock( &( shard1->mMutex ) );
+	if( shard1 != shard2 ) sp_thread_mutex_unlock( &( shard2->mMutex ) );
+}
+
+SP_Topic_t * SP_TopicRegistry :: findTopic( SP_TopicShard_t * shard,
+		const char * topic, unsigned int hash )
+{
+	SP_TopicNode_t * iter = sp_table_head( &( shard->mTopics ), hash );
+	for( ; NULL != iter; iter = iter->mNext ) {
+		if( iter->mHash == hash && 0 == strcmp( ( (SP_Topic_t*)iter )->mName, topic ) ) {
+			return (SP_Topic_t*)iter;
+		}
+	}
+
+	return NULL;
+}
+
+int SP_TopicRegistry :: subscribe( const char * topic, SP_Sid_t sid )
+{
+	int ret = 0;
+
+	unsigned int hash = sp_topic_hash( topic ), sidHash = sp_sid_hash( sid );
+	SP_TopicShard_t * shard = getShard( hash );
+	SP_TopicShard_t * sidShard = getShard( sidHash );
+
+	// the topic and the topics of the sid change together, a concurrent
+	// unsubscribeAll sees both or neither
+	lockShards( shard, sidShard );
+
+	SP_Topic_t * iter = findTopic( shard, topic, hash );
+	if( NULL == iter ) {
+		iter = (SP_Topic_t*)calloc( 1, sizeof( SP_Topic_t ) );
+		iter->mNode.mHash = hash;
+		iter->mName = strdup( topic );
+		sp_table_init( &( iter->mMembers ) );
+		sp_table_add( &( shard->mTopics ), &( iter->mNode ) );
+	}
+
+	if( NULL != sp_topic_find_member( iter, sid, sidHash ) ) {
+		ret = 1;
+	} else {
+		if( iter->mCount >= iter->mMaxCount ) {
+			iter->mMaxCount = iter->mMaxCount * 2 + 8;
+			iter->mSids = (SP_Sid_t*)realloc( iter->mSids, sizeof( SP_Sid_t ) * iter->mMaxCount );
+		}
+
+		SP_TopicMember_t * member = (SP_TopicMember_t*)malloc( sizeof( SP_TopicMember_t ) );
+		member->mNode.mHash = sidHash;
+		member->mSid = sid;
+		member->mIndex = iter->mCount;
+		sp_table_add( &( iter->mMembers ), &( member->mNode ) );
+
+		iter->mSids[ iter->mCount++ ] = sid;
+
+		if( NULL != iter->mSnapshot ) iter->mSnapshot->release();
+		iter->mSnapshot = NULL;
+
+		addTopicOf( sidShard, sid, topic );
+	}
+
+	unlockShards( shard, sidShard );
+
+	return ret;
+}
+
+int SP_TopicRegistry :: removeSid( SP_TopicShard_t * shard, SP_Topic_t * topic, SP_Sid_t sid )
+{
+	SP_TopicMember_t * member = sp_topic_find_member( topic, sid, sp_sid_hash( sid ) );
+	if( NULL == member ) return -1;
+
+	// move the last sid into the hole
+	int index = member->mIndex;
+	SP_Sid_t last = topic->mSids[ --topic->mCount ];
+	if( index < topic->mCount ) {
+		topic->mSids[ index ] = last;
+		sp_topic_find_member( topic, last, sp_sid_hash( last ) )->mIndex = index;
+	}
+
+	sp_table_remove( &( topic->mMembers ), &( member->mNode ) );
+	free( member );
+
+	if( NULL != topic->mSnapshot ) topic->mSnapshot->release();
+	topic->mSnapshot = NULL;
+
+	if( topic->mCount <= 0 ) {
+		sp_table_remove( &( shard->mTopics ), &( topic->mNode ) );
+		sp_topic_free( topic );
+	}
+
+	return 0;
+}
+
+int SP_TopicRegistry :: unsubscribe( const char * topic, SP_Sid_t sid )
+{
+	int ret = -1;
+
+	unsigned int hash = sp_topic_hash( topic );
+	SP_TopicShard_t * shard = getShard( hash );
+	SP_TopicShard_t * sidShard = getShard( sp_sid_hash( sid ) );
+
+	lockShards( shard, sidShard );
+
+	SP_Topic_t * iter = findTopic( shard, topic, hash );
+	if( NULL != iter ) ret = removeSid( shard, iter, sid );
+
+	if( 0 == ret ) removeTopicOf( sidShard, sid, topic );
+
+	unlockShards( shard, sidShard );
+
+	return ret;
+}
+
+int SP_TopicRegistry :: unsubscribeAll( SP_Sid_t sid )
+{
+	unsigned int sidHash = sp_sid_hash( sid );
+	SP_TopicShard_t * shard = getShard( sidHash );
+
+	SP_TopicSubscriber_t * subscriber = NULL;
+
+	// only one mutex at a time, take the topics of the sid out first
+	sp_thread_mutex_lock( &( shard->mMutex ) );
+
+	SP_TopicNode_t * iter = sp_table_head( &( shard->mSubscribers ), sidHash );
+	for( ; NULL != iter; iter = iter->mNext ) {
+		SP_TopicSubscriber_t * theSubscriber = (SP_TopicSubscriber_t*)iter;
+		if( iter->mHash == sidHash && theSubscriber->mSid.mKey == sid.mKey
+				&& theSubscriber->mSid.mSeq == sid.mSeq ) {
+			subscriber = theSubscriber;
+			sp_table_remove( &( shard->mSubscribers ), iter );
+			break;
+		}
+	}
+
+	sp_thread_mutex_unlock( &( shard->mMutex ) );
+
+	if( NULL == subscriber ) return 0;
+
+	int count = subscriber->mTopics->getCount();
+
+	for( ; subscriber->mTopics->getCount() > 0; ) {
+		char * topic = (char*)subscriber->mTopics->takeItem( SP_ArrayList::LAST_INDEX );
+
+		unsigned int hash = sp_topic_hash( topic );
+		SP_TopicShard_t * topicShard = getShard( hash );
+
+		sp_thread_mutex_lock( &( topicShard->mMutex ) );
+
+		SP_Topic_t * theTopic = findTopic( topicShard, topic, hash );
+		if( NULL != theTopic ) removeSid( topicShard, theTopic, sid );
+
+		sp_thread_mutex_unlock( &( topicShard->mMutex ) );
+
+		free( topic );
+	}
+
+	delete subscriber->mTopics;
+	free( subscriber );
+
+	return count;
+}
+
+void SP_TopicRegistry :: addTopicOf( SP_TopicShard_t * shard, SP_Sid_t sid, const char * topic )
+{
+	unsigned int sidHash = sp_sid_hash( sid );
+
+	SP_TopicSubscriber_t * subscriber = NULL;
+
+	SP_TopicNode_t * iter = sp_table_head( &( shard->mSubscribers ), sidHash );
+	for( ; NULL != iter && NULL == subscriber; iter = iter->mNext ) {
+		SP_TopicSubscriber_t * theSubscriber = (SP_TopicSubscriber_t*)iter;
+		if( iter->mHash == sidHash && theSubscriber->mSid.mKey == sid.mKey
+				&& theSubscriber->mSid.mSeq == sid.mSeq ) {
+			subscriber = theSubscriber;
+		}
+	}
+
+	if( NULL == subscriber ) {
+		subscriber = (SP_TopicSubscriber_t*)malloc( sizeof( SP_TopicSubscriber_t ) );
+		subscriber->mNode.mHash = sidHash;
+		subscriber->mSid = sid;
+		subscriber->mTopics = new SP_ArrayList();
+		sp_table_add( &( shard->mSubscribers ), &( subscriber->mNode ) );
+	}
+
+	subscriber->mTopics->append( strdup( topic ) );
+}
+
+void SP_TopicRegistry :: removeTopicOf( SP_TopicShard_t * shard, SP_Sid_t sid, const char * topic )
+{
+	unsigned int sidHash = sp_sid_hash( sid );
+
+	SP_TopicNode_t * iter = sp_table_head( &( shard->mSubscribers ), sidHash );
+	for( ; NULL != iter; iter = iter->mNext ) {
+		SP_TopicSubscriber_t * subscriber = (SP_TopicSubscriber_t*)iter;
+		if( iter->mHash != sidHash || subscriber->mSid.mKey != sid.mKey
+				|| subscriber->mSid.mSeq != sid.mSeq ) {
+			continue;
+		}
+
+		// a sid subscribes a few topics
+		SP_ArrayList * topics = subscriber->mTopics;
+		for( int i = 0; i < topics->getCount(); i++ ) {
+			if( 0 == strcmp( (char*)topics->getItem( i ), topic ) ) {
+				free( topics->takeItem( i ) );
+				break;
+			}
+		}
+
+		if( topics->getCount() <= 0 ) {
+			sp_table_remove( &( shard->mSubscribers ), iter );
+			delete topics;
+			free( subscriber );
+		}
+
+		break;
+	}
+}
+
+int SP_TopicRegistry :: publish( const char * topic, SP_Message * msg )
+{
+	int count = 0;
+
+	unsigned int hash = sp_topic_hash( topic );
+	SP_TopicShard_t * shard = getShard( hash );
+
+	sp_thread_mutex_lock( &( shard->mMutex ) );
+
+	SP_Topic_t * iter = findTopic( shard, topic, hash );
+	if( NULL != iter && iter->mCount > 0 ) {
+		if( NULL == iter->mSnapshot ) {
+			iter->mSnapshot = new SP_SidSnapshot( iter->mSids, iter->mCount );
+		}
+
+		msg->getToList()->share( iter->mSnapshot );
+		count = iter->mCount;
+	}
+
+	sp_thread_mutex_unlock( &( shard->mMutex ) );
+
+	return count;
+}
+
+int SP_TopicRegistry :: getCount( const char * topic )
+{
+	int count = 0;
+
+	unsigned int hash = sp_topic_hash( topic );
+	SP_TopicShard_t * shard = getShard( hash );
+
+	sp_thread_mutex_lock( &( shard->mMutex ) );
+
+	SP_Topic_t * iter = findTopic( shard, topic, hash );
+	if( NULL != iter ) count = iter->mCount;
+
+	sp_thread_mutex_unlock( &( shard->mMutex ) );
+
+	return count;
+}
+
+int SP_TopicRegistry :: getTopicCount()
+{
+	int count = 0;
+
+	for( int i = 0; i < mShardCount; i++ ) {
+		sp_thread_mutex_lock( &( mShards[i].mMutex ) );
+		count += mShards[i].mTopics.mCount;
+		sp_thread_mutex_unlock( &( mShards[i].mMutex ) );
+	}
+
+	return count;
+}
+
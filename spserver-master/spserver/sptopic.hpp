@@ -0,0 +1,80 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+
+#ifndef __sptopic_hpp__
+#define __sptopic_hpp__
+
+#include "spresponse.hpp"
+
+typedef struct tagSP_TopicShard SP_TopicShard_t;
+typedef struct tagSP_Topic SP_Topic_t;
+
+/**
+ * @brief the subscribers of named topics, such as the members of chat rooms,
+ *        shared by the handlers of a server.
+ *
+ *        The topics are spread over shards, each with its own mutex.
+ *        Subscribe and unsubscribe are O(1). A publish does not copy the
+ *        subscribers, the to-list of the message refers to an immutable
+ *        snapshot of the topic. The snapshot is shared by all the messages
+ *        until the topic changes, and the first publish after a change
+ *        builds a new one; the old one lives until its last message is done.
+ *
+ *        With SP_Server::setTopicRegistry, the sid of a closed session is
+ *        removed from all its topics by the server.
+ */
+class SP_TopicRegistry {
+public:
+	SP_TopicRegistry( int shardCount = 16 );
+	~SP_TopicRegistry();
+
+	/// @return 0 : subscribed, 1 : already subscribed
+	int subscribe( const char * topic, SP_Sid_t sid );
+
+	/// @return 0 : unsubscribed, -1 : not subscribed
+	int unsubscribe( const char * topic, SP_Sid_t sid );
+
+	/// remove the sid from every topic it subscribes, O(topics of the sid)
+	/// @return the count of topics
+	int unsubscribeAll( SP_Sid_t sid );
+
+	/**
+	 * @brief address msg to the subscribers of topic, the to-list of msg
+	 *        is replaced by the snapshot of the topic
+	 * @return the count of subscribers, 0 : no subscriber, msg is untouched
+	 */
+	int publish( const char * topic, SP_Message * msg );
+
+	/// the count of subscribers of topic
+	int getCount( const char * topic );
+
+	/// the count of topics with subscribers
+	int getTopicCount();
+
+private:
+	SP_TopicRegistry( SP_TopicRegistry & );
+	SP_TopicRegistry & operator=( SP_TopicRegistry & );
+
+	SP_TopicShard_t * mShards;
+	int mShardCount;
+
+	SP_TopicShard_t * getShard( unsigned int hash );
+
+	// the shards of a topic and a sid, locked in address order
+	static void lockShards( SP_TopicShard_t * shard1, SP_TopicShard_t * shard2 );
+	static void unlockShards( SP_TopicShard_t * shard1, SP_TopicShard_t * shard2 );
+
+	// with the mutex of the shard held
+	SP_Topic_t * findTopic( SP_TopicShard_t * shard, const char * topic, unsigned int hash );
+	int removeSid( SP_TopicShard_t * shard, SP_Topic_t * topic, SP_Sid_t sid );
+
+	// the topics of a sid are kept in the shard of the sid, with its mutex held
+	void addTopicOf( SP_TopicShard_t * shard, SP_Sid_t sid, const char * topic );
+	void removeTopicOf( SP_TopicShard_t * shard, SP_Sid_t sid, const char * topic );
+};
+
+#endif
+
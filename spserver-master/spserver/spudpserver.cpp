@@ -0,0 +1,618 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "spudpserver.hpp"
+#include "sphandler.hpp"
+#include "sprequest.hpp"
+#include "spresponse.hpp"
+#include "spmsgdecoder.hpp"
+#include "spmsgblock.hpp"
+#include "spbuffer.hpp"
+#include "spexecutor.hpp"
+#include "sputils.hpp"
+#include "spioutils.hpp"
+#include "spthreadpool.hpp"
+
+#include "event_msgqueue.h"
+
+typedef struct tagSP_UdpPacket {
+	struct sockaddr_in mAddr;
+	int mLen;
+
+	// in the replies of the batch
+	int mReplyOffset;
+	int mReplyLen;
+} SP_UdpPacket_t;
+
+struct tagSP_UdpBatch {
+	SP_UdpReactor_t * mReactor;
+
+	// datagrams received, then replies to send
+	int mCount;
+	int mSent;
+
+	SP_UdpPacket_t * mPackets;
+	char * mData;
+	SP_Buffer * mReplies;
+
+	struct iovec * mIovs;
+#ifdef MSG_WAITFORONE
+	struct mmsghdr * mMsgs;
+#endif
+};
+
+struct tagSP_UdpReactor {
+	SP_UdpServer * mServer;
+	int mIndex;
+	int mFd;
+
+	struct event_base * mBase;
+	struct event mEvRead, mEvWrite, mEvWakeup;
+	int mIsReading, mIsWriting;
+
+	// batches back from the workers
+	struct event_msgqueue * mDoneQueue;
+
+	SP_CircleQueue * mSending;
+	SP_ArrayList * mFree;
+
+	// every batch of the reactor, at most mMaxBatches
+	SP_ArrayList * mBatches;
+	int mMaxBatches;
+
+	// datagrams dropped for being longer than mMaxDatagram
+	int mTruncated;
+};
+
+SP_UdpServer :: SP_UdpServer( const char * bindIP, int port,
+		SP_HandlerFactory * handlerFactory )
+{
+	snprintf( mBindIP, sizeof( mBindIP ), "%s", bindIP );
+	mPort = port;
+	mIsShutdown = 0;
+	mIsRunning = 0;
+
+	mHandlerFactory = handlerFactory;
+
+	mMaxThreads = 4;
+	mBatchSize = 32;
+	mMaxDatagram = 4096;
+	mReactorCount = 1;
+
+	mReactors = NULL;
+	mExecutor = NULL;
+}
+
+SP_UdpServer :: ~SP_UdpServer()
+{
+	if( NULL != mHandlerFactory ) delete mHandlerFactory;
+	mHandlerFactory = NULL;
+}
+
+void SP_UdpServer :: setMaxThreads( int maxThreads )
+{
+	mMaxThreads = maxThreads > 0 ? maxThreads : mMaxThreads;
+}
+
+void SP_UdpServer :: setBatchSize( int batchSize )
+{
+	mBatchSize = batchSize > 0 ? batchSize : mBatchSize;
+}
+
+void SP_UdpServer :: setMaxDatagram( int maxDatagram )
+{
+	mMaxDatagram = maxDatagram > 0 ? maxDatagram : mMaxDatagram;
+}
+
+void SP_UdpServer :: setReactors( int reactors )
+{
+	mReactorCount = reactors > 0 ? reactors : mReactorCount;
+}
+
+void SP_UdpServer :: shutdown()
+{
+	mIsShutdown = 1;
+}
+
+int SP_UdpServer :: isRunning()
+{
+	return mIsRunning;
+}
+
+int SP_UdpServer :: run()
+{
+	int ret = -1;
+
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	assert( sp_thread_attr_setstacksize( &attr, 1024 * 1024 ) == 0 );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	sp_thread_t thread;
+	ret = sp_thread_create( &thread, &attr, eventLoop, this );
+	sp_thread_attr_destroy( &attr );
+	if( 0 == ret ) {
+		sp_syslog( LOG_NOTICE, "Thread #%ld has been created for UDP server on port [%d]", thread, mPort );
+	} else {
+		mIsRunning = 0;
+		sp_syslog( LOG_WARNING, "Unable to create a thread for UDP server on port [%d], %s",
+			mPort, strerror( errno ) ) ;
+	}
+
+	return ret;
+}
+
+void SP_UdpServer :: runForever()
+{
+	eventLoop( this );
+}
+
+sp_thread_result_t SP_THREAD_CALL SP_UdpServer :: eventLoop( void * arg )
+{
+	SP_UdpServer * server = (SP_UdpServer*)arg;
+
+	server->mIsRunning = 1;
+
+	server->start();
+
+	server->mIsRunning = 0;
+
+	return 0;
+}
+
+void SP_UdpServer :: sigHandler( int, short, void * arg )
+{
+	SP_UdpServer * server = (SP_UdpServer*)arg;
+	server->shutdown();
+}
+
+void SP_UdpServer :: wakeupTimer( int, short, void * arg )
+{
+	// only wake up the loop, a shutdown is checked after it
+	struct timeval tv = { 1, 0 };
+	evtimer_add( (struct event*)arg, &tv );
+}
+
+void SP_UdpServer :: reactorHandler( void * arg )
+{
+	SP_UdpReactor_t * reactor = (SP_UdpReactor_t*)arg;
+	reactor->mServer->loop( reactor );
+}
+
+void SP_UdpServer :: loop( SP_UdpReactor_t * reactor )
+{
+	for( ; 0 == mIsShutdown; ) {
+		event_base_loop( reactor->mBase, EVLOOP_ONCE );
+
+		// the replies of all the batches done in this iteration go out together
+		if( 0 == reactor->mIsWriting ) sendReplies( reactor );
+
+		if( 0 == reactor->mIsReading && reactor->mFree->getCount() > 0 ) {
+			event_add( &( reactor->mEvRead ), NULL );
+			reactor->mIsReading = 1;
+		}
+	}
+}
+
+SP_UdpBatch_t * SP_UdpServer :: newBatch( SP_UdpReactor_t * reactor )
+{
+	if( reactor->mFree->getCount() > 0 ) {
+		return (SP_UdpBatch_t*)reactor->mFree->takeItem( SP_ArrayList::LAST_INDEX );
+	}
+
+	if( reactor->mBatches->getCount() >= reactor->mMaxBatches ) return NULL;
+
+	SP_UdpBatch_t * batch = (SP_UdpBatch_t*)calloc( 1, sizeof( SP_UdpBatch_t ) );
+	batch->mReactor = reactor;
+	batch->mPackets = (SP_UdpPacket_t*)calloc( mBatchSize, sizeof( SP_UdpPacket_t ) );
+	batch->mData = (char*)malloc( mBatchSize * mMaxDatagram );
+	batch->mReplies = new SP_Buffer();
+	batch->mIovs = (struct iovec*)calloc( mBatchSize, sizeof( struct iovec ) );
+#ifdef MSG_WAITFORONE
+	batch->mMsgs = (struct mmsghdr*)calloc( mBatchSize, sizeof( struct mmsghdr ) );
+#endif
+
+	reactor->mBatches->append( batch );
+
+	return batch;
+}
+
+void SP_UdpServer :: freeBatch( SP_UdpBatch_t * batch )
+{
+	free( batch->mPackets );
+	free( batch->mData );
+	delete batch->mReplies;
+	free( batch->mIovs );
+#ifdef MSG_WAITFORONE
+	free( batch->mMsgs );
+#endif
+	free( batch );
+}
+
+int SP_UdpServer :: recvBatch( SP_UdpReactor_t * reactor, SP_UdpBatch_t * batch )
+{
+	int ret = 0;
+
+	batch->mCount = batch->mSent = 0;
+
+#ifdef MSG_WAITFORONE
+	for( int i = 0; i < mBatchSize; i++ ) {
+		batch->mIovs[i].iov_base = batch->mData + i * mMaxDatagram;
+		batch->mIovs[i].iov_len = mMaxDatagram;
+
+		struct msghdr * hdr = &( batch->mMsgs[i].msg_hdr );
+		memset( hdr, 0, sizeof( struct msghdr ) );
+		hdr->msg_name = &( batch->mPackets[i].mAddr );
+		hdr->msg_namelen = sizeof( struct sockaddr_in );
+		hdr->msg_iov = &( batch->mIovs[i] );
+		hdr->msg_iovlen = 1;
+	}
+
+	ret = recvmmsg( reactor->mFd, batch->mMsgs, mBatchSize, 0, NULL );
+
+	for( int i = 0; i < ret; i++ ) {
+		batch->mPackets[i].mLen = batch->mMsgs[i].msg_len;
+		if( batch->mMsgs[i].msg_hdr.msg_flags & MSG_TRUNC ) batch->mPackets[i].mLen = -1;
+	}
+#else
+	for( ; ret < mBatchSize; ret++ ) {
+		SP_UdpPacket_t * packet = &( batch->mPackets[ ret ] );
+
+		batch->mIovs[0].iov_base = batch->mData + ret * mMaxDatagram;
+		batch->mIovs[0].iov_len = mMaxDatagram;
+
+		struct msghdr hdr;
+		memset( &hdr, 0, sizeof( hdr ) );
+		hdr.msg_name = &( packet->mAddr );
+		hdr.msg_namelen = sizeof( packet->mAddr );
+		hdr.msg_iov = &( batch->mIovs[0] );
+		hdr.msg_iovlen = 1;
+
+		int len = recvmsg( reactor->mFd, &hdr, 0 );
+		if( len < 0 ) {
+			if( 0 == ret ) ret = -1;
+			break;
+		}
+		packet->mLen = ( hdr.msg_flags & MSG_TRUNC ) ? -1 : len;
+	}
+#endif
+
+	// the tail of a truncated datagram is lost, so it is not handled at all
+	int truncated = 0;
+	for( int i = 0; i < ret; i++ ) {
+		if( batch->mPackets[i].mLen < 0 ) truncated++;
+	}
+
+	if( truncated > 0 ) {
+		reactor->mTruncated += truncated;
+		sp_syslog( LOG_WARNING, "drop %d datagrams longer than %d bytes on port [%d], %d in all",
+				truncated, mMaxDatagram, mPort, reactor->mTruncated );
+	}
+
+	if( ret < 0 ) {
+		if( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno ) {
+			sp_syslog( LOG_WARNING, "recv datagrams on port [%d] failed, errno %d, %s",
+					mPort, errno, strerror( errno ) );
+		}
+		ret = 0;
+	}
+
+	batch->mCount = ret;
+
+	return ret;
+}
+
+void SP_UdpServer :: onRead( int fd, short events, void * arg )
+{
+	SP_UdpReactor_t * reactor = (SP_UdpReactor_t*)arg;
+	SP_UdpServer * server = reactor->mServer;
+
+	// a few batches per wakeup, so the replies are not held back too long
+	for( int i = 0; i < 4; i++ ) {
+		SP_UdpBatch_t * batch = server->newBatch( reactor );
+
+		if( NULL == batch ) {
+			// all the batches are with the workers, leave the rest in the socket buffer
+			event_del( &( reactor->mEvRead ) );
+			reactor->mIsReading = 0;
+			break;
+		}
+
+		int count = server->recvBatch( reactor, batch );
+
+		if( count <= 0 ) {
+			reactor->mFree->append( batch );
+			break;
+		}
+
+		server->mExecutor->execute( handleBatch, batch );
+
+		if( count < server->mBatchSize ) break;
+	}
+}
+
+void SP_UdpServer :: handleBatch( void * arg )
+{
+	SP_UdpBatch_t * batch = (SP_UdpBatch_t*)arg;
+	SP_UdpServer * server = batch->mReactor->mServer;
+
+	SP_Handler * handler = server->mHandlerFactory->create();
+
+	SP_Request request;
+	request.setServerIP( server->mBindIP );
+
+	SP_Buffer inBuffer;
+
+	batch->mReplies->reset();
+
+	for( int i = 0; i < batch->mCount; i++ ) {
+		handleDatagram( handler, &request, &inBuffer, batch, i );
+	}
+
+	handler->close();
+	delete handler;
+
+	msgqueue_push( batch->mReactor->mDoneQueue, batch );
+}
+
+void SP_UdpServer :: handleDatagram( SP_Handler * handler, SP_Request * request,
+		SP_Buffer * inBuffer, SP_UdpBatch_t * batch, int index )
+{
+	SP_UdpServer * server = batch->mReactor->mServer;
+	SP_UdpPacket_t * packet = &( batch->mPackets[ index ] );
+
+	packet->mReplyOffset = batch->mReplies->getSize();
+	packet->mReplyLen = 0;
+
+	if( packet->mLen <= 0 ) return;
+
+	char clientIP[ 32 ] = { 0 };
+	SP_IOUtils::inetNtoa( &( packet->mAddr.sin_addr ), clientIP, sizeof( clientIP ) );
+	request->setClientIP( clientIP );
+	request->setClientPort( ntohs( packet->mAddr.sin_port ) );
+
+	inBuffer->reset();
+	inBuffer->append( batch->mData + index * server->mMaxDatagram, packet->mLen );
+	if( SP_MsgDecoder::eOK != request->getMsgDecoder()->decode( inBuffer ) ) return;
+
+	// keys 0 and 1 are taken by the timer and the push sids
+	SP_Sid_t sid;
+	sid.mKey = batch->mReactor->mIndex + 2;
+	sid.mSeq = index;
+
+	SP_Response response( sid );
+	handler->handle( request, &response );
+
+	// only the messages to the sender are sent, as one datagram
+	for( SP_Message * msg = response.takeMessage(); NULL != msg;
+			msg = response.takeMessage() ) {
+		if( msg->getToList()->find( sid ) >= 0 ) {
+			batch->mReplies->append( msg->getMsg() );
+
+			SP_MsgBlockList * blockList = msg->getFollowBlockList();
+			for( int i = 0; i < blockList->getCount(); i++ ) {
+				const SP_MsgBlock * block = blockList->getItem( i );
+				if( block->getSize() > 0 ) {
+					batch->mReplies->append( block->getData(), block->getSize() );
+				}
+			}
+		}
+		delete msg;
+	}
+
+	packet->mReplyLen = batch->mReplies->getSize() - packet->mReplyOffset;
+}
+
+void SP_UdpServer :: onDone( void * queueData, void * arg )
+{
+	SP_UdpBatch_t * batch = (SP_UdpBatch_t*)queueData;
+	SP_UdpReactor_t * reactor = (SP_UdpReactor_t*)arg;
+
+	// keep the datagrams with a reply at the front
+	int count = 0;
+	for( int i = 0; i < batch->mCount; i++ ) {
+		if( batch->mPackets[i].mReplyLen > 0 ) {
+			if( i != count ) batch->mPackets[ count ] = batch->mPackets[i];
+			count++;
+		}
+	}
+	batch->mCount = count;
+	batch->mSent = 0;
+
+	reactor->mSending->push( batch );
+}
+
+void SP_UdpServer :: onWrite( int fd, short events, void * arg )
+{
+	SP_UdpReactor_t * reactor = (SP_UdpReactor_t*)arg;
+
+	// the loop sends the rest after this iteration
+	reactor->mIsWriting = 0;
+}
+
+void SP_UdpServer :: sendReplies( SP_UdpReactor_t * reactor )
+{
+	for( SP_UdpBatch_t * batch = (SP_UdpBatch_t*)reactor->mSending->top();
+			NULL != batch; batch = (SP_UdpBatch_t*)reactor->mSending->top() ) {
+
+		const char * replies = (const char*)batch->mReplies->getBuffer();
+
+		for( ; batch->mSent < batch->mCount; ) {
+			SP_UdpPacket_t * packets = &( batch->mPackets[ batch->mSent ] );
+
+#ifdef MSG_WAITFORONE
+			int count = batch->mCount - batch->mSent;
+			for( int i = 0; i < count; i++ ) {
+				batch->mIovs[i].iov_base = (void*)( replies + packets[i].mReplyOffset );
+				batch->mIovs[i].iov_len = packets[i].mReplyLen;
+
+				struct msghdr * hdr = &( batch->mMsgs[i].msg_hdr );
+				memset( hdr, 0, sizeof( struct msghdr ) );
+				hdr->msg_name = &( packets[i].mAddr );
+				hdr->msg_namelen = sizeof( struct sockaddr_in );
+				hdr->msg_iov = &( batch->mIovs[i] );
+				hdr->msg_iovlen = 1;
+			}
+
+			int ret = sendmmsg( reactor->mFd, batch->mMsgs, count, 0 );
+#else
+			int ret = sendto( reactor->mFd, replies + packets->mReplyOffset, packets->mReplyLen, 0,
+					(struct sockaddr*)&( packets->mAddr ), sizeof( packets->mAddr ) );
+			if( ret >= 0 ) ret = 1;
+#endif
+
+			if( ret > 0 ) {
+				batch->mSent += ret;
+			} else if( EAGAIN == errno || EWOULDBLOCK == errno ) {
+				// the socket buffer is full, go on when it is writable
+				event_add( &( reactor->mEvWrite ), NULL );
+				reactor->mIsWriting = 1;
+				return;
+			} else if( EINTR != errno ) {
+				// such as a reply too long for a datagram, skip it
+				char clientIP[ 32 ] = { 0 };
+				SP_IOUtils::inetNtoa( &( packets->mAddr.sin_addr ), clientIP, sizeof( clientIP ) );
+				sp_syslog( LOG_WARNING, "send %d bytes to %s:%d failed, errno %d, %s",
+						packets->mReplyLen, clientIP, ntohs( packets->mAddr.sin_port ),
+						errno, strerror( errno ) );
+				batch->mSent++;
+			}
+		}
+
+		reactor->mSending->pop();
+		reactor->mFree->append( batch );
+	}
+}
+
+int SP_UdpServer :: start()
+{
+#ifdef SIGPIPE
+	/* Don't die with SIGPIPE on remote read shutdown. That's dumb. */
+	signal( SIGPIPE, SIG_IGN );
+#endif
+
+	int ret = 0;
+
+	mReactors = (SP_UdpReactor_t*)calloc( mReactorCount, sizeof( SP_UdpReactor_t ) );
+
+	// every reactor binds its own socket, the kernel spreads the senders over them
+	for( int i = 0; i < mReactorCount; i++ ) {
+		mReactors[i].mFd = -1;
+		if( 0 == ret ) {
+			ret = SP_IOUtils::udpBind( mBindIP, mPort, &( mReactors[i].mFd ), 0,
+					mReactorCount > 1 );
+		}
+	}
+
+	if( 0 == ret ) {
+		SP_Executor executor( mMaxThreads, "udp" );
+		mExecutor = &executor;
+
+		for( int i = 0; i < mReactorCount; i++ ) {
+			SP_UdpReactor_t * reactor = &( mReactors[i] );
+
+			reactor->mServer = this;
+			reactor->mIndex = i;
+			reactor->mBase = (struct event_base*)event_init();
+
+			reactor->mSending = new SP_CircleQueue();
+			reactor->mFree = new SP_ArrayList();
+			reactor->mBatches = new SP_ArrayList();
+			reactor->mMaxBatches = mMaxThreads * 2 / mReactorCount + 2;
+
+			reactor->mDoneQueue = msgqueue_new( reactor->mBase, 0, onDone, reactor );
+
+			event_set( &( reactor->mEvRead ), reactor->mFd, EV_READ | EV_PERSIST, onRead, reactor );
+			event_base_set( reactor->mBase, &( reactor->mEvRead ) );
+			event_add( &( reactor->mEvRead ), NULL );
+			reactor->mIsReading = 1;
+
+			event_set( &( reactor->mEvWrite ), reactor->mFd, EV_WRITE, onWrite, reactor );
+			event_base_set( reactor->mBase, &( reactor->mEvWrite ) );
+
+			// a reactor may have no datagrams, wake it up to see a shutdown
+			struct timeval tv = { 1, 0 };
+			evtimer_set( &( reactor->mEvWakeup ), wakeupTimer, &( reactor->mEvWakeup ) );
+			event_base_set( reactor->mBase, &( reactor->mEvWakeup ) );
+			evtimer_add( &( reactor->mEvWakeup ), &tv );
+		}
+
+		// Clean close on SIGINT or SIGTERM.
+		struct event evSigInt, evSigTerm;
+		signal_set( &evSigInt, SIGINT,  sigHandler, this );
+		event_base_set( mReactors[0].mBase, &evSigInt );
+		signal_add( &evSigInt, NULL);
+		signal_set( &evSigTerm, SIGTERM, sigHandler, this );
+		event_base_set( mReactors[0].mBase, &evSigTerm );
+		signal_add( &evSigTerm, NULL);
+
+		SP_ThreadPool * threadPool = NULL;
+		if( mReactorCount > 1 ) {
+			threadPool = new SP_ThreadPool( mReactorCount - 1, "udp-reactor" );
+			for( int i = 1; i < mReactorCount; i++ ) {
+				threadPool->dispatch( reactorHandler, &( mReactors[i] ) );
+			}
+		}
+
+		loop( &( mReactors[0] ) );
+
+		// wait for the other reactors
+		if( NULL != threadPool ) delete threadPool;
+
+		sp_syslog( LOG_NOTICE, "UDP server is shutdown." );
+
+		signal_del( &evSigTerm );
+		signal_del( &evSigInt );
+
+		for( int i = 0; i < mReactorCount; i++ ) {
+			SP_UdpReactor_t * reactor = &( mReactors[i] );
+
+			event_del( &( reactor->mEvWakeup ) );
+			if( reactor->mIsWriting ) event_del( &( reactor->mEvWrite ) );
+			if( reactor->mIsReading ) event_del( &( reactor->mEvRead ) );
+		}
+
+		// the executor waits for the batches with the workers
+	}
+
+	mExecutor = NULL;
+
+	for( int i = 0; i < mReactorCount; i++ ) {
+		SP_UdpReactor_t * reactor = &( mReactors[i] );
+
+		// the workers are gone, take the batches they pushed after the loop stopped
+		if( NULL != reactor->mDoneQueue ) {
+			for( ; msgqueue_length( reactor->mDoneQueue ) > 0; ) {
+				event_base_loop( reactor->mBase, EVLOOP_NONBLOCK );
+			}
+			msgqueue_destroy( reactor->mDoneQueue );
+		}
+		if( NULL != reactor->mBase ) event_base_free( reactor->mBase );
+
+		if( NULL != reactor->mBatches ) {
+			for( ; reactor->mBatches->getCount() > 0; ) {
+				freeBatch( (SP_UdpBatch_t*)reactor->mBatches->takeItem( SP_ArrayList::LAST_INDEX ) );
+			}
+			delete reactor->mBatches;
+			delete reactor->mFree;
+			delete reactor->mSending;
+		}
+
+		if( reactor->mFd >= 0 ) sp_close( reactor->mFd );
+	}
+
+	free( mReactors );
+	mReactors = NULL;
+
+	return ret;
+}
+
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+
+#ifndef __spudpserver_hpp__
+#define __spudpserver_hpp__
+
+#include <sys/types.h>
+#include "spthread.hpp"
+
+class SP_HandlerFactory;
+class SP_Handler;
+class SP_Request;
+class SP_Buffer;
+class SP_Executor;
+
+typedef struct tagSP_UdpBatch SP_UdpBatch_t;
+typedef struct tagSP_UdpReactor SP_UdpReactor_t;
+
+/**
+ * @brief request/response over UDP with the SP_Handler model.
+ *
+ *        A reactor reads up to batchSize datagrams at a time (recvmmsg)
+ *        and hands them to a worker as one task. The worker calls handle()
+ *        for every datagram the msg decoder of the request takes, by default
+ *        SP_DefaultMsgDecoder; the reply of the response goes back to the
+ *        sender as one datagram, other messages are dropped. The replies
+ *        finished during a loop iteration are sent together (sendmmsg).
+ *
+ *        A handler is created per batch and closed after it, start() is not
+ *        called and the return value of handle() is ignored.
+ */
+class SP_UdpServer {
+public:
+	SP_UdpServer( const char * bindIP, int port, SP_HandlerFactory * handlerFactory );
+	~SP_UdpServer();
+
+	void setMaxThreads( int maxThreads );
+
+	/// datagrams read at a time, default is 32
+	void setBatchSize( int batchSize );
+
+	/// longer datagrams are dropped and logged, default is 4096
+	void setMaxDatagram( int maxDatagram );
+
+	/**
+	 * @brief reactors, each with its own SO_REUSEPORT socket, event base
+	 *        and thread; the kernel spreads the senders over them, default is 1
+	 */
+	void setReactors( int reactors );
+
+	void shutdown();
+	int isRunning();
+	int run();
+	void runForever();
+
+private:
+	SP_HandlerFactory * mHandlerFactory;
+
+	char mBindIP[ 64 ];
+	int mPort;
+	int mIsShutdown;
+	int mIsRunning;
+
+	int mMaxThreads;
+	int mBatchSize;
+	int mMaxDatagram;
+	int mReactorCount;
+
+	SP_UdpReactor_t * mReactors;
+	SP_Executor * mExecutor;
+
+	static sp_thread_result_t SP_THREAD_CALL eventLoop( void * arg );
+
+	int start();
+
+	static void reactorHandler( void * arg );
+	static void sigHandler( int, short, void * arg );
+	static void wakeupTimer( int, short, void * arg );
+	static void onRead( int fd, short events, void * arg );
+	static void onWrite( int fd, short events, void * arg );
+	static void onDone( void * queueData, void * arg );
+
+	// runs on a worker
+	static void handleBatch( void * arg );
+	static void handleDatagram( SP_Handler * handler, SP_Request * request,
+			SP_Buffer * inBuffer, SP_UdpBatch_t * batch, int index );
+
+	void loop( SP_UdpReactor_t * reactor );
+
+	SP_UdpBatch_t * newBatch( SP_UdpReactor_t * reactor );
+	int recvBatch( SP_UdpReactor_t * reactor, SP_UdpBatch_t * batch );
+	void freeBatch( SP_UdpBatch_t * batch );
+	void sendReplies( SP_UdpReactor_t * reactor );
+};
+
+#endif
+
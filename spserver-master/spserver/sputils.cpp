@@ -11,6 +11,7 @@
 #include "sputils.hpp"
 
 const int SP_ArrayList::LAST_INDEX = -1;
+const int SP_CircleList::LAST_INDEX = -1;
 
 SP_ArrayList :: SP_ArrayList( int initCount )
 {
@@ -57,12 +58,12 @@ void * SP_ArrayList :: takeItem( int index )
 
 	mCount--;
 
-	if( ( index + 1 ) < mMaxCount ) {
+	// only the items after index are moved, not the whole capacity
+	if( index < mCount ) {
 		memmove( mFirst + index, mFirst + index + 1,
-			( mMaxCount - index - 1 ) * sizeof( void * ) );
-	} else {
-		mFirst[ index ] = NULL;
+			( mCount - index ) * sizeof( void * ) );
 	}
+	mFirst[ mCount ] = NULL;
 
 	return ret;
 }
@@ -87,6 +88,87 @@ void SP_ArrayList :: clean()
 
 //-------------------------------------------------------------------
 
+SP_CircleList :: SP_CircleList( int initCount )
+{
+	for( mMaxCount = 4; mMaxCount < initCount; ) mMaxCount = mMaxCount * 2;
+
+	mCount = mHead = 0;
+	mEntries = (void**)malloc( sizeof( void * ) * mMaxCount );
+}
+
+SP_CircleList :: ~SP_CircleList()
+{
+	free( mEntries );
+	mEntries = NULL;
+}
+
+int SP_CircleList :: getCount() const
+{
+	return mCount;
+}
+
+int SP_CircleList :: append( void * value )
+{
+	if( NULL == value ) return -1;
+
+	if( mCount >= mMaxCount ) {
+		void ** newEntries = (void**)malloc( sizeof( void * ) * mMaxCount * 2 );
+		assert( NULL != newEntries );
+
+		int headLen = mMaxCount - mHead;
+		memcpy( newEntries, mEntries + mHead, sizeof( void * ) * headLen );
+		memcpy( newEntries + headLen, mEntries, sizeof( void * ) * mHead );
+
+		free( mEntries );
+		mEntries = newEntries;
+		mMaxCount = mMaxCount * 2;
+		mHead = 0;
+	}
+
+	mEntries[ ( mHead + mCount ) & ( mMaxCount - 1 ) ] = value;
+	mCount++;
+
+	return 0;
+}
+
+const void * SP_CircleList :: getItem( int index ) const
+{
+	if( LAST_INDEX == index ) index = mCount - 1;
+	if( index < 0 || index >= mCount ) return NULL;
+
+	return mEntries[ ( mHead + index ) & ( mMaxCount - 1 ) ];
+}
+
+void * SP_CircleList :: takeItem( int index )
+{
+	if( LAST_INDEX == index ) index = mCount - 1;
+	if( index < 0 || index >= mCount ) return NULL;
+
+	int mask = mMaxCount - 1;
+
+	void * ret = mEntries[ ( mHead + index ) & mask ];
+
+	if( 0 == index ) {
+		mHead = ( mHead + 1 ) & mask;
+	} else {
+		for( int i = index; i < mCount - 1; i++ ) {
+			mEntries[ ( mHead + i ) & mask ] = mEntries[ ( mHead + i + 1 ) & mask ];
+		}
+	}
+
+	mCount--;
+	if( 0 == mCount ) mHead = 0;
+
+	return ret;
+}
+
+void SP_CircleList :: clean()
+{
+	mCount = mHead = 0;
+}
+
+//-------------------------------------------------------------------
+
 SP_CircleQueue :: SP_CircleQueue()
 {
 	mMaxCount = 8;
@@ -225,6 +307,21 @@ int SP_BlockingQueue :: getLength()
 	return len;
 }
 
+int SP_BlockingQueue :: drain( void ** items, int max )
+{
+	int count = 0;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	for( ; count < max && mQueue->getLength() > 0; count++ ) {
+		items[ count ] = mQueue->pop();
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	return count;
+}
+
 //-------------------------------------------------------------------
 
 int sp_strtok( const char * src, int index, char * dest, int len,
@@ -31,6 +31,35 @@ private:
 	void ** mFirst;
 };
 
+/**
+ * @brief a ring of pointers, append and take at both ends are O(1),
+ *        used as the out-list of a session, which is taken from the head
+ */
+class SP_CircleList {
+public:
+	static const int LAST_INDEX;
+
+	SP_CircleList( int initCount = 4 );
+	virtual ~SP_CircleList();
+
+	int getCount() const;
+	int append( void * value );
+	const void * getItem( int index ) const;
+	void * takeItem( int index );
+
+	void clean();
+
+private:
+	SP_CircleList( SP_CircleList & );
+	SP_CircleList & operator=( SP_CircleList & );
+
+	// a power of 2
+	int mMaxCount;
+	int mCount;
+	int mHead;
+	void ** mEntries;
+};
+
 class SP_CircleQueue {
 public:
 	SP_CircleQueue();
@@ -66,6 +95,9 @@ public:
 	// non-blocking
 	int getLength();
 
+	// non-blocking, pop at most max items under one lock, return the count
+	int drain( void ** items, int max );
+
 private:
 	SP_CircleQueue * mQueue;
 	sp_thread_mutex_t mMutex;
@@ -336,6 +336,7 @@ BOOL SP_IocpEventCallback :: onAccept( SP_IocpAcceptArg_t * acceptArg )
 			msg->getMsg()->append( acceptArg->mRefusedMsg );
 			msg->getMsg()->append( "\r\n" );
 			session->getOutList()->append( msg );
+			msg->addPending( 1 );
 			session->setStatus( SP_Session::eExit );
 
 			addSend( session );
@@ -398,31 +399,31 @@ void SP_IocpEventCallback :: onResponse( void * queueData, void * arg )
 				if( seq == sid.mSeq && NULL != session ) {
 					if( 0 != memcmp( &fromSid, &sid, sizeof( sid ) )
 							&& SP_Session::eExit == session->getStatus() ) {
-						sidList->take( i );
 						msg->getFailure()->add( sid );
 						sp_syslog( LOG_WARNING, "session(%d.%d) would exit, invalid TO", sid.mKey, sid.mSeq );
 					} else {
 						if( addSend( session ) ) {
 							session->getOutList()->append( msg );
+							msg->addPending( 1 );
 						} else {
+							msg->getFailure()->add( sid );
 							if( 0 == session->getRunning() ) {
 								SP_IocpEventHelper::doError( session );
 							}
 						}
 					}
 				} else {
-					sidList->take( i );
 					msg->getFailure()->add( sid );
 					sp_syslog( LOG_WARNING, "session(%d.%d) invalid, unknown TO", sid.mKey, sid.mSeq );
 				}
 			}
 		} else {
-			for( ; sidList->getCount() > 0; ) {
-				msg->getFailure()->add( sidList->take( SP_ArrayList::LAST_INDEX ) );
+			for( int i = sidList->getCount() - 1; i >= 0; i-- ) {
+				msg->getFailure()->add( sidList->get( i ) );
 			}
 		}
 
-		if( msg->getToList()->getCount() <= 0 ) {
+		if( msg->getPending() <= 0 ) {
 			SP_IocpEventHelper::doCompletion( eventArg, msg );
 		}
 	}
@@ -739,15 +740,13 @@ void SP_IocpEventHelper :: doError( SP_Session * session )
 
 	session->setRunning( 1 );
 
-	SP_ArrayList * outList = session->getOutList();
+	SP_CircleList * outList = session->getOutList();
 	for( ; outList->getCount() > 0; ) {
-		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_ArrayList::LAST_INDEX );
+		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_CircleList::LAST_INDEX );
 
-		int index = msg->getToList()->find( sid );
-		if( index >= 0 ) msg->getToList()->take( index );
 		msg->getFailure()->add( sid );
 
-		if( msg->getToList()->getCount() <= 0 ) {
+		if( msg->addPending( -1 ) <= 0 ) {
 			doCompletion( eventArg, msg );
 		}
 	}
@@ -807,15 +806,13 @@ void SP_IocpEventHelper :: doTimeout( SP_Session * session )
 
 	session->setRunning( 1 );
 
-	SP_ArrayList * outList = session->getOutList();
+	SP_CircleList * outList = session->getOutList();
 	for( ; outList->getCount() > 0; ) {
-		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_ArrayList::LAST_INDEX );
+		SP_Message * msg = ( SP_Message * ) outList->takeItem( SP_CircleList::LAST_INDEX );
 
-		int index = msg->getToList()->find( sid );
-		if( index >= 0 ) msg->getToList()->take( index );
 		msg->getFailure()->add( sid );
 
-		if( msg->getToList()->getCount() <= 0 ) {
+		if( msg->addPending( -1 ) <= 0 ) {
 			doCompletion( eventArg, msg );
 		}
 	}
@@ -900,5 +897,8 @@ void SP_IocpEventHelper :: start( void * arg )
 
 void SP_IocpEventHelper :: doCompletion( SP_IocpEventArg * eventArg, SP_Message * msg )
 {
+	// every sid is in the success or the failure list now
+	msg->getToList()->reset();
+
 	eventArg->getOutputResultQueue()->push( msg );
 }
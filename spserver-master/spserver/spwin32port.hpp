@@ -48,6 +48,7 @@ typedef int socklen_t;
 #define sp_socketpair   spwin32_socketpair
 #define sp_initsock     spwin32_initsocket
 #define sp_gettimeofday spwin32_gettimeofday
+#define sp_atomic_add( ptr, n ) ( InterlockedExchangeAdd( (LONG volatile*)( ptr ), ( n ) ) + ( n ) )
 
 #define sp_syslog       g_spwin32_syslog
 #define sp_openlog      spwin32_openlog
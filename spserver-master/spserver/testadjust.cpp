@@ -0,0 +1,91 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "spporting.hpp"
+
+#include "spthreadpool.hpp"
+
+// replays fixed measurements through the votes of the adaptive pool,
+// a grow needs 2 busy intervals in a row, a shrink needs 5 idle ones
+
+static int getLimit( SP_ThreadPool * pool )
+{
+	SP_ThreadPoolStat_t stat;
+	pool->getStat( &stat );
+	return stat.mLimit;
+}
+
+int main( int argc, char * argv[] )
+{
+	sp_openlog( "testadjust", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
+
+	SP_ThreadPool pool( 8, "adjust" );
+
+	// not adaptive, nothing changes
+	assert( 0 == pool.adjust( 100000, 100 ) );
+
+	pool.setAdaptive( 2, 2000, 30 );
+	assert( 2 == getLimit( &pool ) );
+
+	// long dispatch wait
+	assert( 0 == pool.adjust( 5000, 50 ) );
+	assert( 1 == pool.adjust( 5000, 50 ) );
+	assert( 3 == getLimit( &pool ) );
+
+	// saturated, a quiet interval in between starts the count again
+	assert( 0 == pool.adjust( 0, 95 ) );
+	assert( 0 == pool.adjust( 0, 50 ) );
+	assert( 0 == pool.adjust( 0, 95 ) );
+	assert( 1 == pool.adjust( 0, 95 ) );
+	assert( 4 == getLimit( &pool ) );
+
+	// grow by half, capped by maxThreads
+	assert( 0 == pool.adjust( 5000, 100 ) );
+	assert( 1 == pool.adjust( 5000, 100 ) );
+	assert( 6 == getLimit( &pool ) );
+	assert( 0 == pool.adjust( 5000, 100 ) );
+	assert( 1 == pool.adjust( 5000, 100 ) );
+	assert( 8 == getLimit( &pool ) );
+	assert( 0 == pool.adjust( 5000, 100 ) );
+	assert( 0 == pool.adjust( 5000, 100 ) );
+	assert( 8 == getLimit( &pool ) );
+
+	// idle, one thread less after 5 intervals
+	for( int i = 0; i < 4; i++ ) assert( 0 == pool.adjust( 0, 10 ) );
+	assert( -1 == pool.adjust( 0, 10 ) );
+	assert( 7 == getLimit( &pool ) );
+
+	// a busy interval breaks the idle run
+	for( int i = 0; i < 4; i++ ) assert( 0 == pool.adjust( 0, 10 ) );
+	assert( 0 == pool.adjust( 5000, 10 ) );
+	for( int i = 0; i < 4; i++ ) assert( 0 == pool.adjust( 0, 10 ) );
+	assert( -1 == pool.adjust( 0, 10 ) );
+	assert( 6 == getLimit( &pool ) );
+
+	// down to minThreads and no further
+	for( int limit = 6; limit > 2; limit-- ) {
+		for( int i = 0; i < 4; i++ ) assert( 0 == pool.adjust( 0, 0 ) );
+		assert( -1 == pool.adjust( 0, 0 ) );
+	}
+	assert( 2 == getLimit( &pool ) );
+	for( int i = 0; i < 10; i++ ) assert( 0 == pool.adjust( 0, 0 ) );
+	assert( 2 == getLimit( &pool ) );
+
+	SP_ThreadPoolStat_t stat;
+	pool.getStat( &stat );
+	assert( 4 == stat.mGrowCount );
+	assert( 6 == stat.mShrinkCount );
+
+	printf( "testadjust: OK\n" );
+
+	sp_closelog();
+
+	return 0;
+}
+
@@ -0,0 +1,234 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "spporting.hpp"
+
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "spserver.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "sprequest.hpp"
+#include "spthreadpool.hpp"
+#include "spthread.hpp"
+
+// latency tail of a line echo round trip, run it with and without pinning:
+//   ./testaffinity -c 8 -n 20000
+//   ./testaffinity -c 8 -n 20000 -r 0 -w 1-3 -l 4-7
+
+class SP_PingHandler : public SP_Handler {
+public:
+	SP_PingHandler(){}
+	virtual ~SP_PingHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		SP_LineMsgDecoder * decoder = (SP_LineMsgDecoder*)request->getMsgDecoder();
+
+		response->getReply()->getMsg()->append( decoder->getMsg() );
+		response->getReply()->getMsg()->append( "\n" );
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+class SP_PingHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_PingHandlerFactory() {}
+	virtual ~SP_PingHandlerFactory() {}
+
+	virtual SP_Handler * create() const {
+		return new SP_PingHandler();
+	}
+};
+
+//---------------------------------------------------------
+
+static int gPort = 3334;
+static int gRequests = 10000;
+static const char * gClientCpus = NULL;
+
+typedef struct tagPingClient {
+	int mIndex;
+	int * mRtt;
+	int mCount;
+} PingClient_t;
+
+static sp_thread_result_t SP_THREAD_CALL pingLoop( void * arg )
+{
+	PingClient_t * client = (PingClient_t*)arg;
+
+	if( NULL != gClientCpus ) SP_ThreadPool::setCpuAffinity( gClientCpus );
+
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( gPort );
+	addr.sin_addr.s_addr = inet_addr( "127.0.0.1" );
+
+	if( connect( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 ) {
+		fprintf( stderr, "#%d connect fail, errno %d, %s\n", client->mIndex, errno, strerror( errno ) );
+		sp_close( fd );
+		return 0;
+	}
+
+	int flags = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flags, sizeof( flags ) );
+
+	const char * line = "ping\n";
+	char buffer[ 64 ];
+
+	for( int i = 0; i < gRequests; i++ ) {
+		struct timeval start, end;
+		sp_gettimeofday( &start, NULL );
+
+		if( send( fd, line, strlen( line ), 0 ) <= 0 ) break;
+
+		int len = 0;
+		for( ; len < (int)strlen( line ); ) {
+			int ret = recv( fd, buffer + len, sizeof( buffer ) - len, 0 );
+			if( ret <= 0 ) break;
+			len += ret;
+		}
+		if( len < (int)strlen( line ) ) break;
+
+		sp_gettimeofday( &end, NULL );
+
+		client->mRtt[ client->mCount++ ] = ( end.tv_sec - start.tv_sec ) * 1000000
+				+ ( end.tv_usec - start.tv_usec );
+	}
+
+	sp_close( fd );
+
+	return 0;
+}
+
+static int cmpInt( const void * a, const void * b )
+{
+	return *(int*)a - *(int*)b;
+}
+
+int main( int argc, char * argv[] )
+{
+	int clients = 4, maxThreads = 4;
+	const char * reactorCpus = NULL, * workerCpus = NULL;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:c:n:t:r:w:l:v" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				gPort = atoi( optarg );
+				break;
+			case 'c' :
+				clients = atoi( optarg );
+				break;
+			case 'n' :
+				gRequests = atoi( optarg );
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'r':
+				reactorCpus = optarg;
+				break;
+			case 'w':
+				workerCpus = optarg;
+				break;
+			case 'l':
+				gClientCpus = optarg;
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-c <clients>] [-n <requests per client>] [-t <threads>]\n"
+						"\t\t[-r <reactor cpus>] [-w <worker cpus>] [-l <client cpus>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	sp_openlog( "testaffinity", LOG_CONS | LOG_PID, LOG_USER );
+
+	assert( 0 == sp_initsock() );
+
+	SP_Server server( "", gPort, new SP_PingHandlerFactory() );
+	server.setMaxThreads( maxThreads );
+	server.setMaxConnections( clients + 16 );
+	if( NULL != reactorCpus ) server.setReactorCpus( reactorCpus );
+	if( NULL != workerCpus ) server.setWorkerCpus( workerCpus );
+	server.run();
+
+	for( int i = 0; i < 100 && 0 == server.isRunning(); i++ ) usleep( 10000 );
+	usleep( 100000 );
+
+	PingClient_t * clientList = (PingClient_t*)calloc( clients, sizeof( PingClient_t ) );
+	sp_thread_t * threadList = (sp_thread_t*)calloc( clients, sizeof( sp_thread_t ) );
+
+	struct timeval start, end;
+	sp_gettimeofday( &start, NULL );
+
+	for( int i = 0; i < clients; i++ ) {
+		clientList[ i ].mIndex = i;
+		clientList[ i ].mRtt = (int*)malloc( sizeof( int ) * gRequests );
+		sp_thread_create( &threadList[ i ], NULL, pingLoop, &clientList[ i ] );
+	}
+
+	int total = 0;
+	for( int i = 0; i < clients; i++ ) {
+		pthread_join( threadList[ i ], NULL );
+		total += clientList[ i ].mCount;
+	}
+
+	sp_gettimeofday( &end, NULL );
+
+	int * rtt = (int*)malloc( sizeof( int ) * ( total > 0 ? total : 1 ) );
+	for( int i = 0, n = 0; i < clients; i++ ) {
+		memcpy( rtt + n, clientList[ i ].mRtt, sizeof( int ) * clientList[ i ].mCount );
+		n += clientList[ i ].mCount;
+		free( clientList[ i ].mRtt );
+	}
+
+	qsort( rtt, total, sizeof( int ), cmpInt );
+
+	double usec = ( end.tv_sec - start.tv_sec ) * 1000000.0 + ( end.tv_usec - start.tv_usec );
+
+	printf( "reactor %s, worker %s, client %s\n", NULL == reactorCpus ? "-" : reactorCpus,
+			NULL == workerCpus ? "-" : workerCpus, NULL == gClientCpus ? "-" : gClientCpus );
+	if( total > 0 ) {
+		printf( "%d requests, %.0f req/s, rtt usec: p50 %d, p90 %d, p99 %d, p999 %d, max %d\n",
+				total, total * 1000000.0 / usec, rtt[ total / 2 ], rtt[ total * 90 / 100 ],
+				rtt[ total * 99 / 100 ], rtt[ total * 999 / 1000 ], rtt[ total - 1 ] );
+	} else {
+		printf( "no response\n" );
+	}
+
+	free( rtt );
+	free( clientList );
+	free( threadList );
+
+	server.shutdown();
+
+	return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "spporting.hpp"
+
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "spdispatcher.hpp"
+#include "spserver.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "sprequest.hpp"
+#include "spioutils.hpp"
+#include "sputils.hpp"
+#include "spasyncclient.hpp"
+
+// a gateway fans every line out to all upstreams and relays the replies:
+//   ./testasync -p 4000 -u localhost:4001,127.0.0.1:4001
+//   telnet localhost 4000
+// without -u, a line echo upstream is started on port 4001
+
+class SP_EchoHandler : public SP_Handler {
+public:
+	SP_EchoHandler(){}
+	virtual ~SP_EchoHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		SP_LineMsgDecoder * decoder = (SP_LineMsgDecoder*)request->getMsgDecoder();
+
+		response->getReply()->getMsg()->append( decoder->getMsg() );
+		response->getReply()->getMsg()->append( "\n" );
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+class SP_EchoHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_EchoHandlerFactory() {}
+	virtual ~SP_EchoHandlerFactory() {}
+
+	virtual SP_Handler * create() const {
+		return new SP_EchoHandler();
+	}
+};
+
+//---------------------------------------------------------
+
+class SP_GatewayCallback : public SP_AsyncCallback {
+public:
+	SP_GatewayCallback( const char * upstream ) {
+		snprintf( mUpstream, sizeof( mUpstream ), "%s", upstream );
+	}
+	virtual ~SP_GatewayCallback() {}
+
+	virtual void completed( SP_MsgDecoder * decoder, int error, SP_Response * response ) {
+		char buffer[ 512 ] = { 0 };
+
+		if( 0 == error ) {
+			snprintf( buffer, sizeof( buffer ), "%s : %s\r\n", mUpstream,
+					((SP_LineMsgDecoder*)decoder)->getMsg() );
+		} else {
+			snprintf( buffer, sizeof( buffer ), "%s : error %d, %s\r\n", mUpstream,
+					error, strerror( error ) );
+		}
+
+		response->getReply()->getMsg()->append( buffer );
+	}
+
+private:
+	char mUpstream[ 160 ];
+};
+
+class SP_GatewayHandler : public SP_Handler {
+public:
+	SP_GatewayHandler( SP_AsyncClient * client, const char * upstreams ) {
+		mClient = client;
+		mUpstreams = upstreams;
+	}
+	virtual ~SP_GatewayHandler() {}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		response->getReply()->getMsg()->append( "Welcome to the async gateway, quit to exit\r\n" );
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		SP_LineMsgDecoder * decoder = (SP_LineMsgDecoder*)request->getMsgDecoder();
+		const char * line = decoder->getMsg();
+
+		if( 0 == strcasecmp( line, "quit" ) ) {
+			response->getReply()->getMsg()->append( "Byebye\r\n" );
+			return -1;
+		}
+
+		char buffer[ 512 ] = { 0 };
+		int len = snprintf( buffer, sizeof( buffer ), "%s\n", line );
+
+		char upstream[ 160 ] = { 0 };
+		for( int i = 0; 0 == sp_strtok( mUpstreams, i, upstream, sizeof( upstream ), ',' ); i++ ) {
+			char host[ 128 ] = { 0 };
+			int port = 0;
+
+			char * pos = strchr( upstream, ':' );
+			if( NULL == pos ) continue;
+			snprintf( host, sizeof( host ), "%.*s", (int)( pos - upstream ), upstream );
+			port = atoi( pos + 1 );
+
+			mClient->call( response->getFromSid(), host, port, buffer, len,
+					new SP_LineMsgDecoder(), new SP_GatewayCallback( upstream ), 1000 );
+		}
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+
+private:
+	SP_AsyncClient * mClient;
+	const char * mUpstreams;
+};
+
+//---------------------------------------------------------
+
+int main( int argc, char * argv[] )
+{
+	int port = 4000, maxThreads = 10;
+	const char * upstreams = NULL;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:t:u:v" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				port = atoi( optarg );
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'u':
+				upstreams = optarg;
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-u <host:port,host:port,...>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	sp_openlog( "testasync", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
+
+	assert( 0 == sp_initsock() );
+
+	SP_Server * echoServer = NULL;
+	if( NULL == upstreams ) {
+		upstreams = "localhost:4001,127.0.0.1:4001";
+
+		echoServer = new SP_Server( "", 4001, new SP_EchoHandlerFactory() );
+		echoServer->run();
+	}
+
+	int maxConnections = 100, reqQueueSize = 10;
+	const char * refusedMsg = "System busy, try again later.";
+
+	int listenFd = -1;
+	if( 0 == SP_IOUtils::tcpListen( "", port, &listenFd ) ) {
+		SP_Dispatcher dispatcher( new SP_DefaultCompletionHandler(), maxThreads );
+		dispatcher.dispatch();
+
+		SP_AsyncClient client( &dispatcher );
+
+		for( ; ; ) {
+			struct sockaddr_in addr;
+			socklen_t socklen = sizeof( addr );
+			int fd = accept( listenFd, (struct sockaddr*)&addr, &socklen );
+
+			if( fd > 0 ) {
+				if( dispatcher.getSessionCount() >= maxConnections
+						|| dispatcher.getReqQueueLength() >= reqQueueSize ) {
+					send( fd, refusedMsg, strlen( refusedMsg ), 0 );
+					sp_close( fd );
+				} else {
+					dispatcher.push( fd, new SP_GatewayHandler( &client, upstreams ) );
+				}
+			} else {
+				break;
+			}
+		}
+	}
+
+	if( NULL != echoServer ) {
+		echoServer->shutdown();
+		delete echoServer;
+	}
+
+	sp_closelog();
+
+	return 0;
+}
+
@@ -19,96 +19,16 @@
 #include "sphandler.hpp"
 #include "spresponse.hpp"
 #include "sprequest.hpp"
+#include "sptopic.hpp"
 
 #ifdef WIN32
 #include "spgetopt.h"
 #endif
 
-class SP_OnlineSidList {
-public:
-	SP_OnlineSidList();
-	~SP_OnlineSidList();
-
-	void copy( SP_SidList * outList, SP_Sid_t * ignoreSid = NULL );
-	void remove( SP_Sid_t sid );
-	void add( SP_Sid_t sid );
-	int getCount();
-
-private:
-	SP_SidList mList;
-	sp_thread_mutex_t mMutex;
-};
-
-SP_OnlineSidList :: SP_OnlineSidList()
-{
-	sp_thread_mutex_init( &mMutex, NULL );
-}
-
-SP_OnlineSidList :: ~SP_OnlineSidList()
-{
-	sp_thread_mutex_destroy( &mMutex );
-}
-
-void SP_OnlineSidList :: copy( SP_SidList * outList, SP_Sid_t * ignoreSid )
-{
-	sp_thread_mutex_lock( &mMutex );
-
-	for( int i = 0; i < mList.getCount(); i++ ) {
-		if( NULL != ignoreSid ) {
-			SP_Sid_t theSid = mList.get( i );
-			if( theSid.mKey == ignoreSid->mKey && theSid.mSeq == ignoreSid->mSeq ) {
-				continue;
-			}
-		}
-
-		outList->add( mList.get( i ) );
-	}
-
-	sp_thread_mutex_unlock( &mMutex );
-}
-
-void SP_OnlineSidList :: remove( SP_Sid_t sid )
-{
-	sp_thread_mutex_lock( &mMutex );
-
-	for( int i = 0; i < mList.getCount(); i++ ) {
-		SP_Sid_t theSid = mList.get( i );
-		if( theSid.mKey == sid.mKey && theSid.mSeq == sid.mSeq ) {
-			mList.take( i );
-			break;
-		}
-	}
-
-	sp_thread_mutex_unlock( &mMutex );
-}
-
-void SP_OnlineSidList :: add( SP_Sid_t sid )
-{
-	sp_thread_mutex_lock( &mMutex );
-
-	mList.add( sid );
-
-	sp_thread_mutex_unlock( &mMutex );
-}
-
-int SP_OnlineSidList :: getCount()
-{
-	int count = 0;
-
-	sp_thread_mutex_lock( &mMutex );
-
-	count = mList.getCount();
-
-	sp_thread_mutex_unlock( &mMutex );
-
-	return count;
-}
-
-//---------------------------------------------------------
-
+// every room is a topic, a client starts in the lobby and moves with "join <room>"
 class SP_ChatHandler : public SP_Handler {
 public:
-	SP_ChatHandler( SP_OnlineSidList * onlineSidList );
+	SP_ChatHandler( SP_TopicRegistry * topicRegistry );
 	virtual ~SP_ChatHandler();
 
 	virtual int start( SP_Request * request, SP_Response * response );
@@ -124,36 +44,41 @@ public:
 
 private:
 	SP_Sid_t mSid;
+	char mRoom[ 64 ];
 
-	SP_OnlineSidList * mOnlineSidList;
+	SP_TopicRegistry * mTopicRegistry;
 
 	static int mMsgSeq;
 
-	void broadcast( SP_Response * response, const char * buffer, SP_Sid_t * ignoreSid = 0 );
+	void broadcast( SP_Response * response, const char * buffer );
 };
 
 int SP_ChatHandler :: mMsgSeq = 0;
 
-SP_ChatHandler :: SP_ChatHandler( SP_OnlineSidList * onlineSidList )
+SP_ChatHandler :: SP_ChatHandler( SP_TopicRegistry * topicRegistry )
 {
 	memset( &mSid, 0, sizeof( mSid ) );
+	snprintf( mRoom, sizeof( mRoom ), "%s", "lobby" );
 
-	mOnlineSidList = onlineSidList;
+	mTopicRegistry = topicRegistry;
 }
 
 SP_ChatHandler :: ~SP_ChatHandler()
 {
 }
 
-void SP_ChatHandler :: broadcast( SP_Response * response, const char * buffer, SP_Sid_t * ignoreSid )
+void SP_ChatHandler :: broadcast( SP_Response * response, const char * buffer )
 {
-	if( mOnlineSidList->getCount() > 0 ) {
-		SP_Message * msg = new SP_Message();
-		mOnlineSidList->copy( msg->getToList(), ignoreSid );
+	SP_Message * msg = new SP_Message();
+
+	// the to-list shares the members of the room, they are not copied
+	if( mTopicRegistry->publish( mRoom, msg ) > 0 ) {
 		msg->setCompletionKey( ++mMsgSeq );
 
 		msg->getMsg()->append( buffer );
 		response->addMessage( msg );
+	} else {
+		delete msg;
 	}
 }
 
@@ -165,7 +90,7 @@ int SP_ChatHandler :: start( SP_Request * request, SP_Response * response )
 
 	char buffer[ 128 ] = { 0 };
 	snprintf( buffer, sizeof( buffer ),
-		"Welcome %d to chat server, enter 'quit' to quit.\r\n", mSid.mKey );
+		"Welcome %d to chat server, enter 'join <room>' to change room, 'quit' to quit.\r\n", mSid.mKey );
 	response->getReply()->getMsg()->append( buffer );
 	response->getReply()->setCompletionKey( ++mMsgSeq );
 
@@ -173,7 +98,7 @@ int SP_ChatHandler :: start( SP_Request * request, SP_Response * response )
 
 	broadcast( response, buffer );
 
-	mOnlineSidList->add( mSid );
+	mTopicRegistry->subscribe( mRoom, mSid );
 
 	return 0;
 }
@@ -181,17 +106,39 @@ int SP_ChatHandler :: start( SP_Request * request, SP_Response * response )
 int SP_ChatHandler :: handle( SP_Request * request, SP_Response * response )
 {
 	SP_LineMsgDecoder * decoder = (SP_LineMsgDecoder*)request->getMsgDecoder();
+	const char * line = (char*)decoder->getMsg();
 
 	char buffer[ 256 ] = { 0 };
 
-	if( 0 != strcasecmp( (char*)decoder->getMsg(), "quit" ) ) {
-		snprintf( buffer, sizeof( buffer ), "%d say: %s\r\n", mSid.mKey, (char*)decoder->getMsg() );
+	if( 0 == strncasecmp( line, "join ", 5 ) && '\0' != line[5] ) {
+		mTopicRegistry->unsubscribe( mRoom, mSid );
+
+		snprintf( buffer, sizeof( buffer ), "SYS : %d leave for %s\r\n", mSid.mKey, line + 5 );
+		broadcast( response, buffer );
+
+		snprintf( mRoom, sizeof( mRoom ), "%s", line + 5 );
+
+		snprintf( buffer, sizeof( buffer ), "SYS : %d join\r\n", mSid.mKey );
+		broadcast( response, buffer );
+
+		mTopicRegistry->subscribe( mRoom, mSid );
+
+		snprintf( buffer, sizeof( buffer ), "SYS : room %s, %d online\r\n",
+				mRoom, mTopicRegistry->getCount( mRoom ) );
+		response->getReply()->getMsg()->append( buffer );
+		response->getReply()->setCompletionKey( ++mMsgSeq );
+
+		return 0;
+	} else if( 0 != strcasecmp( line, "quit" ) ) {
+		snprintf( buffer, sizeof( buffer ), "%d say: %s\r\n", mSid.mKey, line );
 		broadcast( response, buffer );
 
 		return 0;
 	} else {
+		mTopicRegistry->unsubscribe( mRoom, mSid );
+
 		snprintf( buffer, sizeof( buffer ), "SYS : %d normal offline\r\n", mSid.mKey );
-		broadcast( response, buffer, &mSid );
+		broadcast( response, buffer );
 
 		response->getReply()->getMsg()->append( "SYS : Byebye\r\n" );
 		response->getReply()->setCompletionKey( ++mMsgSeq );
@@ -202,10 +149,11 @@ int SP_ChatHandler :: handle( SP_Request * request, SP_Response * response )
 
 void SP_ChatHandler :: error( SP_Response * response )
 {
+	// the server has removed the sid from the room already
 	char buffer[ 64 ] = { 0 };
 	snprintf( buffer, sizeof( buffer ), "SYS : %d error offline\r\n", mSid.mKey );
 
-	broadcast( response, buffer, &mSid );
+	broadcast( response, buffer );
 }
 
 void SP_ChatHandler :: timeout( SP_Response * response )
@@ -213,12 +161,11 @@ void SP_ChatHandler :: timeout( SP_Response * response )
 	char buffer[ 64 ] = { 0 };
 	snprintf( buffer, sizeof( buffer ), "SYS : %d timeout offline\r\n", mSid.mKey );
 
-	broadcast( response, buffer, &mSid );
+	broadcast( response, buffer );
 }
 
 void SP_ChatHandler :: close()
 {
-	mOnlineSidList->remove( mSid );
 }
 
 //---------------------------------------------------------
@@ -263,7 +210,7 @@ void SP_ChatCompletionHandler :: completionMessage( SP_Message * msg )
 
 class SP_ChatHandlerFactory : public SP_HandlerFactory {
 public:
-	SP_ChatHandlerFactory( SP_OnlineSidList * onlineSidList );
+	SP_ChatHandlerFactory( SP_TopicRegistry * topicRegistry );
 	virtual ~SP_ChatHandlerFactory();
 
 	virtual SP_Handler * create() const;
@@ -271,12 +218,12 @@ public:
 	virtual SP_CompletionHandler * createCompletionHandler() const;
 
 private:
-	SP_OnlineSidList * mOnlineSidList;
+	SP_TopicRegistry * mTopicRegistry;
 };
 
-SP_ChatHandlerFactory :: SP_ChatHandlerFactory( SP_OnlineSidList * onlineSidList )
+SP_ChatHandlerFactory :: SP_ChatHandlerFactory( SP_TopicRegistry * topicRegistry )
 {
-	mOnlineSidList = onlineSidList;
+	mTopicRegistry = topicRegistry;
 }
 
 SP_ChatHandlerFactory :: ~SP_ChatHandlerFactory()
@@ -285,7 +232,7 @@ SP_ChatHandlerFactory :: ~SP_ChatHandlerFactory()
 
 SP_Handler * SP_ChatHandlerFactory :: create() const
 {
-	return new SP_ChatHandler( mOnlineSidList );
+	return new SP_ChatHandler( mTopicRegistry );
 }
 
 SP_CompletionHandler * SP_ChatHandlerFactory :: createCompletionHandler() const
@@ -297,13 +244,13 @@ SP_CompletionHandler * SP_ChatHandlerFactory :: createCompletionHandler() const
 
 int main( int argc, char * argv[] )
 {
-	int port = 5555, maxThreads = 10;
+	int port = 5555, maxThreads = 10, highWatermark = 64 * 1024;
 	const char * serverType = "hahs";
 
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "p:t:s:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "p:t:s:w:v" )) != EOF ) {
 		switch ( c ) {
 			case 'p' :
 				port = atoi( optarg );
@@ -314,9 +261,13 @@ int main( int argc, char * argv[] )
 			case 's':
 				serverType = optarg;
 				break;
+			case 'w':
+				highWatermark = atoi( optarg );
+				break;
 			case '?' :
 			case 'v' :
-				printf( "Usage: %s [-p <port>] [-t <threads>] [-s <hahs|lf>]\n", argv[0] );
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-s <hahs|lf>] [-w <bytes>]\n", argv[0] );
+				printf( "\t-w drop the chat to a client with this much queued, 0 : unlimited\n" );
 				exit( 0 );
 		}
 	}
@@ -325,22 +276,26 @@ int main( int argc, char * argv[] )
 
 	assert( 0 == sp_initsock() );
 
-	SP_OnlineSidList onlineSidList;
+	SP_TopicRegistry topicRegistry;
 
 	if( 0 == strcasecmp( serverType, "hahs" ) ) {
-		SP_Server server( "", port, new SP_ChatHandlerFactory( &onlineSidList ) );
+		SP_Server server( "", port, new SP_ChatHandlerFactory( &topicRegistry ) );
+		server.setTopicRegistry( &topicRegistry );
 
 		server.setTimeout( 60 );
 		server.setMaxThreads( maxThreads );
 		server.setReqQueueSize( 100, "Sorry, server is busy now!\n" );
+		server.setOutputWatermarks( highWatermark, 0, SP_OutputPolicy::eDrop );
 
 		server.runForever();
 	} else {
-		SP_LFServer server( "", port, new SP_ChatHandlerFactory( &onlineSidList ) );
+		SP_LFServer server( "", port, new SP_ChatHandlerFactory( &topicRegistry ) );
+		server.setTopicRegistry( &topicRegistry );
 
 		server.setTimeout( 60 );
 		server.setMaxThreads( maxThreads );
 		server.setReqQueueSize( 100, "Sorry, server is busy now!\n" );
+		server.setOutputWatermarks( highWatermark, 0, SP_OutputPolicy::eDrop );
 
 		server.runForever();
 	}
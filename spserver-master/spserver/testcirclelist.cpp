@@ -0,0 +1,107 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <deque>
+
+#include "spporting.hpp"
+
+#include "sputils.hpp"
+
+// random appends and takes at the head, the tail and in the middle of a
+// SP_CircleList, checked against a std::deque after every step, so the
+// ring wraps and grows at every possible head:
+//   ./testcirclelist [<steps>] [<seed>]
+
+static void * toItem( int value )
+{
+	return (void*)(long)value;
+}
+
+static void check( SP_CircleList * list, std::deque<int> * ref )
+{
+	assert( (int)ref->size() == list->getCount() );
+
+	for( int i = 0; i < (int)ref->size(); i++ ) {
+		assert( toItem( (*ref)[i] ) == list->getItem( i ) );
+	}
+
+	assert( NULL == list->getItem( -2 ) );
+	assert( NULL == list->getItem( list->getCount() ) );
+
+	if( ref->empty() ) {
+		assert( NULL == list->getItem( SP_CircleList::LAST_INDEX ) );
+	} else {
+		assert( toItem( ref->back() ) == list->getItem( SP_CircleList::LAST_INDEX ) );
+	}
+}
+
+int main( int argc, char * argv[] )
+{
+	int steps = argc > 1 ? atoi( argv[1] ) : 200000;
+	unsigned int seed = argc > 2 ? (unsigned int)atoi( argv[2] ) : 1;
+
+	srand( seed );
+
+	SP_CircleList list;
+	std::deque<int> ref;
+
+	assert( -1 == list.append( NULL ) );
+	assert( NULL == list.takeItem( 0 ) );
+	assert( NULL == list.takeItem( SP_CircleList::LAST_INDEX ) );
+
+	int next = 1, maxCount = 0;
+
+	for( int i = 0; i < steps; i++ ) {
+		int op = rand() % 100;
+
+		// mostly appends and head takes, as an out-list sees them
+		if( op < 50 ) {
+			assert( 0 == list.append( toItem( next ) ) );
+			ref.push_back( next++ );
+		} else if( op < 80 ) {
+			void * item = list.takeItem( 0 );
+			if( ref.empty() ) {
+				assert( NULL == item );
+			} else {
+				assert( toItem( ref.front() ) == item );
+				ref.pop_front();
+			}
+		} else if( op < 90 ) {
+			void * item = list.takeItem( SP_CircleList::LAST_INDEX );
+			if( ref.empty() ) {
+				assert( NULL == item );
+			} else {
+				assert( toItem( ref.back() ) == item );
+				ref.pop_back();
+			}
+		} else if( op < 99 ) {
+			// -2 and count are out of range, -1 is LAST_INDEX
+			int index = rand() % ( ref.size() + 2 ) - 1;
+			if( -1 == index ) index = -2;
+			void * item = list.takeItem( index );
+			if( index < 0 || index >= (int)ref.size() ) {
+				assert( NULL == item );
+			} else {
+				assert( toItem( ref[ index ] ) == item );
+				ref.erase( ref.begin() + index );
+			}
+		} else if( 0 == rand() % 10 ) {
+			list.clean();
+			ref.clear();
+		}
+
+		if( (int)ref.size() > maxCount ) maxCount = ref.size();
+
+		check( &list, &ref );
+	}
+
+	printf( "testcirclelist: OK, %d steps, seed %u, up to %d items\n", steps, seed, maxCount );
+
+	return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+
+#include "spporting.hpp"
+
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "spdispatcher.hpp"
+#include "spserver.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "sprequest.hpp"
+#include "spioutils.hpp"
+#include "spasyncclient.hpp"
+#include "spcohandler.hpp"
+
+// a line protocol as linear code, no worker is held while a session
+// waits for input, a timer or an upstream reply:
+//   ./testcoro -p 5000
+//   telnet localhost 5000
+// an upstream line echo is started on port 5001 for "call";
+// teststress drives many sessions, each message gets an "unknown command"
+// reply with the message in it:
+//   ulimit -n 210000
+//   ./testcoro -p 5000 -G &
+//   ./teststress -p 5000 -P line -c 100000 -m 10 -t 4
+// -G turns the stack guard pages off, with them every session takes two
+// memory mappings and vm.max_map_count must be raised above 200000
+
+class SP_EchoHandler : public SP_Handler {
+public:
+	SP_EchoHandler(){}
+	virtual ~SP_EchoHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		SP_LineMsgDecoder * decoder = (SP_LineMsgDecoder*)request->getMsgDecoder();
+
+		response->getReply()->getMsg()->append( decoder->getMsg() );
+		response->getReply()->getMsg()->append( "\n" );
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+class SP_EchoHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_EchoHandlerFactory() {}
+	virtual ~SP_EchoHandlerFactory() {}
+
+	virtual SP_Handler * create() const {
+		return new SP_EchoHandler();
+	}
+};
+
+//---------------------------------------------------------
+
+class SP_LineCoHandler : public SP_CoHandler {
+public:
+	SP_LineCoHandler() {}
+	virtual ~SP_LineCoHandler() {}
+
+	virtual void run() {
+		setMsgDecoder( new SP_LineMsgDecoder() );
+
+		getReply()->getMsg()->append( "Welcome to coroutine server, your name?\r\n" );
+		if( 0 != readMsg() ) return;
+
+		char name[ 64 ] = { 0 };
+		snprintf( name, sizeof( name ), "%s", getLine() );
+
+		char buffer[ 256 ] = { 0 };
+		snprintf( buffer, sizeof( buffer ), "Hello %s, commands: sleep <msec>, "
+				"call <line>, quit\r\n", name );
+		getReply()->getMsg()->append( buffer );
+
+		for( ; 0 == readMsg(); ) {
+			const char * line = getLine();
+
+			if( 0 == strncasecmp( line, "sleep ", 6 ) ) {
+				int msec = atoi( line + 6 );
+				if( 0 != sleep( msec ) ) break;
+
+				snprintf( buffer, sizeof( buffer ), "%s, slept %d msec\r\n", name, msec );
+			} else if( 0 == strncasecmp( line, "call ", 5 ) ) {
+				char request[ 256 ] = { 0 };
+				int len = snprintf( request, sizeof( request ), "%s\n", line + 5 );
+
+				SP_LineMsgDecoder reply;
+				int error = call( "127.0.0.1", 5001, request, len, &reply, 1000 );
+				if( error < 0 ) break;
+
+				if( 0 == error ) {
+					snprintf( buffer, sizeof( buffer ), "%s, upstream replied [%s]\r\n",
+							name, reply.getMsg() );
+				} else {
+					snprintf( buffer, sizeof( buffer ), "%s, call failed, %s\r\n",
+							name, strerror( error ) );
+				}
+			} else if( 0 == strcasecmp( line, "quit" ) ) {
+				getReply()->getMsg()->append( "Byebye\r\n" );
+				break;
+			} else {
+				snprintf( buffer, sizeof( buffer ), "%s, unknown command [%s]\r\n", name, line );
+			}
+
+			getReply()->getMsg()->append( buffer );
+		}
+	}
+
+private:
+	const char * getLine() {
+		return ((SP_LineMsgDecoder*)getMsgDecoder())->getMsg();
+	}
+};
+
+//---------------------------------------------------------
+
+int main( int argc, char * argv[] )
+{
+	int port = 5000, maxThreads = 4, maxConnections = 100000, stackSize = 0, stackGuard = 1;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:t:c:s:Gv" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				port = atoi( optarg );
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'c':
+				maxConnections = atoi( optarg );
+				break;
+			case 's':
+				stackSize = atoi( optarg );
+				break;
+			case 'G':
+				stackGuard = 0;
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-c <max connections>] "
+						"[-s <stack size>] [-G]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	sp_openlog( "testcoro", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
+
+	SP_CoHandlerAdapter::setStackGuard( stackGuard );
+
+	assert( 0 == sp_initsock() );
+
+	SP_Server echoServer( "", 5001, new SP_EchoHandlerFactory() );
+	echoServer.run();
+
+	const char * refusedMsg = "System busy, try again later.";
+
+	int listenFd = -1;
+	if( 0 == SP_IOUtils::tcpListen( "", port, &listenFd ) ) {
+		SP_Dispatcher dispatcher( new SP_DefaultCompletionHandler(), maxThreads );
+		dispatcher.dispatch();
+
+		SP_AsyncClient client( &dispatcher );
+
+		for( ; ; ) {
+			struct sockaddr_in addr;
+			socklen_t socklen = sizeof( addr );
+			int fd = accept( listenFd, (struct sockaddr*)&addr, &socklen );
+
+			if( fd > 0 ) {
+				if( dispatcher.getSessionCount() >= maxConnections ) {
+					send( fd, refusedMsg, strlen( refusedMsg ), 0 );
+					sp_close( fd );
+				} else {
+					dispatcher.push( fd, new SP_CoHandlerAdapter( new SP_LineCoHandler(),
+							&dispatcher, &client, stackSize ) );
+				}
+			} else {
+				break;
+			}
+		}
+	}
+
+	echoServer.shutdown();
+
+	sp_closelog();
+
+	return 0;
+}
+
@@ -15,10 +15,12 @@
 #include "spbuffer.hpp"
 
 #include "spserver.hpp"
+#include "splfserver.hpp"
 #include "sphandler.hpp"
 #include "spresponse.hpp"
 #include "sprequest.hpp"
 #include "sputils.hpp"
+#include "spiouring.hpp"
 
 class SP_EchoHandler : public SP_Handler {
 public:
@@ -80,14 +82,65 @@ int main( int argc, char * argv[] )
 {
 	sp_openlog( "testecho", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
 
-	int port = 3333;
+	int port = 3333, useUring = 0, useLF = 0, basePerThread = 0, maxThreads = 0;
+	int highWatermark = 0;
+
+#ifndef WIN32
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:ulbt:w:v" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				port = atoi( optarg );
+				break;
+			case 'u':
+				useUring = 1;
+				break;
+			case 'l':
+				useLF = 1;
+				break;
+			case 'b':
+				useLF = basePerThread = 1;
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'w':
+				highWatermark = atoi( optarg );
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-u] [-l] [-b] [-t <threads>] [-w <bytes>]\n", argv[0] );
+				printf( "\t-u use the io_uring io channel\n" );
+				printf( "\t-l use the leader/follower server\n" );
+				printf( "\t-b use the leader/follower server with an event base per thread\n" );
+				printf( "\t-w stop reading a client with this much echo queued\n" );
+				exit( 0 );
+		}
+	}
+#endif
 
 	assert( 0 == sp_initsock() );
 
-	SP_Server server( "", port, new SP_EchoHandlerFactory() );
-	server.setMaxConnections( 100000 );
-	server.setReqQueueSize( 10000, "Server busy!" );
-	server.runForever();
+	if( useLF ) {
+		SP_LFServer server( "", port, new SP_EchoHandlerFactory() );
+		server.setMaxConnections( 100000 );
+		server.setReqQueueSize( 10000, "Server busy!" );
+		server.setMaxThreads( maxThreads );
+		server.setBasePerThread( basePerThread );
+		server.setOutputWatermarks( highWatermark, 0, SP_OutputPolicy::ePause );
+		if( useUring ) server.setIOChannelFactory( new SP_UringIOChannelFactory() );
+		server.runForever();
+	} else {
+		SP_Server server( "", port, new SP_EchoHandlerFactory() );
+		server.setMaxConnections( 100000 );
+		server.setReqQueueSize( 10000, "Server busy!" );
+		server.setMaxThreads( maxThreads );
+		server.setOutputWatermarks( highWatermark, 0, SP_OutputPolicy::ePause );
+		if( useUring ) server.setIOChannelFactory( new SP_UringIOChannelFactory() );
+		server.runForever();
+	}
 
 	return 0;
 }
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "spporting.hpp"
+
+#include "spbuffer.hpp"
+#include "spmsgdecoder.hpp"
+
+// decode length prefixed frames fed in read-sized chunks,
+// SP_FrameMsgDecoder against SP_DefaultMsgDecoder with the framing in the handler:
+//   ./testframe -s 100
+//   ./testframe -s 65536
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// the stream of frames, sent repeatedly
+static char * makeStream( int frameSize, int frameCount, int * streamSize )
+{
+	SP_Buffer buffer;
+
+	char * frame = (char*)malloc( frameSize );
+	for( int i = 0; i < frameSize; i++ ) frame[i] = 'a' + i % 26;
+
+	for( int i = 0; i < frameCount; i++ ) {
+		frame[0] = 'a' + i % 26;
+		SP_FrameMsgDecoder::appendFrame( &buffer, frame, frameSize );
+	}
+
+	free( frame );
+
+	*streamSize = buffer.getSize();
+	char * stream = (char*)malloc( *streamSize );
+	memcpy( stream, buffer.getRawBuffer(), *streamSize );
+
+	return stream;
+}
+
+// the handler keeps the partial frames, and copies every frame it takes
+static unsigned long handleDefault( SP_DefaultMsgDecoder * decoder, SP_Buffer * pending )
+{
+	unsigned long sum = 0;
+
+	pending->append( decoder->getMsg() );
+
+	for( ; pending->getSize() >= 4; ) {
+		const unsigned char * pos = (unsigned char*)pending->getRawBuffer();
+		int len = ( pos[0] << 24 ) | ( pos[1] << 16 ) | ( pos[2] << 8 ) | pos[3];
+		if( (int)pending->getSize() < 4 + len ) break;
+
+		char * frame = (char*)malloc( len );
+		memcpy( frame, pos + 4, len );
+		sum += frame[0];
+		free( frame );
+
+		pending->erase( 4 + len );
+	}
+
+	return sum;
+}
+
+static unsigned long handleFrame( SP_FrameMsgDecoder * decoder )
+{
+	unsigned long sum = 0;
+
+	for( int i = 0; i < decoder->getCount(); i++ ) {
+		int len = 0;
+		const char * frame = decoder->getFrame( i, &len );
+		sum += frame[0];
+	}
+
+	return sum;
+}
+
+static void run( const char * name, int useFrame, const char * stream, int streamSize,
+		int readSize, long long totalBytes, int frameSize )
+{
+	SP_Buffer inBuffer, pending;
+	SP_DefaultMsgDecoder defaultDecoder;
+	SP_FrameMsgDecoder frameDecoder;
+
+	unsigned long sum = 0;
+	long long bytes = 0;
+
+	double begin = now();
+
+	for( int offset = 0; bytes < totalBytes; ) {
+		int len = streamSize - offset < readSize ? streamSize - offset : readSize;
+
+		inBuffer.append( stream + offset, len );
+		offset = ( offset + len ) % streamSize;
+		bytes += len;
+
+		if( useFrame ) {
+			for( ; SP_MsgDecoder::eOK == frameDecoder.decode( &inBuffer ); ) {
+				if( 0 == frameDecoder.getCount() ) break;
+				sum += handleFrame( &frameDecoder );
+			}
+		} else {
+			if( SP_MsgDecoder::eOK == defaultDecoder.decode( &inBuffer ) ) {
+				sum += handleDefault( &defaultDecoder, &pending );
+			}
+		}
+	}
+
+	double used = now() - begin;
+	double frames = bytes / ( frameSize + 4.0 );
+
+	printf( "%-8s frame %6d, read %6d : %8.3f s, %10.0f frames/s, %8.1f MB/s (%lu)\n",
+			name, frameSize, readSize, used, frames / used, bytes / used / 1048576.0, sum );
+}
+
+int main( int argc, char * argv[] )
+{
+	int frameSize = 100, readSize = 65536, totalMB = 1024;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "s:r:n:v" )) != EOF ) {
+		switch ( c ) {
+			case 's' :
+				frameSize = atoi( optarg );
+				break;
+			case 'r':
+				readSize = atoi( optarg );
+				break;
+			case 'n':
+				totalMB = atoi( optarg );
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-s <frame size>] [-r <read size>] [-n <total MB>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	int frameCount = ( 4 * 1024 * 1024 ) / ( frameSize + 4 ) + 1;
+
+	int streamSize = 0;
+	char * stream = makeStream( frameSize, frameCount, &streamSize );
+
+	long long totalBytes = (long long)totalMB * 1024 * 1024;
+
+	run( "default", 0, stream, streamSize, readSize, totalBytes, frameSize );
+	run( "frame", 1, stream, streamSize, readSize, totalBytes, frameSize );
+
+	free( stream );
+
+	return 0;
+}
+
@@ -16,6 +16,7 @@
 #include "sphttpmsg.hpp"
 #include "spserver.hpp"
 #include "splfserver.hpp"
+#include "spiouring.hpp"
 
 class SP_HttpEchoHandler : public SP_HttpHandler {
 public:
@@ -75,12 +76,13 @@ int main( int argc, char * argv[] )
 {
 	int port = 8080, maxThreads = 10;
 	const char * serverType = "lf";
+	int useUring = 0;
 
 #ifndef WIN32
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "p:t:s:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "p:t:s:uv" )) != EOF ) {
 		switch ( c ) {
 			case 'p' :
 				port = atoi( optarg );
@@ -91,9 +93,13 @@ int main( int argc, char * argv[] )
 			case 's':
 				serverType = optarg;
 				break;
+			case 'u':
+				useUring = 1;
+				break;
 			case '?' :
 			case 'v' :
-				printf( "Usage: %s [-p <port>] [-t <threads>] [-s <hahs|lf>]\n", argv[0] );
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-s <hahs|lf>] [-u]\n", argv[0] );
+				printf( "\t-u use the io_uring io channel\n" );
 				exit( 0 );
 		}
 	}
@@ -109,6 +115,7 @@ int main( int argc, char * argv[] )
 		server.setTimeout( 60 );
 		server.setMaxThreads( maxThreads );
 		server.setReqQueueSize( 100, "HTTP/1.1 500 Sorry, server is busy now!\r\n" );
+		if( useUring ) server.setIOChannelFactory( new SP_UringIOChannelFactory() );
 
 		server.runForever();
 	} else {
@@ -117,6 +124,7 @@ int main( int argc, char * argv[] )
 		server.setTimeout( 60 );
 		server.setMaxThreads( maxThreads );
 		server.setReqQueueSize( 100, "HTTP/1.1 500 Sorry, server is busy now!\r\n" );
+		if( useUring ) server.setIOChannelFactory( new SP_UringIOChannelFactory() );
 
 		server.runForever();
 	}
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "spporting.hpp"
+
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "spserver.hpp"
+#include "splfserver.hpp"
+#include "spdispatcher.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "sprequest.hpp"
+#include "spioutils.hpp"
+
+// every client pipelines its numbered lines at once, the lane mode must
+// hand them to the handler in order and echo them back in order:
+//   ./testlane -m server -c 50 -n 200
+//   ./testlane -m lfserver
+//   ./testlane -m lfbase        SP_LFServer with an event base per thread
+//   ./testlane -m dispatcher
+// a session stays on one lane thread except with the shared base of
+// SP_LFServer, where the threads take turns
+
+static volatile int gDisorder = 0;
+static volatile int gSwitches = 0;
+
+class SP_LaneHandler : public SP_Handler {
+public:
+	SP_LaneHandler() { mExpect = 0; mIsBound = 0; }
+	virtual ~SP_LaneHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		const char * line = ((SP_LineMsgDecoder*)request->getMsgDecoder())->getMsg();
+
+		if( atoi( line ) != mExpect ) sp_atomic_add( &gDisorder, 1 );
+		mExpect = atoi( line ) + 1;
+
+		sp_thread_t self = sp_thread_self();
+		if( mIsBound && ! pthread_equal( self, mThread ) ) sp_atomic_add( &gSwitches, 1 );
+		mThread = self;
+		mIsBound = 1;
+
+		response->getReply()->getMsg()->append( line );
+		response->getReply()->getMsg()->append( "\n" );
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+
+private:
+	int mExpect;
+	int mIsBound;
+	sp_thread_t mThread;
+};
+
+class SP_LaneHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_LaneHandlerFactory() {}
+	virtual ~SP_LaneHandlerFactory() {}
+
+	virtual SP_Handler * create() const {
+		return new SP_LaneHandler();
+	}
+};
+
+static int unixListen( const char * path )
+{
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+	struct sockaddr_un addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	snprintf( addr.sun_path, sizeof( addr.sun_path ), "%s", path );
+
+	unlink( path );
+
+	if( fd < 0 || bind( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0
+			|| listen( fd, 1024 ) < 0 ) {
+		fprintf( stderr, "listen on %s fail, errno %d, %s\n", path, errno, strerror( errno ) );
+		exit( -1 );
+	}
+
+	return fd;
+}
+
+static int unixConnect( const char * path )
+{
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+	struct sockaddr_un addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	snprintf( addr.sun_path, sizeof( addr.sun_path ), "%s", path );
+
+	if( fd < 0 || connect( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 ) {
+		fprintf( stderr, "connect to %s fail, errno %d, %s\n", path, errno, strerror( errno ) );
+		exit( -1 );
+	}
+
+	return fd;
+}
+
+// read the replies of one client, return the number of lines out of order
+static int readReplies( int fd, int requests )
+{
+	int disorder = 0, expect = 0;
+	char line[ 32 ] = { 0 };
+	int len = 0;
+
+	for( ; expect < requests; ) {
+		char c = 0;
+		if( recv( fd, &c, 1, 0 ) <= 0 ) {
+			fprintf( stderr, "client %d: %d replies of %d, errno %d, %s\n",
+					fd, expect, requests, errno, strerror( errno ) );
+			exit( -1 );
+		}
+
+		if( '\n' == c ) {
+			line[ len ] = '\0';
+			if( atoi( line ) != expect ) disorder++;
+			expect++;
+			len = 0;
+		} else if( len < (int)sizeof( line ) - 1 ) {
+			line[ len++ ] = c;
+		}
+	}
+
+	return disorder;
+}
+
+int main( int argc, char * argv[] )
+{
+	const char * mode = "server";
+	int clientCount = 50, requests = 200, maxThreads = 4;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "m:c:n:t:v" )) != EOF ) {
+		switch ( c ) {
+			case 'm' :
+				mode = optarg;
+				break;
+			case 'c':
+				clientCount = atoi( optarg );
+				break;
+			case 'n':
+				requests = atoi( optarg );
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-m <server|lfserver|lfbase|dispatcher>] "
+						"[-c <clients>] [-n <requests per client>] [-t <threads>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	if( clientCount <= 0 ) clientCount = 1;
+	if( requests <= 0 ) requests = 1;
+
+	sp_openlog( "testlane", LOG_CONS | LOG_PID, LOG_USER );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	SP_HandlerFactory * factory = new SP_LaneHandlerFactory();
+
+	char path[ 64 ] = { 0 };
+	snprintf( path, sizeof( path ), "/tmp/testlane.%d", (int)getpid() );
+
+	SP_Dispatcher * dispatcher = NULL;
+	int isOneLane = 1;
+
+	if( 0 == strcmp( mode, "server" ) ) {
+		SP_Server * server = new SP_Server( "", 0, factory );
+		server->setListenFd( unixListen( path ) );
+		server->setMaxConnections( clientCount + 16 );
+		server->setMaxThreads( maxThreads );
+		server->setReqQueueSize( clientCount + 16, "Busy" );
+		server->setLaneMode( 1 );
+		server->run();
+	} else if( 0 == strcmp( mode, "lfserver" ) || 0 == strcmp( mode, "lfbase" ) ) {
+		SP_LFServer * lfServer = new SP_LFServer( "", 0, factory );
+		lfServer->setListenFd( unixListen( path ) );
+		// divided over the bases, which may not get an equal share
+		lfServer->setMaxConnections( ( clientCount + 16 ) * maxThreads );
+		lfServer->setMaxThreads( maxThreads );
+		lfServer->setBasePerThread( 0 == strcmp( mode, "lfbase" ) );
+		lfServer->setReqQueueSize( clientCount + 16, "Busy" );
+		lfServer->setLaneMode( 1 );
+		assert( 0 == lfServer->run() );
+		isOneLane = ( 0 == strcmp( mode, "lfbase" ) );
+	} else if( 0 == strcmp( mode, "dispatcher" ) ) {
+		dispatcher = new SP_Dispatcher( new SP_DefaultCompletionHandler(), maxThreads );
+		dispatcher->setLaneMode( 1 );
+		dispatcher->dispatch();
+	} else {
+		fprintf( stderr, "unknown mode %s\n", mode );
+		exit( -1 );
+	}
+
+	int * fds = (int*)calloc( clientCount, sizeof( int ) );
+
+	for( int i = 0; i < clientCount; i++ ) {
+		if( NULL != dispatcher ) {
+			int pair[ 2 ] = { -1, -1 };
+			if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) < 0 ) {
+				fprintf( stderr, "socketpair fail, errno %d, %s\n", errno, strerror( errno ) );
+				exit( -1 );
+			}
+			SP_IOUtils::setNonblock( pair[1] );
+			dispatcher->push( pair[1], factory->create() );
+			fds[i] = pair[0];
+		} else {
+			fds[i] = unixConnect( path );
+		}
+	}
+
+	// all the requests are sent before any reply is read, so they are
+	// pipelined and a lane worker finds several of them in the buffer
+	for( int i = 0; i < clientCount; i++ ) {
+		SP_Buffer buffer;
+		for( int j = 0; j < requests; j++ ) buffer.printf( "%d\n", j );
+
+		const char * data = (const char*)buffer.getRawBuffer();
+		for( int sent = 0, len = buffer.getSize(); sent < len; ) {
+			int ret = send( fds[i], data + sent, len - sent, 0 );
+			if( ret <= 0 ) {
+				fprintf( stderr, "send fail, errno %d, %s\n", errno, strerror( errno ) );
+				exit( -1 );
+			}
+			sent += ret;
+		}
+	}
+
+	int disorder = 0;
+	for( int i = 0; i < clientCount; i++ ) {
+		disorder += readReplies( fds[i], requests );
+		sp_close( fds[i] );
+	}
+	free( fds );
+
+	unlink( path );
+
+	printf( "%s: clients %d, requests %d, threads %d, "
+			"handled out of order %d, replied out of order %d, lane switches %d\n",
+			mode, clientCount, clientCount * requests, maxThreads, gDisorder, disorder, gSwitches );
+
+	assert( 0 == gDisorder );
+	assert( 0 == disorder );
+	if( isOneLane ) assert( 0 == gSwitches );
+
+	printf( "testlane: OK\n" );
+
+	sp_closelog();
+
+	return 0;
+}
@@ -0,0 +1,653 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+
+#include "spporting.hpp"
+
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "spserver.hpp"
+#include "splfserver.hpp"
+#include "spdispatcher.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "sprequest.hpp"
+#include "spioutils.hpp"
+#include "sphttp.hpp"
+#include "sphttpmsg.hpp"
+
+#include "event.h"
+
+// the framework overhead without the network: thousands of clients in the
+// same process talk to the server over unix sockets (SP_Server, SP_LFServer)
+// or socketpairs (SP_Dispatcher), one request outstanding per client:
+//   ./testloopback -m server -h echo -c 1000 -n 100
+//   ./testloopback -m lfserver -h line
+//   ./testloopback -m lfbase -h line        SP_LFServer with an event base per thread
+//   ./testloopback -m dispatcher -h http
+// every request carries its send time and every reply the time the handler
+// ended, so the latency is split into stages:
+//   queue  : client send to handler start, reactor + decoder + worker queue
+//   handle : the handler itself
+//   reply  : handler end to the reply read by the client
+// the cpu time of the client thread is subtracted from the process
+
+enum { STAMP_LEN = 16 };
+
+static int64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t parseStamp( const char * text )
+{
+	char hex[ STAMP_LEN + 1 ] = { 0 };
+	memcpy( hex, text, STAMP_LEN );
+	return strtoll( hex, NULL, 16 );
+}
+
+static void formatStamp( char * text, int64_t stamp )
+{
+	char hex[ STAMP_LEN + 1 ] = { 0 };
+	snprintf( hex, sizeof( hex ), "%016llx", (long long)stamp );
+	memcpy( text, hex, STAMP_LEN );
+}
+
+//---------------------------------------------------------
+
+#ifdef __GLIBC__
+
+// count the allocations, the program's malloc is used by libspserver too
+extern "C" void * __libc_malloc( size_t size );
+extern "C" void * __libc_calloc( size_t count, size_t size );
+extern "C" void * __libc_realloc( void * ptr, size_t size );
+
+static volatile long gAllocCount = 0;
+
+extern "C" void * malloc( size_t size )
+{
+	__sync_fetch_and_add( &gAllocCount, 1 );
+	return __libc_malloc( size );
+}
+
+extern "C" void * calloc( size_t count, size_t size )
+{
+	__sync_fetch_and_add( &gAllocCount, 1 );
+	return __libc_calloc( count, size );
+}
+
+extern "C" void * realloc( void * ptr, size_t size )
+{
+	__sync_fetch_and_add( &gAllocCount, 1 );
+	return __libc_realloc( ptr, size );
+}
+
+#else
+
+static volatile long gAllocCount = -1;
+
+#endif
+
+//---------------------------------------------------------
+
+class SP_Samples {
+public:
+	SP_Samples( const char * name, int capacity ) {
+		mName = name;
+		mCapacity = capacity;
+		mCount = 0;
+		mData = (int64_t*)malloc( sizeof( int64_t ) * capacity );
+	}
+
+	~SP_Samples() {
+		free( mData );
+	}
+
+	// called by the workers and the client thread
+	void add( int64_t value ) {
+		int index = __sync_fetch_and_add( &mCount, 1 );
+		if( index < mCapacity ) mData[ index ] = value;
+	}
+
+	void report() {
+		int count = mCount < mCapacity ? mCount : mCapacity;
+		if( count <= 0 ) return;
+
+		qsort( mData, count, sizeof( int64_t ), compare );
+
+		printf( "  %-8s p50 %9.1f us, p99 %9.1f us, p999 %9.1f us, max %9.1f us\n",
+				mName, mData[ count / 2 ] / 1000.0, mData[ (int)( count * 0.99 ) ] / 1000.0,
+				mData[ (int)( count * 0.999 ) ] / 1000.0, mData[ count - 1 ] / 1000.0 );
+	}
+
+private:
+	const char * mName;
+	int64_t * mData;
+	int mCapacity;
+	volatile int mCount;
+
+	static int compare( const void * a, const void * b ) {
+		int64_t x = *(int64_t*)a, y = *(int64_t*)b;
+		return x < y ? -1 : ( x > y ? 1 : 0 );
+	}
+};
+
+static SP_Samples * gQueueStage = NULL, * gHandleStage = NULL;
+static SP_Samples * gReplyStage = NULL, * gTotalStage = NULL;
+
+// off during the warm-up round
+static volatile int gIsRecording = 0;
+
+static int gPayloadSize = 64;
+
+//---------------------------------------------------------
+
+// SP_DefaultMsgDecoder, the reply is the request with the handler's stamp
+class SP_EchoHandler : public SP_Handler {
+public:
+	SP_EchoHandler(){}
+	virtual ~SP_EchoHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		int64_t begin = nowNs();
+
+		SP_Buffer * msg = ((SP_DefaultMsgDecoder*)request->getMsgDecoder())->getMsg();
+		SP_Buffer * reply = response->getReply()->getMsg();
+
+		const char * data = (const char*)msg->getRawBuffer();
+		int len = msg->getSize();
+
+		if( len >= STAMP_LEN ) {
+			if( gIsRecording ) gQueueStage->add( begin - parseStamp( data ) );
+
+			char stamp[ STAMP_LEN ];
+			int64_t end = nowNs();
+			formatStamp( stamp, end );
+
+			reply->append( stamp, STAMP_LEN );
+			if( len > STAMP_LEN ) reply->append( data + STAMP_LEN, len - STAMP_LEN );
+
+			if( gIsRecording ) gHandleStage->add( end - begin );
+		} else if( len > 0 ) {
+			reply->append( data, len );
+		}
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+// SP_LineMsgDecoder, one line per request
+class SP_LineHandler : public SP_Handler {
+public:
+	SP_LineHandler(){}
+	virtual ~SP_LineHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		int64_t begin = nowNs();
+
+		const char * line = ((SP_LineMsgDecoder*)request->getMsgDecoder())->getMsg();
+		SP_Buffer * reply = response->getReply()->getMsg();
+
+		int len = strlen( line );
+
+		if( len >= STAMP_LEN ) {
+			if( gIsRecording ) gQueueStage->add( begin - parseStamp( line ) );
+
+			char stamp[ STAMP_LEN ];
+			int64_t end = nowNs();
+			formatStamp( stamp, end );
+
+			reply->append( stamp, STAMP_LEN );
+			if( len > STAMP_LEN ) reply->append( line + STAMP_LEN, len - STAMP_LEN );
+			reply->append( "\n" );
+
+			if( gIsRecording ) gHandleStage->add( end - begin );
+		} else {
+			reply->append( line );
+			reply->append( "\n" );
+		}
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+class SP_LoopbackHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_LoopbackHandlerFactory( int isLine ) { mIsLine = isLine; }
+	virtual ~SP_LoopbackHandlerFactory() {}
+
+	virtual SP_Handler * create() const {
+		if( mIsLine ) return new SP_LineHandler();
+		return new SP_EchoHandler();
+	}
+
+private:
+	int mIsLine;
+};
+
+// GET /<stamp>, the content is the handler's stamp padded to the payload size
+class SP_LoopbackHttpHandler : public SP_HttpHandler {
+public:
+	SP_LoopbackHttpHandler(){}
+	virtual ~SP_LoopbackHttpHandler(){}
+
+	virtual void handle( SP_HttpRequest * request, SP_HttpResponse * response ) {
+		int64_t begin = nowNs();
+
+		const char * uri = request->getURI();
+		if( '/' == *uri ) uri++;
+
+		if( gIsRecording && strlen( uri ) >= STAMP_LEN ) {
+			gQueueStage->add( begin - parseStamp( uri ) );
+		}
+
+		response->setStatusCode( 200 );
+		response->addHeader( "Content-Type", "text/plain" );
+
+		char * content = (char*)malloc( gPayloadSize );
+		memset( content, 'a', gPayloadSize );
+
+		int64_t end = nowNs();
+		formatStamp( content, end );
+		response->appendContent( content, gPayloadSize );
+		free( content );
+
+		if( gIsRecording ) gHandleStage->add( end - begin );
+	}
+};
+
+class SP_LoopbackHttpHandlerFactory : public SP_HttpHandlerFactory {
+public:
+	SP_LoopbackHttpHandlerFactory(){}
+	virtual ~SP_LoopbackHttpHandlerFactory(){}
+
+	virtual SP_HttpHandler * create() const {
+		return new SP_LoopbackHttpHandler();
+	}
+};
+
+//---------------------------------------------------------
+
+typedef struct tagSP_Client {
+	int mFd;
+	int mRemaining;
+	int64_t mSendTime;
+
+	char * mReply;
+	int mReplyLen;
+
+	struct event mEvent;
+} SP_Client_t;
+
+static int gIsHttp = 0;
+static int gReplyCapacity = 0;
+static int gActiveClients = 0;
+
+static void sendRequest( SP_Client_t * client )
+{
+	char request[ 256 ];
+	char * data = request;
+	int len = 0;
+
+	client->mSendTime = nowNs();
+
+	if( gIsHttp ) {
+		len = snprintf( request, sizeof( request ), "GET /%016llx HTTP/1.1\r\n"
+				"Host: loopback\r\nConnection: Keep-Alive\r\n\r\n", (long long)client->mSendTime );
+	} else {
+		// the reply buffer is free until the reply arrives
+		data = client->mReply;
+		len = gPayloadSize;
+		memset( data, 'a', len );
+		formatStamp( data, client->mSendTime );
+		data[ len - 1 ] = '\n';
+	}
+
+	client->mReplyLen = 0;
+
+	for( int sent = 0; sent < len; ) {
+		int ret = write( client->mFd, data + sent, len - sent );
+		if( ret <= 0 ) {
+			fprintf( stderr, "write fail, errno %d, %s\n", errno, strerror( errno ) );
+			exit( -1 );
+		}
+		sent += ret;
+	}
+}
+
+// return the offset of the reply stamp, -1 : more data
+static int checkReply( SP_Client_t * client )
+{
+	if( ! gIsHttp ) return client->mReplyLen >= gPayloadSize ? 0 : -1;
+
+	client->mReply[ client->mReplyLen ] = '\0';
+
+	char * end = strstr( client->mReply, "\r\n\r\n" );
+	if( NULL == end ) return -1;
+
+	const char * pos = strcasestr( client->mReply, "Content-Length:" );
+	int contentLength = NULL != pos ? atoi( pos + strlen( "Content-Length:" ) ) : 0;
+
+	int headerLen = end + 4 - client->mReply;
+	if( client->mReplyLen < headerLen + contentLength ) return -1;
+
+	return contentLength >= STAMP_LEN ? headerLen : -1;
+}
+
+static void onClientRead( int fd, short events, void * arg )
+{
+	SP_Client_t * client = (SP_Client_t*)arg;
+
+	int ret = read( fd, client->mReply + client->mReplyLen,
+			gReplyCapacity - 1 - client->mReplyLen );
+	if( ret <= 0 ) {
+		fprintf( stderr, "read fail, ret %d, errno %d, %s\n", ret, errno, strerror( errno ) );
+		exit( -1 );
+	}
+
+	client->mReplyLen += ret;
+
+	int offset = checkReply( client );
+	if( offset < 0 ) return;
+
+	int64_t now = nowNs();
+
+	if( gIsRecording ) {
+		gReplyStage->add( now - parseStamp( client->mReply + offset ) );
+		gTotalStage->add( now - client->mSendTime );
+	}
+
+	if( --client->mRemaining > 0 ) {
+		sendRequest( client );
+	} else {
+		gActiveClients--;
+	}
+}
+
+// every client sends count requests, one by one
+static void runRound( struct event_base * base, SP_Client_t * clients, int clientCount, int count )
+{
+	gActiveClients = clientCount;
+
+	for( int i = 0; i < clientCount; i++ ) {
+		clients[i].mRemaining = count;
+		sendRequest( &( clients[i] ) );
+	}
+
+	for( ; gActiveClients > 0; ) event_base_loop( base, EVLOOP_ONCE );
+}
+
+static int64_t cpuNs( int who )
+{
+	struct rusage usage;
+	getrusage( who, &usage );
+
+	return ( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000000LL
+			+ ( usage.ru_utime.tv_usec + usage.ru_stime.tv_usec ) * 1000LL;
+}
+
+static int64_t threadCpuNs()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t readTsc()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int unixListen( const char * path )
+{
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+	struct sockaddr_un addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	snprintf( addr.sun_path, sizeof( addr.sun_path ), "%s", path );
+
+	unlink( path );
+
+	if( fd < 0 || bind( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0
+			|| listen( fd, 4096 ) < 0 ) {
+		fprintf( stderr, "listen on %s fail, errno %d, %s\n", path, errno, strerror( errno ) );
+		exit( -1 );
+	}
+
+	return fd;
+}
+
+static int unixConnect( const char * path )
+{
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+	struct sockaddr_un addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	snprintf( addr.sun_path, sizeof( addr.sun_path ), "%s", path );
+
+	if( fd < 0 || connect( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 ) {
+		fprintf( stderr, "connect to %s fail, errno %d, %s\n", path, errno, strerror( errno ) );
+		exit( -1 );
+	}
+
+	return fd;
+}
+
+int main( int argc, char * argv[] )
+{
+	const char * mode = "server", * handler = "echo";
+	int clientCount = 1000, requests = 100, maxThreads = 4;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "m:h:c:n:t:z:v" )) != EOF ) {
+		switch ( c ) {
+			case 'm' :
+				mode = optarg;
+				break;
+			case 'h':
+				handler = optarg;
+				break;
+			case 'c':
+				clientCount = atoi( optarg );
+				break;
+			case 'n':
+				requests = atoi( optarg );
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'z':
+				gPayloadSize = atoi( optarg );
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-m <server|lfserver|lfbase|dispatcher>] [-h <echo|line|http>] "
+						"[-c <clients>] [-n <requests per client>] [-t <threads>] "
+						"[-z <payload size>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	if( clientCount <= 0 ) clientCount = 1;
+	if( requests <= 0 ) requests = 1;
+	if( gPayloadSize < STAMP_LEN + 2 ) gPayloadSize = STAMP_LEN + 2;
+
+	gIsHttp = ( 0 == strcmp( handler, "http" ) );
+	int isLine = ( 0 == strcmp( handler, "line" ) );
+	gReplyCapacity = gPayloadSize + 4096;
+
+	sp_openlog( "testloopback", LOG_CONS | LOG_PID, LOG_USER );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	int capacity = clientCount * requests;
+	gQueueStage = new SP_Samples( "queue", capacity );
+	gHandleStage = new SP_Samples( "handle", capacity );
+	gReplyStage = new SP_Samples( "reply", capacity );
+	gTotalStage = new SP_Samples( "total", capacity );
+
+	SP_HandlerFactory * factory = NULL;
+	if( gIsHttp ) {
+		factory = new SP_HttpHandlerAdapterFactory( new SP_LoopbackHttpHandlerFactory() );
+	} else {
+		factory = new SP_LoopbackHandlerFactory( isLine );
+	}
+
+	char path[ 64 ] = { 0 };
+	snprintf( path, sizeof( path ), "/tmp/testloopback.%d", (int)getpid() );
+
+	SP_Server * server = NULL;
+	SP_LFServer * lfServer = NULL;
+	SP_Dispatcher * dispatcher = NULL;
+
+	if( 0 == strcmp( mode, "server" ) ) {
+		server = new SP_Server( "", 0, factory );
+		server->setListenFd( unixListen( path ) );
+		server->setMaxConnections( clientCount + 16 );
+		server->setMaxThreads( maxThreads );
+		server->setReqQueueSize( clientCount + 16, "Busy" );
+		server->run();
+	} else if( 0 == strcmp( mode, "lfserver" ) || 0 == strcmp( mode, "lfbase" ) ) {
+		lfServer = new SP_LFServer( "", 0, factory );
+		lfServer->setListenFd( unixListen( path ) );
+		// divided over the bases, which may not get an equal share
+		lfServer->setMaxConnections( ( clientCount + 16 ) * maxThreads );
+		lfServer->setMaxThreads( maxThreads );
+		lfServer->setBasePerThread( 0 == strcmp( mode, "lfbase" ) );
+		lfServer->setReqQueueSize( clientCount + 16, "Busy" );
+		assert( 0 == lfServer->run() );
+	} else if( 0 == strcmp( mode, "dispatcher" ) ) {
+		dispatcher = new SP_Dispatcher( new SP_DefaultCompletionHandler(), maxThreads );
+		dispatcher->dispatch();
+	} else {
+		fprintf( stderr, "unknown mode %s\n", mode );
+		exit( -1 );
+	}
+
+	struct event_base * base = (struct event_base*)event_init();
+
+	SP_Client_t * clients = (SP_Client_t*)calloc( clientCount, sizeof( SP_Client_t ) );
+
+	for( int i = 0; i < clientCount; i++ ) {
+		SP_Client_t * client = &( clients[i] );
+
+		if( NULL != dispatcher ) {
+			int fds[ 2 ] = { -1, -1 };
+			if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) < 0 ) {
+				fprintf( stderr, "socketpair fail, errno %d, %s\n", errno, strerror( errno ) );
+				exit( -1 );
+			}
+			SP_IOUtils::setNonblock( fds[1] );
+			dispatcher->push( fds[1], factory->create() );
+			client->mFd = fds[0];
+		} else {
+			client->mFd = unixConnect( path );
+		}
+
+		client->mReply = (char*)malloc( gReplyCapacity );
+
+		event_set( &client->mEvent, client->mFd, EV_READ | EV_PERSIST, onClientRead, client );
+		event_base_set( base, &client->mEvent );
+		event_add( &client->mEvent, NULL );
+	}
+
+	// the sessions are set up and the buffers are grown in the warm-up round
+	runRound( base, clients, clientCount, 1 );
+
+	gIsRecording = 1;
+
+	long allocBegin = gAllocCount;
+	int64_t cpuBegin = cpuNs( RUSAGE_SELF ), clientCpuBegin = threadCpuNs();
+	uint64_t tscBegin = readTsc();
+	int64_t begin = nowNs();
+
+	runRound( base, clients, clientCount, requests );
+
+	int64_t used = nowNs() - begin;
+	uint64_t tscUsed = readTsc() - tscBegin;
+	int64_t clientCpu = threadCpuNs() - clientCpuBegin;
+	int64_t serverCpu = cpuNs( RUSAGE_SELF ) - cpuBegin - clientCpu;
+	long allocs = gAllocCount - allocBegin;
+
+	gIsRecording = 0;
+
+	double total = (double)clientCount * requests;
+
+	printf( "%s/%s: clients %d, requests %.0f, threads %d, payload %d\n",
+			mode, handler, clientCount, total, maxThreads, gPayloadSize );
+	printf( "  elapsed %.3f s, %.0f req/s\n", used / 1e9, total * 1e9 / used );
+	printf( "  server cpu %.0f ns/req", serverCpu / total );
+	if( tscUsed > 0 ) {
+		// at the tsc rate, cycles of a fixed frequency
+		printf( ", %.0f cycles/req", serverCpu / total * tscUsed / used );
+	}
+	printf( ", client cpu %.0f ns/req\n", clientCpu / total );
+	if( allocs >= 0 ) printf( "  allocs %.2f /req\n", allocs / total );
+
+	gQueueStage->report();
+	gHandleStage->report();
+	gReplyStage->report();
+	gTotalStage->report();
+
+	for( int i = 0; i < clientCount; i++ ) {
+		event_del( &( clients[i].mEvent ) );
+		sp_close( clients[i].mFd );
+		free( clients[i].mReply );
+	}
+	free( clients );
+
+	unlink( path );
+
+	sp_closelog();
+
+	return 0;
+}
+
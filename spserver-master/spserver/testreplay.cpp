@@ -0,0 +1,154 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+
+#include "spporting.hpp"
+
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "spserver.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "sprequest.hpp"
+#include "spiochannel.hpp"
+#include "spcapture.hpp"
+
+// capture the traffic of a line echo server, then replay it against the
+// same handler without the network:
+//   ./testreplay -p 3333 -c echo.cap      serve and capture, ctrl-c to stop
+//   ./teststress -p 3333 -c 100 -m 1000
+//   ./testreplay -r echo.cap              as fast as possible
+//   ./testreplay -r echo.cap -s 1         at the original pace
+
+class SP_EchoHandler : public SP_Handler {
+public:
+	SP_EchoHandler(){}
+	virtual ~SP_EchoHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		response->getReply()->getMsg()->append(
+			"Welcome to line echo server, enter 'quit' to quit.\r\n" );
+
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		SP_LineMsgDecoder * decoder = (SP_LineMsgDecoder*)request->getMsgDecoder();
+
+		if( 0 != strcasecmp( (char*)decoder->getMsg(), "quit" ) ) {
+			response->getReply()->getMsg()->append( (char*)decoder->getMsg() );
+			response->getReply()->getMsg()->append( "\r\n" );
+			return 0;
+		} else {
+			response->getReply()->getMsg()->append( "Byebye\r\n" );
+			return -1;
+		}
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+class SP_EchoHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_EchoHandlerFactory() {}
+	virtual ~SP_EchoHandlerFactory() {}
+
+	virtual SP_Handler * create() const {
+		return new SP_EchoHandler();
+	}
+};
+
+int main( int argc, char * argv[] )
+{
+	int port = 3333;
+	const char * captureFile = NULL, * replayFile = NULL;
+	double speed = 0;
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:c:r:s:v" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				port = atoi( optarg );
+				break;
+			case 'c':
+				captureFile = optarg;
+				break;
+			case 'r':
+				replayFile = optarg;
+				break;
+			case 's':
+				speed = atof( optarg );
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-c <capture file>]\n", argv[0] );
+				printf( "       %s -r <capture file> [-s <speed, 0 is as fast as possible>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	sp_openlog( "testreplay", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
+
+	if( NULL != replayFile ) {
+		SP_Replayer replayer( new SP_EchoHandlerFactory() );
+		if( 0 != replayer.run( replayFile, speed ) ) return -1;
+
+		double elapsed = replayer.getElapsed() > 0 ? replayer.getElapsed() : 1e-6;
+
+		if( speed > 0 ) {
+			printf( "replay %s at %.2f times the original pace\n", replayFile, speed );
+		} else {
+			printf( "replay %s at full speed\n", replayFile );
+		}
+		printf( "  sessions %d, reads %lld, bytes %lld, msgs %lld, reply bytes %lld\n",
+				replayer.getSessions(), replayer.getRecords(), replayer.getBytes(),
+				replayer.getMsgs(), replayer.getReplyBytes() );
+		printf( "  elapsed %.3f s, %.0f msgs/s, %.1f MB/s\n", elapsed,
+				replayer.getMsgs() / elapsed, replayer.getBytes() / elapsed / 1048576.0 );
+		printf( "  latency per read (usec) : p50 %lld, p99 %lld, p999 %lld, max %lld\n",
+				replayer.getLatency( 50 ), replayer.getLatency( 99 ),
+				replayer.getLatency( 99.9 ), replayer.getLatency( 100 ) );
+		if( replayer.getGaps() > 0 ) {
+			printf( "  gaps %d, sessions truncated %d\n",
+					replayer.getGaps(), replayer.getTruncated() );
+		}
+	} else {
+		assert( 0 == sp_initsock() );
+
+		SP_Capture capture;
+
+		SP_Server server( "", port, new SP_EchoHandlerFactory() );
+		server.setMaxConnections( 10000 );
+		server.setReqQueueSize( 10000, "Byebye\r\n" );
+
+		if( NULL != captureFile ) {
+			if( 0 != capture.open( captureFile ) ) return -1;
+			server.setIOChannelFactory( new SP_CaptureIOChannelFactory(
+					new SP_DefaultIOChannelFactory(), &capture ) );
+		}
+
+		server.runForever();
+
+		capture.close();
+	}
+
+	sp_closelog();
+
+	return 0;
+}
+
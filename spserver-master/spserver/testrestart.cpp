@@ -0,0 +1,186 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+
+#include "spporting.hpp"
+
+#include "sphandler.hpp"
+#include "sprequest.hpp"
+#include "spresponse.hpp"
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "sphttp.hpp"
+#include "sphttpmsg.hpp"
+#include "spserver.hpp"
+#include "splfserver.hpp"
+#include "spioutils.hpp"
+#include "sprestart.hpp"
+
+// restart the server under load, no request should fail:
+//   ./testrestart -p 8080 &
+//   weighttp -n 1000000 -c 100 -t 4 http://127.0.0.1:8080/ &
+//   kill -USR2 <pid>
+// the new copy takes over the listening socket, the old copy finishes
+// the requests in progress and exits, the pid in the response changes;
+// /sleep?ms=2000 keeps a request in progress across the restart;
+// with -P line every line is echoed for teststress, see checkrestart.sh
+
+class SP_HttpPidHandler : public SP_HttpHandler {
+public:
+	SP_HttpPidHandler(){}
+	virtual ~SP_HttpPidHandler(){}
+
+	virtual void handle( SP_HttpRequest * request, SP_HttpResponse * response ) {
+		if( 0 == strncmp( request->getURI(), "/sleep", 6 ) ) {
+			const char * ms = request->getParamValue( "ms" );
+			usleep( ( NULL != ms ? atoi( ms ) : 1000 ) * 1000 );
+		}
+
+		char buffer[ 128 ] = { 0 };
+		snprintf( buffer, sizeof( buffer ), "pid %d\n", (int)getpid() );
+
+		response->setStatusCode( 200 );
+		response->appendContent( buffer );
+	}
+};
+
+class SP_LinePidHandler : public SP_Handler {
+public:
+	SP_LinePidHandler(){}
+	virtual ~SP_LinePidHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		request->setMsgDecoder( new SP_LineMsgDecoder() );
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		SP_LineMsgDecoder * decoder = (SP_LineMsgDecoder*)request->getMsgDecoder();
+
+		char buffer[ 32 ] = { 0 };
+		snprintf( buffer, sizeof( buffer ), " pid %d\r\n", (int)getpid() );
+
+		response->getReply()->getMsg()->append( decoder->getMsg() );
+		response->getReply()->getMsg()->append( buffer );
+
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+class SP_LinePidHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_LinePidHandlerFactory(){}
+	virtual ~SP_LinePidHandlerFactory(){}
+
+	virtual SP_Handler * create() const {
+		return new SP_LinePidHandler();
+	}
+};
+
+class SP_HttpPidHandlerFactory : public SP_HttpHandlerFactory {
+public:
+	SP_HttpPidHandlerFactory(){}
+	virtual ~SP_HttpPidHandlerFactory(){}
+
+	virtual SP_HttpHandler * create() const {
+		return new SP_HttpPidHandler();
+	}
+};
+
+int main( int argc, char * argv[] )
+{
+	int port = 8080, maxThreads = 10, drainTimeout = 30, runAsDaemon = 0;
+	const char * serverType = "hahs";
+	const char * protocol = "http";
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:t:s:P:w:dv" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				port = atoi( optarg );
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 's':
+				serverType = optarg;
+				break;
+			case 'P':
+				protocol = optarg;
+				break;
+			case 'w':
+				drainTimeout = atoi( optarg );
+				break;
+			case 'd':
+				runAsDaemon = 1;
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-s <hahs|lf|lfbase>] [-P <http|line>]\n"
+						"\t\t[-w <drain timeout>] [-d]\n", argv[0] );
+				printf( "\tkill -USR2 <pid> to restart\n" );
+				exit( 0 );
+		}
+	}
+
+	sp_openlog( "testrestart", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
+
+	// before any listener is created, the old copy passes its listeners here
+	SP_HotRestart::init( argc, argv, drainTimeout );
+
+	if( runAsDaemon ) SP_IOUtils::initDaemon();
+
+	assert( 0 == sp_initsock() );
+
+	sp_syslog( LOG_NOTICE, "pid %d, %s", (int)getpid(),
+			SP_HotRestart::isRestarted() ? "restarted" : "started" );
+
+	SP_HandlerFactory * handlerFactory = NULL;
+	if( 0 == strcasecmp( protocol, "line" ) ) {
+		handlerFactory = new SP_LinePidHandlerFactory();
+	} else {
+		handlerFactory = new SP_HttpHandlerAdapterFactory( new SP_HttpPidHandlerFactory() );
+	}
+
+	if( 0 == strcasecmp( serverType, "hahs" ) ) {
+		SP_Server server( "", port, handlerFactory );
+
+		server.setTimeout( 60 );
+		server.setMaxThreads( maxThreads );
+		server.setReqQueueSize( 1000, "HTTP/1.1 500 Sorry, server is busy now!\r\n" );
+
+		server.runForever();
+	} else {
+		SP_LFServer server( "", port, handlerFactory );
+
+		server.setTimeout( 60 );
+		server.setMaxThreads( maxThreads );
+		server.setReqQueueSize( 1000, "HTTP/1.1 500 Sorry, server is busy now!\r\n" );
+		server.setBasePerThread( 0 == strcasecmp( serverType, "lfbase" ) );
+
+		server.runForever();
+	}
+
+	sp_syslog( LOG_NOTICE, "pid %d exit", (int)getpid() );
+
+	sp_closelog();
+
+	return 0;
+}
+
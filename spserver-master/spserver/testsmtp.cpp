@@ -24,15 +24,23 @@
 
 class SP_FakeSmtpHandler : public SP_SmtpHandler {
 public:
-	SP_FakeSmtpHandler(){
+	SP_FakeSmtpHandler( const char * spoolDir ){
 		mAuthResult = 1;
+
+		mSpoolDir = spoolDir;
+		mFile = NULL;
+		mSize = 0;
+		mCount = 0;
 	}
 
-	virtual ~SP_FakeSmtpHandler() {}
+	virtual ~SP_FakeSmtpHandler() {
+		if( NULL != mFile ) fclose( mFile );
+	}
 
 	int ehlo( const char * args, SP_Buffer * reply )
 	{
 		reply->append( "250-OK\n" );
+		reply->append( "250-PIPELINING\n" );
 		reply->append( "250-AUTH LOGIN\n" );
 		reply->append( "250 HELP\n" );
 
@@ -85,6 +93,40 @@ public:
 		return eAccept;
 	}
 
+	// spool the message to a file as it arrives, instead of holding it in memory
+	virtual int dataChunk( const char * chunk, int len, int isLast, SP_Buffer * reply ) {
+		if( NULL == mSpoolDir ) return SP_SmtpHandler::dataChunk( chunk, len, isLast, reply );
+
+		if( NULL == mFile ) {
+			char path[ 256 ] = { 0 };
+			snprintf( path, sizeof( path ), "%s/%d.%p.%d.eml",
+					mSpoolDir, (int)getpid(), this, ++mCount );
+			mFile = fopen( path, "w" );
+			mSize = 0;
+
+			if( NULL == mFile ) {
+				reply->append( "451 Requested action aborted: local error in processing\r\n" );
+				return eReject;
+			}
+		}
+
+		if( len > 0 && 1 != fwrite( chunk, len, 1, mFile ) ) {
+			fclose( mFile );
+			mFile = NULL;
+			reply->append( "452 Requested action not taken: insufficient system storage\r\n" );
+			return eReject;
+		}
+		mSize += len;
+
+		if( isLast ) {
+			fclose( mFile );
+			mFile = NULL;
+			reply->printf( "250 Requested mail action okay, completed, %d bytes.\r\n", mSize );
+		}
+
+		return eAccept;
+	}
+
 	virtual int rset( SP_Buffer * reply ) {
 		reply->append( "250 OK\r\n" );
 
@@ -93,23 +135,31 @@ public:
 
 private:
 	int mAuthResult;
+
+	const char * mSpoolDir;
+	FILE * mFile;
+	int mSize, mCount;
 };
 
 //---------------------------------------------------------
 
 class SP_FakeSmtpHandlerFactory : public SP_SmtpHandlerFactory {
 public:
-	SP_FakeSmtpHandlerFactory();
+	SP_FakeSmtpHandlerFactory( const char * spoolDir );
 	virtual ~SP_FakeSmtpHandlerFactory();
 
 	virtual SP_SmtpHandler * create() const;
 
 	//use default SP_CompletionHandler is enough, not need to implement
 	//virtual SP_CompletionHandler * createCompletionHandler() const;
+
+private:
+	const char * mSpoolDir;
 };
 
-SP_FakeSmtpHandlerFactory :: SP_FakeSmtpHandlerFactory()
+SP_FakeSmtpHandlerFactory :: SP_FakeSmtpHandlerFactory( const char * spoolDir )
 {
+	mSpoolDir = spoolDir;
 }
 
 SP_FakeSmtpHandlerFactory :: ~SP_FakeSmtpHandlerFactory()
@@ -118,21 +168,22 @@ SP_FakeSmtpHandlerFactory :: ~SP_FakeSmtpHandlerFactory()
 
 SP_SmtpHandler * SP_FakeSmtpHandlerFactory :: create() const
 {
-	return new SP_FakeSmtpHandler();
+	return new SP_FakeSmtpHandler( mSpoolDir );
 }
 
 //---------------------------------------------------------
 
 int main( int argc, char * argv[] )
 {
-	int port = 1025, maxThreads = 10;
+	int port = 1025, maxThreads = 10, batchSize = 1;
 	const char * serverType = "hahs";
+	const char * spoolDir = NULL;
 
 #ifndef WIN32
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "p:t:s:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "p:t:s:b:f:v" )) != EOF ) {
 		switch ( c ) {
 			case 'p' :
 				port = atoi( optarg );
@@ -143,9 +194,17 @@ int main( int argc, char * argv[] )
 			case 's':
 				serverType = optarg;
 				break;
+			case 'b':
+				batchSize = atoi( optarg );
+				break;
+			case 'f':
+				spoolDir = optarg;
+				break;
 			case '?' :
 			case 'v' :
-				printf( "Usage: %s [-p <port>] [-t <threads>] [-s <hahs|lf>]\n", argv[0] );
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-s <hahs|lf>] [-b <batch size>] [-f <spool dir>]\n", argv[0] );
+				printf( "\t-b handle up to <batch size> pipelined commands per worker task\n" );
+				printf( "\t-f stream the messages into files in <spool dir>\n" );
 				exit( 0 );
 		}
 	}
@@ -156,21 +215,23 @@ int main( int argc, char * argv[] )
 	assert( 0 == sp_initsock() );
 
 	if( 0 == strcasecmp( serverType, "hahs" ) ) {
-		SP_Server server( "", port, new SP_SmtpHandlerAdapterFactory( new SP_FakeSmtpHandlerFactory() ) );
+		SP_Server server( "", port, new SP_SmtpHandlerAdapterFactory( new SP_FakeSmtpHandlerFactory( spoolDir ) ) );
 
 		server.setMaxConnections( 2048 );
 		server.setTimeout( 600 );
 		server.setMaxThreads( maxThreads );
 		server.setReqQueueSize( 100, "Sorry, server is busy now!\n" );
+		server.setBatchSize( batchSize );
 
 		server.runForever();
 	} else {
-		SP_LFServer server( "", port, new SP_SmtpHandlerAdapterFactory( new SP_FakeSmtpHandlerFactory() ) );
+		SP_LFServer server( "", port, new SP_SmtpHandlerAdapterFactory( new SP_FakeSmtpHandlerFactory( spoolDir ) ) );
 
 		server.setMaxConnections( 2048 );
 		server.setTimeout( 600 );
 		server.setMaxThreads( maxThreads );
 		server.setReqQueueSize( 100, "Sorry, server is busy now!\n" );
+		server.setBatchSize( batchSize );
 
 		server.runForever();
 	}
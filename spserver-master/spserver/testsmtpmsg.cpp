@@ -0,0 +1,242 @@
+/*
+ * Copyright 2009 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "spporting.hpp"
+
+#include "spsmtp.hpp"
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+#include "sprequest.hpp"
+#include "spresponse.hpp"
+
+// the input split at every byte, as the reads of a slow client:
+//   SP_DotTermStreamMsgDecoder : <CRLF>.<CRLF> split across the reads,
+//       dot-stuffed lines, the pipelined command after the message
+//   SP_SmtpHandlerAdapter : a pipelined command group followed by DATA,
+//       the message and QUIT in one stream
+
+static const char * gMessage =
+	"Subject: test\r\n"
+	"..hidden\r\n"
+	"...two\r\n"
+	"a line with . and .. inside\r\n"
+	".\r\n"
+	"QUIT\r\n";
+
+static const char * gUnstuffed =
+	"Subject: test\r\n"
+	".hidden\r\n"
+	"..two\r\n"
+	"a line with . and .. inside\r\n";
+
+// decode what is in the buffer, return 1 when the last chunk was taken
+static int takeChunks( SP_DotTermStreamMsgDecoder * decoder, SP_Buffer * inBuffer,
+		SP_Buffer * content )
+{
+	for( ; SP_MsgDecoder::eOK == decoder->decode( inBuffer ); ) {
+		content->append( decoder->getChunk() );
+		if( decoder->isLast() ) return 1;
+	}
+
+	return 0;
+}
+
+static void testDotTerm( int chunkSize )
+{
+	int len = strlen( gMessage );
+
+	for( int split = 0; split <= len; split++ ) {
+		SP_DotTermStreamMsgDecoder decoder( chunkSize );
+		SP_Buffer inBuffer, content;
+
+		// a length of 0 appends the whole string
+		if( split > 0 ) inBuffer.append( gMessage, split );
+		int isLast = takeChunks( &decoder, &inBuffer, &content );
+		assert( 0 == isLast || split >= len - 6 );
+
+		if( split < len ) inBuffer.append( gMessage + split, len - split );
+		if( ! isLast ) isLast = takeChunks( &decoder, &inBuffer, &content );
+
+		assert( isLast );
+		assert( strlen( gUnstuffed ) == content.getSize() );
+		assert( 0 == memcmp( gUnstuffed, content.getRawBuffer(), content.getSize() ) );
+
+		// the command after the message is left for the next decoder
+		assert( 6 == inBuffer.getSize() );
+		assert( 0 == memcmp( "QUIT\r\n", inBuffer.getRawBuffer(), 6 ) );
+	}
+
+	// one byte per read
+	SP_DotTermStreamMsgDecoder decoder( chunkSize );
+	SP_Buffer inBuffer, content;
+	int isLast = 0;
+	for( int i = 0; i < len && ! isLast; i++ ) {
+		inBuffer.append( gMessage + i, 1 );
+		isLast = takeChunks( &decoder, &inBuffer, &content );
+	}
+	assert( isLast );
+	assert( strlen( gUnstuffed ) == content.getSize() );
+	assert( 0 == memcmp( gUnstuffed, content.getRawBuffer(), content.getSize() ) );
+}
+
+//---------------------------------------------------------
+
+class SP_TestSmtpHandler : public SP_SmtpHandler {
+public:
+	SP_TestSmtpHandler( SP_Buffer * mail ) { mMail = mail; }
+	virtual ~SP_TestSmtpHandler() {}
+
+	virtual int from( const char * args, SP_Buffer * reply ) {
+		mMail->printf( "from %s\n", args );
+		reply->append( "250 sender ok\r\n" );
+		return eAccept;
+	}
+
+	virtual int rcpt( const char * args, SP_Buffer * reply ) {
+		mMail->printf( "rcpt %s\n", args );
+		reply->append( "250 recipient ok\r\n" );
+		return eAccept;
+	}
+
+	virtual int data( const char * data, SP_Buffer * reply ) {
+		mMail->printf( "data %s\n", data );
+		reply->append( "250 queued\r\n" );
+		return eAccept;
+	}
+
+	virtual int rset( SP_Buffer * reply ) {
+		reply->append( "250 OK\r\n" );
+		return eAccept;
+	}
+
+private:
+	SP_Buffer * mMail;
+};
+
+class SP_TestSmtpHandlerFactory : public SP_SmtpHandlerFactory {
+public:
+	SP_TestSmtpHandlerFactory( SP_Buffer * mail ) { mMail = mail; }
+	virtual ~SP_TestSmtpHandlerFactory() {}
+
+	virtual SP_SmtpHandler * create() const {
+		return new SP_TestSmtpHandler( mMail );
+	}
+
+private:
+	SP_Buffer * mMail;
+};
+
+static const char * gSession =
+	"EHLO client\r\n"
+	"MAIL FROM:<a@b.c>\r\n"
+	"RCPT TO:<d@e.f>\r\n"
+	"RCPT TO:<g@h.i>\r\n"
+	"DATA\r\n"
+	"Subject: test\r\n"
+	"..hidden\r\n"
+	".\r\n"
+	"QUIT\r\n";
+
+static const char * gMail =
+	"from <a@b.c>\n"
+	"rcpt <d@e.f>\n"
+	"rcpt <g@h.i>\n"
+	"data Subject: test\r\n"
+	".hidden\n";
+
+// the first 3 bytes of every reply line
+static const char * gReplyCodes = "220 250 250 250 250 250 250 250 354 250 221 ";
+
+// decode and handle what is in the buffer as the server does, return -1 when closed
+static int feed( SP_Handler * handler, SP_Request * request, SP_Buffer * inBuffer,
+		SP_Buffer * replies )
+{
+	SP_Sid_t sid = { 0, 0 };
+
+	for( ; ; ) {
+		// the handler changes the decoder at DATA and after the message
+		SP_MsgDecoder * decoder = request->getMsgDecoder();
+		if( SP_MsgDecoder::eOK != decoder->decode( inBuffer ) ) break;
+
+		SP_Response response( sid );
+		int ret = handler->handle( request, &response );
+		replies->append( response.getReply()->getMsg() );
+
+		if( 0 != ret ) return -1;
+	}
+
+	return 0;
+}
+
+static void getReplyCodes( SP_Buffer * replies, SP_Buffer * codes )
+{
+	for( char * line = replies->getLine(); NULL != line; line = replies->getLine() ) {
+		codes->printf( "%.3s ", line );
+		free( line );
+	}
+}
+
+static void testSmtpSession()
+{
+	int len = strlen( gSession );
+
+	for( int split = 0; split <= len; split++ ) {
+		SP_Buffer mail, replies, codes;
+
+		SP_SmtpHandlerAdapterFactory factory( new SP_TestSmtpHandlerFactory( &mail ) );
+		SP_Handler * handler = factory.create();
+
+		SP_Request request;
+		request.setClientIP( "127.0.0.1" );
+
+		SP_Sid_t sid = { 0, 0 };
+		SP_Response response( sid );
+		assert( 0 == handler->start( &request, &response ) );
+		replies.append( response.getReply()->getMsg() );
+
+		SP_Buffer inBuffer;
+		if( split > 0 ) inBuffer.append( gSession, split );
+		int ret = feed( handler, &request, &inBuffer, &replies );
+		assert( 0 == ret || split == len );
+
+		if( split < len ) inBuffer.append( gSession + split, len - split );
+		if( 0 == ret ) ret = feed( handler, &request, &inBuffer, &replies );
+		assert( -1 == ret );
+
+		handler->close();
+		delete handler;
+
+		assert( strlen( gMail ) == mail.getSize() );
+		assert( 0 == memcmp( gMail, mail.getRawBuffer(), mail.getSize() ) );
+
+		getReplyCodes( &replies, &codes );
+		if( strlen( gReplyCodes ) != codes.getSize()
+				|| 0 != memcmp( gReplyCodes, codes.getRawBuffer(), codes.getSize() ) ) {
+			fprintf( stderr, "split %d, replies %.*s\n", split, (int)codes.getSize(),
+					(char*)codes.getRawBuffer() );
+			assert( 0 );
+		}
+	}
+}
+
+int main( int argc, char * argv[] )
+{
+	testDotTerm( SP_DotTermStreamMsgDecoder::DEFAULT_CHUNK_SIZE );
+
+	// a chunk ends inside the lines too
+	testDotTerm( 8 );
+	testDotTerm( 16 );
+
+	testSmtpSession();
+
+	printf( "testsmtpmsg: OK\n" );
+
+	return 0;
+}
@@ -10,87 +10,400 @@
 #include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <math.h>
 
 #ifdef WIN32
 #include "spgetopt.h"
 #endif
 
 #include "spporting.hpp"
+#include "spthread.hpp"
+#include "spbuffer.hpp"
+#include "spioutils.hpp"
 
 #include "event.h"
 
+// a load generator for the line, echo and chat examples:
+//   ./teststress -p 5555 -c 100 -r 20000 -d 30 -t 2
+// sends 20000 messages/s in total, on schedule whether or not the replies
+// have come back (open loop), for 30 seconds from 2 event loop threads.
+// the latency of a reply is measured from the time its message was due,
+// not from the time it was sent, so a stalled server is not hidden by the
+// sender waiting with it (coordinated omission)
+//
+// without -r every client sends its next message when the reply arrives
+
+enum { eLine, eEcho, eChat };
+
 static const char * gHost = "127.0.0.1";
 static int gPort = 3333;
 static int gMsgs = 10;
 static int gClients = 10;
 static int gConnWait = 0;
-static int gSockWait = 0;
+static int gProtocol = eLine;
+static int gRate = 0;
+static int gDuration = 0;
+static int gThreads = 1;
+static int gDrain = 5;
+static const char * gHgrmFile = NULL;
+
+static long long gStartTime = 0;
+
+static const char * gProtocolNames[] = { "line", "echo", "chat" };
+
+static long long nowUsec()
+{
+	struct timeval tv;
+	sp_gettimeofday( &tv, NULL );
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+//---------------------------------------------------------
+
+// HDR style histogram of usec values, 1% precision from 1 usec to hours
+class SP_Histogram {
+public:
+	enum { SUB_BITS = 7, SUB_HALF = 1 << SUB_BITS, BUCKETS = 40,
+		SLOTS = SUB_HALF * 2 + ( BUCKETS - 1 ) * SUB_HALF };
+
+	SP_Histogram() {
+		memset( mCounts, 0, sizeof( mCounts ) );
+		mTotal = 0;
+		mSum = 0;
+		mMin = -1;
+		mMax = 0;
+	}
+
+	void record( long long value ) {
+		if( value < 0 ) value = 0;
+
+		mCounts[ indexOf( value ) ]++;
+		mTotal++;
+		mSum += value;
+		if( mMin < 0 || value < mMin ) mMin = value;
+		if( value > mMax ) mMax = value;
+	}
+
+	void merge( const SP_Histogram * other ) {
+		for( int i = 0; i < SLOTS; i++ ) mCounts[i] += other->mCounts[i];
+		mTotal += other->mTotal;
+		mSum += other->mSum;
+		if( other->mMin >= 0 && ( mMin < 0 || other->mMin < mMin ) ) mMin = other->mMin;
+		if( other->mMax > mMax ) mMax = other->mMax;
+	}
+
+	long long getTotal() const { return mTotal; }
+
+	long long percentile( double percent ) const {
+		long long target = (long long)ceil( mTotal * percent / 100 );
+		if( target < 1 ) target = 1;
+
+		long long count = 0;
+		for( int i = 0; i < SLOTS; i++ ) {
+			count += mCounts[i];
+			if( count >= target ) return valueOf( i ) < mMax ? valueOf( i ) : mMax;
+		}
+
+		return mMax;
+	}
+
+	void summary( FILE * fp, const char * title ) const {
+		if( mTotal <= 0 ) {
+			fprintf( fp, "%s : no replies\n", title );
+			return;
+		}
+
+		fprintf( fp, "%s (msec) :\n", title );
+		fprintf( fp, "  min %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, p99.99 %.3f, max %.3f, mean %.3f\n",
+				mMin / 1000.0, percentile( 50 ) / 1000.0, percentile( 90 ) / 1000.0,
+				percentile( 99 ) / 1000.0, percentile( 99.9 ) / 1000.0, percentile( 99.99 ) / 1000.0,
+				mMax / 1000.0, mSum / 1000.0 / mTotal );
+	}
+
+	// the percentile distribution in the HdrHistogram .hgrm format, in msec
+	void outputHgrm( FILE * fp ) const {
+		fprintf( fp, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)" );
+
+		double level = 0;
+		long long count = 0;
+
+		for( int i = 0; i < SLOTS && mTotal > 0; i++ ) {
+			if( 0 == mCounts[i] ) continue;
+
+			count += mCounts[i];
+			double percent = 100.0 * count / mTotal;
+			double value = ( valueOf( i ) < mMax ? valueOf( i ) : mMax ) / 1000.0;
+
+			// the last value is reported up to the level of one in total
+			for( ; percent >= level && ( count < mTotal || 1 / ( 1 - level / 100 ) <= mTotal ); ) {
+				fprintf( fp, "%12.3f %2.12f %10lld %14.2f\n", value, level / 100, count,
+						1 / ( 1 - level / 100 ) );
+
+				// 5 ticks per half distance to 100%
+				int halves = (int)( log( 100 / ( 100 - level ) ) / log( 2.0 ) ) + 1;
+				level += 100.0 / ( 5 * pow( 2.0, halves ) );
+			}
+
+			if( count == mTotal ) fprintf( fp, "%12.3f %2.12f %10lld\n", value, 1.0, count );
+		}
+
+		double mean = mTotal > 0 ? (double)mSum / mTotal : 0;
+		fprintf( fp, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1000, stddev( mean ) / 1000 );
+		fprintf( fp, "#[Max     = %12.3f, Total count    = %12lld]\n", mMax / 1000.0, mTotal );
+		fprintf( fp, "#[Buckets = %12d, SubBuckets     = %12d]\n", BUCKETS, SUB_HALF * 2 );
+	}
+
+private:
+	long long mCounts[ SLOTS ];
+	long long mTotal, mSum, mMin, mMax;
+
+	// values below 2*SUB_HALF are exact, then SUB_HALF slots per power of 2
+	static int indexOf( long long value ) {
+		if( value < SUB_HALF * 2 ) return (int)value;
+
+		int shift = 0;
+		for( ; ( value >> shift ) >= SUB_HALF * 2; ) shift++;
+
+		int index = SUB_HALF * 2 + ( shift - 1 ) * SUB_HALF + (int)( ( value >> shift ) - SUB_HALF );
+		return index < SLOTS ? index : SLOTS - 1;
+	}
+
+	// the highest value of the slot
+	static long long valueOf( int index ) {
+		if( index < SUB_HALF * 2 ) return index;
+
+		int shift = ( index - SUB_HALF * 2 ) / SUB_HALF + 1;
+		long long sub = ( index - SUB_HALF * 2 ) % SUB_HALF + SUB_HALF;
+
+		return ( ( sub + 1 ) << shift ) - 1;
+	}
 
-static time_t gStartTime = 0;
+	double stddev( double mean ) const {
+		double sum = 0;
+		for( int i = 0; i < SLOTS; i++ ) {
+			if( mCounts[i] > 0 ) sum += mCounts[i] * pow( valueOf( i ) - mean, 2 );
+		}
+		return mTotal > 0 ? sqrt( sum / mTotal ) : 0;
+	}
+};
+
+//---------------------------------------------------------
+
+struct SP_StressThread;
 
 struct SP_TestClient {
 	int mFd;
+	int mIndex;
+	int mIsClosed;
+	SP_StressThread * mThread;
+
 	struct event mReadEvent;
 	struct event mWriteEvent;
+	int mIsWriting;
+
 	int mSendMsgs;
 	int mRecvMsgs;
-	char mBuffer[ 512 ];
+	int mRecvLines;
+
+	// due and sent time of the messages waiting for the reply, in order
+	long long * mDueList;
+	long long * mSentList;
+	int mHead, mCount, mCapacity;
+
+	int mEchoBytes;
+
+	SP_Buffer * mInBuffer;
+	SP_Buffer * mOutBuffer;
 };
 
+struct SP_StressThread {
+	struct event_base * mBase;
+	struct event mTimer;
+
+	SP_TestClient * mClients;
+	int mCount;
+
+	// the open loop schedule, the n-th message is due at start + n * interval
+	long long mScheduled;
+	double mInterval;
+	int mIsScheduled;
+
+	long long mStopTime;
+	int mIsDone;
+
+	// how late the messages were sent, the error of the load generator
+	long long mMaxLag, mLagSum, mLagCount;
+
+	SP_Histogram mLatency;
+	SP_Histogram mService;
+};
+
+static sp_thread_mutex_t gMutex;
+static sp_thread_cond_t gCond;
+static int gRunningThreads = 0;
+
 void showUsage( const char * program )
 {
 	printf( "\nStress Test Tools for spserver example -- testecho/testchat\n\n" );
 	printf( "Usage: %s [-h <host>] [-p <port>] [-c <clients>] [-m <messages>]\n"
-			"\t\t\t[-w <connect wait>] [-s <socket wait>]\n\n", program );
+			"\t\t\t[-w <connect wait>] [-P <line|echo|chat>] [-r <rate>] [-d <seconds>]\n"
+			"\t\t\t[-t <threads>] [-D <drain seconds>] [-o <hgrm file>]\n\n", program );
 	printf( "\t-h default is %s\n", gHost );
 	printf( "\t-p default is %d\n", gPort );
 	printf( "\t-c how many clients, default is %d\n", gClients );
-	printf( "\t-m messages per client, default is %d\n", gMsgs );
+	printf( "\t-m messages per client, default is %d, ignored with -d\n", gMsgs );
 	printf( "\t-w how many milliseconds to wait between creating every 100 connections, default is %d\n", gConnWait );
-	printf( "\t-s how many milliseconds to wait between every event loop, default is %d\n", gSockWait );
+	printf( "\t-P protocol, line : a reply line per message, echo : the message bytes back,\n"
+			"\t   chat : every message is broadcast to all clients, default is line\n" );
+	printf( "\t-r messages per second from all clients, open loop, default is closed loop\n" );
+	printf( "\t-d run for seconds instead of -m messages\n" );
+	printf( "\t-t event loop threads, default is %d\n", gThreads );
+	printf( "\t-D seconds to wait for the last replies, default is %d\n", gDrain );
+	printf( "\t-o write the latency percentile distribution in the .hgrm format\n" );
 	printf( "\n" );
 }
 
-void close_read( SP_TestClient * client )
+void close_client( SP_TestClient * client )
 {
-	//fprintf( stderr, "#%d close read\n", client->mFd );
+	if( client->mIsClosed ) return;
+
+	client->mIsClosed = 1;
 	event_del( &client->mReadEvent );
-	gClients--;
+	if( client->mIsWriting ) event_del( &client->mWriteEvent );
+	client->mIsWriting = 0;
 }
 
-void close_write( SP_TestClient * client )
+// all the messages are the same size, the echo replies are counted by bytes
+int format_msg( SP_TestClient * client, char * buffer, int size )
 {
-	//fprintf( stderr, "#%d close write\n", client->mFd );
-	event_del( &client->mWriteEvent );
+	return snprintf( buffer, size, "mail #%08d.%010d, It's good to see how people hire; "
+			"that tells us how to market ourselves to them.\n", client->mIndex, client->mSendMsgs );
 }
 
-void close_client( SP_TestClient * client )
+int flush_client( SP_TestClient * client )
+{
+	SP_Buffer * out = client->mOutBuffer;
+
+	if( out->getSize() > 0 ) {
+		int len = send( client->mFd, (char*)out->getRawBuffer(), out->getSize(), 0 );
+		if( len < 0 && EAGAIN != errno && EWOULDBLOCK != errno ) {
+			fprintf( stderr, "#%d send error, errno %d, %s\n", client->mFd, errno, strerror( errno ) );
+			close_client( client );
+			return -1;
+		}
+		if( len > 0 ) out->erase( len );
+	}
+
+	// wait for the socket only when it is full
+	if( out->getSize() > 0 && ! client->mIsWriting ) {
+		event_add( &client->mWriteEvent, NULL );
+		client->mIsWriting = 1;
+	} else if( out->getSize() <= 0 && client->mIsWriting ) {
+		event_del( &client->mWriteEvent );
+		client->mIsWriting = 0;
+	}
+
+	return 0;
+}
+
+void send_msg( SP_TestClient * client, long long dueTime )
+{
+	if( client->mIsClosed ) return;
+
+	if( client->mCount >= client->mCapacity ) {
+		int capacity = client->mCapacity * 2;
+		long long * dueList = (long long*)malloc( sizeof( long long ) * capacity );
+		long long * sentList = (long long*)malloc( sizeof( long long ) * capacity );
+
+		for( int i = 0; i < client->mCount; i++ ) {
+			int index = ( client->mHead + i ) % client->mCapacity;
+			dueList[i] = client->mDueList[ index ];
+			sentList[i] = client->mSentList[ index ];
+		}
+
+		free( client->mDueList );
+		free( client->mSentList );
+		client->mDueList = dueList;
+		client->mSentList = sentList;
+		client->mHead = 0;
+		client->mCapacity = capacity;
+	}
+
+	int tail = ( client->mHead + client->mCount ) % client->mCapacity;
+	client->mDueList[ tail ] = dueTime;
+	client->mSentList[ tail ] = nowUsec();
+	client->mCount++;
+
+	char buffer[ 256 ] = { 0 };
+	int len = format_msg( client, buffer, sizeof( buffer ) );
+	client->mOutBuffer->append( buffer, len );
+	client->mSendMsgs++;
+
+	flush_client( client );
+}
+
+// a sender with nothing left to send, either on count or on time
+int is_sending( SP_TestClient * client, long long now )
+{
+	if( client->mIsClosed ) return 0;
+	if( gDuration > 0 ) return now < gStartTime + gDuration * 1000000LL;
+	return client->mSendMsgs < gMsgs;
+}
+
+void on_reply( SP_TestClient * client )
 {
-	close_write( client );
-	close_read( client );
+	if( client->mCount <= 0 ) return;
+
+	long long now = nowUsec();
+
+	SP_StressThread * thread = client->mThread;
+	thread->mLatency.record( now - client->mDueList[ client->mHead ] );
+	thread->mService.record( now - client->mSentList[ client->mHead ] );
+
+	client->mHead = ( client->mHead + 1 ) % client->mCapacity;
+	client->mCount--;
+	client->mRecvMsgs++;
+
+	if( 0 == gRate && is_sending( client, now ) ) send_msg( client, now );
 }
 
 void on_read( int fd, short events, void *arg )
 {
 	SP_TestClient * client = ( SP_TestClient * ) arg;
 
-	if( EV_READ & events ) {
-		int len = recv( fd, client->mBuffer, sizeof( client->mBuffer ), 0 );
-		if( len <= 0 ) {
-			if( len < 0 && EAGAIN != errno ) {
-				fprintf( stderr, "#%d on_read error, count %d, errno %d, %s\n",
-						fd, client->mRecvMsgs, errno, strerror( errno ) );
-			}
-			close_client( client );
-		} else {
-			for( int i = 0; i < len; i++ ) {
-				//if( 10 == fd ) printf( "%c", client->mBuffer[i] );
-				if( '\n' == client->mBuffer[i] ) client->mRecvMsgs++;
-			}
+	char buffer[ 4096 ];
+	int len = recv( fd, buffer, sizeof( buffer ), 0 );
+	if( len <= 0 ) {
+		if( len < 0 && ( EAGAIN == errno || EWOULDBLOCK == errno ) ) return;
+		if( len < 0 ) {
+			fprintf( stderr, "#%d on_read error, count %d, errno %d, %s\n",
+					fd, client->mRecvMsgs, errno, strerror( errno ) );
 		}
-	} else {
-		fprintf( stderr, "#%d on_read timeout\n", fd );
 		close_client( client );
+		return;
+	}
+
+	if( eEcho == gProtocol ) {
+		char msg[ 256 ] = { 0 };
+		int msgLen = format_msg( client, msg, sizeof( msg ) );
+
+		for( client->mEchoBytes += len; client->mEchoBytes >= msgLen; ) {
+			client->mEchoBytes -= msgLen;
+			on_reply( client );
+		}
+		return;
+	}
+
+	client->mInBuffer->append( buffer, len );
+
+	// the own messages are the replies, the others are welcome or broadcast
+	char tag[ 32 ] = { 0 };
+	snprintf( tag, sizeof( tag ), "mail #%08d.", client->mIndex );
+
+	for( char * line = NULL; NULL != ( line = client->mInBuffer->getLine() ); ) {
+		client->mRecvLines++;
+		if( NULL != strstr( line, tag ) ) on_reply( client );
+		free( line );
 	}
 }
 
@@ -98,29 +411,104 @@ void on_write( int fd, short events, void *arg )
 {
 	SP_TestClient * client = ( SP_TestClient * ) arg;
 
-	if( EV_WRITE & events ) {
-		client->mSendMsgs++;
+	flush_client( client );
+}
 
-		if( client->mSendMsgs >= gMsgs ) {
-			snprintf( client->mBuffer, sizeof( client->mBuffer ), "quit\n" );
-		} else {
-			snprintf( client->mBuffer, sizeof( client->mBuffer ),
-				"mail #%d, It's good to see how people hire; "
-				"that tells us how to market ourselves to them.\n", client->mSendMsgs );
+void on_timer( int fd, short events, void * arg )
+{
+	SP_StressThread * thread = (SP_StressThread*)arg;
+
+	long long now = nowUsec();
+
+	int isSending = 0;
+
+	if( gRate > 0 ) {
+		// send every message which is due, late ones keep their due time
+		for( ; 0 == thread->mIsScheduled; ) {
+			long long due = gStartTime + (long long)( thread->mScheduled * thread->mInterval );
+			if( due > now ) break;
+
+			SP_TestClient * client = &( thread->mClients[ thread->mScheduled % thread->mCount ] );
+			if( is_sending( client, due ) ) {
+				send_msg( client, due );
+				if( now - due > thread->mMaxLag ) thread->mMaxLag = now - due;
+				thread->mLagSum += now - due;
+				thread->mLagCount++;
+			}
+
+			thread->mScheduled++;
+
+			// stop when a whole round has nothing to send
+			if( 0 == thread->mScheduled % thread->mCount ) {
+				int isAny = 0;
+				for( int i = 0; i < thread->mCount && ! isAny; i++ ) {
+					isAny = is_sending( &( thread->mClients[i] ), due );
+				}
+				if( ! isAny ) thread->mIsScheduled = 1;
+			}
 		}
+	}
+
+	int pending = 0;
+	for( int i = 0; i < thread->mCount; i++ ) {
+		SP_TestClient * client = &( thread->mClients[i] );
+		if( is_sending( client, now ) ) isSending = 1;
+		if( ! client->mIsClosed ) pending += client->mCount;
+	}
 
-		int len = send( fd, client->mBuffer, strlen( client->mBuffer ), 0 );
+	if( ! isSending ) {
+		if( 0 == thread->mStopTime ) thread->mStopTime = now;
 
-		if( len <= 0 && EAGAIN != errno ) {
-			fprintf( stderr, "#%d on_write error, errno %d, %s\n", fd, errno, strerror( errno ) );
-			close_client( client );
-		} else {
-			if( client->mSendMsgs >= gMsgs ) close_write( client );
+		if( 0 == pending || now - thread->mStopTime > gDrain * 1000000LL ) {
+			thread->mIsDone = 1;
+			return;
 		}
-	} else {
-		fprintf( stderr, "#%d on_write timeout\n", fd );
-		close_client( client );
 	}
+
+	// wake up when the next message is due, the drain is checked every 10 msec
+	long long wait = 10000;
+	if( gRate > 0 && 0 == thread->mIsScheduled ) {
+		wait = gStartTime + (long long)( thread->mScheduled * thread->mInterval ) - nowUsec();
+		if( wait < 0 ) wait = 0;
+	}
+
+	struct timeval tv = { (long)( wait / 1000000 ), (long)( wait % 1000000 ) };
+	evtimer_add( &thread->mTimer, &tv );
+}
+
+static sp_thread_result_t SP_THREAD_CALL run_thread( void * arg )
+{
+	SP_StressThread * thread = (SP_StressThread*)arg;
+
+	for( int i = 0; i < thread->mCount; i++ ) {
+		SP_TestClient * client = &( thread->mClients[i] );
+
+		event_set( &client->mWriteEvent, client->mFd, EV_WRITE | EV_PERSIST, on_write, client );
+		event_base_set( thread->mBase, &client->mWriteEvent );
+
+		event_set( &client->mReadEvent, client->mFd, EV_READ | EV_PERSIST, on_read, client );
+		event_base_set( thread->mBase, &client->mReadEvent );
+		event_add( &client->mReadEvent, NULL );
+
+		if( 0 == gRate ) send_msg( client, nowUsec() );
+	}
+
+	evtimer_set( &thread->mTimer, on_timer, thread );
+	event_base_set( thread->mBase, &thread->mTimer );
+	on_timer( -1, 0, thread );
+
+	while( 0 == thread->mIsDone ) {
+		event_base_loop( thread->mBase, EVLOOP_ONCE );
+	}
+
+	for( int i = 0; i < thread->mCount; i++ ) close_client( &( thread->mClients[i] ) );
+
+	sp_thread_mutex_lock( &gMutex );
+	gRunningThreads--;
+	sp_thread_cond_signal( &gCond );
+	sp_thread_mutex_unlock( &gMutex );
+
+	return 0;
 }
 
 void parse_arg( int argc, char * argv[] )
@@ -128,7 +516,7 @@ void parse_arg( int argc, char * argv[] )
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "h:p:c:m:w:s:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "h:p:c:m:w:P:r:d:t:D:o:v" )) != EOF ) {
 		switch ( c ) {
 			case 'h' :
 				gHost = optarg;
@@ -145,8 +533,24 @@ void parse_arg( int argc, char * argv[] )
 			case 'w':
 				gConnWait = atoi( optarg );
 				break;
-			case 's':
-				gSockWait = atoi( optarg );
+			case 'P':
+				if( 0 == strcasecmp( optarg, "echo" ) ) gProtocol = eEcho;
+				if( 0 == strcasecmp( optarg, "chat" ) ) gProtocol = eChat;
+				break;
+			case 'r':
+				gRate = atoi( optarg );
+				break;
+			case 'd':
+				gDuration = atoi( optarg );
+				break;
+			case 't':
+				gThreads = atoi( optarg );
+				break;
+			case 'D':
+				gDrain = atoi( optarg );
+				break;
+			case 'o':
+				gHgrmFile = optarg;
 				break;
 			case 'v' :
 			case '?' :
@@ -154,6 +558,11 @@ void parse_arg( int argc, char * argv[] )
 				exit( 0 );
 		}
 	}
+
+	if( gClients <= 0 ) gClients = 1;
+	if( gThreads <= 0 ) gThreads = 1;
+	if( gThreads > gClients ) gThreads = gClients;
+	if( gRate < 0 ) gRate = 0;
 }
 
 int main( int argc, char * argv[] )
@@ -166,7 +575,8 @@ int main( int argc, char * argv[] )
 
 	sp_initsock();
 
-	event_init();
+	sp_thread_mutex_init( &gMutex, NULL );
+	sp_thread_cond_init( &gCond, NULL );
 
 	SP_TestClient * clientList = (SP_TestClient*)calloc( gClients, sizeof( SP_TestClient ) );
 
@@ -176,7 +586,7 @@ int main( int argc, char * argv[] )
 	sin.sin_addr.s_addr = inet_addr( gHost );
 	sin.sin_port = htons( gPort );
 
-	int totalClients = gClients, i = 0;
+	int i = 0;
 
 	printf( "Create %d connections to server, it will take some minutes to complete.\n", gClients );
 	for( i = 0; i < gClients; i++ ) {
@@ -199,64 +609,136 @@ int main( int argc, char * argv[] )
 			return -1;
 		}
 
-		event_set( &client->mWriteEvent, client->mFd, EV_WRITE | EV_PERSIST, on_write, client );
-		event_add( &client->mWriteEvent, NULL );
+		SP_IOUtils::setNonblock( client->mFd );
 
-		event_set( &client->mReadEvent, client->mFd, EV_READ | EV_PERSIST, on_read, client );
-		event_add( &client->mReadEvent, NULL );
+		client->mIndex = i;
+		client->mCapacity = 16;
+		client->mDueList = (long long*)malloc( sizeof( long long ) * client->mCapacity );
+		client->mSentList = (long long*)malloc( sizeof( long long ) * client->mCapacity );
+		client->mInBuffer = new SP_Buffer();
+		client->mOutBuffer = new SP_Buffer();
 
 		if( 0 == ( i % 10 ) ) write( fileno( stdout ), ".", 1 );
 
 		if( gConnWait > 0 && ( i > 0 ) && ( 0 == ( i % 100 ) ) ) usleep( gConnWait * 1000 );
 	}
 
-	time( &gStartTime );
+	printf( "\n" );
+
+	// the clients are split among the threads, each with its own event loop
+	SP_StressThread * threadList = new SP_StressThread[ gThreads ];
 
-	struct timeval startTime, stopTime;
+	for( i = 0; i < gThreads; i++ ) {
+		SP_StressThread * thread = threadList + i;
 
-	sp_gettimeofday( &startTime, NULL );
+		int first = (int)( (long long)gClients * i / gThreads );
+		int last = (int)( (long long)gClients * ( i + 1 ) / gThreads );
 
-	time_t lastInfoTime = time( NULL );
+		thread->mBase = (struct event_base*)event_init();
+		thread->mClients = clientList + first;
+		thread->mCount = last - first;
+		thread->mScheduled = 0;
+		thread->mInterval = gRate > 0 ? 1000000.0 * gClients / gRate / thread->mCount : 0;
+		thread->mIsScheduled = 0;
+		thread->mStopTime = 0;
+		thread->mIsDone = 0;
+		thread->mMaxLag = 0;
+		thread->mLagSum = 0;
+		thread->mLagCount = 0;
 
-	// start event loop until all clients are exit
-	while( gClients > 0 ) {
-		event_loop( EVLOOP_ONCE );
+		for( int j = first; j < last; j++ ) clientList[j].mThread = thread;
+	}
 
-		if( time( NULL ) - lastInfoTime > 5 ) {
-			time( &lastInfoTime );
-			printf( "waiting for %d client(s) to exit\n", gClients );
-		}
+	gStartTime = nowUsec();
+	gRunningThreads = gThreads;
 
-		if( gSockWait > 0 ) usleep( gSockWait * 1000 );
+	sp_thread_attr_t attr;
+	sp_thread_attr_init( &attr );
+	sp_thread_attr_setdetachstate( &attr, SP_THREAD_CREATE_DETACHED );
+
+	for( i = 0; i < gThreads; i++ ) {
+		sp_thread_t id;
+		if( 0 != sp_thread_create( &id, &attr, run_thread, threadList + i ) ) {
+			fprintf( stderr, "create thread failed, errno %d, %s\n", errno, strerror( errno ) );
+			return -1;
+		}
 	}
 
-	sp_gettimeofday( &stopTime, NULL );
+	sp_thread_attr_destroy( &attr );
 
-	double totalTime = (double) ( 1000000 * ( stopTime.tv_sec - startTime.tv_sec )
-			+ ( stopTime.tv_usec - startTime.tv_usec ) ) / 1000000;
+	sp_thread_mutex_lock( &gMutex );
+	for( ; gRunningThreads > 0; ) sp_thread_cond_wait( &gCond, &gMutex );
+	sp_thread_mutex_unlock( &gMutex );
+
+	double totalTime = ( nowUsec() - gStartTime ) / 1000000.0;
+
+	SP_Histogram latency, service;
+	long long maxLag = 0, lagSum = 0, lagCount = 0, sendTime = 0;
+	for( i = 0; i < gThreads; i++ ) {
+		latency.merge( &( threadList[i].mLatency ) );
+		service.merge( &( threadList[i].mService ) );
+		if( threadList[i].mMaxLag > maxLag ) maxLag = threadList[i].mMaxLag;
+		lagSum += threadList[i].mLagSum;
+		lagCount += threadList[i].mLagCount;
+		if( threadList[i].mStopTime - gStartTime > sendTime ) sendTime = threadList[i].mStopTime - gStartTime;
+	}
 
 	// show result
-	printf( "\n\nTest result :\n" );
-	printf( "Host %s, Port %d, ConnWait: %d, SockWait: %d\n", gHost, gPort, gConnWait, gSockWait );
-	printf( "Clients : %d, Messages Per Client : %d\n", totalClients, gMsgs );
+	printf( "\nTest result :\n" );
+	printf( "Host %s, Port %d, Protocol %s, Threads %d, ConnWait: %d\n",
+			gHost, gPort, gProtocolNames[ gProtocol ], gThreads, gConnWait );
+	if( gDuration > 0 ) {
+		printf( "Clients : %d, Duration : %d seconds\n", gClients, gDuration );
+	} else {
+		printf( "Clients : %d, Messages Per Client : %d\n", gClients, gMsgs );
+	}
+	if( gRate > 0 ) {
+		printf( "Rate : %d/s open loop, send lag avg %.3f msec, max %.3f msec\n", gRate,
+				lagCount > 0 ? lagSum / 1000.0 / lagCount : 0, maxLag / 1000.0 );
+	} else {
+		printf( "Rate : closed loop, one message in flight per client\n" );
+	}
 	printf( "ExecTimes: %.6f seconds\n\n", totalTime );
 
-	printf( "client\tSend\tRecv\n" );
-	int totalSend = 0, totalRecv = 0;
-	for( i = 0; i < totalClients; i++ ) {
+	long long totalSend = 0, totalRecv = 0, totalLines = 0, lost = 0;
+	for( i = 0; i < gClients; i++ ) {
 		SP_TestClient * client = clientList + i;
 
-		//printf( "client#%d : %d\t%d\n", i, client->mSendMsgs, client->mRecvMsgs );
-
 		totalSend += client->mSendMsgs;
 		totalRecv += client->mRecvMsgs;
+		totalLines += client->mRecvLines;
+		lost += client->mCount;
 
 		sp_close( client->mFd );
+		free( client->mDueList );
+		free( client->mSentList );
+		delete client->mInBuffer;
+		delete client->mOutBuffer;
 	}
 
-	printf( "total   : %d\t%d\n", totalSend, totalRecv );
-	printf( "average : %.0f/s\t%.0f/s\n", totalSend / totalTime, totalRecv / totalTime );
+	double activeTime = sendTime > 0 ? sendTime / 1000000.0 : totalTime;
+
+	printf( "client\tSend\tRecv\tNo reply\n" );
+	printf( "total   : %lld\t%lld\t%lld\n", totalSend, totalRecv, lost );
+	printf( "average : %.0f/s\t%.0f/s\n", totalSend / activeTime, totalRecv / activeTime );
+	if( eChat == gProtocol ) printf( "broadcast lines received : %lld\n", totalLines );
+	printf( "\n" );
+
+	latency.summary( stdout, gRate > 0 ? "Latency from the due time" : "Latency" );
+	if( gRate > 0 ) service.summary( stdout, "Latency from the send time, uncorrected" );
 
+	if( NULL != gHgrmFile ) {
+		FILE * fp = fopen( gHgrmFile, "w" );
+		if( NULL != fp ) {
+			latency.outputHgrm( fp );
+			fclose( fp );
+			printf( "percentile distribution written to %s\n", gHgrmFile );
+		} else {
+			fprintf( stderr, "cannot open %s, errno %d, %s\n", gHgrmFile, errno, strerror( errno ) );
+		}
+	}
+
+	delete [] threadList;
 	free( clientList );
 
 #ifdef WIN32
@@ -265,4 +747,3 @@ int main( int argc, char * argv[] )
 
 	return 0;
 }
-
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2007 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "spporting.hpp"
+
+#include "spmsgdecoder.hpp"
+#include "spbuffer.hpp"
+
+#include "spudpserver.hpp"
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+#include "sprequest.hpp"
+#include "sputils.hpp"
+
+// a datagram echo server, and a client which keeps a window of requests
+// in flight and reports the rate:
+//   ./testudp -p 3333 -r 2 -t 4
+//   ./testudp -c 100000 -w 64 -p 3333
+
+class SP_UdpEchoHandler : public SP_Handler {
+public:
+	SP_UdpEchoHandler(){}
+	virtual ~SP_UdpEchoHandler(){}
+
+	virtual int start( SP_Request * request, SP_Response * response ) {
+		return 0;
+	}
+
+	virtual int handle( SP_Request * request, SP_Response * response ) {
+		SP_DefaultMsgDecoder * decoder = (SP_DefaultMsgDecoder*)request->getMsgDecoder();
+		response->getReply()->getMsg()->append( decoder->getMsg() );
+		return 0;
+	}
+
+	virtual void error( SP_Response * response ) {}
+
+	virtual void timeout( SP_Response * response ) {}
+
+	virtual void close() {}
+};
+
+class SP_UdpEchoHandlerFactory : public SP_HandlerFactory {
+public:
+	SP_UdpEchoHandlerFactory() {}
+	virtual ~SP_UdpEchoHandlerFactory() {}
+
+	virtual SP_Handler * create() const {
+		return new SP_UdpEchoHandler();
+	}
+};
+
+static int runClient( const char * host, int port, int count, int window )
+{
+	int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+	if( fd < 0 ) {
+		printf( "socket failed, errno %d, %s\n", errno, strerror( errno ) );
+		return -1;
+	}
+
+	struct timeval tv = { 1, 0 };
+	setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof( tv ) );
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( port );
+	sp_inet_aton( host, &addr.sin_addr );
+
+	if( connect( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 ) {
+		printf( "connect to %s:%d failed, errno %d, %s\n", host, port, errno, strerror( errno ) );
+		sp_close( fd );
+		return -1;
+	}
+
+	int sent = 0, received = 0, lost = 0, mismatch = 0;
+	char request[ 64 ], reply[ 128 ];
+
+	struct timeval begin;
+	sp_gettimeofday( &begin, NULL );
+
+	for( ; received + lost < count; ) {
+		// keep the window full
+		for( ; sent < count && sent - received - lost < window; sent++ ) {
+			int len = snprintf( request, sizeof( request ), "request %d", sent );
+			send( fd, request, len, 0 );
+		}
+
+		int len = recv( fd, reply, sizeof( reply ) - 1, 0 );
+		if( len < 0 ) {
+			// the rest of the window is lost
+			lost = sent - received;
+			continue;
+		}
+
+		reply[ len ] = '\0';
+		if( 0 != strncmp( reply, "request ", 8 ) ) mismatch++;
+		received++;
+	}
+
+	struct timeval end;
+	sp_gettimeofday( &end, NULL );
+
+	double elapsed = ( end.tv_sec - begin.tv_sec ) + ( end.tv_usec - begin.tv_usec ) / 1000000.0;
+	if( elapsed <= 0 ) elapsed = 1e-6;
+
+	printf( "sent %d, received %d, lost %d, mismatch %d\n", sent, received, lost, mismatch );
+	printf( "elapsed %.3f s, %.0f requests/s\n", elapsed, received / elapsed );
+
+	sp_close( fd );
+
+	return 0 == mismatch ? 0 : -1;
+}
+
+int main( int argc, char * argv[] )
+{
+	int port = 3333, maxThreads = 4, reactors = 1, batchSize = 32;
+	int count = 0, window = 64;
+	const char * host = "127.0.0.1";
+
+	extern char *optarg ;
+	int c ;
+
+	while( ( c = getopt ( argc, argv, "p:t:r:b:c:w:h:v" )) != EOF ) {
+		switch ( c ) {
+			case 'p' :
+				port = atoi( optarg );
+				break;
+			case 't':
+				maxThreads = atoi( optarg );
+				break;
+			case 'r':
+				reactors = atoi( optarg );
+				break;
+			case 'b':
+				batchSize = atoi( optarg );
+				break;
+			case 'c':
+				count = atoi( optarg );
+				break;
+			case 'w':
+				window = atoi( optarg );
+				break;
+			case 'h':
+				host = optarg;
+				break;
+			case '?' :
+			case 'v' :
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-r <reactors>] [-b <batch size>]\n", argv[0] );
+				printf( "       %s -c <requests> [-w <window>] [-h <host>] [-p <port>]\n", argv[0] );
+				exit( 0 );
+		}
+	}
+
+	sp_openlog( "testudp", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER );
+
+	assert( 0 == sp_initsock() );
+
+	int ret = 0;
+
+	if( count > 0 ) {
+		ret = runClient( host, port, count, window );
+	} else {
+		SP_UdpServer server( "", port, new SP_UdpEchoHandlerFactory() );
+		server.setMaxThreads( maxThreads );
+		server.setReactors( reactors );
+		server.setBatchSize( batchSize );
+
+		server.runForever();
+	}
+
+	sp_closelog();
+
+	return ret;
+}
+
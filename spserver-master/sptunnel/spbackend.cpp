@@ -0,0 +1,603 @@
+/*
+ * Copyright 2007-2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "spporting.hpp"
+
+#include "spbackend.hpp"
+
+#include "sphandler.hpp"
+#include "spresponse.hpp"
+
+#ifdef WIN32
+#include "spiocpdispatcher.hpp"
+#else
+#include "spdispatcher.hpp"
+#endif
+
+static const int SP_BACKEND_CONNECT_TIMEOUT = 10;
+static const int SP_BACKEND_PROBE_INTERVAL = 5;
+static const int SP_BACKEND_PROBE_TIMEOUT = 2;
+
+// log the counters every so many probes
+static const int SP_BACKEND_DUMP_PROBES = 12;
+
+// virtual nodes of a backend on the hash ring
+static const int SP_BACKEND_RING_NODES = 64;
+
+struct tagSP_BackendNode {
+	unsigned int mHash;
+	SP_Backend * mBackend;
+};
+
+static unsigned int hashString( const char * str )
+{
+	// FNV-1a
+	unsigned int hash = 2166136261U;
+	for( const unsigned char * pos = (const unsigned char*)str; '\0' != *pos; pos++ ) {
+		hash ^= *pos;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+#ifndef WIN32
+
+class SP_PoolConnector : public SP_ConnectHandler {
+public:
+	SP_PoolConnector( SP_BackendPool * pool ) { mPool = pool; }
+	virtual ~SP_PoolConnector() {}
+
+	virtual void completed( int fd, int error, SP_Response * response ) {
+		mPool->connected( fd );
+	}
+
+private:
+	SP_BackendPool * mPool;
+};
+
+// an idle backend may have sent a banner, but must not be closed or broken
+static int isAlive( int fd )
+{
+	char c = 0;
+	int ret = recv( fd, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+
+	return ret > 0 || ( ret < 0 && ( EAGAIN == errno || EWOULDBLOCK == errno ) );
+}
+
+SP_BackendPool :: SP_BackendPool( SP_MyDispatcher * dispatcher,
+		const struct sockaddr_in * addr, int minIdle, int maxIdle )
+{
+	mDispatcher = dispatcher;
+	mAddr = *addr;
+
+	mMinIdle = minIdle > 0 ? minIdle : 0;
+	mMaxIdle = maxIdle > mMinIdle ? maxIdle : mMinIdle;
+
+	sp_thread_mutex_init( &mMutex, NULL );
+	mIdleList = (int*)malloc( sizeof( int ) * ( mMaxIdle + 1 ) );
+	mIdleCount = mConnecting = 0;
+}
+
+SP_BackendPool :: ~SP_BackendPool()
+{
+	for( int i = 0; i < mIdleCount; i++ ) ::close( mIdleList[ i ] );
+
+	free( mIdleList );
+	mIdleList = NULL;
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+int SP_BackendPool :: take()
+{
+	int fd = -1;
+
+	for( ; ; ) {
+		sp_thread_mutex_lock( &mMutex );
+		fd = mIdleCount > 0 ? mIdleList[ --mIdleCount ] : -1;
+		sp_thread_mutex_unlock( &mMutex );
+
+		if( fd < 0 || isAlive( fd ) ) break;
+
+		::close( fd );
+	}
+
+	refill();
+
+	return fd;
+}
+
+void SP_BackendPool :: connected( int fd )
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	mConnecting--;
+
+	if( fd >= 0 && mIdleCount < mMaxIdle ) {
+		mIdleList[ mIdleCount++ ] = fd;
+		fd = -1;
+	}
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( fd >= 0 ) ::close( fd );
+}
+
+void SP_BackendPool :: check()
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	int count = 0;
+	for( int i = 0; i < mIdleCount; i++ ) {
+		if( isAlive( mIdleList[ i ] ) ) {
+			mIdleList[ count++ ] = mIdleList[ i ];
+		} else {
+			::close( mIdleList[ i ] );
+		}
+	}
+
+	if( count < mIdleCount ) {
+		sp_syslog( LOG_INFO, "backend pool drop %d dead connections", mIdleCount - count );
+	}
+	mIdleCount = count;
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	refill();
+}
+
+void SP_BackendPool :: refill()
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	int count = mMinIdle - mIdleCount - mConnecting;
+	if( count > 0 ) mConnecting += count;
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	struct timeval timeout = { SP_BACKEND_CONNECT_TIMEOUT, 0 };
+
+	for( int i = 0; i < count; i++ ) {
+		mDispatcher->push( &mAddr, &timeout, new SP_PoolConnector( this ) );
+	}
+}
+
+//---------------------------------------------------------
+
+class SP_ProbeConnector : public SP_ConnectHandler {
+public:
+	SP_ProbeConnector( SP_Backend * backend ) { mBackend = backend; }
+	virtual ~SP_ProbeConnector() {}
+
+	virtual void completed( int fd, int error, SP_Response * response ) {
+		if( fd >= 0 ) {
+			::close( fd );
+			mBackend->markOK();
+		} else {
+			mBackend->markFail();
+		}
+	}
+
+private:
+	SP_Backend * mBackend;
+};
+
+class SP_ProbeTimer : public SP_TimerHandler {
+public:
+	SP_ProbeTimer( SP_BackendGroup * group ) { mGroup = group; }
+	virtual ~SP_ProbeTimer() {}
+
+	virtual int handle( SP_Response * response, struct timeval * timeout ) {
+		mGroup->probe();
+		return 0;
+	}
+
+private:
+	SP_BackendGroup * mGroup;
+};
+
+#endif
+
+//---------------------------------------------------------
+
+SP_Backend :: SP_Backend( const char * host, int port, int maxFails )
+{
+	sp_thread_mutex_init( &mMutex, NULL );
+
+	snprintf( mHost, sizeof( mHost ), "%s", host );
+	mPort = port;
+
+	memset( &mAddr, 0, sizeof( mAddr ) );
+	mAddr.sin_family = AF_INET;
+	mAddr.sin_addr.s_addr = inet_addr( mHost );
+	mAddr.sin_port = htons( mPort );
+
+	mPool = NULL;
+
+	mMaxFails = maxFails > 0 ? maxFails : 1;
+	mFails = 0;
+	mIsUp = 1;
+	mActive = 0;
+	mTotal = mTotalFails = 0;
+	memset( mBytes, 0, sizeof( mBytes ) );
+	memset( mSpliceBytes, 0, sizeof( mSpliceBytes ) );
+}
+
+SP_Backend :: ~SP_Backend()
+{
+#ifndef WIN32
+	if( NULL != mPool ) delete mPool;
+#endif
+	mPool = NULL;
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+const char * SP_Backend :: getHost()
+{
+	return mHost;
+}
+
+int SP_Backend :: getPort()
+{
+	return mPort;
+}
+
+const struct sockaddr_in * SP_Backend :: getAddr()
+{
+	return &mAddr;
+}
+
+void SP_Backend :: setPool( SP_BackendPool * pool )
+{
+	mPool = pool;
+}
+
+SP_BackendPool * SP_Backend :: getPool()
+{
+	return mPool;
+}
+
+void SP_Backend :: acquire()
+{
+	sp_thread_mutex_lock( &mMutex );
+	mActive++;
+	mTotal++;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+void SP_Backend :: release()
+{
+	sp_thread_mutex_lock( &mMutex );
+	mActive--;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+int SP_Backend :: getActive()
+{
+	return mActive;
+}
+
+void SP_Backend :: markOK()
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	int isUp = mIsUp;
+	mFails = 0;
+	mIsUp = 1;
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( ! isUp ) sp_syslog( LOG_NOTICE, "backend %s:%d is up", mHost, mPort );
+}
+
+void SP_Backend :: markFail()
+{
+	sp_thread_mutex_lock( &mMutex );
+
+	int isUp = mIsUp;
+	mFails++;
+	mTotalFails++;
+	if( mFails >= mMaxFails ) mIsUp = 0;
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	if( isUp && ! mIsUp ) {
+		sp_syslog( LOG_WARNING, "backend %s:%d is down after %d failures",
+				mHost, mPort, mMaxFails );
+	}
+}
+
+int SP_Backend :: isUp()
+{
+	return mIsUp;
+}
+
+void SP_Backend :: addBytes( int toBackend, int toClient )
+{
+	sp_thread_mutex_lock( &mMutex );
+	mBytes[ 0 ] += toBackend;
+	mBytes[ 1 ] += toClient;
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+uint64_t * SP_Backend :: getSpliceBytes()
+{
+	return mSpliceBytes;
+}
+
+void SP_Backend :: dump()
+{
+	// the splice pumps do not take the mutex, there are none on win32
+	uint64_t spliceBytes[ 2 ] = { 0, 0 };
+#ifndef WIN32
+	spliceBytes[ 0 ] = sp_atomic_add( &( mSpliceBytes[ 0 ] ), 0 );
+	spliceBytes[ 1 ] = sp_atomic_add( &( mSpliceBytes[ 1 ] ), 0 );
+#endif
+
+	sp_thread_mutex_lock( &mMutex );
+
+	sp_syslog( LOG_NOTICE, "backend %s:%d %s, active %d, total %u, fails %u, "
+			"to backend %llu, to client %llu", mHost, mPort, mIsUp ? "up" : "down",
+			mActive, mTotal, mTotalFails,
+			(unsigned long long)( mBytes[ 0 ] + spliceBytes[ 0 ] ),
+			(unsigned long long)( mBytes[ 1 ] + spliceBytes[ 1 ] ) );
+
+	sp_thread_mutex_unlock( &mMutex );
+}
+
+//---------------------------------------------------------
+
+SP_BackendGroup :: SP_BackendGroup( SP_MyDispatcher * dispatcher, int policy )
+{
+	mDispatcher = dispatcher;
+	mPolicy = policy;
+	mMaxFails = 3;
+	mMinIdle = mMaxIdle = 0;
+
+	sp_thread_mutex_init( &mMutex, NULL );
+	mList = NULL;
+	mCount = 0;
+	mNext = 0;
+	mProbeTimes = 0;
+
+	mRing = NULL;
+	mRingSize = 0;
+}
+
+SP_BackendGroup :: ~SP_BackendGroup()
+{
+	for( int i = 0; i < mCount; i++ ) delete mList[ i ];
+	free( mList );
+	mList = NULL;
+
+	free( mRing );
+	mRing = NULL;
+
+	sp_thread_mutex_destroy( &mMutex );
+}
+
+int SP_BackendGroup :: getPolicy( const char * name )
+{
+	if( 0 == strcasecmp( name, "rr" ) ) return eRoundRobin;
+	if( 0 == strcasecmp( name, "lc" ) ) return eLeastConn;
+	if( 0 == strcasecmp( name, "hash" ) ) return eHash;
+
+	return -1;
+}
+
+void SP_BackendGroup :: setMaxFails( int maxFails )
+{
+	mMaxFails = maxFails;
+}
+
+void SP_BackendGroup :: setPool( int minIdle, int maxIdle )
+{
+	mMinIdle = minIdle;
+	mMaxIdle = maxIdle;
+}
+
+int SP_BackendGroup :: parse( const char * list, int defaultPort )
+{
+	int count = 0;
+
+	char * dup = strdup( list );
+
+	for( char * item = dup; NULL != item && '\0' != *item; ) {
+		char * next = strchr( item, ',' );
+		if( NULL != next ) *next++ = '\0';
+
+		int port = defaultPort;
+		char * pos = strchr( item, ':' );
+		if( NULL != pos ) {
+			port = atoi( pos + 1 );
+			*pos = '\0';
+		}
+
+		if( '\0' != *item && 0 == add( item, port ) ) count++;
+
+		item = next;
+	}
+
+	free( dup );
+
+	return count;
+}
+
+int SP_BackendGroup :: add( const char * host, int port )
+{
+	if( INADDR_NONE == inet_addr( host ) ) {
+		sp_syslog( LOG_WARNING, "invalid backend %s:%d", host, port );
+		return -1;
+	}
+
+	SP_Backend * backend = new SP_Backend( host, port, mMaxFails );
+
+#ifndef WIN32
+	if( mMinIdle > 0 || mMaxIdle > 0 ) {
+		backend->setPool( new SP_BackendPool( mDispatcher, backend->getAddr(),
+				mMinIdle, mMaxIdle ) );
+	}
+#endif
+
+	mList = (SP_Backend**)realloc( mList, sizeof( SP_Backend * ) * ( mCount + 1 ) );
+	mList[ mCount++ ] = backend;
+
+	buildRing();
+
+	return 0;
+}
+
+static int cmpNode( const void * a, const void * b )
+{
+	unsigned int h1 = ((SP_BackendNode_t*)a)->mHash, h2 = ((SP_BackendNode_t*)b)->mHash;
+
+	return h1 < h2 ? -1 : ( h1 > h2 ? 1 : 0 );
+}
+
+void SP_BackendGroup :: buildRing()
+{
+	mRingSize = mCount * SP_BACKEND_RING_NODES;
+	mRing = (SP_BackendNode_t*)realloc( mRing, sizeof( SP_BackendNode_t ) * mRingSize );
+
+	for( int i = 0, n = 0; i < mCount; i++ ) {
+		for( int j = 0; j < SP_BACKEND_RING_NODES; j++, n++ ) {
+			char key[ 128 ] = { 0 };
+			snprintf( key, sizeof( key ), "%s:%d#%d", mList[ i ]->getHost(),
+					mList[ i ]->getPort(), j );
+			mRing[ n ].mHash = hashString( key );
+			mRing[ n ].mBackend = mList[ i ];
+		}
+	}
+
+	qsort( mRing, mRingSize, sizeof( SP_BackendNode_t ), cmpNode );
+}
+
+int SP_BackendGroup :: getCount()
+{
+	return mCount;
+}
+
+SP_Backend * SP_BackendGroup :: get( int index )
+{
+	return index >= 0 && index < mCount ? mList[ index ] : NULL;
+}
+
+void SP_BackendGroup :: start()
+{
+#ifndef WIN32
+	for( int i = 0; i < mCount; i++ ) {
+		if( NULL != mList[ i ]->getPool() ) mList[ i ]->getPool()->refill();
+	}
+
+	struct timeval interval = { SP_BACKEND_PROBE_INTERVAL, 0 };
+	mDispatcher->push( &interval, new SP_ProbeTimer( this ) );
+#endif
+}
+
+void SP_BackendGroup :: probe()
+{
+#ifndef WIN32
+	struct timeval timeout = { SP_BACKEND_PROBE_TIMEOUT, 0 };
+
+	for( int i = 0; i < mCount; i++ ) {
+		SP_Backend * backend = mList[ i ];
+
+		mDispatcher->push( backend->getAddr(), &timeout, new SP_ProbeConnector( backend ) );
+
+		if( backend->isUp() && NULL != backend->getPool() ) backend->getPool()->check();
+	}
+#endif
+
+	if( 0 == ( ++mProbeTimes % SP_BACKEND_DUMP_PROBES ) ) {
+		for( int i = 0; i < mCount; i++ ) mList[ i ]->dump();
+	}
+}
+
+SP_Backend * SP_BackendGroup :: select( const char * clientIP, SP_Backend * exclude )
+{
+	SP_Backend * backend = NULL;
+
+	sp_thread_mutex_lock( &mMutex );
+
+	if( eHash == mPolicy ) {
+		backend = selectHash( clientIP, exclude );
+	} else if( eLeastConn == mPolicy ) {
+		backend = selectLeastConn( exclude );
+	} else {
+		backend = selectRoundRobin( exclude, 1 );
+	}
+
+	// all down, try them anyway rather than refuse the client
+	if( NULL == backend ) backend = selectRoundRobin( exclude, 0 );
+
+	if( NULL != backend ) backend->acquire();
+
+	sp_thread_mutex_unlock( &mMutex );
+
+	return backend;
+}
+
+SP_Backend * SP_BackendGroup :: selectRoundRobin( SP_Backend * exclude, int needUp )
+{
+	for( int i = 0; i < mCount; i++ ) {
+		SP_Backend * backend = mList[ ( mNext + i ) % mCount ];
+		if( backend != exclude && ( backend->isUp() || ! needUp ) ) {
+			mNext = mNext + i + 1;
+			return backend;
+		}
+	}
+
+	return NULL;
+}
+
+SP_Backend * SP_BackendGroup :: selectLeastConn( SP_Backend * exclude )
+{
+	SP_Backend * backend = NULL;
+
+	// start from mNext, so ties are spread round-robin
+	for( int i = 0; i < mCount; i++ ) {
+		SP_Backend * iter = mList[ ( mNext + i ) % mCount ];
+		if( iter != exclude && iter->isUp() ) {
+			if( NULL == backend || iter->getActive() < backend->getActive() ) backend = iter;
+		}
+	}
+
+	mNext++;
+
+	return backend;
+}
+
+SP_Backend * SP_BackendGroup :: selectHash( const char * clientIP, SP_Backend * exclude )
+{
+	if( mRingSize <= 0 ) return NULL;
+
+	unsigned int hash = hashString( NULL != clientIP ? clientIP : "" );
+
+	// first node clockwise from the hash
+	int low = 0, high = mRingSize;
+	while( low < high ) {
+		int mid = ( low + high ) / 2;
+		if( mRing[ mid ].mHash < hash ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	for( int i = 0; i < mRingSize; i++ ) {
+		SP_Backend * backend = mRing[ ( low + i ) % mRingSize ].mBackend;
+		if( backend != exclude && backend->isUp() ) return backend;
+	}
+
+	return NULL;
+}
+
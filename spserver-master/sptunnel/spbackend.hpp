@@ -0,0 +1,160 @@
+/*
+ * Copyright 2007-2008 Stephen Liu
+ * For license terms, see the file COPYING along with this library.
+ */
+
+#ifndef __spbackend_hpp__
+#define __spbackend_hpp__
+
+#include "spporting.hpp"
+#include "spthread.hpp"
+
+#include "sptunnelimpl.hpp"
+
+#ifndef WIN32
+
+/**
+ * @brief idle backend connections, opened ahead with non-blocking connects
+ *        and checked by the probe timer of SP_BackendGroup, so a new tunnel
+ *        does not wait for the backend handshake
+ */
+class SP_BackendPool {
+public:
+	SP_BackendPool( SP_MyDispatcher * dispatcher, const struct sockaddr_in * addr,
+			int minIdle, int maxIdle );
+	~SP_BackendPool();
+
+	// return a connected socket, -1 : pool is empty
+	int take();
+
+	// a pool connect is done, fd is -1 if it failed
+	void connected( int fd );
+
+	// close dead connections and refill up to minIdle
+	void check();
+
+	void refill();
+
+private:
+	SP_MyDispatcher * mDispatcher;
+	struct sockaddr_in mAddr;
+
+	int mMinIdle, mMaxIdle;
+
+	sp_thread_mutex_t mMutex;
+	int * mIdleList;
+	int mIdleCount, mConnecting;
+};
+
+#endif
+
+/**
+ * @brief one backend server, counters are totals since start
+ */
+class SP_Backend {
+public:
+	SP_Backend( const char * host, int port, int maxFails );
+	~SP_Backend();
+
+	const char * getHost();
+	int getPort();
+	const struct sockaddr_in * getAddr();
+
+	void setPool( SP_BackendPool * pool );
+	SP_BackendPool * getPool();
+
+	// a tunnel is assigned to / done with this backend
+	void acquire();
+	void release();
+	int getActive();
+
+	// result of a connect, maxFails failures in a row take it down
+	void markOK();
+	void markFail();
+	int isUp();
+
+	void addBytes( int toBackend, int toClient );
+
+	// [0] : to backend, [1] : to client, added to by the splice pumps with sp_atomic_add
+	uint64_t * getSpliceBytes();
+
+	void dump();
+
+private:
+	sp_thread_mutex_t mMutex;
+
+	char mHost[ 64 ];
+	int mPort;
+	struct sockaddr_in mAddr;
+
+	SP_BackendPool * mPool;
+
+	int mMaxFails, mFails, mIsUp, mActive;
+	unsigned int mTotal, mTotalFails;
+	uint64_t mBytes[ 2 ];
+	uint64_t mSpliceBytes[ 2 ];
+};
+
+typedef struct tagSP_BackendNode SP_BackendNode_t;
+
+/**
+ * @brief backend list with round-robin, least-connections or consistent
+ *        hash by client ip, passive failure marking from tunnel connects
+ *        and active probes from a dispatcher timer
+ */
+class SP_BackendGroup {
+public:
+	enum { eRoundRobin, eLeastConn, eHash };
+
+	SP_BackendGroup( SP_MyDispatcher * dispatcher, int policy );
+	~SP_BackendGroup();
+
+	// "rr", "lc" or "hash", return -1 for unknown name
+	static int getPolicy( const char * name );
+
+	void setMaxFails( int maxFails );
+
+	// keep idle connections to every backend, call it before add
+	void setPool( int minIdle, int maxIdle );
+
+	// "host:port,host:port", return the count of backends added
+	int parse( const char * list, int defaultPort );
+
+	int add( const char * host, int port );
+
+	int getCount();
+	SP_Backend * get( int index );
+
+	// fill the pools and start the probe timer
+	void start();
+
+	// pick a backend that is up and acquire it, return NULL if nothing left
+	SP_Backend * select( const char * clientIP, SP_Backend * exclude = 0 );
+
+	// called by the probe timer
+	void probe();
+
+private:
+	SP_MyDispatcher * mDispatcher;
+	int mPolicy;
+	int mMaxFails;
+	int mMinIdle, mMaxIdle;
+
+	sp_thread_mutex_t mMutex;
+	SP_Backend ** mList;
+	int mCount;
+	unsigned int mNext;
+	unsigned int mProbeTimes;
+
+	// consistent hash ring, sorted by hash
+	SP_BackendNode_t * mRing;
+	int mRingSize;
+
+	void buildRing();
+
+	SP_Backend * selectRoundRobin( SP_Backend * exclude, int needUp );
+	SP_Backend * selectLeastConn( SP_Backend * exclude );
+	SP_Backend * selectHash( const char * clientIP, SP_Backend * exclude );
+};
+
+#endif
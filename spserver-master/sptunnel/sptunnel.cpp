@@ -13,6 +13,7 @@
 
 #include "spioutils.hpp"
 #include "sptunnelimpl.hpp"
+#include "spbackend.hpp"
 
 #ifdef OPENSSL
 #include "spopenssl.hpp"
@@ -30,13 +31,14 @@
 int main( int argc, char * argv[] )
 {
 	int port = 8080, maxThreads = 10;
-	char * dstHost = "66.249.89.99";
-	int dstPort = 80;
+	const char * dstList = "66.249.89.99:80";
+	int policy = SP_BackendGroup::eRoundRobin, maxFails = 3;
+	int spliceMode = 0, minIdle = 0, maxIdle = 0, highWatermark = 256 * 1024;
 
 	extern char *optarg ;
 	int c ;
 
-	while( ( c = getopt ( argc, argv, "p:t:r:v" )) != EOF ) {
+	while( ( c = getopt ( argc, argv, "p:t:r:b:f:sm:x:w:v" )) != EOF ) {
 		switch ( c ) {
 			case 'p' :
 				port = atoi( optarg );
@@ -45,18 +47,40 @@ int main( int argc, char * argv[] )
 				maxThreads = atoi( optarg );
 				break;
 			case 'r':
-			{
-				dstHost = strdup( optarg );
-				char * pos = strchr( dstHost, ':' );
-				if( NULL != pos ) {
-					dstPort = atoi( pos + 1 );
-					*pos = '\0';
+				dstList = optarg;
+				break;
+			case 'b':
+				policy = SP_BackendGroup::getPolicy( optarg );
+				if( policy < 0 ) {
+					printf( "Unknown policy %s\n", optarg );
+					exit( 0 );
 				}
 				break;
-			}
+			case 'f':
+				maxFails = atoi( optarg );
+				break;
+			case 's':
+				spliceMode = 1;
+				break;
+			case 'm':
+				minIdle = atoi( optarg );
+				break;
+			case 'x':
+				maxIdle = atoi( optarg );
+				break;
+			case 'w':
+				highWatermark = atoi( optarg );
+				break;
 			case '?' :
 			case 'v' :
-				printf( "Usage: %s [-p <port>] [-t <threads>] [-r <backend>]\n", argv[0] );
+				printf( "Usage: %s [-p <port>] [-t <threads>] [-r <backend,backend,...>] [-s]\n"
+						"\t\t[-b <rr|lc|hash>] [-f <max fails>]\n"
+						"\t\t[-m <min idle backends>] [-x <max idle backends>] [-w <bytes>]\n"
+						"\t-s : plain tunnel, forward with splice(2) instead of ssl\n"
+						"\t-b : round-robin, least connections or hash by client ip\n"
+						"\t-f : failed connects in a row to take a backend down\n"
+						"\t-m/-x : keep a pool of connected backends\n"
+						"\t-w : stop reading one side while the other has this much queued\n", argv[0] );
 				exit( 0 );
 		}
 	}
@@ -69,8 +93,6 @@ int main( int argc, char * argv[] )
 
 	if( 0 != sp_initsock() ) assert( 0 );
 
-	sp_syslog( LOG_NOTICE, "Backend server - %s:%d", dstHost, dstPort );
-
 	int maxConnections = 100, reqQueueSize = 100;
 	const char * refusedMsg = "System busy, try again later.";
 
@@ -80,8 +102,60 @@ int main( int argc, char * argv[] )
 		SP_MyDispatcher dispatcher( new SP_DefaultCompletionHandler(), maxThreads );
 
 		dispatcher.setTimeout( 60 );
+#ifndef WIN32
+		dispatcher.setOutputWatermarks( highWatermark, highWatermark / 4, SP_OutputPolicy::ePause );
+#endif
 		dispatcher.dispatch();
 
+		SP_BackendGroup group( &dispatcher, policy );
+		group.setMaxFails( maxFails );
+		group.setPool( minIdle, maxIdle );
+		if( group.parse( dstList, 80 ) <= 0 ) {
+			sp_syslog( LOG_ERR, "No valid backend in %s", dstList );
+			exit( -1 );
+		}
+
+		for( int i = 0; i < group.getCount(); i++ ) {
+			sp_syslog( LOG_NOTICE, "Backend server - %s:%d",
+					group.get( i )->getHost(), group.get( i )->getPort() );
+		}
+		if( minIdle > 0 || maxIdle > 0 ) {
+			sp_syslog( LOG_NOTICE, "Backend pool, min idle %d, max idle %d", minIdle, maxIdle );
+		}
+
+		group.start();
+
+#ifndef WIN32
+		if( spliceMode ) {
+			sp_syslog( LOG_NOTICE, "Plain tunnel, forward with splice" );
+
+			for( ; ; ) {
+				struct sockaddr_in addr;
+				socklen_t socklen = sizeof( addr );
+				int fd = accept( listenFd, (struct sockaddr*)&addr, &socklen );
+
+				if( fd > 0 ) {
+					if( dispatcher.getSessionCount() + dispatcher.getSpliceCount() >= maxConnections
+							|| dispatcher.getReqQueueLength() >= reqQueueSize ) {
+						write( fd, refusedMsg, strlen( refusedMsg ) );
+						close( fd );
+					} else {
+						char clientIP[ 32 ] = { 0 };
+						SP_IOUtils::inetNtoa( &( addr.sin_addr ), clientIP, sizeof( clientIP ) );
+
+						SP_SpliceConnector::start( &dispatcher, &group, fd, clientIP );
+					}
+				} else {
+					break;
+				}
+			}
+
+			sp_closelog();
+
+			return 0;
+		}
+#endif
+
 #ifdef	OPENSSL
 		SP_OpensslChannelFactory * sslFactory = new SP_OpensslChannelFactory();
 #else
@@ -109,8 +183,7 @@ int main( int argc, char * argv[] )
 					write( fd, refusedMsg, strlen( refusedMsg ) );
 					close( fd );
 				} else {
-					SP_TunnelHandler * handler = new SP_TunnelHandler(
-							&dispatcher, dstHost, dstPort );
+					SP_TunnelHandler * handler = new SP_TunnelHandler( &dispatcher, &group );
 					dispatcher.push( fd, handler, sslFactory->create() );
 
 					// for non-ssl tunnel
@@ -12,6 +12,7 @@
 #include "spporting.hpp"
 
 #include "sptunnelimpl.hpp"
+#include "spbackend.hpp"
 
 #include "sprequest.hpp"
 #include "spresponse.hpp"
@@ -24,6 +25,8 @@
 #include "spdispatcher.hpp"
 #endif
 
+static const int SP_TUNNEL_CONNECT_TIMEOUT = 10;
+
 class SP_MutexGuard {
 public:
 	SP_MutexGuard( sp_thread_mutex_t * mutex ) {
@@ -48,10 +51,19 @@ SP_TunnelArg :: SP_TunnelArg()
 	mTunnelStatus = mBackendStatus = eCreate;
 	memset( &mTunnelSid, 0, sizeof( SP_Sid_t ) );
 	memset( &mBackendSid, 0, sizeof( SP_Sid_t ) );
+
+	mPendingList = new SP_MsgBlockList();
+	mBackend = NULL;
 }
 
 SP_TunnelArg :: ~SP_TunnelArg()
 {
+	if( NULL != mBackend ) mBackend->release();
+	mBackend = NULL;
+
+	delete mPendingList;
+	mPendingList = NULL;
+
 	sp_thread_mutex_destroy( &mMutex );
 }
 
@@ -111,6 +123,56 @@ SP_Sid_t SP_TunnelArg :: getBackendSid()
 	return mBackendSid;
 }
 
+int SP_TunnelArg :: savePending( SP_Buffer * buffer )
+{
+	SP_MutexGuard gurad( &mMutex );
+
+	if( eCreate != mBackendStatus ) return 0;
+
+	mPendingList->append( new SP_BufferMsgBlock( buffer, 1 ) );
+
+	return 1;
+}
+
+void SP_TunnelArg :: startBackend( SP_MyDispatcher * dispatcher, SP_Sid_t sid )
+{
+	SP_MutexGuard gurad( &mMutex );
+
+	mBackendSid = sid;
+	mBackendStatus = eNormal;
+
+	if( mPendingList->getCount() <= 0 ) return;
+
+	SP_Message * msg = new SP_Message();
+	msg->getToList()->add( sid );
+
+	for( ; mPendingList->getCount() > 0; ) {
+		msg->getFollowBlockList()->append( mPendingList->takeItem( 0 ) );
+	}
+
+	// not in the response of the backend start, which is queued after the
+	// tunnel handle has seen eNormal and queued the newer data
+	SP_Sid_t pushSid = { SP_Sid_t::ePushKey, SP_Sid_t::ePushSeq };
+	SP_Response * response = new SP_Response( pushSid );
+	response->addMessage( msg );
+	dispatcher->push( response );
+}
+
+void SP_TunnelArg :: setBackend( SP_Backend * backend )
+{
+	SP_MutexGuard gurad( &mMutex );
+
+	if( NULL != mBackend ) mBackend->release();
+	mBackend = backend;
+}
+
+SP_Backend * SP_TunnelArg :: getBackend()
+{
+	SP_MutexGuard gurad( &mMutex );
+
+	return mBackend;
+}
+
 void SP_TunnelArg :: addRef()
 {
 	SP_MutexGuard gurad( &mMutex );
@@ -176,8 +238,9 @@ SP_Buffer * SP_TunnelDecoder :: takeBuffer()
 
 //---------------------------------------------------------
 
-SP_BackendHandler :: SP_BackendHandler( SP_TunnelArg * tunnelArg )
+SP_BackendHandler :: SP_BackendHandler( SP_MyDispatcher * dispatcher, SP_TunnelArg * tunnelArg )
 {
+	mDispatcher = dispatcher;
 	mArg = tunnelArg;
 }
 
@@ -188,11 +251,11 @@ SP_BackendHandler :: ~SP_BackendHandler()
 
 int SP_BackendHandler :: start( SP_Request * request, SP_Response * response )
 {
-	mArg->setBackendSid( response->getFromSid() );
-	mArg->setBackendStatus( SP_TunnelArg::eNormal );
-
 	request->setMsgDecoder( new SP_TunnelDecoder() );
 
+	// forward what the client sent while the backend was connecting
+	mArg->startBackend( mDispatcher, response->getFromSid() );
+
 	return 0;
 }
 
@@ -201,6 +264,8 @@ int SP_BackendHandler :: handle( SP_Request * request, SP_Response * response )
 	SP_TunnelDecoder * decoder = (SP_TunnelDecoder*)request->getMsgDecoder();
 	SP_Buffer * buffer = decoder->takeBuffer();
 
+	mArg->getBackend()->addBytes( 0, buffer->getSize() );
+
 	SP_Message * msg = new SP_Message();
 	msg->getToList()->add( mArg->getTunnelSid() );
 	msg->getFollowBlockList()->append( new SP_BufferMsgBlock( buffer, 1 ) );
@@ -227,24 +292,17 @@ void SP_BackendHandler :: close()
 //---------------------------------------------------------
 
 SP_TunnelHandler :: SP_TunnelHandler( SP_MyDispatcher * dispatcher,
-		const char * dstHost, int dstPort )
+		SP_BackendGroup * group )
 {
 	mDispatcher = dispatcher;
+	mGroup = group;
 	mArg = SP_TunnelArg::create();
-
-	mMsgBlockList = new SP_MsgBlockList();
-
-	snprintf( mHost, sizeof( mHost ), "%s", dstHost );
-	mPort = dstPort;
 }
 
 SP_TunnelHandler :: ~SP_TunnelHandler()
 {
 	mArg->release();
 	mArg = NULL;
-
-	delete mMsgBlockList;
-	mMsgBlockList = NULL;
 }
 
 int SP_TunnelHandler :: start( SP_Request * request, SP_Response * response )
@@ -254,21 +312,24 @@ int SP_TunnelHandler :: start( SP_Request * request, SP_Response * response )
 
 	request->setMsgDecoder( new SP_TunnelDecoder() );
 
+	SP_Backend * backend = mGroup->select( request->getClientIP() );
+	if( NULL == backend ) return -1;
+
+	mArg->setBackend( backend );
+
 	int ret = 0;
 
+#ifdef WIN32
 	int socketFd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
 	if( socketFd >= 0 ) {
-		struct sockaddr_in inAddr;
-		inAddr.sin_family = AF_INET;
-		inAddr.sin_addr.s_addr = inet_addr( mHost );
-		inAddr.sin_port = htons( mPort );
-
-		ret = connect( socketFd, (struct sockaddr*)&inAddr, sizeof( inAddr ) );
+		ret = connect( socketFd, (struct sockaddr*)backend->getAddr(), sizeof( struct sockaddr_in ) );
 		if( 0 == ret ) {
+			backend->markOK();
 			mArg->addRef();
-			mDispatcher->push( socketFd, new SP_BackendHandler( mArg ) );
+			mDispatcher->push( socketFd, new SP_BackendHandler( mDispatcher, mArg ) );
 		} else {
-			sp_syslog( LOG_WARNING, "Cannot connect to %s:%d", mHost, mPort );
+			sp_syslog( LOG_WARNING, "Cannot connect to %s:%d", backend->getHost(), backend->getPort() );
+			backend->markFail();
 			::close( socketFd );
 		}
 	} else {
@@ -276,6 +337,21 @@ int SP_TunnelHandler :: start( SP_Request * request, SP_Response * response )
 		sp_syslog( LOG_WARNING, "Cannot open socket, errno %d, %s",
 			errno, strerror( errno ) );
 	}
+#else
+	int socketFd = NULL != backend->getPool() ? backend->getPool()->take() : -1;
+
+	mArg->addRef();
+
+	if( socketFd >= 0 ) {
+		mDispatcher->push( socketFd, new SP_BackendHandler( mDispatcher, mArg ) );
+	} else {
+		// the client is served at once, its data waits in mArg until connected
+		struct timeval timeout = { SP_TUNNEL_CONNECT_TIMEOUT, 0 };
+
+		mDispatcher->push( backend->getAddr(), &timeout, new SP_BackendConnector(
+				mDispatcher, mGroup, mArg, request->getClientIP() ) );
+	}
+#endif
 
 	return ret;
 }
@@ -285,18 +361,17 @@ int SP_TunnelHandler :: handle( SP_Request * request, SP_Response * response )
 	SP_TunnelDecoder * decoder = (SP_TunnelDecoder*)request->getMsgDecoder();
 	SP_Buffer * buffer = decoder->takeBuffer();
 
-	if( SP_TunnelArg::eCreate == mArg->getBackendStatus() ) {
-		mMsgBlockList->append( new SP_BufferMsgBlock( buffer, 1 ) );
+	if( SP_TunnelArg::eDestroy == mArg->getBackendStatus() ) {
+		delete buffer;
 	} else {
-		SP_Message * msg = new SP_Message();
-		msg->getToList()->add( mArg->getBackendSid() );
+		mArg->getBackend()->addBytes( buffer->getSize(), 0 );
 
-		for( ; mMsgBlockList->getCount() > 0; ) {
-			msg->getFollowBlockList()->append( mMsgBlockList->takeItem( 0 ) );
+		if( 0 == mArg->savePending( buffer ) ) {
+			SP_Message * msg = new SP_Message();
+			msg->getToList()->add( mArg->getBackendSid() );
+			msg->getFollowBlockList()->append( new SP_BufferMsgBlock( buffer, 1 ) );
+			response->addMessage( msg );
 		}
-
-		msg->getFollowBlockList()->append( new SP_BufferMsgBlock( buffer, 1 ) );
-		response->addMessage( msg );
 	}
 
 	return SP_TunnelArg::eDestroy != mArg->getBackendStatus() ? 0 : -1;
@@ -317,3 +392,148 @@ void SP_TunnelHandler :: close()
 	mArg->setTunnelStatus( SP_TunnelArg::eDestroy );
 }
 
+
+//===================================================================
+
+#ifndef WIN32
+
+SP_BackendConnector :: SP_BackendConnector( SP_MyDispatcher * dispatcher,
+		SP_BackendGroup * group, SP_TunnelArg * tunnelArg, const char * clientIP, int retry )
+{
+	mDispatcher = dispatcher;
+	mGroup = group;
+	mArg = tunnelArg;
+
+	snprintf( mClientIP, sizeof( mClientIP ), "%s", clientIP );
+	mRetry = retry;
+}
+
+SP_BackendConnector :: ~SP_BackendConnector()
+{
+	if( NULL != mArg ) mArg->release();
+	mArg = NULL;
+}
+
+void SP_BackendConnector :: completed( int fd, int error, SP_Response * response )
+{
+	SP_Backend * backend = mArg->getBackend();
+
+	if( fd >= 0 ) {
+		backend->markOK();
+		mDispatcher->push( fd, new SP_BackendHandler( mDispatcher, mArg ) );
+		mArg = NULL;
+		return;
+	}
+
+	sp_syslog( LOG_WARNING, "Cannot connect to %s:%d, errno %d, %s",
+			backend->getHost(), backend->getPort(), error, strerror( error ) );
+	backend->markFail();
+
+	SP_Backend * next = NULL;
+	if( mRetry < SP_TUNNEL_MAX_RETRY && SP_TunnelArg::eNormal == mArg->getTunnelStatus() ) {
+		next = mGroup->select( mClientIP, backend );
+	}
+
+	if( NULL != next ) {
+		mArg->setBackend( next );
+
+		struct timeval timeout = { SP_TUNNEL_CONNECT_TIMEOUT, 0 };
+		mDispatcher->push( next->getAddr(), &timeout, new SP_BackendConnector(
+				mDispatcher, mGroup, mArg, mClientIP, mRetry + 1 ) );
+		mArg = NULL;
+	} else {
+		mArg->setBackendStatus( SP_TunnelArg::eDestroy );
+		response->getToCloseList()->add( mArg->getTunnelSid() );
+	}
+}
+
+//---------------------------------------------------------
+
+// releases the backend when the splice pump is done
+class SP_SpliceHandler : public SP_Handler {
+public:
+	SP_SpliceHandler( SP_Backend * backend ) { mBackend = backend; }
+	virtual ~SP_SpliceHandler() { mBackend->release(); }
+
+	virtual int start( SP_Request * request, SP_Response * response ) { return 0; }
+	virtual int handle( SP_Request * request, SP_Response * response ) { return 0; }
+	virtual void error( SP_Response * response ) {}
+	virtual void timeout( SP_Response * response ) {}
+	virtual void close() {}
+
+private:
+	SP_Backend * mBackend;
+};
+
+void SP_SpliceConnector :: start( SP_MyDispatcher * dispatcher, SP_BackendGroup * group,
+		int fd, const char * clientIP )
+{
+	SP_Backend * backend = group->select( clientIP );
+
+	if( NULL == backend ) {
+		::close( fd );
+		return;
+	}
+
+	int backendFd = NULL != backend->getPool() ? backend->getPool()->take() : -1;
+
+	if( backendFd >= 0 ) {
+		dispatcher->pushSplice( fd, backendFd, new SP_SpliceHandler( backend ),
+				backend->getSpliceBytes() );
+	} else {
+		connect( dispatcher, group, backend, fd, clientIP, 0 );
+	}
+}
+
+void SP_SpliceConnector :: connect( SP_MyDispatcher * dispatcher, SP_BackendGroup * group,
+		SP_Backend * backend, int fd, const char * clientIP, int retry )
+{
+	struct timeval timeout = { SP_TUNNEL_CONNECT_TIMEOUT, 0 };
+
+	dispatcher->push( backend->getAddr(), &timeout, new SP_SpliceConnector(
+			dispatcher, group, backend, fd, clientIP, retry ) );
+}
+
+SP_SpliceConnector :: SP_SpliceConnector( SP_MyDispatcher * dispatcher, SP_BackendGroup * group,
+		SP_Backend * backend, int fd, const char * clientIP, int retry )
+{
+	mDispatcher = dispatcher;
+	mGroup = group;
+	mBackend = backend;
+	mFd = fd;
+
+	snprintf( mClientIP, sizeof( mClientIP ), "%s", clientIP );
+	mRetry = retry;
+}
+
+SP_SpliceConnector :: ~SP_SpliceConnector()
+{
+}
+
+void SP_SpliceConnector :: completed( int fd, int error, SP_Response * response )
+{
+	if( fd >= 0 ) {
+		mBackend->markOK();
+		mDispatcher->pushSplice( mFd, fd, new SP_SpliceHandler( mBackend ),
+				mBackend->getSpliceBytes() );
+		return;
+	}
+
+	sp_syslog( LOG_WARNING, "Cannot connect to %s:%d, errno %d, %s",
+			mBackend->getHost(), mBackend->getPort(), error, strerror( error ) );
+	mBackend->markFail();
+
+	SP_Backend * next = NULL;
+	if( mRetry < SP_TUNNEL_MAX_RETRY ) next = mGroup->select( mClientIP, mBackend );
+
+	mBackend->release();
+
+	if( NULL != next ) {
+		connect( mDispatcher, mGroup, next, mFd, mClientIP, mRetry + 1 );
+	} else {
+		::close( mFd );
+	}
+}
+
+#endif
+
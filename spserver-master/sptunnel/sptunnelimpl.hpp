@@ -12,6 +12,17 @@
 #include "sphandler.hpp"
 #include "spresponse.hpp"
 
+class SP_Buffer;
+class SP_MsgBlockList;
+class SP_Backend;
+class SP_BackendGroup;
+
+#ifdef WIN32
+typedef class SP_IocpDispatcher SP_MyDispatcher;
+#else
+typedef class SP_Dispatcher SP_MyDispatcher;
+#endif
+
 class SP_TunnelArg {
 public:
 	static SP_TunnelArg * create();
@@ -30,6 +41,19 @@ public:
 	void setBackendSid( SP_Sid_t sid );
 	SP_Sid_t getBackendSid();
 
+	// keep data from the client while the backend is connecting
+	// return 1 : saved, 0 : backend is not in eCreate, caller sends it
+	int savePending( SP_Buffer * buffer );
+
+	// backend is up, push the saved data to dispatcher and turn eNormal,
+	// both with the mutex held, so that the data sent by the caller of
+	// savePending after it is queued behind the saved data
+	void startBackend( SP_MyDispatcher * dispatcher, SP_Sid_t sid );
+
+	// the acquired backend, released when the tunnel is gone
+	void setBackend( SP_Backend * backend );
+	SP_Backend * getBackend();
+
 	void addRef();
 	void release();
 
@@ -40,6 +64,9 @@ private:
 	unsigned char mTunnelStatus, mBackendStatus;
 	SP_Sid_t mTunnelSid, mBackendSid;
 
+	SP_MsgBlockList * mPendingList;
+	SP_Backend * mBackend;
+
 	SP_TunnelArg();
 	~SP_TunnelArg();
 };
@@ -61,7 +88,7 @@ private:
 
 class SP_BackendHandler : public SP_Handler {
 public:
-	SP_BackendHandler( SP_TunnelArg * tunnelArg );
+	SP_BackendHandler( SP_MyDispatcher * dispatcher, SP_TunnelArg * tunnelArg );
 	virtual ~SP_BackendHandler();
 
 	// return -1 : terminate session, 0 : continue
@@ -77,21 +104,13 @@ public:
 	virtual void close();
 
 private:
+	SP_MyDispatcher * mDispatcher;
 	SP_TunnelArg * mArg;
 };
 
-#ifdef WIN32
-typedef class SP_IocpDispatcher SP_MyDispatcher;
-#else
-typedef class SP_Dispatcher SP_MyDispatcher;
-#endif
-
-class SP_MsgBlockList;
-
 class SP_TunnelHandler : public SP_Handler {
 public:
-	SP_TunnelHandler( SP_MyDispatcher * dispatcher,
-			const char * dstHost, int dstPort );
+	SP_TunnelHandler( SP_MyDispatcher * dispatcher, SP_BackendGroup * group );
 
 	virtual ~SP_TunnelHandler();
 
@@ -109,13 +128,58 @@ public:
 
 private:
 	SP_MyDispatcher * mDispatcher;
+	SP_BackendGroup * mGroup;
+	SP_TunnelArg * mArg;
+};
+
+#ifndef WIN32
+
+// connect failures are retried on other backends up to this times
+enum { SP_TUNNEL_MAX_RETRY = 2 };
+
+class SP_BackendConnector : public SP_ConnectHandler {
+public:
+	SP_BackendConnector( SP_MyDispatcher * dispatcher, SP_BackendGroup * group,
+			SP_TunnelArg * tunnelArg, const char * clientIP, int retry = 0 );
+	virtual ~SP_BackendConnector();
+
+	virtual void completed( int fd, int error, SP_Response * response );
+
+private:
+	SP_MyDispatcher * mDispatcher;
+	SP_BackendGroup * mGroup;
 	SP_TunnelArg * mArg;
 
-	SP_MsgBlockList * mMsgBlockList;
+	char mClientIP[ 32 ];
+	int mRetry;
+};
+
+// plain tunnel, splice the client with a pooled or newly connected backend
+class SP_SpliceConnector : public SP_ConnectHandler {
+public:
+	// select a backend for the accepted fd and hand the pair to the dispatcher
+	static void start( SP_MyDispatcher * dispatcher, SP_BackendGroup * group,
+			int fd, const char * clientIP );
+
+	SP_SpliceConnector( SP_MyDispatcher * dispatcher, SP_BackendGroup * group,
+			SP_Backend * backend, int fd, const char * clientIP, int retry = 0 );
+	virtual ~SP_SpliceConnector();
+
+	virtual void completed( int fd, int error, SP_Response * response );
 
-	char mHost[ 32 ];
-	int mPort;
+private:
+	SP_MyDispatcher * mDispatcher;
+	SP_BackendGroup * mGroup;
+	SP_Backend * mBackend;
+	int mFd;
+
+	char mClientIP[ 32 ];
+	int mRetry;
+
+	static void connect( SP_MyDispatcher * dispatcher, SP_BackendGroup * group,
+			SP_Backend * backend, int fd, const char * clientIP, int retry );
 };
 
 #endif
 
+#endif
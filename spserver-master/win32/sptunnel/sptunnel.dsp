@@ -99,6 +99,10 @@ SOURCE=..\..\sptunnel\sptunnel.cpp
 
 SOURCE=..\..\sptunnel\sptunnelimpl.cpp
 # End Source File
+# Begin Source File
+
+SOURCE=..\..\sptunnel\spbackend.cpp
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
@@ -107,6 +111,10 @@ SOURCE=..\..\sptunnel\sptunnelimpl.cpp
 
 SOURCE=..\..\sptunnel\sptunnelimpl.hpp
 # End Source File
+# Begin Source File
+
+SOURCE=..\..\sptunnel\spbackend.hpp
+# End Source File
 # End Group
 # Begin Group "Resource Files"
 